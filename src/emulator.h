@@ -1,24 +1,54 @@
 #ifndef EMULATOR_H
 #define EMULATOR_H
 
+#ifdef EMULATOR_JIT
+#define _DEFAULT_SOURCE // mmap's MAP_ANONYMOUS
+#endif
+
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
 #include <assert.h>
+#include <threads.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#ifdef EMULATOR_JIT
+#include <sys/mman.h>
+#endif
 
 #define MAX_MEMORY (1 << 16)
 #define MAX_LABELS 0xFF
 #define MAX_PORTS 5
+#define MAX_INST_LEN 4
+#define MAX_EVENTS 32
+#define OPCODE_PAGE_COUNT 4 // Opcodes without a prefix, then one page per opcode_prefixes entry
+#define MEMORY_PAGE_SIZE 0x100 // Granularity of the region table and of snapshots
+#define MEMORY_PAGES (MAX_MEMORY / MEMORY_PAGE_SIZE)
+#define DEFAULT_XTAL_HZ 8000000.0 // E clock is a quarter of the crystal
 #define FMT8 "0x%02x"
 #define FMT16 "0x%04x"
 
+// Rarely taken paths called from the run loops, inlined they crowd out the loops' registers
+#ifdef __GNUC__
+#define COLD_PATH __attribute__((noinline))
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define COLD_PATH
+#define ALWAYS_INLINE inline
+#endif
+
 #define u8 uint8_t
 #define u16 uint16_t
 #define i8 int8_t
 #define i16 int16_t
+#define i32 int32_t
 #define u32 uint32_t
+#define u64 uint64_t
 
 typedef enum {
     NONE,
@@ -53,6 +83,7 @@ typedef struct {
     const char *opcode_str;
     operand operand;
     directive_type type;
+    const char *operand_str;
 } directive;
 
 typedef directive label_list[MAX_LABELS];
@@ -62,6 +93,14 @@ typedef struct {
     u8 count;
 } labels;
 
+// Something due at a given cycle count, like a byte arriving on the SCI
+typedef struct {
+    u64 at;
+    u64 period; // Cycles until it comes back, 0 when it happens once
+    u8 source;  // irq_source it raises
+    u8 data;    // Received byte for the SCI
+} event;
+
 typedef struct {
     union {
         struct {
@@ -70,21 +109,44 @@ typedef struct {
         };
         u16 d;
     };
+    u16 ix;
+    u16 iy;
     u16 sp;
     u16 pc;
+    u64 cycles; // E-clock cycles executed
+    u8 sleep;   // sleep_state, set by WAI and STOP
+    // Timed events, a binary heap ordered on at. Run loops only look at them once the cycle count
+    // reaches next_event, the first one's date or UINT64_MAX without any.
+    event events[MAX_EVENTS];
+    u8 event_count;
+    u64 next_event;
+    u8 pending; // irq_source bits raised and not taken yet
     union {
         struct {
-            u8 s : 1;
-            u8 x : 1;
-            u8 h : 1;
-            u8 i : 1;
-            u8 n : 1;
-            u8 z : 1;
-            u8 v : 1;
             u8 c : 1;
+            u8 v : 1;
+            u8 z : 1;
+            u8 n : 1;
+            u8 i : 1;
+            u8 h : 1;
+            u8 x : 1;
+            u8 s : 1;
         };
         u8 status;
     };
+    // N Z V C are kept in the form that is cheapest to produce, the matching
+    // bits of status are only written by SYNC_FLAGS. Read them with FLAG_*.
+    // Last result, 8 bit ones sign extended. Z is the low 16 bits being 0, N is any bit from 15
+    // up. Bit 16 alone is N with Z, which no result gives but TAP, RTI or a restore can load.
+    u32 cc_nz;
+    u16 cc_dst; // Operands V is computed from, sign extended as well
+    u16 cc_src;
+    u8 cc_v;    // How V is derived from the above
+    u8 cc_c;
+
+    // region_kind of each 256 byte page, set by set_default_regions and map_memory. Part of
+    // the head, so snapshots and lockstep lanes carry it.
+    u8 regions[MEMORY_PAGES];
 
     u8 memory[MAX_MEMORY];
 
@@ -95,8 +157,251 @@ typedef struct {
         label_list label; // With this trick you can access
         labels labels;
     };
+
+    // Predecoded instructions, one entry per address. Allocated on first use.
+    struct decoded_inst *decoded;
+    // Translated blocks when built with EMULATOR_JIT
+    struct jit_state *jit;
+    // Hot loops recorded as straight-line traces
+    struct trace_cache *traces;
+    // One bit per byte that decoded, translated or traced code was built from
+    u8 *code_map;
+    u32 code_writes; // Stores that hit code_map
+    // Snapshot pages memory still matches, except for the pages marked dirty.
+    // Allocated by the first snapshot taken or restored.
+    struct snapshot_page **shadow;
+    u8 dirty[MEMORY_PAGES]; // Pages written since the last snapshot or restore
+    // What each step changed, to run backward. NULL unless enable_undo was called.
+    struct undo_log *undo;
+    // Port values read while recording, or fed back when replaying. NULL otherwise.
+    struct input_log *inputs;
+    struct trace_stream *trace; // Set by start_trace
+#ifdef EMULATOR_PROFILE
+    struct profile *profile; // Set by start_profile
+#endif
+    // Breakpoints and watchpoints, NULL until the first one is set
+    struct debug_points *debug;
+    // Set from another thread or a signal handler to stop run_cpu at the end of the current
+    // block of instructions, see break_requested. NULL when nothing can ask.
+    atomic_uchar *break_in;
 } cpu;
 
+// One page of memory, shared by every snapshot it did not change in
+typedef struct snapshot_page {
+    atomic_uint refs;
+    u8 data[MEMORY_PAGE_SIZE];
+} snapshot_page;
+
+// Registers, cycles, events and the memory map: everything before memory
+typedef u8 cpu_head[offsetof(cpu, memory)];
+
+// Saved state of a cpu. Only the pages written since the previous snapshot are
+// copied, the others are shared with it.
+typedef struct {
+    cpu_head head;
+    u8 ports[MAX_PORTS];
+    u8 ddrx[MAX_PORTS];
+    snapshot_page *pages[MEMORY_PAGES];
+} snapshot;
+
+#define UNDO_MAX_WRITES 0xFF // Distinct bytes a step can write and still be undone exactly
+
+// Ring of undo records, plus the state before the step being recorded
+typedef struct undo_log {
+    u8 *ring;
+    u64 mask;  // Ring size - 1, the size is a power of two
+    u64 head;  // End of the newest record, counted from the first byte ever appended
+    u64 floor; // Bytes before this were overwritten
+    u16 pc, sp, ix, iy;
+    u8 a, b, status;
+    u64 cycles;
+    u8 ports[MAX_PORTS];
+    u64 next_event;
+    u8 pending, sleep, event_count;
+    event events[MAX_EVENTS];
+    u8 write_count;
+    u16 write_addr[UNDO_MAX_WRITES];
+    u8 write_old[UNDO_MAX_WRITES];
+} undo_log;
+
+// One traced instruction. Registers are the values after it, laid out as at the start of cpu
+// so they are copied at once. The compressed stream only keeps the 16 bit halves that changed
+// from the previous record.
+typedef struct {
+    union {
+        struct {
+            u8 b;
+            u8 a;
+        };
+        u16 d;
+    };
+    u16 ix, iy, sp;
+    u16 pc;
+    u16 opcode;     // Prefix in the high byte
+    u16 operand;    // The two bytes after the opcode
+    u16 write_addr; // First byte written, when writes is not 0
+    u8 ccr;
+    u8 write_value;
+    u8 writes;      // Bytes written, stops at 255
+    u8 cycles;
+} trace_record;
+
+// Instructions that get a record: pc in [first, last] and the bit of their opcode set
+typedef struct {
+    u16 first;
+    u16 last;
+    u8 opcodes[OPCODE_PAGE_COUNT * 0x100 / 8]; // Indexed like instr_func
+} trace_filter;
+
+typedef enum {
+    WATCH_READ = 1,
+    WATCH_WRITE = 2,
+} watch_kind;
+
+typedef enum {
+    DEBUG_NONE,
+    DEBUG_READ,   // A watched byte was read
+    DEBUG_WRITE,  // A watched byte was written
+    DEBUG_RETURN, // RTS or RTI left sp at or above out_sp
+} debug_event;
+
+#define CONDITION_SIZE 64  // Bytes of bytecode, and of text, a condition can take
+#define CONDITION_STACK 16 // Values the bytecode can have pending
+#define MAX_CONDITIONS 16
+
+// Condition of a breakpoint, compiled once by set_conditional_breakpoint
+typedef struct {
+    u16 addr;
+    u8 code[CONDITION_SIZE]; // condition_op, the value left on the stack at COND_END is the result
+    char text[CONDITION_SIZE];
+} condition;
+
+// One bit per address, the run loop tests the breakpoint of each pc and the memory
+// accesses the watchpoint of each byte
+typedef struct debug_points {
+    u8 breaks[MAX_MEMORY / 8];
+    u8 reads[MAX_MEMORY / 8];
+    u8 writes[MAX_MEMORY / 8];
+    u8 conditional[MAX_MEMORY / 8]; // Breakpoints that have an entry in conditions
+    condition conditions[MAX_CONDITIONS];
+    u8 condition_count;
+    u32 out_sp;   // For step out and step over, UINT32_MAX when no return is waited for
+    u8 hit;       // debug_event of the instruction that just ran
+    u16 hit_addr; // Byte it accessed
+} debug_points;
+
+#define DEBUG_BIT(bits, addr) (((bits)[(u16) (addr) >> 3] >> ((addr) & 7)) & 1)
+
+#define DEBUG_WATCH(cpu, kind, event, addr) \
+    do { \
+        if ((cpu)->debug != NULL && DEBUG_BIT((cpu)->debug->kind, addr)) { \
+            (cpu)->debug->hit = (event); \
+            (cpu)->debug->hit_addr = (addr); \
+        } \
+    } while (0)
+
+#define DEBUG_RETURNED(cpu) \
+    do { \
+        if ((cpu)->debug != NULL && (cpu)->sp >= (cpu)->debug->out_sp) { \
+            (cpu)->debug->hit = DEBUG_RETURN; \
+        } \
+    } while (0)
+
+#ifdef EMULATOR_PROFILE
+#define CALL_STACK_DEPTH 256 // Deeper calls are not tracked, their returns are told apart by sp
+
+typedef struct {
+    u64 instructions;
+    u64 cycles;
+} profile_cost;
+
+// A subroutine, known by its entry address. Interrupt handlers are called by the interrupt.
+typedef struct {
+    u64 calls;
+    profile_cost inclusive; // Outermost activations only, recursion is not counted twice
+    profile_cost exclusive;
+    u32 active;     // Frames of it on the call stack
+    u32 first_edge; // Its callees, chained through profile_edge.next, 1 based, 0 for none
+} profile_function;
+
+typedef struct {
+    u16 callee;
+    u32 next;
+    u64 calls;
+    profile_cost inclusive;
+} profile_edge;
+
+typedef struct {
+    u16 function;
+    u32 ret_sp;           // sp once the call returned, frames at or below it are left on return
+    profile_cost start;   // Totals when it was entered
+    profile_cost callees; // Inclusive cost of the calls it made
+} profile_frame;
+
+// Counters per address and call graph, only in builds with EMULATOR_PROFILE
+typedef struct profile {
+    u64 executions[MAX_MEMORY]; // Instructions that started at the address
+    u64 cycles[MAX_MEMORY];     // Their cycles
+    u64 reads[MAX_MEMORY];      // Data reads, operand fetches are not counted
+    u64 writes[MAX_MEMORY];
+    u64 instructions;           // Since start_profile, the call graph's clock with cpu->cycles
+    profile_function functions[MAX_MEMORY];
+    profile_edge *edges;
+    u32 edge_count;
+    u32 edge_capacity;
+    profile_frame frames[CALL_STACK_DEPTH];
+    u32 depth;
+    u64 untracked;              // Calls past CALL_STACK_DEPTH
+    u8 calling;                 // The instruction running is a call to call_entry
+    u16 call_entry;
+    u32 call_ret_sp;
+} profile;
+
+#define PROFILE_ADD(cpu, counter, n) \
+    do { if ((cpu)->profile != NULL) (cpu)->profile->counter += (n); } while (0)
+// From a call instruction, the call starts once the instruction is counted
+#define PROFILE_CALL(cpu, entry, ret_sp) \
+    do { \
+        if ((cpu)->profile != NULL) { \
+            (cpu)->profile->calling = 1; \
+            (cpu)->profile->call_entry = (entry); \
+            (cpu)->profile->call_ret_sp = (ret_sp); \
+        } \
+    } while (0)
+#define PROFILE_INTERRUPT(cpu, entry, ret_sp) \
+    do { if ((cpu)->profile != NULL) profile_call(cpu, entry, ret_sp); } while (0)
+#define PROFILE_STEP(cpu) \
+    do { if ((cpu)->profile != NULL) profile_step(cpu); } while (0)
+#else
+#define PROFILE_ADD(cpu, counter, n) ((void) 0)
+#define PROFILE_CALL(cpu, entry, ret_sp) ((void) 0)
+#define PROFILE_INTERRUPT(cpu, entry, ret_sp) ((void) 0)
+#define PROFILE_STEP(cpu) ((void) 0)
+#endif
+#define PROFILE_COUNT(cpu, counter, addr, n) PROFILE_ADD(cpu, counter[addr], n)
+
+typedef enum {
+    INPUT_RECORD,
+    INPUT_REPLAY,
+} input_mode;
+
+// Values read on the input ports, one entry each time a port reads something new. Entries are
+// keyed on the number of port reads before them so a replay does not depend on the timing of
+// the engine it runs on.
+typedef struct input_log {
+    u8 mode;
+    u8 *data;
+    u32 size;
+    u32 capacity;
+    u32 pos;              // Replay cursor in data
+    u64 reads;            // Input port reads so far
+    u64 last_read;        // Read and cycle count of the previous entry, entries store the difference
+    u64 last_cycles;
+    u8 values[MAX_PORTS]; // Last value of each port in the log
+    u8 logged;            // Ports that have a value yet, one bit each
+    u64 mismatches;       // Replayed reads that did not happen at the recorded cycle count
+} input_log;
+
 #endif // EMUALTOR_H
 
 #ifdef EMULATOR_IMPLEMENTATION
@@ -108,7 +413,8 @@ typedef struct {
 
 #define INFO(f_, ...) printf("[INFO] "f_"\n", __VA_ARGS__)
 
-static u32 file_line = 0;
+// Line being assembled, reported by ERROR. Per thread so programs can be loaded concurrently.
+static _Thread_local u32 file_line = 0;
 
 typedef enum {
     CARRY = 0x1,
@@ -121,6 +427,56 @@ typedef enum {
     STOP  = 0x80,
 } flags;
 
+// Interrupt sources, highest priority first
+typedef enum {
+    IRQ_XIRQ, // Masked by X
+    IRQ_IRQ,  // The others are masked by I
+    IRQ_RTI,  // Real time interrupt
+    IRQ_TOF,  // Timer overflow
+    IRQ_SCI,
+    IRQ_SOURCE_COUNT
+} irq_source;
+
+typedef enum {
+    SCI_VECTOR = 0xFFD6,
+    TOF_VECTOR = 0xFFDE,
+    RTI_VECTOR = 0xFFF0,
+    IRQ_VECTOR = 0xFFF2,
+    XIRQ_VECTOR = 0xFFF4,
+    SWI_VECTOR = 0xFFF6,
+} vectors;
+
+// Registers the events write to, interrupts are only raised when their enable bit is set
+typedef enum {
+    TMSK2 = 0x1024, // TOI (bit 7) and RTII (bit 6)
+    TFLG2 = 0x1025, // TOF (bit 7) and RTIF (bit 6)
+    SCCR2 = 0x102D, // RIE (bit 5)
+    SCSR = 0x102E,  // RDRF (bit 5)
+    SCDR = 0x102F,
+} timer_sci_addr;
+
+#define INTERRUPT_CYCLES 14 // Stacking the registers and fetching the vector
+#define INTERRUPT_FRAME 9   // Bytes STACK_REGISTERS pushes
+
+typedef enum {
+    AWAKE,
+    SLEEP_WAI,  // Registers stacked, waiting for an interrupt
+    SLEEP_STOP, // Clocks stopped until XIRQ, IRQ or reset
+} sleep_state;
+
+// The external lines, the only interrupts that go on while the clocks are stopped
+#define STOP_WAKE_SOURCES ((1 << IRQ_XIRQ) | (1 << IRQ_IRQ))
+
+typedef enum {
+    V_STATUS, // V is up to date in status
+    V_CLEAR,
+    V_ADD,    // Signed overflow of cc_dst + cc_src
+    V_SUB,    // Signed overflow of cc_dst - cc_src
+    V_INC,    // Result is 0x80
+    V_DEC,    // Result is 0x7F
+    V_SHIFT,  // N ^ C
+} cc_v_op;
+
 typedef enum {
     PORTA,
     PORTB,
@@ -145,8 +501,15 @@ typedef enum {
     PORTE_ADDR = 0x100a,
 } ports_addr;
 
+typedef enum {
+    REGION_RAM,
+    REGION_EEPROM, // Written like RAM, the programming sequence is not emulated
+    REGION_ROM,    // Writes are ignored
+    REGION_IO,     // Registers, reads and writes go through READ_IO / WRITE_IO
+} region_kind;
+
 typedef struct {
-    u8 opcode;
+    u16 opcode; // Prefixed opcodes keep the prefix in the high byte
     operand operand;
     u8 immediate_16;
     u16 extra_value;
@@ -155,9 +518,11 @@ typedef struct {
 typedef struct {
     char *names[2]; // Some instructions have aliases like lda = ldaa
     u8 name_count;
-    u8 codes[OPERAND_TYPE_COUNT];
+    u16 codes[OPERAND_TYPE_COUNT]; // 0x1A83 is opcode 0x83 of the page behind prefix 0x1A
     void (*func[OPERAND_TYPE_COUNT]) (cpu *cpu);
     operand_type operands[OPERAND_TYPE_COUNT];
+    u8 cycles[OPERAND_TYPE_COUNT]; // E-clock cycles of each addressing mode
+    u8 taken_cycles; // Added to cycles when a branch is taken
     // The maximum value an operand in immediate addressing mode can have,
     // certain isntruction like 'LDA' can go up to 0xFF but others like 'LDS' can go up to 0xFFFF
     u8 immediate_16;
@@ -170,7 +535,140 @@ const char *directives_name[] = { "org", "equ" };
 
 
 
-void (*instr_func[0x100]) (cpu *cpu) = {0};
+// The 68HC11 has a second byte of opcodes behind the 0x18, 0x1A and 0xCD prefixes. Each of
+// them gets its own page of 0x100 entries after the first one in the instr_* tables, so
+// that a prefix only costs one more table lookup. instr_page holds where a prefix's page starts.
+const u8 opcode_prefixes[OPCODE_PAGE_COUNT - 1] = {0x18, 0x1A, 0xCD};
+
+void (*instr_func[OPCODE_PAGE_COUNT * 0x100]) (cpu *cpu) = {0};
+// Same handler taking its operand decoded ahead of time, NULL when it fetches it itself
+void (*instr_exec[OPCODE_PAGE_COUNT * 0x100]) (cpu *cpu, u16 operand) = {0};
+u8 instr_len[OPCODE_PAGE_COUNT * 0x100] = {0}; // Prefix included
+u8 instr_cycles[OPCODE_PAGE_COUNT * 0x100] = {0};
+u8 instr_taken_cycles[OPCODE_PAGE_COUNT * 0x100] = {0};
+u16 instr_page[0x100] = {0}; // 0 when the opcode is not a prefix
+u8 instr_max_cycles = 1; // Most cycles a single instruction can take
+u8 instr_pure[0x100] = {0}; // Only reads memory and changes registers, see pure_handlers
+// Opcode 0x00 and what can start, unmask or wait for an interrupt (SWI, RTI, CLI, TAP, WAI,
+// STOP). Kept out of the run loops' fast path so they can look at interrupts right after.
+u8 instr_slow[0x100] = {0};
+
+typedef enum {
+    DECODED_FUNC, // func fetches its operand itself
+    DECODED_EXEC, // exec is given the operand, it never changes pc
+    DECODED_SLOW, // See instr_slow
+} decoded_kind;
+
+// An exec runs a prefixed instruction without INST_PREFIX, cycles are the paged instruction's
+typedef struct decoded_inst {
+    union {
+        void (*func) (cpu *cpu);
+        void (*exec) (cpu *cpu, u16 operand);
+    };
+    u16 operand; // Operand bytes after the opcode, high order first
+    u16 next;    // Address of the following instruction
+    u8 kind;
+    u8 len;      // 0 means the entry has not been decoded yet
+    u8 cycles;
+    u8 taken_cycles;
+} decoded_inst;
+
+#ifdef EMULATOR_JIT
+#define JIT_CODE_SIZE (4 << 20)
+#define JIT_MAX_BLOCKS 4096
+#define JIT_MAX_BLOCK_INSTS 64
+#define JIT_MAX_INST_BYTES 80 // Longest native sequence emitted for one instruction
+
+typedef void (*jit_code) (cpu *cpu);
+
+typedef struct {
+    jit_code code;
+    u16 start;
+    u32 end; // First address after the block
+    u8 live;
+} jit_block;
+
+typedef struct jit_state {
+    u8 *code; // Executable arena, blocks are bump allocated until it is flushed
+    u32 code_used;
+    jit_block blocks[JIT_MAX_BLOCKS];
+    u16 block_count;
+    jit_block *entry[MAX_MEMORY];   // Live block starting at each address
+    u8 invalidated; // Set when the running block may have been overwritten
+} jit_state;
+#endif
+
+#define TRACE_HOT_THRESHOLD 64
+#define TRACE_MAX_LEN 128
+#define MAX_TRACES 256
+
+typedef struct {
+    void (*func) (cpu *cpu);
+    u16 pc;
+    u16 next;  // Where the recorded path went after this instruction
+    u8 len;
+    u8 guard;  // Control flow, leave the trace if it does not go to next
+    u8 cycles;
+    u8 taken_cycles;
+} trace_inst;
+
+typedef struct {
+    trace_inst insts[TRACE_MAX_LEN];
+    u16 len;   // Set to 0 when the trace is invalidated
+    u16 head;
+} trace;
+
+typedef struct trace_cache {
+    u16 hot[MAX_MEMORY];       // Taken backward branches per target
+    trace *entry[MAX_MEMORY];  // Trace starting at each loop head
+    trace pool[MAX_TRACES];
+    u16 count;
+} trace_cache;
+
+#define NO_STOP_PC 0x10000 // run_limits.until that no pc can reach
+
+// Why run_cpu returned
+typedef enum {
+    STOP_HALT,         // Reached opcode 0x00
+    STOP_INSTRUCTIONS, // Executed max_instructions
+    STOP_CYCLES,       // Spent max_cycles
+    STOP_PC,           // pc reached until, the instruction there is not executed
+    STOP_IDLE,         // Spinning in a loop that nothing can end, with no limit to wait for
+    STOP_SLEEP,        // WAI or STOP with nothing pending to wake the cpu up
+    STOP_BREAK,        // pc reached a breakpoint, the instruction there is not executed
+    STOP_WATCH,        // The last instruction accessed a watched byte
+    STOP_RETURN,       // The return step_over or step_out waited for
+    STOP_BREAK_IN,     // break_in was set while running
+} stop_reason;
+
+typedef struct {
+    u64 max_instructions; // 0 for no limit
+    u64 max_cycles;       // 0 for no limit. Instructions are never cut, the last one may go over.
+    u32 until;            // Address to stop at, NO_STOP_PC for none
+} run_limits;
+
+typedef struct {
+    stop_reason reason;
+    u64 instructions;
+    u64 cycles;
+    u64 idle_cycles; // Part of cycles skipped over idle loops or while asleep
+} run_result;
+
+// Run loops look at break_in between blocks of instructions, and clear it when they stop on it
+static inline u8 break_requested(cpu *cpu) {
+    return cpu->break_in != NULL && atomic_load_explicit(cpu->break_in, memory_order_relaxed)
+        && atomic_exchange_explicit(cpu->break_in, 0, memory_order_relaxed);
+}
+
+#define IDLE_CHECK_INTERVAL 0x10000 // Instructions between two looks for an idle loop
+#define IDLE_MAX_LOOP 16            // Longest idle loop recognised, in instructions
+
+// A loop that left every register as it found it. Since it only reads memory it will go on
+// the same way until something outside the program changes.
+typedef struct {
+    u64 instructions; // Per iteration, 0 when no loop was found
+    u64 cycles;
+} idle_loop;
 
 /*****************************
 *        Instructions        *
@@ -180,8 +678,8 @@ u16 join(u8 a, u8 b) {
 }
 
 // Returns addr and addr + 1 in a single value
-u16 join_addr(cpu *cpu, u8 addr) {
-    return join(cpu->memory[addr], cpu->memory[addr + 1]);
+u16 join_addr16(cpu *cpu, u16 addr) {
+    return join(cpu->memory[addr], cpu->memory[(u16)(addr + 1)]);
 }
 
 u8 NEXT8(cpu *cpu) {
@@ -194,519 +692,538 @@ u16 NEXT16(cpu *cpu) {
     return join(b0, b1);
 }
 
-u8 DIR_WORD(cpu *cpu) {
-    // Get value of the next operand
-    u8 addr = NEXT8(cpu);
-    // Get value the operand is poiting at
-    return cpu->memory[addr];
+void invalidate_code(cpu *cpu, u16 addr);
+void undo_note(cpu *cpu, u16 addr);
+void trace_note(cpu *cpu, u16 addr, u8 v);
+u64 end_trace(cpu *cpu);
+void stop_inputs(cpu *cpu);
+void clear_debug_points(cpu *cpu);
+u8 breakpoint_holds(const cpu *cpu);
+#ifdef EMULATOR_PROFILE
+void stop_profile(cpu *cpu);
+void profile_call(cpu *cpu, u16 entry, u32 ret_sp);
+void profile_step(cpu *cpu);
+#endif
+
+// Changes a byte without it being seen as a write of the program: no watchpoint, profile,
+// undo or trace record. Copies of translated code are still dropped.
+static inline void POKE8(cpu *cpu, u16 addr, u8 v) {
+    cpu->memory[addr] = v;
+    cpu->dirty[addr >> 8] = 1;
+    if (cpu->code_map != NULL && (cpu->code_map[addr >> 3] >> (addr & 7)) & 1) {
+        invalidate_code(cpu, addr);
+    }
 }
 
-u16 DIR_WORD16(cpu *cpu) {
-    // Get values of the next operands
-    u8 addr = NEXT8(cpu);
-    // Get value the operand is poiting at
-    return join_addr(cpu, addr);
+void WRITE8(cpu *cpu, u16 addr, u8 v) {
+    PROFILE_COUNT(cpu, writes, addr, 1);
+    DEBUG_WATCH(cpu, writes, DEBUG_WRITE, addr);
+    if (cpu->undo != NULL) {
+        undo_note(cpu, addr);
+    }
+    if (cpu->trace != NULL) {
+        trace_note(cpu, addr, v);
+    }
+    POKE8(cpu, addr, v);
 }
 
-u8 EXT_WORD(cpu *cpu) {
-    return cpu->memory[NEXT16(cpu)];
-}
+// Kind of each 256 byte page of the address space. Every page not listed is RAM.
+// The part the program is loaded in stays writable so programs can set their vectors
+// and patch their own code, map_memory() can turn it into ROM.
+static const u8 default_regions[MEMORY_PAGES] = {
+    [0x10] = REGION_IO,
+    [0xF8] = REGION_EEPROM, [0xF9] = REGION_EEPROM, [0xFA] = REGION_EEPROM, [0xFB] = REGION_EEPROM,
+    [0xFC] = REGION_EEPROM, [0xFD] = REGION_EEPROM, [0xFE] = REGION_EEPROM, [0xFF] = REGION_EEPROM,
+};
 
-u16 EXT_WORD16(cpu *cpu) {
-    u16 addr = NEXT16(cpu);
-    return join_addr(cpu, addr);
+// A zeroed cpu has nothing but RAM, init_cpu calls this
+void set_default_regions(cpu *cpu) {
+    memcpy(cpu->regions, default_regions, sizeof(cpu->regions));
 }
 
-u8 STACK_POP8(cpu *cpu) {
-    cpu->sp++;
-    return cpu->memory[cpu->sp];
+// Maps the pages of `cpu` from `start` to `end` (both included) to `kind`
+void map_memory(cpu *cpu, u16 start, u16 end, region_kind kind) {
+    for (u16 page = start >> 8; page <= end >> 8; ++page) {
+        cpu->regions[page] = kind;
+    }
 }
 
-u16 STACK_POP16(cpu *cpu) {
-    u8 v1 = STACK_POP8(cpu);
-    u8 v2 = STACK_POP8(cpu);
-    return join(v1, v2);
-}
+/*****************************
+*        Port inputs         *
+*****************************/
 
-void STACK_PUSH8(cpu *cpu, u8 v) {
-    cpu->memory[cpu->sp] = v & 0xFF;
-    cpu->sp--;
+// An entry is (reads since the previous entry << 3 | port) and the cycles since the previous
+// entry, 7 bits per byte, then the value read. Most entries take 3 bytes.
+#define INPUT_LOG_MAGIC "HCIN"
+
+static void input_new(cpu *cpu, input_mode mode) {
+    stop_inputs(cpu);
+    cpu->inputs = calloc(1, sizeof(input_log));
+    if (cpu->inputs == NULL) {
+        ERROR("%s", "calloc");
+    }
+    cpu->inputs->mode = mode;
+    cpu->inputs->last_cycles = cpu->cycles;
 }
 
-void STACK_PUSH16(cpu *cpu, u16 v) {
-    STACK_PUSH8(cpu, v & 0xFF);
-    STACK_PUSH8(cpu, (v >> 8) & 0xFF);
+// Logs every value the program reads on an input port from now on
+void record_inputs(cpu *cpu) {
+    input_new(cpu, INPUT_RECORD);
 }
 
-void SET_FLAGS(cpu *cpu, i16 result, u8 flags) {
-    if (flags & CARRY) {
-        cpu->c = (result > 0xFF) || (result < 0);
-    }
-    if (flags & OFLOW) {
-        cpu->v = (result >= 127 || result <= -128);
-    }
-    if (flags & ZERO) {
-        cpu->z = (result == 0);
-    }
-    if (flags & NEG) {
-        cpu->n = (result >> 7) & 1;
+// Feeds the values of a recorded log back instead of cpu->ports. Once the log runs out
+// the ports keep their last value. Start from the state the recording started from.
+void replay_inputs(cpu *cpu, const u8 *data, u32 size) {
+    input_new(cpu, INPUT_REPLAY);
+    cpu->inputs->data = malloc(size != 0 ? size : 1);
+    if (cpu->inputs->data == NULL) {
+        ERROR("%s", "malloc");
     }
-    // TODO: IRQ, HALF CARRY, XIRQ, STOP
+    memcpy(cpu->inputs->data, data, size);
+    cpu->inputs->size = size;
 }
 
-void INST_NOP(cpu *cpu) {
-    (void) cpu;
-    // DOES NOTHING
+void stop_inputs(cpu *cpu) {
+    if (cpu->inputs != NULL) {
+        free(cpu->inputs->data);
+        free(cpu->inputs);
+        cpu->inputs = NULL;
+    }
 }
 
-void INST_CLV(cpu *cpu) {
-    cpu->v = 0;
-}
-void INST_SEV(cpu *cpu) {
-    cpu->v = 1;
-}
-void INST_CLC(cpu *cpu) {
-    cpu->c = 0;
-}
-void INST_SEC(cpu *cpu) {
-    cpu->c = 1;
+static void input_put(input_log *log, u64 v) {
+    do {
+        if (log->size == log->capacity) {
+            log->capacity = log->capacity != 0 ? log->capacity * 2 : 0x1000;
+            log->data = realloc(log->data, log->capacity);
+            if (log->data == NULL) {
+                ERROR("%s", "realloc");
+            }
+        }
+        log->data[log->size++] = (v & 0x7F) | (v > 0x7F ? 0x80 : 0);
+        v >>= 7;
+    } while (v != 0);
 }
-void INST_CLI(cpu *cpu) {
-    cpu->i = 0;
+
+static u64 input_get(input_log *log) {
+    u64 v = 0;
+    for (u8 shift = 0; log->pos < log->size && shift < 64; shift += 7) {
+        u8 byte = log->data[log->pos++];
+        v |= (u64) (byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            break;
+        }
+    }
+    return v;
+}
+
+// Value the program reads on `port`, `v` being what the port holds now
+static u8 input_value(cpu *cpu, u8 port, u8 v) {
+    input_log *log = cpu->inputs;
+    u64 read = log->reads++;
+    if (log->mode == INPUT_RECORD) {
+        if (!((log->logged >> port) & 1) || log->values[port] != v) {
+            input_put(log, (read - log->last_read) << 3 | port);
+            input_put(log, cpu->cycles - log->last_cycles);
+            input_put(log, v);
+            log->last_read = read;
+            log->last_cycles = cpu->cycles;
+            log->values[port] = v;
+            log->logged |= 1 << port;
+        }
+        return v;
+    }
+    // Entries of the reads up to this one, there is at most one per read
+    while (log->pos < log->size) {
+        u32 pos = log->pos;
+        u64 key = input_get(log);
+        if (log->last_read + (key >> 3) > read) {
+            log->pos = pos;
+            break;
+        }
+        log->last_read += key >> 3;
+        log->last_cycles += input_get(log);
+        log->values[key & 7] = input_get(log);
+        log->logged |= 1 << (key & 7);
+        if (log->last_read == read && log->last_cycles != cpu->cycles) {
+            log->mismatches++;
+        }
+    }
+    return (log->logged >> port) & 1 ? log->values[port] : v;
 }
-void INST_SEI(cpu *cpu) {
-    cpu->i = 1;
+
+void save_inputs(const cpu *cpu, const char *path) {
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        ERROR("Error while opennig file : %s\n", path);
+    }
+    const input_log *log = cpu->inputs;
+    fwrite(INPUT_LOG_MAGIC, 1, 4, f);
+    if (log != NULL && log->size != 0) {
+        fwrite(log->data, 1, log->size, f);
+    }
+    fclose(f);
 }
 
-u16 READ_FROM_PORTS(cpu *cpu, u16 addr) {
-    if (addr == PORTA_ADDR) {
-        u8 ret = cpu->ports[PORTA] & 0x7;
-        // Or with ret only if third and seventh bit is 0 (input mode)
-        ret |= cpu->ports[PORTA] & (~((cpu->memory[addr] >> 3) & 1) << 3);
-        ret |= cpu->ports[PORTA] & (~((cpu->memory[addr] >> 7) & 1) << 7);
-        return ret;
+// Replays the log saved at `path`
+void replay_inputs_file(cpu *cpu, const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        ERROR("Error while opennig file : %s\n", path);
     }
-    if (addr == PORTB_ADDR) { // Output only port
-        return 0;
+    char magic[4];
+    if (fread(magic, 1, 4, f) != 4 || memcmp(magic, INPUT_LOG_MAGIC, 4) != 0) {
+        ERROR("%s is not an input log", path);
     }
-    if (addr == PORTC_ADDR) {
-        return cpu->ports[PORTC] & cpu->memory[DDRC];
+    u8 *data = NULL;
+    u32 size = 0;
+    for (;;) {
+        data = realloc(data, size + 0x1000);
+        if (data == NULL) {
+            ERROR("%s", "realloc");
+        }
+        size_t n = fread(data + size, 1, 0x1000, f);
+        size += n;
+        if (n < 0x1000) {
+            break;
+        }
     }
-    if (addr == PORTD_ADDR) {
-        return cpu->ports[PORTD] & cpu->memory[DDRD] & 0x70;
+    fclose(f);
+    replay_inputs(cpu, data, size);
+    free(data);
+}
+
+// Registers page. A register without a port behind it is plain memory.
+u8 READ_IO(cpu *cpu, u16 addr) {
+    u8 port;
+    u8 v;
+    switch (addr) {
+        case PORTA_ADDR: // Bits 0 - 2 are inputs, bits 3 and 7 are when their DDRA bit is 0
+            port = PORTA;
+            v = cpu->ports[PORTA] & (0x07 | (~cpu->memory[DDRA] & 0x88));
+            break;
+        case PORTB_ADDR: // Output only port
+            return 0;
+        case PORTC_ADDR:
+            port = PORTC;
+            v = cpu->ports[PORTC] & cpu->memory[DDRC];
+            break;
+        case PORTD_ADDR:
+            port = PORTD;
+            v = cpu->ports[PORTD] & cpu->memory[DDRD] & 0x70;
+            break;
+        case PORTE_ADDR: // Input only port
+            port = PORTE;
+            v = cpu->ports[PORTE];
+            break;
+        default:
+            return cpu->memory[addr];
     }
-    if (addr == PORTE_ADDR) { // Input only port
-        return cpu->ports[PORTE];
+    return cpu->inputs != NULL ? input_value(cpu, port, v) : v;
+}
+
+void WRITE_IO(cpu *cpu, u16 addr, u8 v) {
+    switch (addr) {
+        case PORTA_ADDR: // Only write where bits are in output mode
+            cpu->ports[PORTA] = v & cpu->memory[DDRA];
+            break;
+        case DDRA: // Only bits 3 and 7 can change direction, 4 - 6 are always outputs
+            WRITE8(cpu, addr, 0x70 | (v & 0x88));
+            break;
+        case PORTG_ADDR:
+            ERROR("%s", "PORT G NOT IMPLETEND");
+            break;
+        case DDRG:
+            ERROR("%s", "DDRG NOT IMPLETEND");
+            break;
+        case PORTB_ADDR: // Full output mode
+            cpu->ports[PORTB] = v;
+            break;
+        case PORTF_ADDR:
+            ERROR("%s", "PORT F NOT IMPLETEND");
+            break;
+        case PORTC_ADDR: // Only write where bits are in output mode
+            cpu->ports[PORTC] = v & cpu->memory[DDRC];
+            break;
+        case DDRC:
+            WRITE8(cpu, addr, v);
+            break;
+        case PORTD_ADDR: // 6 bits port, only write where bits are in output mode
+            cpu->ports[PORTD] = v & cpu->memory[DDRD];
+            break;
+        case DDRD: // Only keep the first 6 bits (3F = 0011 1111)
+            WRITE8(cpu, addr, v & 0x3F);
+            break;
+        default:
+            WRITE8(cpu, addr, v);
+            break;
     }
+}
 
-    // If we get there, it means we're not reading from a port
-    return 0xFFFF;
+// Effective address of each memory addressing mode, pc is left on the last operand byte.
+// The offset of the indexed modes is unsigned.
+static inline u16 ADDR_DIR(cpu *cpu) {
+    return NEXT8(cpu);
 }
 
-void SET_LD_FLAGS(cpu *cpu, u8 result) {
-    cpu->n = (result >> 7) & 1;
-    cpu->z = result == 0;
-    cpu->v = 0;
+static inline u16 ADDR_EXT(cpu *cpu) {
+    return NEXT16(cpu);
 }
 
-void INST_LDA_IMM(cpu *cpu) {
-    // Operand is a constant, just load the next byte in memory
-    u8 value = NEXT8(cpu);
-    cpu->a = value;
-    SET_LD_FLAGS(cpu, value);
+static inline u16 ADDR_IDX(cpu *cpu) {
+    return cpu->ix + NEXT8(cpu);
 }
 
-void INST_LDA_DIR(cpu *cpu) {
-    u8 value = DIR_WORD(cpu);
-    cpu->a = value;
-    SET_LD_FLAGS(cpu, value);
+static inline u16 ADDR_IDY(cpu *cpu) {
+    return cpu->iy + NEXT8(cpu);
 }
 
-void INST_LDA_EXT(cpu *cpu) {
-    u16 addr = NEXT16(cpu);
-    u16 port_val = READ_FROM_PORTS(cpu, addr);
-    if (port_val < 0xFF) { // < 0xFF means reading from a port
-        cpu->a = port_val;
-        SET_LD_FLAGS(cpu, port_val);
-    } else {
-        u8 value = cpu->memory[addr];
-        cpu->a = value;
-        SET_LD_FLAGS(cpu, value);
-    }
+// Same from an operand decoded ahead of time, see decode_inst
+static inline u16 ADDR_OF_DIR(cpu *cpu, u16 operand) {
+    (void) cpu;
+    return operand;
+}
+
+static inline u16 ADDR_OF_EXT(cpu *cpu, u16 operand) {
+    (void) cpu;
+    return operand;
 }
 
-void INST_LDB_IMM(cpu *cpu) {
-    // Operand is a constant, just load the next byte in memory
-    u8 value = NEXT8(cpu);
-    cpu->b = value;
-    SET_LD_FLAGS(cpu, value);
+static inline u16 ADDR_OF_IDX(cpu *cpu, u16 operand) {
+    return cpu->ix + operand;
 }
 
-void INST_LDB_DIR(cpu *cpu) {
-    u8 value = DIR_WORD(cpu);
-    cpu->b = value;
-    SET_LD_FLAGS(cpu, value);
+static inline u16 ADDR_OF_IDY(cpu *cpu, u16 operand) {
+    return cpu->iy + operand;
 }
 
-void INST_LDB_EXT(cpu *cpu) {
-    u16 addr = NEXT16(cpu);
-    u16 port_val = READ_FROM_PORTS(cpu, addr);
-    if (port_val < 0xFF) { // < 0xFF means reading from a port
-        cpu->b = port_val;
-        SET_LD_FLAGS(cpu, port_val);
-    } else {
-        u8 value = cpu->memory[addr];
-        cpu->b = value;
-        SET_LD_FLAGS(cpu, value);
-    }
+u8 STACK_POP8(cpu *cpu) {
+    cpu->sp++;
+    PROFILE_COUNT(cpu, reads, cpu->sp, 1);
+    DEBUG_WATCH(cpu, reads, DEBUG_READ, cpu->sp);
+    return cpu->memory[cpu->sp];
+}
+
+u16 STACK_POP16(cpu *cpu) {
+    u8 v1 = STACK_POP8(cpu);
+    u8 v2 = STACK_POP8(cpu);
+    return join(v1, v2);
 }
 
-void INST_LDD_IMM(cpu *cpu) {
-    // Operand is a constant, just load the next byte in memory
-    u16 value = NEXT16(cpu);
-    cpu->d = value;
-    SET_LD_FLAGS(cpu, value);
+void STACK_PUSH8(cpu *cpu, u8 v) {
+    WRITE8(cpu, cpu->sp, v & 0xFF);
+    cpu->sp--;
 }
 
-void INST_LDD_DIR(cpu *cpu) {
-    u16 value = DIR_WORD(cpu);
-    cpu->d = value;
-    SET_LD_FLAGS(cpu, value);
+void STACK_PUSH16(cpu *cpu, u16 v) {
+    STACK_PUSH8(cpu, v & 0xFF);
+    STACK_PUSH8(cpu, (v >> 8) & 0xFF);
 }
 
-void INST_LDD_EXT(cpu *cpu) {
-    u16 addr = NEXT16(cpu);
-    u16 port_val = READ_FROM_PORTS(cpu, addr);
-    if (port_val < 0xFF) { // < 0xFF means reading from a port
-        cpu->d = port_val;
-        SET_LD_FLAGS(cpu, port_val);
-    } else {
-        u16 value = join_addr(cpu, addr);
-        cpu->d = value;
-        SET_LD_FLAGS(cpu, value);
-    }
+static inline u16 SEXT8(u8 v) {
+    return (u16) (i16) (i8) v;
 }
 
-void INST_ABA(cpu *cpu) {
-    i16 result = cpu->a + cpu->b;
-    cpu->a = result & 0xFF;
-    SET_FLAGS(cpu, result, CARRY | OFLOW | ZERO | NEG);
+static inline u8 FLAG_Z(const cpu *cpu) {
+    return (u16) cpu->cc_nz == 0;
 }
 
-void INST_ADCA_IMM(cpu *cpu) {
-    u8 v = NEXT8(cpu);
-    i16 result = cpu->a + v + cpu->c;
-    cpu->a = result & 0xFF;
-    SET_FLAGS(cpu, result, CARRY | OFLOW | ZERO | NEG);
+static inline u8 FLAG_N(const cpu *cpu) {
+    return cpu->cc_nz >= 0x8000;
 }
 
-void INST_ADCA_DIR(cpu *cpu) {
-    u8 v = DIR_WORD(cpu);
-    i16 result = cpu->a + v + cpu->c;
-    cpu->a = result & 0xFF;
-    SET_FLAGS(cpu, result, CARRY | OFLOW | ZERO | NEG);
+// cc_nz value for any N and Z, 1 stands for a non zero positive result
+static inline u32 NZ_OF(u8 n, u8 z) {
+    return z ? (u32) n << 16 : (n ? 0x8000 : 1);
 }
 
-void INST_ADCA_EXT(cpu *cpu) {
-    u8 v = EXT_WORD(cpu);
-    i16 result = cpu->a + v + cpu->c;
-    cpu->a = result & 0xFF;
-    SET_FLAGS(cpu, result, CARRY | OFLOW | ZERO | NEG);
+static inline u8 FLAG_C(const cpu *cpu) {
+    return cpu->cc_c;
 }
 
-void INST_ADCB_IMM(cpu *cpu) {
-    u8 v = NEXT8(cpu);
-    i16 result = cpu->b + v + cpu->c;
-    cpu->b = result & 0xFF;
-    SET_FLAGS(cpu, result, CARRY | OFLOW | ZERO | NEG);
+// 8 bit operands are sign extended so bit 15 is the sign bit for both widths
+static inline u8 FLAG_V(const cpu *cpu) {
+    u16 r = (u16) cpu->cc_nz;
+    u16 d = cpu->cc_dst;
+    u16 s = cpu->cc_src;
+    switch (cpu->cc_v) {
+        case V_CLEAR: return 0;
+        case V_ADD: return (u16) (~(d ^ s) & (d ^ r)) >> 15;
+        case V_SUB: return (u16) ((d ^ s) & (d ^ r)) >> 15;
+        case V_INC: return r == 0xFF80;
+        case V_DEC: return r == 0x007F;
+        case V_SHIFT: return FLAG_N(cpu) ^ cpu->cc_c;
+        default: return cpu->v;
+    }
 }
 
-void INST_ADCB_DIR(cpu *cpu) {
-    u8 v = DIR_WORD(cpu);
-    i16 result = cpu->b + v + cpu->c;
-    cpu->b = result & 0xFF;
-    SET_FLAGS(cpu, result, CARRY | OFLOW | ZERO | NEG);
+// Writes N Z V C into status, for anything that reads the whole register
+static inline void SYNC_FLAGS(cpu *cpu) {
+    cpu->n = FLAG_N(cpu);
+    cpu->z = FLAG_Z(cpu);
+    cpu->v = FLAG_V(cpu);
+    cpu->c = cpu->cc_c;
 }
 
-void INST_ADCB_EXT(cpu *cpu) {
-    u8 v = EXT_WORD(cpu);
-    i16 result = cpu->b + v + cpu->c;
-    cpu->b = result & 0xFF;
-    SET_FLAGS(cpu, result, CARRY | OFLOW | ZERO | NEG);
+// Takes N Z V C back from status after the whole register was written
+static inline void LOAD_FLAGS(cpu *cpu) {
+    cpu->cc_nz = NZ_OF(cpu->n, cpu->z);
+    cpu->cc_c = cpu->c;
+    cpu->cc_v = V_STATUS;
 }
 
-void INST_ADDA_IMM(cpu *cpu) {
-    u8 v = NEXT8(cpu);
-    i16 result = cpu->a + v;
-    cpu->a = result & 0xFF;
-    SET_FLAGS(cpu, result, CARRY | OFLOW | ZERO | NEG);
+static inline void SET_CARRY(cpu *cpu, u8 c) {
+    // V of a shift depends on C, keep it before C changes
+    if (cpu->cc_v == V_SHIFT) {
+        cpu->v = FLAG_V(cpu);
+        cpu->cc_v = V_STATUS;
+    }
+    cpu->cc_c = c;
 }
 
-void INST_ADDA_DIR(cpu *cpu) {
-    u8 v = DIR_WORD(cpu);
-    i16 result = cpu->a + v;
-    cpu->a = result & 0xFF;
-    SET_FLAGS(cpu, result, CARRY | OFLOW | ZERO | NEG);
+// Loads, stores, transfers and logic operations
+static inline void SET_LD_FLAGS(cpu *cpu, u8 result) {
+    cpu->cc_nz = SEXT8(result);
+    cpu->cc_v = V_CLEAR;
 }
 
-void INST_ADDA_EXT(cpu *cpu) {
-    u8 v = EXT_WORD(cpu);
-    i16 result = cpu->a + v;
-    cpu->a = result & 0xFF;
-    SET_FLAGS(cpu, result, CARRY | OFLOW | ZERO | NEG);
+static inline void SET_LD16_FLAGS(cpu *cpu, u16 result) {
+    cpu->cc_nz = result;
+    cpu->cc_v = V_CLEAR;
 }
 
-void INST_ADDB_IMM(cpu *cpu) {
-    u8 v = NEXT8(cpu);
-    i16 result = cpu->b + v;
-    cpu->b = result & 0xFF;
-    SET_FLAGS(cpu, result, CARRY | OFLOW | ZERO | NEG);
+// TST, CLR and COM also set C
+static inline void SET_TST_FLAGS(cpu *cpu, u8 result, u8 carry) {
+    cpu->cc_nz = SEXT8(result);
+    cpu->cc_v = V_CLEAR;
+    cpu->cc_c = carry;
 }
 
-void INST_ADDB_DIR(cpu *cpu) {
-    u8 v = DIR_WORD(cpu);
-    i16 result = cpu->b + v;
-    cpu->b = result & 0xFF;
-    SET_FLAGS(cpu, result, CARRY | OFLOW | ZERO | NEG);
+// result is the full dst + src (+ carry), H is the only flag still computed eagerly
+static inline void SET_ADD_FLAGS(cpu *cpu, u8 dst, u8 src, u16 result) {
+    cpu->h = ((dst ^ src ^ result) >> 4) & 1;
+    cpu->cc_nz = SEXT8(result);
+    cpu->cc_dst = SEXT8(dst);
+    cpu->cc_src = SEXT8(src);
+    cpu->cc_v = V_ADD;
+    cpu->cc_c = (result >> 8) & 1;
 }
 
-void INST_ADDB_EXT(cpu *cpu) {
-    u8 v = EXT_WORD(cpu);
-    i16 result = cpu->b + v;
-    cpu->b = result & 0xFF;
-    SET_FLAGS(cpu, result, CARRY | OFLOW | ZERO | NEG);
+static inline void SET_ADD16_FLAGS(cpu *cpu, u16 dst, u16 src, u32 result) {
+    cpu->cc_nz = (u16) result;
+    cpu->cc_dst = dst;
+    cpu->cc_src = src;
+    cpu->cc_v = V_ADD;
+    cpu->cc_c = (result >> 16) & 1;
 }
 
-void INST_ADDD_IMM(cpu *cpu) {
-    u8 v = NEXT16(cpu);
-    int32_t result = cpu->d + v;
-    cpu->d = result & 0xFFFF;
-    SET_FLAGS(cpu, result, CARRY | OFLOW | ZERO | NEG);
+// result is dst - src (- borrow) computed without truncation
+static inline void SET_SUB_FLAGS(cpu *cpu, u8 dst, u8 src, u16 result) {
+    cpu->cc_nz = SEXT8(result);
+    cpu->cc_dst = SEXT8(dst);
+    cpu->cc_src = SEXT8(src);
+    cpu->cc_v = V_SUB;
+    cpu->cc_c = (result >> 8) & 1;
 }
 
-void INST_ADDD_DIR(cpu *cpu) {
-    u8 v = DIR_WORD(cpu);
-    int32_t result = cpu->d + v;
-    cpu->d = result & 0xFFFF;
-    SET_FLAGS(cpu, result, CARRY | OFLOW | ZERO | NEG);
+static inline void SET_SUB16_FLAGS(cpu *cpu, u16 dst, u16 src, u32 result) {
+    cpu->cc_nz = (u16) result;
+    cpu->cc_dst = dst;
+    cpu->cc_src = src;
+    cpu->cc_v = V_SUB;
+    cpu->cc_c = (result >> 16) & 1;
 }
 
-void INST_ADDD_EXT(cpu *cpu) {
-    u16 addr = NEXT16(cpu);
-    u16 v = join_addr(cpu, addr);
-    int32_t result = cpu->d + v;
-    cpu->d = result & 0xFFFF;
-    SET_FLAGS(cpu, result, CARRY | OFLOW | ZERO | NEG);
+// INC and DEC leave C alone
+static inline void SET_INC_FLAGS(cpu *cpu, u8 result) {
+    cpu->cc_nz = SEXT8(result);
+    cpu->cc_v = V_INC;
 }
 
-void INST_ANDA_IMM(cpu *cpu) {
-    u8 v = NEXT8(cpu);
-    i8 result = cpu->a & v;
-    cpu->a = result;
-    SET_FLAGS(cpu, result, ZERO | NEG);
-    cpu->v = 0;
+static inline void SET_DEC_FLAGS(cpu *cpu, u8 result) {
+    cpu->cc_nz = SEXT8(result);
+    cpu->cc_v = V_DEC;
 }
 
-void INST_ANDA_DIR(cpu *cpu) {
-    u8 v = DIR_WORD(cpu);
-    i8 result = cpu->a & v;
-    cpu->a = result;
-    SET_FLAGS(cpu, result, ZERO | NEG);
-    cpu->v = 0;
+static inline void SET_NEG_FLAGS(cpu *cpu, u8 result) {
+    cpu->cc_nz = SEXT8(result);
+    cpu->cc_v = V_INC; // Only overflows on 0x80 as well
+    cpu->cc_c = result != 0;
 }
 
-void INST_ANDA_EXT(cpu *cpu) {
-    u8 v = EXT_WORD(cpu);
-    i8 result = cpu->a & v;
-    cpu->a = result;
-    SET_FLAGS(cpu, result, ZERO | NEG);
-    cpu->v = 0;
+// carry is the bit shifted out
+static inline void SET_SHIFT_FLAGS(cpu *cpu, u8 result, u8 carry) {
+    cpu->cc_nz = SEXT8(result);
+    cpu->cc_v = V_SHIFT;
+    cpu->cc_c = carry;
 }
 
-void INST_ANDB_IMM(cpu *cpu) {
-    u8 v = NEXT8(cpu);
-    i8 result = cpu->b & v;
-    cpu->b = result;
-    SET_FLAGS(cpu, result, ZERO | NEG);
-    cpu->v = 0;
+static inline void SET_SHIFT16_FLAGS(cpu *cpu, u16 result, u8 carry) {
+    cpu->cc_nz = result;
+    cpu->cc_v = V_SHIFT;
+    cpu->cc_c = carry;
 }
 
-void INST_ANDB_DIR(cpu *cpu) {
-    u8 v = DIR_WORD(cpu);
-    i8 result = cpu->b & v;
-    cpu->b = result;
-    SET_FLAGS(cpu, result, ZERO | NEG);
-    cpu->v = 0;
+void INST_NOP(cpu *cpu) {
+    (void) cpu;
+    // DOES NOTHING
 }
 
-void INST_ANDB_EXT(cpu *cpu) {
-    u8 v = EXT_WORD(cpu);
-    i8 result = cpu->b & v;
-    cpu->b = result;
-    SET_FLAGS(cpu, result, ZERO | NEG);
+void INST_CLV(cpu *cpu) {
     cpu->v = 0;
+    cpu->cc_v = V_STATUS;
+}
+void INST_SEV(cpu *cpu) {
+    cpu->v = 1;
+    cpu->cc_v = V_STATUS;
+}
+void INST_CLC(cpu *cpu) {
+    SET_CARRY(cpu, 0);
+}
+void INST_SEC(cpu *cpu) {
+    SET_CARRY(cpu, 1);
+}
+void INST_CLI(cpu *cpu) {
+    cpu->i = 0;
+}
+void INST_SEI(cpu *cpu) {
+    cpu->i = 1;
 }
 
-void INST_ASL_EXT(cpu *cpu) {
-    u16 addr = NEXT16(cpu);
-    u16 v = cpu->memory[addr];
-    u32 result = (v << 1);
-    cpu->memory[addr] = result & 0xFF;
-    SET_FLAGS(cpu, result, CARRY | OFLOW | ZERO | NEG);
+void INST_ABA(cpu *cpu) {
+    u16 result = cpu->a + cpu->b;
+    SET_ADD_FLAGS(cpu, cpu->a, cpu->b, result);
+    cpu->a = result & 0xFF;
 }
 
 void INST_ASLA_INH(cpu *cpu) {
-    u16 result = cpu->a << 1;
-    cpu->a = result & 0xFF;
-    SET_FLAGS(cpu, result, CARRY | OFLOW | ZERO | NEG);
+    u8 v = cpu->a;
+    cpu->a = v << 1;
+    SET_SHIFT_FLAGS(cpu, cpu->a, v >> 7);
 }
 
 void INST_ASLB_INH(cpu *cpu) {
-    u16 result = cpu->b << 1;
-    cpu->b = result & 0xFF;
-    SET_FLAGS(cpu, result, CARRY | OFLOW | ZERO | NEG);
+    u8 v = cpu->b;
+    cpu->b = v << 1;
+    SET_SHIFT_FLAGS(cpu, cpu->b, v >> 7);
 }
 
 void INST_ASLD_INH(cpu *cpu) {
-    u32 result = cpu->d << 1;
-    cpu->d = result & 0xFFFF;
-    SET_FLAGS(cpu, result, CARRY | OFLOW | ZERO | NEG);
+    u16 v = cpu->d;
+    cpu->d = v << 1;
+    SET_SHIFT16_FLAGS(cpu, cpu->d, v >> 15);
 }
 
 void INST_ASRA_INH(cpu *cpu) {
-    u8 msb = (cpu->a >> 7) & 1;
-    u32 result = cpu->a >> 1;
-    result |= msb << 7;
-    cpu->a = result;
-
-    cpu->c = result & 1;
-    SET_FLAGS(cpu, result, ZERO | NEG);
-    cpu->v = cpu->n ^ cpu->c;
+    u8 v = cpu->a;
+    cpu->a = (v >> 1) | (v & 0x80);
+    SET_SHIFT_FLAGS(cpu, cpu->a, v & 1);
 }
 
 void INST_ASRB_INH(cpu *cpu) {
-    u8 msb = (cpu->b >> 7) & 1;
-    u32 result = cpu->b >> 1;
-    result |= msb << 7;
-    cpu->b = result;
-
-    cpu->c = result & 1;
-    SET_FLAGS(cpu, result, ZERO | NEG);
-    cpu->v = cpu->n ^ cpu->c;
-}
-
-void INST_ASR_EXT(cpu *cpu) {
-    u16 addr = NEXT16(cpu);
-    u8 m = cpu->memory[addr];
-
-    u8 msb = (m >> 7) & 1;
-    u32 result = m >> 1;
-    result |= msb << 7;
-    cpu->memory[addr] = result;
-
-    cpu->c = result & 1;
-    SET_FLAGS(cpu, result, ZERO | NEG);
-    cpu->v = cpu->n ^ cpu->c;
-}
-
-u8 WRITE_TO_PORTS(cpu *cpu, u16 addr) {
-    if (addr == PORTA_ADDR) { // PORT A
-        cpu->ports[PORTA] = cpu->a & cpu->memory[DDRA]; // Only write where bits are in output mode
-        return 1;
-    }
-    else if (addr == DDRA) { // DDRA
-        cpu->memory[addr] = 0x70; // (0x70 == 0111 0000)
-        cpu->memory[addr] |= ((cpu->a >> 3) & 1) << 3; // Copy third bit from ACC A to DDRA
-        cpu->memory[addr] |= ((cpu->a >> 7) & 1) << 7; // Copy seventh bit from ACC A to DDRA
-        return 1;
-    }
-    else if (addr == PORTG_ADDR) { // PORT G
-        ERROR("%s", "PORT G NOT IMPLETEND");
-        return 1;
-    } else if (addr == DDRG) { // DDRG
-        ERROR("%s", "DDRG NOT IMPLETEND");
-        return 1;
-    }
-    else if (addr == PORTB_ADDR) { // PORT B Full output mode
-        cpu->ports[PORTB] = cpu->a;
-        return 1;
-    }
-    else if (addr == PORTF_ADDR) { // PORT F
-        ERROR("%s", "PORT F NOT IMPLETEND");
-        return 1;
-    }
-    else if (addr == PORTC_ADDR) { // PORT C
-        cpu->ports[PORTC] = cpu->a & cpu->memory[DDRC]; // Only write where bits are in output mode
-        return 1;
-    }
-    else if (addr == DDRC) { // DDRC
-        cpu->memory[addr] = cpu->a;
-        return 1;
-    }
-    else if (addr == PORTD_ADDR) { // PORT D (6 bits pin)
-        cpu->ports[PORTD] = cpu->a & cpu->memory[DDRD]; // Only write where bits are in output mode
-        return 1;
-    }
-    else if (addr == DDRD) { // DDRD
-        cpu->memory[addr] = cpu->a & 0x3F; // Only keep the first 6 bits (3F = 0011 1111)
-        return 1;
-    }
-    else if (addr == PORTE_ADDR) { // PORT E
-    }
-    return 0;
-}
-
-void INST_STA_DIR(cpu *cpu) {
-    u8 addr = NEXT8(cpu);
-    cpu->memory[addr] = cpu->a;
-    SET_FLAGS(cpu, cpu->a, ZERO | NEG);
-    cpu->v = 0;
-}
-
-
-void INST_STA_EXT(cpu *cpu) {
-    u16 addr = NEXT16(cpu);
-    if (!WRITE_TO_PORTS(cpu, addr)) {
-        cpu->memory[addr] = cpu->a;
-    }
-    SET_FLAGS(cpu, cpu->a, ZERO | NEG);
-    cpu->v = 0;
-}
-
-void INST_STB_DIR(cpu *cpu) {
-    u8 addr = NEXT8(cpu);
-    cpu->memory[addr] = cpu->b;
-    SET_FLAGS(cpu, cpu->a, ZERO | NEG);
-    cpu->v = 0;
-}
-
-void INST_STB_EXT(cpu *cpu) {
-    u16 addr = NEXT16(cpu);
-    if (!WRITE_TO_PORTS(cpu, addr)) {
-        cpu->memory[addr] = cpu->b;
-    }
-    SET_FLAGS(cpu, cpu->a, ZERO | NEG);
-    cpu->v = 0;
-}
-
-void INST_STD_DIR(cpu *cpu) {
-    u8 addr = NEXT8(cpu);
-    if (!WRITE_TO_PORTS(cpu, addr)) {
-        cpu->memory[addr + 0] = cpu->a;
-        cpu->memory[addr + 1] = cpu->b;
-    }
-    SET_FLAGS(cpu, cpu->a, ZERO | NEG);
-    cpu->v = 0;
-}
-
-void INST_STD_EXT(cpu *cpu) {
-    u16 addr = NEXT16(cpu);
-    if (!WRITE_TO_PORTS(cpu, addr)) {
-        cpu->memory[addr + 0] = cpu->a;
-        cpu->memory[addr + 1] = cpu->b;
-    }
-    SET_FLAGS(cpu, cpu->a, ZERO | NEG);
-    cpu->v = 0;
+    u8 v = cpu->b;
+    cpu->b = (v >> 1) | (v & 0x80);
+    SET_SHIFT_FLAGS(cpu, cpu->b, v & 1);
 }
 
 void INST_BRA(cpu *cpu) {
@@ -716,84 +1233,84 @@ void INST_BRA(cpu *cpu) {
 
 void INST_BCC(cpu *cpu) {
     u8 jmp = NEXT8(cpu);
-    if (cpu->c == 0) {
+    if (FLAG_C(cpu) == 0) {
         cpu->pc += (i8) jmp;
     }
 }
 
 void INST_BCS(cpu *cpu) {
     u8 jmp = NEXT8(cpu);
-    if (cpu->c == 1) {
+    if (FLAG_C(cpu) == 1) {
         cpu->pc += (i8) jmp;
     }
 }
 
 void INST_BEQ(cpu *cpu) {
     u8 jmp = NEXT8(cpu);
-    if (cpu->z == 0) {
+    if (FLAG_Z(cpu) == 1) {
         cpu->pc += (i8) jmp;
     }
 }
 
 void INST_BGE(cpu *cpu) {
     u8 jmp = NEXT8(cpu);
-    if ((cpu->n ^ cpu->v) == 0) {
+    if ((FLAG_N(cpu) ^ FLAG_V(cpu)) == 0) {
         cpu->pc += (i8) jmp;
     }
 }
 
 void INST_BGT(cpu *cpu) {
     u8 jmp = NEXT8(cpu);
-    if (cpu->z + (cpu->n ^ cpu->v) == 0) {
+    if ((FLAG_Z(cpu) | (FLAG_N(cpu) ^ FLAG_V(cpu))) == 0) {
         cpu->pc += (i8) jmp;
     }
 }
 
 void INST_BHI(cpu *cpu) {
     u8 jmp = NEXT8(cpu);
-    if (cpu->c + cpu->z == 0) {
+    if ((FLAG_C(cpu) | FLAG_Z(cpu)) == 0) {
         cpu->pc += (i8) jmp;
     }
 }
 
 void INST_BLE(cpu *cpu) {
     u8 jmp = NEXT8(cpu);
-    if (cpu->z + (cpu->n ^ cpu->c) != 0) {
+    if ((FLAG_Z(cpu) | (FLAG_N(cpu) ^ FLAG_V(cpu))) != 0) {
         cpu->pc += (i8) jmp;
     }
 }
 
 void INST_BLS(cpu *cpu) {
     u8 jmp = NEXT8(cpu);
-    if (cpu->c + cpu->z != 0) {
+    if ((FLAG_C(cpu) | FLAG_Z(cpu)) != 0) {
         cpu->pc += (i8) jmp;
     }
 }
 
 void INST_BLT(cpu *cpu) {
     u8 jmp = NEXT8(cpu);
-    if (cpu->n + cpu->v != 0) {
+    if ((FLAG_N(cpu) ^ FLAG_V(cpu)) != 0) {
         cpu->pc += (i8) jmp;
     }
 }
 
 void INST_BMI(cpu *cpu) {
     u8 jmp = NEXT8(cpu);
-    if (cpu->n == 1) {
+    if (FLAG_N(cpu) == 1) {
         cpu->pc += (i8) jmp;
     }
 }
 
 void INST_BNE(cpu *cpu) {
     u8 jmp = NEXT8(cpu);
-    if (cpu->z == 0) {
+    if (FLAG_Z(cpu) == 0) {
         cpu->pc += (i8) jmp;
     }
 }
 
 void INST_BPL(cpu *cpu) {
     u8 jmp = NEXT8(cpu);
-    if (cpu->n == 0) {
+    if (FLAG_N(cpu) == 0) {
         cpu->pc += (i8) jmp;
     }
 }
@@ -805,79 +1322,37 @@ void INST_BRN(cpu *cpu) {
 
 void INST_BVC(cpu *cpu) {
     u8 jmp = NEXT8(cpu);
-    if (cpu->v == 0) {
+    if (FLAG_V(cpu) == 0) {
         cpu->pc += (i8) jmp;
     }
 }
 
 void INST_BVS(cpu *cpu) {
     u8 jmp = NEXT8(cpu);
-    if (cpu->v == 1) {
+    if (FLAG_V(cpu) == 1) {
         cpu->pc += (i8) jmp;
     }
 }
 
-void INST_BSR_REL(cpu *cpu) {
-    cpu->pc += 2;
-    STACK_PUSH16(cpu, cpu->pc);
-    cpu->pc += (i8) NEXT8(cpu);
-}
-
 void INST_TAB_INH(cpu *cpu) {
     cpu->b = cpu->a;
-    SET_FLAGS(cpu, cpu->b, ZERO | NEG);
-    cpu->v = 0;
+    SET_LD_FLAGS(cpu, cpu->b);
 }
 
 void INST_TAP_INH(cpu *cpu) {
+    u8 x = cpu->x;
     cpu->status = cpu->a;
+    cpu->x &= x; // X can be cleared but not set again
+    LOAD_FLAGS(cpu);
 }
 
 void INST_TBA_INH(cpu *cpu) {
     cpu->a = cpu->b;
-    SET_FLAGS(cpu, cpu->b, ZERO | NEG);
-    cpu->v = 0;
-}
-
-void SET_CMP_FLAGS(cpu *cpu, u8 a, u8 v) {
-    i16 r = a - v;
-    SET_FLAGS(cpu, r, CARRY | OFLOW | ZERO | NEG);
-}
-
-void INST_CMPA_IMM(cpu *cpu) {
-    u8 a = cpu->a;
-    u8 v = NEXT8(cpu);
-    SET_CMP_FLAGS(cpu, a, v);
+    SET_LD_FLAGS(cpu, cpu->a);
 }
 
-void INST_CMPA_DIR(cpu *cpu) {
-    u8 a = cpu->a;
-    u8 v = DIR_WORD(cpu);
-    SET_CMP_FLAGS(cpu, a, v);
-}
-
-void INST_CMPA_EXT(cpu *cpu) {
-    u8 a = cpu->a;
-    u8 v = EXT_WORD(cpu);
-    SET_CMP_FLAGS(cpu, a, v);
-}
-
-void INST_CMPB_IMM(cpu *cpu) {
-    u8 b = cpu->b;
-    u8 v = NEXT8(cpu);
-    SET_CMP_FLAGS(cpu, b, v);
-}
-
-void INST_CMPB_DIR(cpu *cpu) {
-    u8 b = cpu->b;
-    u8 v = DIR_WORD(cpu);
-    SET_CMP_FLAGS(cpu, b, v);
-}
-
-void INST_CMPB_EXT(cpu *cpu) {
-    u8 b = cpu->b;
-    u8 v = EXT_WORD(cpu);
-    SET_CMP_FLAGS(cpu, b, v);
+static inline void SET_CMP_FLAGS(cpu *cpu, u8 a, u8 v) {
+    SET_SUB_FLAGS(cpu, a, v, a - v);
 }
 
 void INST_CBA_INH(cpu *cpu) {
@@ -886,173 +1361,75 @@ void INST_CBA_INH(cpu *cpu) {
     SET_CMP_FLAGS(cpu, a, b);
 }
 
-void INST_COM_EXT(cpu *cpu) {
-    u16 addr = NEXT16(cpu);
-    u8 v = cpu->memory[addr];
-    v = 0xFF - v;
-    cpu->memory[addr] = v & 0xFF;
-
-    SET_FLAGS(cpu, v, NEG | ZERO);
-    cpu->v = 0;
-    cpu->c = 0;
-}
-
 void INST_COMA_INH(cpu *cpu) {
-    u8 v = cpu->a;
-    v = 0xFF - v;
-    cpu->a = v & 0xFF;
-
-    SET_FLAGS(cpu, v, NEG | ZERO);
-    cpu->v = 0;
-    cpu->c = 0;
+    cpu->a = ~cpu->a;
+    SET_TST_FLAGS(cpu, cpu->a, 1);
 }
 
 void INST_COMB_INH(cpu *cpu) {
-    u8 v = cpu->b;
-    v = 0xFF - v;
-    cpu->b = v & 0xFF;
-
-    SET_FLAGS(cpu, v, NEG | ZERO);
-    cpu->v = 0;
-    cpu->c = 0;
-}
-
-
-void INST_LDS_IMM(cpu *cpu) {
-    u16 v = NEXT16(cpu);
-    SET_FLAGS(cpu, v, NEG | ZERO);
-    cpu->v = 0;
-    cpu->sp = v;
-}
-
-void INST_LDS_DIR(cpu *cpu) {
-    u16 v = DIR_WORD(cpu);
-    SET_FLAGS(cpu, v, NEG | ZERO);
-    cpu->v = 0;
-    cpu->sp = v;
-}
-
-void INST_LDS_EXT(cpu *cpu) {
-    u16 v = EXT_WORD(cpu);
-    SET_FLAGS(cpu, v, NEG | ZERO);
-    cpu->v = 0;
-    cpu->sp = v;
-}
-
-static inline void SET_SHIFT_FLAGS(cpu *cpu, u32 res, u16 base, u16 offset) {
-    cpu->n = (res >> offset) & 1;
-    cpu->z = res == 0;
-    cpu->c = (base >> offset) & 1;
-    cpu->v = cpu->n ^ cpu->c;
+    cpu->b = ~cpu->b;
+    SET_TST_FLAGS(cpu, cpu->b, 1);
 }
 
-void INST_LSL_EXT(cpu *cpu) {
-    u16 addr = NEXT16(cpu);
-    u8 v = cpu->memory[addr];
-    u16 res = v << 1;
-    SET_SHIFT_FLAGS(cpu, res, v, 7);
-    cpu->memory[addr] = res & 0xFF;
-}
 
 void INST_LSLA_INH(cpu *cpu) {
-    u16 res = cpu->a << 1;
-    SET_SHIFT_FLAGS(cpu, res, cpu->a, 7);
-    cpu->a = res & 0xFF;
+    u8 v = cpu->a;
+    cpu->a = v << 1;
+    SET_SHIFT_FLAGS(cpu, cpu->a, v >> 7);
 }
 
 void INST_LSLB_INH(cpu *cpu) {
-    u16 res = cpu->b << 1;
-    SET_SHIFT_FLAGS(cpu, res, cpu->b, 7);
-    cpu->b = res & 0xFF;
+    u8 v = cpu->b;
+    cpu->b = v << 1;
+    SET_SHIFT_FLAGS(cpu, cpu->b, v >> 7);
 }
 
 void INST_LSLD_INH(cpu *cpu) {
-    u32 res = cpu->d << 1;
-    SET_SHIFT_FLAGS(cpu, res, cpu->b, 15);
-    cpu->d = res & 0xFFFF;
-}
-
-void INST_LSR_EXT(cpu *cpu) {
-    u16 addr = NEXT16(cpu);
-    u8 v = cpu->memory[addr];
-    u16 res = v >> 1;
-    SET_SHIFT_FLAGS(cpu, res, v, 0);
-    cpu->memory[addr] = res & 0xFF;
+    u16 v = cpu->d;
+    cpu->d = v << 1;
+    SET_SHIFT16_FLAGS(cpu, cpu->d, v >> 15);
 }
 
 void INST_LSRA_INH(cpu *cpu) {
-    u16 res = cpu->a >> 1;
-    SET_SHIFT_FLAGS(cpu, res, cpu->a, 0);
-    cpu->a = res & 0xFF;
+    u8 v = cpu->a;
+    cpu->a = v >> 1;
+    SET_SHIFT_FLAGS(cpu, cpu->a, v & 1);
 }
 
 void INST_LSRB_INH(cpu *cpu) {
-    u16 res = cpu->b >> 1;
-    SET_SHIFT_FLAGS(cpu, res, cpu->b, 0);
-    cpu->b = res & 0xFF;
+    u8 v = cpu->b;
+    cpu->b = v >> 1;
+    SET_SHIFT_FLAGS(cpu, cpu->b, v & 1);
 }
 
 void INST_LSRD_INH(cpu *cpu) {
-    u32 res = cpu->d >> 1;
-    SET_SHIFT_FLAGS(cpu, res, cpu->d, 0);
-    cpu->d = res & 0xFFFF;
-}
-
-void INST_ROL_EXT(cpu *cpu) {
-    u16 addr = NEXT16(cpu);
-    u8 v = cpu->memory[addr];
-    u16 res = (v << 1) | cpu->c;
-    SET_SHIFT_FLAGS(cpu, res, v, 7);
-    cpu->memory[addr] = res & 0xFF;
+    u16 v = cpu->d;
+    cpu->d = v >> 1;
+    SET_SHIFT16_FLAGS(cpu, cpu->d, v & 1);
 }
 
 void INST_ROLA_INH(cpu *cpu) {
-    u16 res = (cpu->a << 1) | cpu->c;
-    SET_SHIFT_FLAGS(cpu, res, cpu->a, 7);
-    cpu->a = res & 0xFF;
+    u8 v = cpu->a;
+    cpu->a = (v << 1) | FLAG_C(cpu);
+    SET_SHIFT_FLAGS(cpu, cpu->a, v >> 7);
 }
 
 void INST_ROLB_INH(cpu *cpu) {
-    u16 res = (cpu->b << 1) | cpu->c;
-    SET_SHIFT_FLAGS(cpu, res, cpu->b, 7);
-    cpu->b = res & 0xFF;
-}
-
-void INST_ROR_EXT(cpu *cpu) {
-    u16 addr = NEXT16(cpu);
-    u8 v = cpu->memory[addr];
-    u16 res = (v >> 1) | (cpu->c << 7);
-    SET_SHIFT_FLAGS(cpu, res, v, 0);
-    cpu->memory[addr] = res & 0xFF;
+    u8 v = cpu->b;
+    cpu->b = (v << 1) | FLAG_C(cpu);
+    SET_SHIFT_FLAGS(cpu, cpu->b, v >> 7);
 }
 
 void INST_RORA_INH(cpu *cpu) {
-    u16 res = (cpu->a >> 1) | (cpu->c << 7);
-    SET_SHIFT_FLAGS(cpu, res, cpu->a, 0);
-    cpu->a = res & 0xFF;
+    u8 v = cpu->a;
+    cpu->a = (v >> 1) | (FLAG_C(cpu) << 7);
+    SET_SHIFT_FLAGS(cpu, cpu->a, v & 1);
 }
 
 void INST_RORB_INH(cpu *cpu) {
-    u16 res = (cpu->b >> 1) | (cpu->c << 7);
-    SET_SHIFT_FLAGS(cpu, res, cpu->b, 0);
-    cpu->b = res & 0xFF;
-}
-
-void INST_RTS_INH(cpu *cpu) {
-    u16 ret_addr = STACK_POP16(cpu);
-    cpu->pc = ret_addr;
-}
-
-void INST_JSR_DIR(cpu *cpu) {
-    u8 sub_addr = DIR_WORD(cpu);
-    STACK_PUSH16(cpu, cpu->pc);
-    cpu->pc = sub_addr;
-}
-
-void INST_JSR_EXT(cpu *cpu) {
-    u16 sub_addr = NEXT16(cpu);
-    STACK_PUSH16(cpu, cpu->pc);
-    cpu->pc = sub_addr;
+    u8 v = cpu->b;
+    cpu->b = (v >> 1) | (FLAG_C(cpu) << 7);
+    SET_SHIFT_FLAGS(cpu, cpu->b, v & 1);
 }
 
 void INST_PSHA_INH(cpu *cpu) {
@@ -1065,11 +1442,6 @@ void INST_PSHB_INH(cpu *cpu) {
     STACK_PUSH8(cpu, b);
 }
 
-void INST_PSHX_INH(cpu *cpu) {
-    u8 x = cpu->x;
-    STACK_PUSH16(cpu, x);
-}
-
 void INST_PULA_INH(cpu *cpu) {
     u8 v = STACK_POP8(cpu);
     cpu->a = v;
@@ -1080,76 +1452,38 @@ void INST_PULB_INH(cpu *cpu) {
     cpu->b = v;
 }
 
-void INST_PULX_INH(cpu *cpu) {
-    u16 v = STACK_POP16(cpu);
-    cpu->x = v;
-}
-
-void INST_DEC_EXT(cpu *cpu) {
-    u16 addr = NEXT16(cpu);
-    u8 m = cpu->memory[addr];
-    m--;
-    cpu->memory[addr] = m & 0xFF;
-    SET_FLAGS(cpu, m, OFLOW | ZERO | NEG);
-}
-
 void INST_DECA_INH(cpu *cpu) {
-    u8 a = cpu->a;
-    a--;
-    cpu->a = a & 0xFF;
-    SET_FLAGS(cpu, a, OFLOW | ZERO | NEG);
+    cpu->a--;
+    SET_DEC_FLAGS(cpu, cpu->a);
 }
 
 void INST_DECB_INH(cpu *cpu) {
-    u8 b = cpu->b;
-    b--;
-    cpu->b = b;
-    SET_FLAGS(cpu, b, OFLOW | ZERO | NEG);
+    cpu->b--;
+    SET_DEC_FLAGS(cpu, cpu->b);
 }
 
 void INST_DES_INH(cpu *cpu) {
     cpu->sp--;
 }
 
-void INST_INC_EXT(cpu *cpu) {
-    u16 addr = NEXT16(cpu);
-    u16 v = cpu->memory[addr] + 1;
-    cpu->memory[addr] = v & 0xFF;
-    SET_FLAGS(cpu, v, OFLOW | ZERO | NEG);
-}
-
 void INST_INCA_INH(cpu *cpu) {
-    i16 result = cpu->a + 1;
-    cpu->a = result & 0xFF;
-    SET_FLAGS(cpu, result, OFLOW | ZERO | NEG);
+    cpu->a++;
+    SET_INC_FLAGS(cpu, cpu->a);
 }
 
 void INST_INCB_INH(cpu *cpu) {
-    i16 result = cpu->b + 1;
-    cpu->b = result & 0xFF;
-    SET_FLAGS(cpu, result, OFLOW | ZERO | NEG);
-}
-
-void INST_NEG_EXT(cpu *cpu) {
-    u16 addr = NEXT16(cpu);
-    u8 v = cpu->memory[addr];
-    v = -v;
-    cpu->memory[addr] = v;
-    SET_FLAGS(cpu, v, CARRY | OFLOW | ZERO | NEG);
+    cpu->b++;
+    SET_INC_FLAGS(cpu, cpu->b);
 }
 
 void INST_NEGA_INH(cpu *cpu) {
-    u8 v = cpu->a;
-    v = -v;
-    cpu->a = v;
-    SET_FLAGS(cpu, v, CARRY | OFLOW | ZERO | NEG);
+    cpu->a = -cpu->a;
+    SET_NEG_FLAGS(cpu, cpu->a);
 }
 
 void INST_NEGB_INH(cpu *cpu) {
-    u8 v = cpu->b;
-    v = -v;
-    cpu->b = v;
-    SET_FLAGS(cpu, v, CARRY | OFLOW | ZERO | NEG);
+    cpu->b = -cpu->b;
+    SET_NEG_FLAGS(cpu, cpu->b);
 }
 
 void INST_NOP_INH(cpu *cpu) {
@@ -1157,1149 +1491,1689 @@ void INST_NOP_INH(cpu *cpu) {
     // DOES NOTHING
 }
 
-void INST_ORAA_IMM(cpu *cpu) {
-    u8 v = NEXT8(cpu);
-    u8 result = cpu->a | v;
-    cpu->a = result;
-    SET_FLAGS(cpu, v, NEG | ZERO);
-    cpu->v = 0;
+void INST_CLRA_INH(cpu *cpu) {
+    cpu->a = 0;
+    SET_TST_FLAGS(cpu, 0, 0);
 }
 
-void INST_ORAA_DIR(cpu *cpu) {
-    u8 v = DIR_WORD(cpu);
-    u8 result = cpu->a | v;
-    cpu->a = result;
-    SET_FLAGS(cpu, v, NEG | ZERO);
-    cpu->v = 0;
+void INST_CLRB_INH(cpu *cpu) {
+    cpu->b = 0;
+    SET_TST_FLAGS(cpu, 0, 0);
 }
 
-void INST_ORAA_EXT(cpu *cpu) {
-    u8 v = EXT_WORD(cpu);
-    u8 result = cpu->a | v;
-    cpu->a = result;
-    SET_FLAGS(cpu, v, NEG | ZERO);
-    cpu->v = 0;
+void INST_MUL_INH(cpu *cpu) {
+    cpu->d = cpu->a * cpu->b;
+    SET_CARRY(cpu, (cpu->b >> 7) & 1);
 }
 
-void INST_ORAB_IMM(cpu *cpu) {
-    u8 v = NEXT8(cpu);
-    u8 result = cpu->b | v;
-    cpu->b = result;
-    SET_FLAGS(cpu, v, NEG | ZERO);
-    cpu->v = 0;
+void INST_TPA_INH(cpu *cpu) {
+    SYNC_FLAGS(cpu);
+    cpu->a = cpu->status;
 }
 
-void INST_ORAB_DIR(cpu *cpu) {
-    u8 v = DIR_WORD(cpu);
-    u8 result = cpu->b | v;
-    cpu->b = result;
-    SET_FLAGS(cpu, v, NEG | ZERO);
-    cpu->v = 0;
+void INST_TSTA_INH(cpu *cpu) {
+    SET_TST_FLAGS(cpu, cpu->a, 0);
 }
 
-void INST_ORAB_EXT(cpu *cpu) {
-    u8 v = EXT_WORD(cpu);
-    u8 result = cpu->b | v;
-    cpu->b = result;
-    SET_FLAGS(cpu, v, NEG | ZERO);
-    cpu->v = 0;
+void INST_TSTB_INH(cpu *cpu) {
+    SET_TST_FLAGS(cpu, cpu->b, 0);
 }
 
-void INST_SUBA_IMM(cpu *cpu) {
-    u8 v = NEXT8(cpu);
-    i16 result = cpu->a - v;
-    cpu->a = result & 0xFF;
-    SET_FLAGS(cpu, v, CARRY | OFLOW | ZERO | NEG);
+void INST_INS_INH(cpu *cpu) {
+    cpu->sp++;
 }
 
-void INST_SUBA_DIR(cpu *cpu) {
-    u8 v = DIR_WORD(cpu);
-    i16 result = cpu->a - v;
+void INST_SBA_INH(cpu *cpu) {
+    u16 result = cpu->a - cpu->b;
+    SET_SUB_FLAGS(cpu, cpu->a, cpu->b, result);
     cpu->a = result & 0xFF;
-    SET_FLAGS(cpu, v, CARRY | OFLOW | ZERO | NEG);
 }
 
-void INST_SUBA_EXT(cpu *cpu) {
-    u8 v = EXT_WORD(cpu);
-    i16 result = cpu->a - v;
-    cpu->a = result & 0xFF;
-    SET_FLAGS(cpu, v, CARRY | OFLOW | ZERO | NEG);
-}
+void INST_BCLR_DIR(cpu *cpu) {
+    u8 addr = NEXT8(cpu);
+    u8 v = cpu->memory[addr];
+    u8 mask = NEXT8(cpu);
 
-void INST_SUBB_IMM(cpu *cpu) {
-    u8 v = NEXT8(cpu);
-    i16 result = cpu->b - v;
-    cpu->b = result & 0xFF;
-    SET_FLAGS(cpu, v, CARRY | OFLOW | ZERO | NEG);
+
+    u8 result = v & (~mask);
+
+    printf(FMT8" & (~"FMT8") = "FMT8"\n", v, mask, result);
+    WRITE8(cpu, addr, result);
+
+    SET_LD_FLAGS(cpu, result);
 }
 
-void INST_SUBB_DIR(cpu *cpu) {
-    u8 v = DIR_WORD(cpu);
-    i16 result = cpu->b - v;
-    cpu->b = result & 0xFF;
-    SET_FLAGS(cpu, v, CARRY | OFLOW | ZERO | NEG);
+/*****************************
+*   Addressing mode families  *
+*****************************/
+
+// Instructions that read, write or modify an operand in memory are written once as an
+// OP_* body and their handlers, one per addressing mode, are generated by the *_MODES
+// X-macros below. Each handler is the body with a single operand fetcher inlined in it.
+
+// The ports are not kept in memory, only the registers page ($1000 - $10FF) has to
+// look at them. Every other page is read with a single load.
+static inline u8 READ8(cpu *cpu, u16 addr) {
+    PROFILE_COUNT(cpu, reads, addr, 1);
+    DEBUG_WATCH(cpu, reads, DEBUG_READ, addr);
+    if (cpu->regions[addr >> 8] == REGION_IO) {
+        return READ_IO(cpu, addr);
+    }
+    return cpu->memory[addr];
 }
 
-void INST_SUBB_EXT(cpu *cpu) {
-    u8 v = EXT_WORD(cpu);
-    i16 result = cpu->b - v;
-    cpu->b = result & 0xFF;
-    SET_FLAGS(cpu, v, CARRY | OFLOW | ZERO | NEG);
+static inline u16 READ16(cpu *cpu, u16 addr) {
+    return join(READ8(cpu, addr), READ8(cpu, addr + 1));
 }
 
-void INST_SUBD_IMM(cpu *cpu) {
-    u16 v = NEXT16(cpu);
-    int32_t result = cpu->d - v;
-    cpu->d = result & 0xFFFF;
-    SET_FLAGS(cpu, v, CARRY | OFLOW | ZERO | NEG);
+static inline void STORE8(cpu *cpu, u16 addr, u8 v) {
+    u8 region = cpu->regions[addr >> 8];
+    if (region <= REGION_EEPROM) {
+        WRITE8(cpu, addr, v);
+    } else if (region == REGION_IO) {
+        WRITE_IO(cpu, addr, v);
+    }
 }
 
-void INST_SUBD_DIR(cpu *cpu) {
-    u16 v = DIR_WORD16(cpu);
-    int32_t result = cpu->d - v;
-    cpu->d = result & 0xFFFF;
-    SET_FLAGS(cpu, v, CARRY | OFLOW | ZERO | NEG);
+static inline void STORE16(cpu *cpu, u16 addr, u16 v) {
+    STORE8(cpu, addr, v >> 8);
+    STORE8(cpu, addr + 1, v & 0xFF);
 }
 
-void INST_SUBD_EXT(cpu *cpu) {
-    u16 v = EXT_WORD16(cpu);
-    int32_t result = cpu->d - v;
-    cpu->d = result & 0xFFFF;
-    SET_FLAGS(cpu, v, CARRY | OFLOW | ZERO | NEG);
+// Value of the operand for each addressing mode
+static inline u8 OPERAND8_IMM(cpu *cpu) {
+    return NEXT8(cpu);
 }
 
-void INST_CLR_EXT(cpu *cpu) {
-    u16 addr = NEXT16(cpu);
-    cpu->memory[addr] = 0;
+static inline u16 OPERAND16_IMM(cpu *cpu) {
+    return NEXT16(cpu);
+}
 
-    u8 top = ((cpu->status >> 4) & 0xF) << 4;
-    u8 bot = 0x4; // 0b0100
-    cpu->status = top | bot;
+static inline u8 OPERAND8_OF_IMM(cpu *cpu, u16 operand) {
+    (void) cpu;
+    return operand;
 }
 
-void INST_CLRA_INH(cpu *cpu) {
-    cpu->a = 0;
+static inline u16 OPERAND16_OF_IMM(cpu *cpu, u16 operand) {
+    (void) cpu;
+    return operand;
+}
+
+#define OPERAND_FETCHERS(M) \
+    static inline u8 OPERAND8_##M(cpu *cpu) { return READ8(cpu, ADDR_##M(cpu)); } \
+    static inline u16 OPERAND16_##M(cpu *cpu) { return READ16(cpu, ADDR_##M(cpu)); } \
+    static inline u8 OPERAND8_OF_##M(cpu *cpu, u16 o) { return READ8(cpu, ADDR_OF_##M(cpu, o)); } \
+    static inline u16 OPERAND16_OF_##M(cpu *cpu, u16 o) { return READ16(cpu, ADDR_OF_##M(cpu, o)); }
+OPERAND_FETCHERS(DIR)
+OPERAND_FETCHERS(EXT)
+OPERAND_FETCHERS(IDX)
+OPERAND_FETCHERS(IDY)
+
+// Addressing modes each kind of instruction has, F is called with the operation and the mode
+#define OPERAND_MODES(F, OP) F(OP, IMM) F(OP, DIR) F(OP, EXT) F(OP, IDX) F(OP, IDY)
+#define MEMORY_MODES(F, OP) F(OP, DIR) F(OP, EXT) F(OP, IDX) F(OP, IDY)
+#define MODIFY_MODES(F, OP) F(OP, EXT) F(OP, IDX) F(OP, IDY)
+
+// Handler shapes. Those that cannot jump also have a DECODED_ version taking the operand
+// bytes decoded ahead of time, called with pc already on the last byte of the instruction.
+#define READ8_HANDLER(OP, M) \
+    void INST_##OP##_##M(cpu *cpu) { OP_##OP(cpu, OPERAND8_##M(cpu)); } \
+    void DECODED_##OP##_##M(cpu *cpu, u16 o) { OP_##OP(cpu, OPERAND8_OF_##M(cpu, o)); }
+#define READ16_HANDLER(OP, M) \
+    void INST_##OP##_##M(cpu *cpu) { OP_##OP(cpu, OPERAND16_##M(cpu)); } \
+    void DECODED_##OP##_##M(cpu *cpu, u16 o) { OP_##OP(cpu, OPERAND16_OF_##M(cpu, o)); }
+#define STORE8_HANDLER(OP, M) \
+    void INST_##OP##_##M(cpu *cpu) { u16 addr = ADDR_##M(cpu); STORE8(cpu, addr, OP_##OP(cpu)); } \
+    void DECODED_##OP##_##M(cpu *cpu, u16 o) { STORE8(cpu, ADDR_OF_##M(cpu, o), OP_##OP(cpu)); }
+#define STORE16_HANDLER(OP, M) \
+    void INST_##OP##_##M(cpu *cpu) { u16 addr = ADDR_##M(cpu); STORE16(cpu, addr, OP_##OP(cpu)); } \
+    void DECODED_##OP##_##M(cpu *cpu, u16 o) { STORE16(cpu, ADDR_OF_##M(cpu, o), OP_##OP(cpu)); }
+#define MODIFY_HANDLER(OP, M) \
+    void INST_##OP##_##M(cpu *cpu) { \
+        u16 addr = ADDR_##M(cpu); \
+        STORE8(cpu, addr, OP_##OP(cpu, READ8(cpu, addr))); \
+    } \
+    void DECODED_##OP##_##M(cpu *cpu, u16 o) { \
+        u16 addr = ADDR_OF_##M(cpu, o); \
+        STORE8(cpu, addr, OP_##OP(cpu, READ8(cpu, addr))); \
+    }
+#define ADDRESS_HANDLER(OP, M) void INST_##OP##_##M(cpu *cpu) { OP_##OP(cpu, ADDR_##M(cpu)); }
 
-    u8 top = ((cpu->status >> 4) & 0xF) << 4;
-    u8 bot = 0x4; // 0b0100
-    cpu->status = top | bot;
+// 8 bit operand
+static inline void OP_LDA(cpu *cpu, u8 v) {
+    cpu->a = v;
+    SET_LD_FLAGS(cpu, v);
 }
 
-void INST_CLRB_INH(cpu *cpu) {
-    cpu->b = 0;
-
-    u8 top = ((cpu->status >> 4) & 0xF) << 4;
-    u8 bot = 0x4; // 0b0100
-    cpu->status = top | bot;
+static inline void OP_LDB(cpu *cpu, u8 v) {
+    cpu->b = v;
+    SET_LD_FLAGS(cpu, v);
 }
 
-void INST_CLV_INH(cpu *cpu) {
-    cpu->v = 0;
+static inline void OP_ADCA(cpu *cpu, u8 v) {
+    u16 result = cpu->a + v + FLAG_C(cpu);
+    SET_ADD_FLAGS(cpu, cpu->a, v, result);
+    cpu->a = result & 0xFF;
 }
 
-void INST_JMP_EXT(cpu *cpu) {
-    cpu->pc = EXT_WORD16(cpu);
+static inline void OP_ADCB(cpu *cpu, u8 v) {
+    u16 result = cpu->b + v + FLAG_C(cpu);
+    SET_ADD_FLAGS(cpu, cpu->b, v, result);
+    cpu->b = result & 0xFF;
 }
 
-void INST_MUL_INH(cpu *cpu) {
-    u32 result = cpu->a * cpu->b;
-    cpu->d = result & 0xFFFF;
-    SET_FLAGS(cpu, result, CARRY);
+static inline void OP_ADDA(cpu *cpu, u8 v) {
+    u16 result = cpu->a + v;
+    SET_ADD_FLAGS(cpu, cpu->a, v, result);
+    cpu->a = result & 0xFF;
 }
 
-void INST_STS_DIR(cpu *cpu) {
-    u32 result = cpu->sp;
-    u8 addr = NEXT8(cpu);
-    cpu->memory[addr]     = (cpu->sp >> 8) & 0xFF;
-    cpu->memory[addr + 1] = cpu->sp & 0xFF;
-    SET_FLAGS(cpu, result, NEG | ZERO);
-    cpu->v = 0;
+static inline void OP_ADDB(cpu *cpu, u8 v) {
+    u16 result = cpu->b + v;
+    SET_ADD_FLAGS(cpu, cpu->b, v, result);
+    cpu->b = result & 0xFF;
 }
 
-void INST_STS_EXT(cpu *cpu) {
-    u32 result = cpu->sp;
-    u16 addr = NEXT16(cpu);
-    cpu->memory[addr]     = (cpu->sp >> 8) & 0xFF;
-    cpu->memory[addr + 1] = cpu->sp & 0xFF;
-    SET_FLAGS(cpu, result, NEG | ZERO);
-    cpu->v = 0;
+static inline void OP_ANDA(cpu *cpu, u8 v) {
+    cpu->a &= v;
+    SET_LD_FLAGS(cpu, cpu->a);
 }
 
-void INST_TPA_INH(cpu *cpu) {
-    cpu->a = cpu->status;
+static inline void OP_ANDB(cpu *cpu, u8 v) {
+    cpu->b &= v;
+    SET_LD_FLAGS(cpu, cpu->b);
 }
 
-void INST_TST_EXT(cpu *cpu) {
-    u8 v = EXT_WORD(cpu);
-    SET_FLAGS(cpu, v, NEG | ZERO);
-    cpu->v = 0;
-    cpu->c = 0;
+static inline void OP_CMPA(cpu *cpu, u8 v) {
+    SET_CMP_FLAGS(cpu, cpu->a, v);
 }
 
-void INST_TSTA_INH(cpu *cpu) {
-    u8 v = cpu->a;
-    SET_FLAGS(cpu, v, NEG | ZERO);
-    cpu->v = 0;
-    cpu->c = 0;
+static inline void OP_CMPB(cpu *cpu, u8 v) {
+    SET_CMP_FLAGS(cpu, cpu->b, v);
+}
 
+static inline void OP_EORA(cpu *cpu, u8 v) {
+    cpu->a ^= v;
+    SET_LD_FLAGS(cpu, cpu->a);
 }
 
-void INST_TSTB_INH(cpu *cpu) {
-    u8 v = cpu->b;
-    SET_FLAGS(cpu, v, NEG | ZERO);
-    cpu->v = 0;
-    cpu->c = 0;
+static inline void OP_EORB(cpu *cpu, u8 v) {
+    cpu->b ^= v;
+    SET_LD_FLAGS(cpu, cpu->b);
 }
 
-void INST_EORA_IMM(cpu *cpu) {
-    u8 a = cpu->a;
-    u8 v = NEXT8(cpu);
-    u8 result = a ^ v;
-    cpu->a = result & 0xFF;
-    SET_FLAGS(cpu, v, NEG | ZERO);
-    cpu->v = 0;
+static inline void OP_ORAA(cpu *cpu, u8 v) {
+    cpu->a |= v;
+    SET_LD_FLAGS(cpu, cpu->a);
 }
 
-void INST_EORA_DIR(cpu *cpu) {
-    u8 a = cpu->a;
-    u8 v = DIR_WORD(cpu);
-    u8 result = a ^ v;
-    cpu->a = result & 0xFF;
-    SET_FLAGS(cpu, v, NEG | ZERO);
-    cpu->v = 0;
+static inline void OP_ORAB(cpu *cpu, u8 v) {
+    cpu->b |= v;
+    SET_LD_FLAGS(cpu, cpu->b);
 }
 
-void INST_EORA_EXT(cpu *cpu) {
-    u8 a = cpu->a;
-    u8 v = EXT_WORD(cpu);
-    u8 result = a ^ v;
+static inline void OP_SUBA(cpu *cpu, u8 v) {
+    u16 result = cpu->a - v;
+    SET_SUB_FLAGS(cpu, cpu->a, v, result);
     cpu->a = result & 0xFF;
-    SET_FLAGS(cpu, v, NEG | ZERO);
-    cpu->v = 0;
 }
 
-void INST_EORB_IMM(cpu *cpu) {
-    u8 b = cpu->b;
-    u8 v = NEXT8(cpu);
-    u8 result = b ^ v;
+static inline void OP_SUBB(cpu *cpu, u8 v) {
+    u16 result = cpu->b - v;
+    SET_SUB_FLAGS(cpu, cpu->b, v, result);
     cpu->b = result & 0xFF;
-    SET_FLAGS(cpu, v, NEG | ZERO);
-    cpu->v = 0;
 }
 
-void INST_EORB_DIR(cpu *cpu) {
-    u8 b = cpu->b;
-    u8 v = DIR_WORD(cpu);
-    u8 result = b ^ v;
-    cpu->b = result & 0xFF;
-    SET_FLAGS(cpu, v, NEG | ZERO);
-    cpu->v = 0;
+static inline void OP_TST(cpu *cpu, u8 v) {
+    SET_TST_FLAGS(cpu, v, 0);
 }
 
-void INST_EORB_EXT(cpu *cpu) {
-    u8 b = cpu->b;
-    u8 v = EXT_WORD(cpu);
-    u8 result = b ^ v;
-    cpu->b = result & 0xFF;
-    SET_FLAGS(cpu, v, NEG | ZERO);
-    cpu->v = 0;
+// 16 bit operand
+static inline void OP_LDD(cpu *cpu, u16 v) {
+    cpu->d = v;
+    SET_LD16_FLAGS(cpu, v);
 }
 
-void INST_INS_INH(cpu *cpu) {
-    cpu->sp++;
+static inline void OP_LDS(cpu *cpu, u16 v) {
+    cpu->sp = v;
+    SET_LD16_FLAGS(cpu, v);
 }
 
-void INST_SBA_INH(cpu *cpu) {
-    u8 a = cpu->a;
-    u8 b = cpu->b;
-    SET_CMP_FLAGS(cpu, a, b);
+static inline void OP_LDX(cpu *cpu, u16 v) {
+    cpu->ix = v;
+    SET_LD16_FLAGS(cpu, v);
 }
 
-void INST_BCLR_DIR(cpu *cpu) {
-    u8 addr = NEXT8(cpu);
-    u8 v = cpu->memory[addr];
-    u8 mask = NEXT8(cpu);
+static inline void OP_LDY(cpu *cpu, u16 v) {
+    cpu->iy = v;
+    SET_LD16_FLAGS(cpu, v);
+}
 
+static inline void OP_ADDD(cpu *cpu, u16 v) {
+    u32 result = cpu->d + v;
+    SET_ADD16_FLAGS(cpu, cpu->d, v, result);
+    cpu->d = result & 0xFFFF;
+}
 
-    u8 result = v & (~mask);
+static inline void OP_SUBD(cpu *cpu, u16 v) {
+    u32 result = cpu->d - v;
+    SET_SUB16_FLAGS(cpu, cpu->d, v, result);
+    cpu->d = result & 0xFFFF;
+}
 
-    printf(FMT8" & (~"FMT8") = "FMT8"\n", v, mask, result);
-    cpu->memory[addr] = result;
+static inline void OP_CPD(cpu *cpu, u16 v) {
+    SET_SUB16_FLAGS(cpu, cpu->d, v, cpu->d - v);
+}
 
-    SET_FLAGS(cpu, result, NEG | ZERO);
-    cpu->v = 0;
+static inline void OP_CPX(cpu *cpu, u16 v) {
+    SET_SUB16_FLAGS(cpu, cpu->ix, v, cpu->ix - v);
+}
+
+static inline void OP_CPY(cpu *cpu, u16 v) {
+    SET_SUB16_FLAGS(cpu, cpu->iy, v, cpu->iy - v);
+}
+
+// Stores return the value to write
+static inline u8 OP_STA(cpu *cpu) {
+    SET_LD_FLAGS(cpu, cpu->a);
+    return cpu->a;
+}
+
+static inline u8 OP_STB(cpu *cpu) {
+    SET_LD_FLAGS(cpu, cpu->b);
+    return cpu->b;
+}
+
+static inline u16 OP_STD(cpu *cpu) {
+    SET_LD16_FLAGS(cpu, cpu->d);
+    return cpu->d;
+}
+
+static inline u16 OP_STS(cpu *cpu) {
+    SET_LD16_FLAGS(cpu, cpu->sp);
+    return cpu->sp;
+}
+
+static inline u16 OP_STX(cpu *cpu) {
+    SET_LD16_FLAGS(cpu, cpu->ix);
+    return cpu->ix;
+}
+
+static inline u16 OP_STY(cpu *cpu) {
+    SET_LD16_FLAGS(cpu, cpu->iy);
+    return cpu->iy;
+}
+
+// Read-modify-write, return the new value of the byte
+static inline u8 OP_ASL(cpu *cpu, u8 v) {
+    u8 result = v << 1;
+    SET_SHIFT_FLAGS(cpu, result, v >> 7);
+    return result;
+}
+
+static inline u8 OP_ASR(cpu *cpu, u8 v) {
+    u8 result = (v >> 1) | (v & 0x80);
+    SET_SHIFT_FLAGS(cpu, result, v & 1);
+    return result;
+}
+
+static inline u8 OP_LSR(cpu *cpu, u8 v) {
+    u8 result = v >> 1;
+    SET_SHIFT_FLAGS(cpu, result, v & 1);
+    return result;
+}
+
+static inline u8 OP_ROL(cpu *cpu, u8 v) {
+    u8 result = (v << 1) | FLAG_C(cpu);
+    SET_SHIFT_FLAGS(cpu, result, v >> 7);
+    return result;
+}
+
+static inline u8 OP_ROR(cpu *cpu, u8 v) {
+    u8 result = (v >> 1) | (FLAG_C(cpu) << 7);
+    SET_SHIFT_FLAGS(cpu, result, v & 1);
+    return result;
+}
+
+static inline u8 OP_COM(cpu *cpu, u8 v) {
+    u8 result = ~v;
+    SET_TST_FLAGS(cpu, result, 1);
+    return result;
+}
+
+static inline u8 OP_NEG(cpu *cpu, u8 v) {
+    u8 result = -v;
+    SET_NEG_FLAGS(cpu, result);
+    return result;
+}
+
+static inline u8 OP_INC(cpu *cpu, u8 v) {
+    u8 result = v + 1;
+    SET_INC_FLAGS(cpu, result);
+    return result;
+}
+
+static inline u8 OP_DEC(cpu *cpu, u8 v) {
+    u8 result = v - 1;
+    SET_DEC_FLAGS(cpu, result);
+    return result;
+}
+
+static inline u8 OP_CLR(cpu *cpu, u8 v) {
+    (void) v;
+    SET_TST_FLAGS(cpu, 0, 0);
+    return 0;
+}
+
+// Jumps, pc is left one byte before the target like every taken jump
+static inline void OP_JMP(cpu *cpu, u16 addr) {
+    cpu->pc = addr - 1;
+}
+
+static inline void OP_JSR(cpu *cpu, u16 addr) {
+    STACK_PUSH16(cpu, cpu->pc + 1);
+    cpu->pc = addr - 1;
+    PROFILE_CALL(cpu, addr, cpu->sp + 2);
+}
+
+#define READ8_FAMILY(OP) OPERAND_MODES(READ8_HANDLER, OP)
+#define READ8_OPS(F) \
+    F(LDA) F(LDB) F(ADCA) F(ADCB) F(ADDA) F(ADDB) F(ANDA) F(ANDB) \
+    F(CMPA) F(CMPB) F(EORA) F(EORB) F(ORAA) F(ORAB) F(SUBA) F(SUBB)
+READ8_OPS(READ8_FAMILY)
+
+#define READ16_FAMILY(OP) OPERAND_MODES(READ16_HANDLER, OP)
+#define READ16_OPS(F) F(LDD) F(LDS) F(LDX) F(LDY) F(ADDD) F(SUBD) F(CPD) F(CPX) F(CPY)
+READ16_OPS(READ16_FAMILY)
+
+MEMORY_MODES(STORE8_HANDLER, STA)
+MEMORY_MODES(STORE8_HANDLER, STB)
+#define STORE16_FAMILY(OP) MEMORY_MODES(STORE16_HANDLER, OP)
+#define STORE16_OPS(F) F(STD) F(STS) F(STX) F(STY)
+STORE16_OPS(STORE16_FAMILY)
+
+#define MODIFY_FAMILY(OP) MODIFY_MODES(MODIFY_HANDLER, OP)
+#define MODIFY_OPS(F) F(ASL) F(ASR) F(LSR) F(ROL) F(ROR) F(COM) F(NEG) F(INC) F(DEC) F(CLR)
+MODIFY_OPS(MODIFY_FAMILY)
+MODIFY_MODES(READ8_HANDLER, TST)
+
+MODIFY_MODES(ADDRESS_HANDLER, JMP)
+MEMORY_MODES(ADDRESS_HANDLER, JSR)
+
+// X and Y only differ by their prefix, R is the register name and reg its field
+#define INDEX_REGISTERS(F) F(X, ix) F(Y, iy)
+
+// INX, DEX, INY and DEY only change Z. N stays in cc_nz, even along with Z, V goes to status
+// first when it is derived from cc_nz, which is only the case once per loop of them.
+static inline void SET_Z_FLAG(cpu *cpu, u8 z) {
+    if (cpu->cc_v != V_STATUS && cpu->cc_v != V_CLEAR) {
+        cpu->v = FLAG_V(cpu);
+        cpu->cc_v = V_STATUS;
+    }
+    cpu->cc_nz = NZ_OF(FLAG_N(cpu), z);
+}
+
+#define INDEX_HANDLERS(R, reg) \
+    void INST_IN##R##_INH(cpu *cpu) { \
+        cpu->reg++; \
+        SET_Z_FLAG(cpu, cpu->reg == 0); \
+    } \
+    void INST_DE##R##_INH(cpu *cpu) { \
+        cpu->reg--; \
+        SET_Z_FLAG(cpu, cpu->reg == 0); \
+    } \
+    void INST_AB##R##_INH(cpu *cpu) { cpu->reg += cpu->b; } \
+    void INST_TS##R##_INH(cpu *cpu) { cpu->reg = cpu->sp + 1; } \
+    void INST_T##R##S_INH(cpu *cpu) { cpu->sp = cpu->reg - 1; } \
+    void INST_XGD##R##_INH(cpu *cpu) { u16 d = cpu->d; cpu->d = cpu->reg; cpu->reg = d; } \
+    void INST_PSH##R##_INH(cpu *cpu) { STACK_PUSH16(cpu, cpu->reg); } \
+    void INST_PUL##R##_INH(cpu *cpu) { cpu->reg = STACK_POP16(cpu); }
+INDEX_REGISTERS(INDEX_HANDLERS)
+
+void INST_RTS_INH(cpu *cpu) {
+    cpu->pc = STACK_POP16(cpu) - 1;
+    DEBUG_RETURNED(cpu);
+}
+
+void INST_BSR_REL(cpu *cpu) {
+    i8 offset = NEXT8(cpu);
+    STACK_PUSH16(cpu, cpu->pc + 1);
+    cpu->pc += offset;
+    PROFILE_CALL(cpu, cpu->pc + 1, cpu->sp + 2);
+}
+
+// Stacks the registers the way an interrupt does, ret being the address to come back to
+void STACK_REGISTERS(cpu *cpu, u16 ret) {
+    SYNC_FLAGS(cpu);
+    STACK_PUSH16(cpu, ret);
+    STACK_PUSH16(cpu, cpu->iy);
+    STACK_PUSH16(cpu, cpu->ix);
+    STACK_PUSH8(cpu, cpu->a);
+    STACK_PUSH8(cpu, cpu->b);
+    STACK_PUSH8(cpu, cpu->status);
+}
+
+// The frame is pushed before sleeping so the interrupt that wakes the cpu can start at once
+void INST_WAI_INH(cpu *cpu) {
+    STACK_REGISTERS(cpu, cpu->pc + 1);
+    cpu->sleep = SLEEP_WAI;
+}
+
+// Acts as a NOP while the S bit disables it
+void INST_STOP_INH(cpu *cpu) {
+    if (!cpu->s) {
+        cpu->sleep = SLEEP_STOP;
+    }
+}
+
+void INST_SWI_INH(cpu *cpu) {
+    STACK_REGISTERS(cpu, cpu->pc + 1);
+    cpu->i = 1;
+    cpu->pc = join_addr16(cpu, SWI_VECTOR) - 1;
+    PROFILE_CALL(cpu, cpu->pc + 1, cpu->sp + INTERRUPT_FRAME);
+}
+
+void INST_RTI_INH(cpu *cpu) {
+    u8 x = cpu->x;
+    cpu->status = STACK_POP8(cpu);
+    cpu->x &= x; // X can be cleared but not set again
+    LOAD_FLAGS(cpu);
+    cpu->b = STACK_POP8(cpu);
+    cpu->a = STACK_POP8(cpu);
+    cpu->ix = STACK_POP16(cpu);
+    cpu->iy = STACK_POP16(cpu);
+    cpu->pc = STACK_POP16(cpu) - 1;
+    DEBUG_RETURNED(cpu);
+}
+
+// Runs the instruction of the page behind this prefix. The run loops only account for the
+// prefix itself (0 cycles), the cycles of the paged instruction are added here.
+void INST_PREFIX(cpu *cpu) {
+    u16 pc = cpu->pc;
+    u16 inst = instr_page[cpu->memory[pc]] | NEXT8(cpu);
+    if (instr_func[inst] == NULL) {
+        return; // Unknown, both bytes are skipped
+    }
+    (*instr_func[inst])(cpu);
+    u8 cycles = instr_cycles[inst];
+    if (cpu->pc != (u16)(pc + instr_len[inst] - 1)) {
+        cycles += instr_taken_cycles[inst];
+    }
+    cpu->cycles += cycles;
+    PROFILE_COUNT(cpu, cycles, pc, cycles);
 }
 
 instruction instructions[] = {
     {
         .names = {"ldaa", "lda"}, .name_count = 2,
-        .codes = {[IMMEDIATE]=0x86, [DIRECT]=0x96, [EXTENDED]=0xB6},
+        .codes = {[IMMEDIATE]=0x86, [DIRECT]=0x96, [EXTENDED]=0xB6, [INDEXDED_X]=0xA6, [INDEXDED_Y]=0x18A6},
+        .cycles = {[IMMEDIATE]=2, [DIRECT]=3, [EXTENDED]=4, [INDEXDED_X]=4, [INDEXDED_Y]=5},
         .func =  {
             [IMMEDIATE]=INST_LDA_IMM,
             [DIRECT]=INST_LDA_DIR,
             [EXTENDED]=INST_LDA_EXT,
+            [INDEXDED_X]=INST_LDA_IDX,
+            [INDEXDED_Y]=INST_LDA_IDY,
         },
-        .operands = { IMMEDIATE, EXTENDED, DIRECT },
+        .operands = { IMMEDIATE, DIRECT, EXTENDED, INDEXDED_X, INDEXDED_Y },
     },
     {
         .names = {"ldab", "ldb"}, .name_count = 2,
-        .codes = {[IMMEDIATE]=0xC6, [DIRECT]=0xD6, [EXTENDED]=0xF6},
+        .codes = {[IMMEDIATE]=0xC6, [DIRECT]=0xD6, [EXTENDED]=0xF6, [INDEXDED_X]=0xE6, [INDEXDED_Y]=0x18E6},
+        .cycles = {[IMMEDIATE]=2, [DIRECT]=3, [EXTENDED]=4, [INDEXDED_X]=4, [INDEXDED_Y]=5},
         .func =  {
             [IMMEDIATE]=INST_LDB_IMM,
             [DIRECT]=INST_LDB_DIR,
             [EXTENDED]=INST_LDB_EXT,
+            [INDEXDED_X]=INST_LDB_IDX,
+            [INDEXDED_Y]=INST_LDB_IDY,
         },
-        .operands = { IMMEDIATE, EXTENDED, DIRECT },
+        .operands = { IMMEDIATE, DIRECT, EXTENDED, INDEXDED_X, INDEXDED_Y },
     },
     {
         .names = {"ldad", "ldd"}, .name_count = 2,
-        .codes = {[IMMEDIATE]=0xCC, [DIRECT]=0xDC, [EXTENDED]=0xFC},
+        .codes = {[IMMEDIATE]=0xCC, [DIRECT]=0xDC, [EXTENDED]=0xFC, [INDEXDED_X]=0xEC, [INDEXDED_Y]=0x18EC},
+        .cycles = {[IMMEDIATE]=3, [DIRECT]=4, [EXTENDED]=5, [INDEXDED_X]=5, [INDEXDED_Y]=6},
         .func =  {
             [IMMEDIATE]=INST_LDD_IMM,
             [DIRECT]=INST_LDD_DIR,
             [EXTENDED]=INST_LDD_EXT,
+            [INDEXDED_X]=INST_LDD_IDX,
+            [INDEXDED_Y]=INST_LDD_IDY,
         },
-        .operands = { IMMEDIATE, EXTENDED, DIRECT },
+        .operands = { IMMEDIATE, DIRECT, EXTENDED, INDEXDED_X, INDEXDED_Y },
         .immediate_16 = 1,
     },
     {
         .names = {"staa", "sta"}, .name_count = 2,
-        .codes = {[DIRECT]=0x97, [EXTENDED]=0xB7},
-        .func = {
+        .codes = {[DIRECT]=0x97, [EXTENDED]=0xB7, [INDEXDED_X]=0xA7, [INDEXDED_Y]=0x18A7},
+        .cycles = {[DIRECT]=3, [EXTENDED]=4, [INDEXDED_X]=4, [INDEXDED_Y]=5},
+        .func =  {
             [DIRECT]=INST_STA_DIR,
             [EXTENDED]=INST_STA_EXT,
+            [INDEXDED_X]=INST_STA_IDX,
+            [INDEXDED_Y]=INST_STA_IDY,
         },
-        .operands = { DIRECT, EXTENDED }
+        .operands = { DIRECT, EXTENDED, INDEXDED_X, INDEXDED_Y },
     },
     {
         .names = {"stab", "stb"}, .name_count = 2,
-        .codes = {[DIRECT]=0xD7, [EXTENDED]=0xF7},
-        .func = {
+        .codes = {[DIRECT]=0xD7, [EXTENDED]=0xF7, [INDEXDED_X]=0xE7, [INDEXDED_Y]=0x18E7},
+        .cycles = {[DIRECT]=3, [EXTENDED]=4, [INDEXDED_X]=4, [INDEXDED_Y]=5},
+        .func =  {
             [DIRECT]=INST_STB_DIR,
             [EXTENDED]=INST_STB_EXT,
+            [INDEXDED_X]=INST_STB_IDX,
+            [INDEXDED_Y]=INST_STB_IDY,
         },
-        .operands = { DIRECT, EXTENDED }
+        .operands = { DIRECT, EXTENDED, INDEXDED_X, INDEXDED_Y },
     },
     {
         .names = {"std"}, .name_count = 1,
-        .codes = {[DIRECT]=0xDD, [EXTENDED]=0xFD},
-        .func = {
+        .codes = {[DIRECT]=0xDD, [EXTENDED]=0xFD, [INDEXDED_X]=0xED, [INDEXDED_Y]=0x18ED},
+        .cycles = {[DIRECT]=4, [EXTENDED]=5, [INDEXDED_X]=5, [INDEXDED_Y]=6},
+        .func =  {
             [DIRECT]=INST_STD_DIR,
             [EXTENDED]=INST_STD_EXT,
+            [INDEXDED_X]=INST_STD_IDX,
+            [INDEXDED_Y]=INST_STD_IDY,
         },
-        .operands = { DIRECT, EXTENDED }
+        .operands = { DIRECT, EXTENDED, INDEXDED_X, INDEXDED_Y },
     },
     {
         .names = {"aba"}, .name_count = 1,
         .codes = {[INHERENT]=0x1B},
+        .cycles = {[INHERENT]=2},
         .func = {[INHERENT]=INST_ABA},
         .operands = { INHERENT }
     },
     {
         .names = {"adca"}, .name_count = 1,
-        .codes = {[IMMEDIATE]=0x89, [DIRECT]=0x99, [EXTENDED]=0xB9},
+        .codes = {[IMMEDIATE]=0x89, [DIRECT]=0x99, [EXTENDED]=0xB9, [INDEXDED_X]=0xA9, [INDEXDED_Y]=0x18A9},
+        .cycles = {[IMMEDIATE]=2, [DIRECT]=3, [EXTENDED]=4, [INDEXDED_X]=4, [INDEXDED_Y]=5},
         .func =  {
             [IMMEDIATE]=INST_ADCA_IMM,
             [DIRECT]=INST_ADCA_DIR,
-            [EXTENDED]=INST_ADCA_EXT
+            [EXTENDED]=INST_ADCA_EXT,
+            [INDEXDED_X]=INST_ADCA_IDX,
+            [INDEXDED_Y]=INST_ADCA_IDY,
         },
-        .operands = { IMMEDIATE, EXTENDED, DIRECT },
+        .operands = { IMMEDIATE, DIRECT, EXTENDED, INDEXDED_X, INDEXDED_Y },
     },
     {
         .names = {"adcb"}, .name_count = 1,
-        .codes = {[IMMEDIATE]=0xC9, [DIRECT]=0xD9, [EXTENDED]=0xF9},
+        .codes = {[IMMEDIATE]=0xC9, [DIRECT]=0xD9, [EXTENDED]=0xF9, [INDEXDED_X]=0xE9, [INDEXDED_Y]=0x18E9},
+        .cycles = {[IMMEDIATE]=2, [DIRECT]=3, [EXTENDED]=4, [INDEXDED_X]=4, [INDEXDED_Y]=5},
         .func =  {
             [IMMEDIATE]=INST_ADCB_IMM,
             [DIRECT]=INST_ADCB_DIR,
-            [EXTENDED]=INST_ADCB_EXT
+            [EXTENDED]=INST_ADCB_EXT,
+            [INDEXDED_X]=INST_ADCB_IDX,
+            [INDEXDED_Y]=INST_ADCB_IDY,
         },
-        .operands = { IMMEDIATE, EXTENDED, DIRECT },
+        .operands = { IMMEDIATE, DIRECT, EXTENDED, INDEXDED_X, INDEXDED_Y },
     },
     {
         .names = {"adda"}, .name_count = 1,
-        .codes = {[IMMEDIATE]=0x8B, [DIRECT]=0x9B, [EXTENDED]=0xBB},
+        .codes = {[IMMEDIATE]=0x8B, [DIRECT]=0x9B, [EXTENDED]=0xBB, [INDEXDED_X]=0xAB, [INDEXDED_Y]=0x18AB},
+        .cycles = {[IMMEDIATE]=2, [DIRECT]=3, [EXTENDED]=4, [INDEXDED_X]=4, [INDEXDED_Y]=5},
         .func =  {
             [IMMEDIATE]=INST_ADDA_IMM,
             [DIRECT]=INST_ADDA_DIR,
-            [EXTENDED]=INST_ADDA_EXT
+            [EXTENDED]=INST_ADDA_EXT,
+            [INDEXDED_X]=INST_ADDA_IDX,
+            [INDEXDED_Y]=INST_ADDA_IDY,
         },
-        .operands = { IMMEDIATE, EXTENDED, DIRECT },
+        .operands = { IMMEDIATE, DIRECT, EXTENDED, INDEXDED_X, INDEXDED_Y },
     },
     {
         .names = {"addb"}, .name_count = 1,
-        .codes = {[IMMEDIATE]=0xCB, [DIRECT]=0xDB, [EXTENDED]=0xFB},
+        .codes = {[IMMEDIATE]=0xCB, [DIRECT]=0xDB, [EXTENDED]=0xFB, [INDEXDED_X]=0xEB, [INDEXDED_Y]=0x18EB},
+        .cycles = {[IMMEDIATE]=2, [DIRECT]=3, [EXTENDED]=4, [INDEXDED_X]=4, [INDEXDED_Y]=5},
         .func =  {
             [IMMEDIATE]=INST_ADDB_IMM,
             [DIRECT]=INST_ADDB_DIR,
-            [EXTENDED]=INST_ADDB_EXT
+            [EXTENDED]=INST_ADDB_EXT,
+            [INDEXDED_X]=INST_ADDB_IDX,
+            [INDEXDED_Y]=INST_ADDB_IDY,
         },
-        .operands = { IMMEDIATE, EXTENDED, DIRECT },
+        .operands = { IMMEDIATE, DIRECT, EXTENDED, INDEXDED_X, INDEXDED_Y },
     },
     {
         .names = {"addd"}, .name_count = 1,
-        .codes = {[IMMEDIATE]=0xC3, [DIRECT]=0xD3, [EXTENDED]=0xF3},
+        .codes = {[IMMEDIATE]=0xC3, [DIRECT]=0xD3, [EXTENDED]=0xF3, [INDEXDED_X]=0xE3, [INDEXDED_Y]=0x18E3},
+        .cycles = {[IMMEDIATE]=4, [DIRECT]=5, [EXTENDED]=6, [INDEXDED_X]=6, [INDEXDED_Y]=7},
         .func =  {
             [IMMEDIATE]=INST_ADDD_IMM,
             [DIRECT]=INST_ADDD_DIR,
-            [EXTENDED]=INST_ADDD_EXT
+            [EXTENDED]=INST_ADDD_EXT,
+            [INDEXDED_X]=INST_ADDD_IDX,
+            [INDEXDED_Y]=INST_ADDD_IDY,
         },
-        .operands = { IMMEDIATE, EXTENDED, DIRECT },
-        .immediate_16 = 1
+        .operands = { IMMEDIATE, DIRECT, EXTENDED, INDEXDED_X, INDEXDED_Y },
+        .immediate_16 = 1,
     },
     {
         .names = {"anda"}, .name_count = 1,
-        .codes = {[IMMEDIATE]=0x84, [DIRECT]=0x94, [EXTENDED]=0xB4},
+        .codes = {[IMMEDIATE]=0x84, [DIRECT]=0x94, [EXTENDED]=0xB4, [INDEXDED_X]=0xA4, [INDEXDED_Y]=0x18A4},
+        .cycles = {[IMMEDIATE]=2, [DIRECT]=3, [EXTENDED]=4, [INDEXDED_X]=4, [INDEXDED_Y]=5},
         .func =  {
             [IMMEDIATE]=INST_ANDA_IMM,
             [DIRECT]=INST_ANDA_DIR,
-            [EXTENDED]=INST_ANDA_EXT
+            [EXTENDED]=INST_ANDA_EXT,
+            [INDEXDED_X]=INST_ANDA_IDX,
+            [INDEXDED_Y]=INST_ANDA_IDY,
         },
-        .operands = { IMMEDIATE, EXTENDED, DIRECT },
+        .operands = { IMMEDIATE, DIRECT, EXTENDED, INDEXDED_X, INDEXDED_Y },
     },
     {
         .names = {"andb"}, .name_count = 1,
-        .codes = {[IMMEDIATE]=0xC4, [DIRECT]=0xD4, [EXTENDED]=0xF4},
+        .codes = {[IMMEDIATE]=0xC4, [DIRECT]=0xD4, [EXTENDED]=0xF4, [INDEXDED_X]=0xE4, [INDEXDED_Y]=0x18E4},
+        .cycles = {[IMMEDIATE]=2, [DIRECT]=3, [EXTENDED]=4, [INDEXDED_X]=4, [INDEXDED_Y]=5},
         .func =  {
             [IMMEDIATE]=INST_ANDB_IMM,
             [DIRECT]=INST_ANDB_DIR,
-            [EXTENDED]=INST_ANDB_EXT
+            [EXTENDED]=INST_ANDB_EXT,
+            [INDEXDED_X]=INST_ANDB_IDX,
+            [INDEXDED_Y]=INST_ANDB_IDY,
         },
-        .operands = { IMMEDIATE, EXTENDED, DIRECT },
+        .operands = { IMMEDIATE, DIRECT, EXTENDED, INDEXDED_X, INDEXDED_Y },
     },
     {
         .names = {"asl"}, .name_count = 1,
-        .codes = {[EXTENDED]=0x78},
-        .func =  {[EXTENDED]=INST_ASL_EXT},
-        .operands = { EXTENDED }
+        .codes = {[EXTENDED]=0x78, [INDEXDED_X]=0x68, [INDEXDED_Y]=0x1868},
+        .cycles = {[EXTENDED]=6, [INDEXDED_X]=6, [INDEXDED_Y]=7},
+        .func =  {
+            [EXTENDED]=INST_ASL_EXT,
+            [INDEXDED_X]=INST_ASL_IDX,
+            [INDEXDED_Y]=INST_ASL_IDY,
+        },
+        .operands = { EXTENDED, INDEXDED_X, INDEXDED_Y },
     },
     {
         .names = {"asla"}, .name_count = 1,
         .codes = {[INHERENT]=0x48},
+        .cycles = {[INHERENT]=2},
         .func =  {[INHERENT]=INST_ASLA_INH},
         .operands = { INHERENT }
     },
     {
         .names = {"aslb"}, .name_count = 1,
         .codes = {[INHERENT]=0x58},
+        .cycles = {[INHERENT]=2},
         .func =  {[INHERENT]=INST_ASLB_INH},
         .operands = { INHERENT }
     },
     {
         .names = {"asld"}, .name_count = 1,
         .codes = {[INHERENT]=0x05},
+        .cycles = {[INHERENT]=3},
         .func =  {[INHERENT]=INST_ASLD_INH},
         .operands = { INHERENT }
     },
     {
         .names = {"asr"}, .name_count = 1,
-        .codes = {[EXTENDED]=0x77},
-        .func =  {[EXTENDED]=INST_ASR_EXT},
-        .operands = { EXTENDED }
+        .codes = {[EXTENDED]=0x77, [INDEXDED_X]=0x67, [INDEXDED_Y]=0x1867},
+        .cycles = {[EXTENDED]=6, [INDEXDED_X]=6, [INDEXDED_Y]=7},
+        .func =  {
+            [EXTENDED]=INST_ASR_EXT,
+            [INDEXDED_X]=INST_ASR_IDX,
+            [INDEXDED_Y]=INST_ASR_IDY,
+        },
+        .operands = { EXTENDED, INDEXDED_X, INDEXDED_Y },
     },
     {
         .names = {"asra"}, .name_count = 1,
         .codes = {[INHERENT]=0x47},
+        .cycles = {[INHERENT]=2},
         .func =  {[INHERENT]=INST_ASRA_INH},
         .operands = { INHERENT }
     },
     {
         .names = {"asrb"}, .name_count = 1,
         .codes = {[INHERENT]=0x57},
+        .cycles = {[INHERENT]=2},
         .func =  {[INHERENT]=INST_ASRB_INH},
         .operands = { INHERENT }
     },
     {
         .names = {"tab"}, .name_count = 1,
         .codes = {[INHERENT]=0x16},
+        .cycles = {[INHERENT]=2},
         .func = {[INHERENT]=INST_TAB_INH},
         .operands = { INHERENT }
     },
     {
         .names = {"tap"}, .name_count = 1,
         .codes = {[INHERENT]=0x06},
+        .cycles = {[INHERENT]=2},
         .func = {[INHERENT]=INST_TAP_INH},
         .operands = { INHERENT }
     },
     {
         .names = {"tba"}, .name_count = 1,
         .codes = {[INHERENT]=0x17},
+        .cycles = {[INHERENT]=2},
         .func = {[INHERENT]=INST_TBA_INH},
         .operands = { INHERENT }
     },
     {
         .names = {"cmpa"}, .name_count = 1,
-        .codes = {[IMMEDIATE]=0x81, [DIRECT]=0x91, [EXTENDED]=0xB1},
+        .codes = {[IMMEDIATE]=0x81, [DIRECT]=0x91, [EXTENDED]=0xB1, [INDEXDED_X]=0xA1, [INDEXDED_Y]=0x18A1},
+        .cycles = {[IMMEDIATE]=2, [DIRECT]=3, [EXTENDED]=4, [INDEXDED_X]=4, [INDEXDED_Y]=5},
         .func =  {
             [IMMEDIATE]=INST_CMPA_IMM,
             [DIRECT]=INST_CMPA_DIR,
             [EXTENDED]=INST_CMPA_EXT,
+            [INDEXDED_X]=INST_CMPA_IDX,
+            [INDEXDED_Y]=INST_CMPA_IDY,
         },
-        .operands = { IMMEDIATE, DIRECT, EXTENDED },
-        .immediate_16 = 1
+        .operands = { IMMEDIATE, DIRECT, EXTENDED, INDEXDED_X, INDEXDED_Y },
     },
     {
         .names = {"cmpb"}, .name_count = 1,
-        .codes = {[IMMEDIATE]=0xC1, [DIRECT]=0xD1, [EXTENDED]=0xE1},
+        .codes = {[IMMEDIATE]=0xC1, [DIRECT]=0xD1, [EXTENDED]=0xF1, [INDEXDED_X]=0xE1, [INDEXDED_Y]=0x18E1},
+        .cycles = {[IMMEDIATE]=2, [DIRECT]=3, [EXTENDED]=4, [INDEXDED_X]=4, [INDEXDED_Y]=5},
         .func =  {
             [IMMEDIATE]=INST_CMPB_IMM,
             [DIRECT]=INST_CMPB_DIR,
             [EXTENDED]=INST_CMPB_EXT,
+            [INDEXDED_X]=INST_CMPB_IDX,
+            [INDEXDED_Y]=INST_CMPB_IDY,
         },
-        .operands = { IMMEDIATE, DIRECT, EXTENDED },
-        .immediate_16 = 1
+        .operands = { IMMEDIATE, DIRECT, EXTENDED, INDEXDED_X, INDEXDED_Y },
     },
     {
         .names = {"cba"}, .name_count = 1,
-        .codes = {[INHERENT]=0x81},
+        .codes = {[INHERENT]=0x11},
+        .cycles = {[INHERENT]=2},
         .func =  {[INHERENT]=INST_CBA_INH},
         .operands = {INHERENT},
     },
     {
         .names = {"com"}, .name_count = 1,
-        .codes = {[EXTENDED]=0x73},
-        .func =  {[EXTENDED]=INST_COM_EXT},
-        .operands = {EXTENDED},
+        .codes = {[EXTENDED]=0x73, [INDEXDED_X]=0x63, [INDEXDED_Y]=0x1863},
+        .cycles = {[EXTENDED]=6, [INDEXDED_X]=6, [INDEXDED_Y]=7},
+        .func =  {
+            [EXTENDED]=INST_COM_EXT,
+            [INDEXDED_X]=INST_COM_IDX,
+            [INDEXDED_Y]=INST_COM_IDY,
+        },
+        .operands = { EXTENDED, INDEXDED_X, INDEXDED_Y },
     },
     {
         .names = {"coma"}, .name_count = 1,
         .codes = {[INHERENT]=0x43},
+        .cycles = {[INHERENT]=2},
         .func =  {[INHERENT]=INST_COMA_INH},
         .operands = {INHERENT},
     },
     {
         .names = {"comb"}, .name_count = 1,
         .codes = {[INHERENT]=0x53},
+        .cycles = {[INHERENT]=2},
         .func =  {[INHERENT]=INST_COMB_INH},
         .operands = {INHERENT},
     },
     {
         .names = {"bcc", "bhs"}, .name_count = 2,
         .codes = {[RELATIVE]=0x24},
+        .cycles = {[RELATIVE]=3},
         .func = {[RELATIVE]=INST_BCC},
         .operands = { RELATIVE }
     },
     {
         .names = {"bcs", "blo"}, .name_count = 2,
         .codes = {[RELATIVE]=0x25},
+        .cycles = {[RELATIVE]=3},
         .func = {[RELATIVE]=INST_BCS},
         .operands = { RELATIVE }
     },
     {
         .names = {"beq"}, .name_count = 1,
         .codes = {[RELATIVE]=0x27},
+        .cycles = {[RELATIVE]=3},
         .func = {[RELATIVE]=INST_BEQ},
         .operands = { RELATIVE }
     },
     {
         .names = {"bge"}, .name_count = 1,
         .codes = {[RELATIVE]=0x2C},
+        .cycles = {[RELATIVE]=3},
         .func = {[RELATIVE]=INST_BGE},
         .operands = { RELATIVE }
     },
     {
         .names = {"bgt"}, .name_count = 1,
         .codes = {[RELATIVE]=0x2E},
+        .cycles = {[RELATIVE]=3},
         .func = {[RELATIVE]=INST_BGT},
         .operands = { RELATIVE }
     },
     {
         .names = {"bhi"}, .name_count = 1,
         .codes = {[RELATIVE]=0x22},
+        .cycles = {[RELATIVE]=3},
         .func = {[RELATIVE]=INST_BHI},
         .operands = { RELATIVE }
     },
     {
         .names = {"ble"}, .name_count = 1,
         .codes = {[RELATIVE]=0x2F},
+        .cycles = {[RELATIVE]=3},
         .func = {[RELATIVE]=INST_BLE},
         .operands = { RELATIVE }
     },
     {
         .names = {"bls"}, .name_count = 1,
         .codes = {[RELATIVE]=0x23},
+        .cycles = {[RELATIVE]=3},
         .func = {[RELATIVE]=INST_BLS},
         .operands = { RELATIVE }
     },
     {
         .names = {"blt"}, .name_count = 1,
         .codes = {[RELATIVE]=0x2D},
+        .cycles = {[RELATIVE]=3},
         .func = {[RELATIVE]=INST_BLT},
         .operands = { RELATIVE }
     },
     {
         .names = {"bmi"}, .name_count = 1,
         .codes = {[RELATIVE]=0x2B},
+        .cycles = {[RELATIVE]=3},
         .func = {[RELATIVE]=INST_BMI},
         .operands = { RELATIVE }
     },
     {
         .names = {"bne"}, .name_count = 1,
         .codes = {[RELATIVE]=0x26},
+        .cycles = {[RELATIVE]=3},
         .func = {[RELATIVE]=INST_BNE},
         .operands = { RELATIVE }
     },
     {
         .names = {"bpl"}, .name_count = 1,
         .codes = {[RELATIVE]=0x2A},
+        .cycles = {[RELATIVE]=3},
         .func = {[RELATIVE]=INST_BPL},
         .operands = { RELATIVE }
     },
     {
         .names = {"bra"}, .name_count = 1,
         .codes = {[RELATIVE]=0x20},
+        .cycles = {[RELATIVE]=3},
         .func = {[RELATIVE]=INST_BRA},
         .operands = { RELATIVE }
     },
     {
         .names = {"brn"}, .name_count = 1,
         .codes = {[RELATIVE]=0x21},
+        .cycles = {[RELATIVE]=3},
         .func = {[RELATIVE]=INST_BRN},
         .operands = { RELATIVE }
     },
     {
         .names = {"bvc"}, .name_count = 1,
         .codes = {[RELATIVE]=0x28},
+        .cycles = {[RELATIVE]=3},
         .func = {[RELATIVE]=INST_BVC},
         .operands = { RELATIVE }
     },
     {
         .names = {"bvs"}, .name_count = 1,
         .codes = {[RELATIVE]=0x29},
+        .cycles = {[RELATIVE]=3},
         .func = {[RELATIVE]=INST_BVS},
         .operands = { RELATIVE }
     },
     {
         .names = {"bsr"}, .name_count = 1,
         .codes = {[RELATIVE]=0x8D},
+        .cycles = {[RELATIVE]=6},
         .func = {[RELATIVE]=INST_BSR_REL},
         .operands = { RELATIVE }
     },
     {
         .names = {"clv"}, .name_count = 1,
         .codes = {[NONE]=0x0A},
+        .cycles = {[NONE]=2},
         .func = {[NONE]=INST_CLV},
         .operands = { NONE }
     },
     {
         .names = {"sev"}, .name_count = 1,
         .codes = {[NONE]=0x0B},
+        .cycles = {[NONE]=2},
         .func = {[NONE]=INST_SEV},
         .operands = { NONE }
     },
     {
         .names = {"clc"}, .name_count = 1,
         .codes = {[NONE]=0x0C},
+        .cycles = {[NONE]=2},
         .func = {[NONE]=INST_CLC},
         .operands = { NONE }
     },
     {
         .names = {"sec"}, .name_count = 1,
         .codes = {[NONE]=0x0D},
+        .cycles = {[NONE]=2},
         .func = {[NONE]=INST_SEC},
         .operands = { NONE }
     },
     {
         .names = {"cli"}, .name_count = 1,
         .codes = {[NONE]=0x0E},
+        .cycles = {[NONE]=2},
         .func = {[NONE]=INST_CLI},
         .operands = { NONE }
     },
     {
         .names = {"sei"}, .name_count = 1,
         .codes = {[NONE]=0x0F},
+        .cycles = {[NONE]=2},
         .func = {[NONE]=INST_SEI},
         .operands = { NONE }
     },
     {
         .names = {"lsl"}, .name_count = 1,
-        .codes = {[EXTENDED]=0x78},
-        .func = { [EXTENDED]=INST_LSL_EXT },
-        .operands = { EXTENDED },
+        .codes = {[EXTENDED]=0x78, [INDEXDED_X]=0x68, [INDEXDED_Y]=0x1868},
+        .cycles = {[EXTENDED]=6, [INDEXDED_X]=6, [INDEXDED_Y]=7},
+        .func =  {
+            [EXTENDED]=INST_ASL_EXT,
+            [INDEXDED_X]=INST_ASL_IDX,
+            [INDEXDED_Y]=INST_ASL_IDY,
+        },
+        .operands = { EXTENDED, INDEXDED_X, INDEXDED_Y },
     },
     {
         .names = {"lsla"}, .name_count = 1,
         .codes = {[INHERENT]=0x48},
+        .cycles = {[INHERENT]=2},
         .func = { [INHERENT]=INST_LSLA_INH },
         .operands = { INHERENT },
     },
     {
         .names = {"lslb"}, .name_count = 1,
         .codes = {[INHERENT]=0x58},
+        .cycles = {[INHERENT]=2},
         .func = { [INHERENT]=INST_LSLB_INH },
         .operands = { INHERENT },
     },
     {
         .names = {"lsld"}, .name_count = 1,
         .codes = {[INHERENT]=0x05},
+        .cycles = {[INHERENT]=3},
         .func = { [INHERENT]=INST_LSLD_INH },
         .operands = { INHERENT },
     },
     {
         .names = {"lsr"}, .name_count = 1,
-        .codes = {[EXTENDED]=0x74},
-        .func = { [EXTENDED]=INST_LSR_EXT },
-        .operands = { EXTENDED },
+        .codes = {[EXTENDED]=0x74, [INDEXDED_X]=0x64, [INDEXDED_Y]=0x1864},
+        .cycles = {[EXTENDED]=6, [INDEXDED_X]=6, [INDEXDED_Y]=7},
+        .func =  {
+            [EXTENDED]=INST_LSR_EXT,
+            [INDEXDED_X]=INST_LSR_IDX,
+            [INDEXDED_Y]=INST_LSR_IDY,
+        },
+        .operands = { EXTENDED, INDEXDED_X, INDEXDED_Y },
     },
     {
         .names = {"lsra"}, .name_count = 1,
         .codes = {[INHERENT]=0x44},
+        .cycles = {[INHERENT]=2},
         .func = { [INHERENT]=INST_LSRA_INH },
         .operands = { INHERENT },
     },
     {
         .names = {"lsrb"}, .name_count = 1,
         .codes = {[INHERENT]=0x54},
+        .cycles = {[INHERENT]=2},
         .func = { [INHERENT]=INST_LSRB_INH },
         .operands = { INHERENT },
     },
     {
         .names = {"lsrd"}, .name_count = 1,
         .codes = {[INHERENT]=0x04},
+        .cycles = {[INHERENT]=3},
         .func = { [INHERENT]=INST_LSRD_INH },
         .operands = { INHERENT },
     },
     {
         .names = {"rol"}, .name_count = 1,
-        .codes = {[EXTENDED]=0x79},
-        .func = { [EXTENDED]=INST_ROL_EXT },
-        .operands = { EXTENDED },
+        .codes = {[EXTENDED]=0x79, [INDEXDED_X]=0x69, [INDEXDED_Y]=0x1869},
+        .cycles = {[EXTENDED]=6, [INDEXDED_X]=6, [INDEXDED_Y]=7},
+        .func =  {
+            [EXTENDED]=INST_ROL_EXT,
+            [INDEXDED_X]=INST_ROL_IDX,
+            [INDEXDED_Y]=INST_ROL_IDY,
+        },
+        .operands = { EXTENDED, INDEXDED_X, INDEXDED_Y },
     },
     {
         .names = {"rola"}, .name_count = 1,
         .codes = {[INHERENT]=0x49},
+        .cycles = {[INHERENT]=2},
         .func = { [INHERENT]=INST_ROLA_INH },
         .operands = { INHERENT },
     },
     {
         .names = {"rolb"}, .name_count = 1,
         .codes = {[INHERENT]=0x59},
+        .cycles = {[INHERENT]=2},
         .func = { [INHERENT]=INST_ROLB_INH },
         .operands = { INHERENT },
     },
     {
         .names = {"ror"}, .name_count = 1,
-        .codes = {[EXTENDED]=0x76},
-        .func = { [EXTENDED]=INST_ROR_EXT },
-        .operands = { EXTENDED },
+        .codes = {[EXTENDED]=0x76, [INDEXDED_X]=0x66, [INDEXDED_Y]=0x1866},
+        .cycles = {[EXTENDED]=6, [INDEXDED_X]=6, [INDEXDED_Y]=7},
+        .func =  {
+            [EXTENDED]=INST_ROR_EXT,
+            [INDEXDED_X]=INST_ROR_IDX,
+            [INDEXDED_Y]=INST_ROR_IDY,
+        },
+        .operands = { EXTENDED, INDEXDED_X, INDEXDED_Y },
     },
     {
         .names = {"rora"}, .name_count = 1,
         .codes = {[INHERENT]=0x46},
+        .cycles = {[INHERENT]=2},
         .func = { [INHERENT]=INST_RORA_INH },
         .operands = { INHERENT },
     },
     {
         .names = {"rorb"}, .name_count = 1,
         .codes = {[INHERENT]=0x56},
+        .cycles = {[INHERENT]=2},
         .func = { [INHERENT]=INST_RORB_INH },
         .operands = { INHERENT },
     },
     {
         .names = {"lds"}, .name_count = 1,
-        .codes = {[IMMEDIATE]=0x8E, [DIRECT]=0x9E,[EXTENDED]=0xBE},
-        .func = {
+        .codes = {[IMMEDIATE]=0x8E, [DIRECT]=0x9E, [EXTENDED]=0xBE, [INDEXDED_X]=0xAE, [INDEXDED_Y]=0x18AE},
+        .cycles = {[IMMEDIATE]=3, [DIRECT]=4, [EXTENDED]=5, [INDEXDED_X]=5, [INDEXDED_Y]=6},
+        .func =  {
             [IMMEDIATE]=INST_LDS_IMM,
             [DIRECT]=INST_LDS_DIR,
-            [EXTENDED]=INST_LDS_EXT
+            [EXTENDED]=INST_LDS_EXT,
+            [INDEXDED_X]=INST_LDS_IDX,
+            [INDEXDED_Y]=INST_LDS_IDY,
         },
-        .operands = { IMMEDIATE, DIRECT, EXTENDED },
-        .immediate_16 = 1
+        .operands = { IMMEDIATE, DIRECT, EXTENDED, INDEXDED_X, INDEXDED_Y },
+        .immediate_16 = 1,
     },
     {
         .names = {"rts"}, .name_count = 1,
         .codes = {[INHERENT]=0x39},
+        .cycles = {[INHERENT]=5},
         .func = { [INHERENT]=INST_RTS_INH},
         .operands = { INHERENT },
     },
     {
         .names = {"jsr"}, .name_count = 1,
-        .codes = {[DIRECT]=0x9D, [EXTENDED]=0xBD},
-        .func = {
+        .codes = {[DIRECT]=0x9D, [EXTENDED]=0xBD, [INDEXDED_X]=0xAD, [INDEXDED_Y]=0x18AD},
+        .cycles = {[DIRECT]=5, [EXTENDED]=6, [INDEXDED_X]=6, [INDEXDED_Y]=7},
+        .func =  {
             [DIRECT]=INST_JSR_DIR,
             [EXTENDED]=INST_JSR_EXT,
+            [INDEXDED_X]=INST_JSR_IDX,
+            [INDEXDED_Y]=INST_JSR_IDY,
         },
-        .operands = { DIRECT, EXTENDED},
+        .operands = { DIRECT, EXTENDED, INDEXDED_X, INDEXDED_Y },
     },
     {
         .names = {"psha"}, .name_count = 1,
         .codes = {[INHERENT]=0x36},
+        .cycles = {[INHERENT]=3},
         .func = { [INHERENT]=INST_PSHA_INH},
         .operands = { INHERENT },
     },
     {
         .names = {"pshb"}, .name_count = 1,
         .codes = {[INHERENT]=0x37},
+        .cycles = {[INHERENT]=3},
         .func = { [INHERENT]=INST_PSHB_INH},
         .operands = { INHERENT },
     },
     {
         .names = {"pshx"}, .name_count = 1,
         .codes = {[INHERENT]=0x3C},
-        .func = { [INHERENT]=INST_PSHX_INH},
+        .cycles = {[INHERENT]=4},
+        .func =  { [INHERENT]=INST_PSHX_INH },
         .operands = { INHERENT },
     },
     {
         .names = {"pula"}, .name_count = 1,
         .codes = {[INHERENT]=0x32},
+        .cycles = {[INHERENT]=4},
         .func = { [INHERENT]=INST_PULA_INH},
         .operands = { INHERENT },
     },
     {
         .names = {"pulb"}, .name_count = 1,
         .codes = {[INHERENT]=0x33},
+        .cycles = {[INHERENT]=4},
         .func = { [INHERENT]=INST_PULB_INH},
         .operands = { INHERENT },
     },
     {
         .names = {"pulx"}, .name_count = 1,
         .codes = {[INHERENT]=0x38},
-        .func = { [INHERENT]=INST_PULX_INH},
+        .cycles = {[INHERENT]=5},
+        .func =  { [INHERENT]=INST_PULX_INH },
         .operands = { INHERENT },
     },
     {
         .names = {"dec"}, .name_count = 1,
-        .codes = {[EXTENDED]=0x7A},
-        .func = { [EXTENDED]=INST_DEC_EXT},
-        .operands = { EXTENDED },
+        .codes = {[EXTENDED]=0x7A, [INDEXDED_X]=0x6A, [INDEXDED_Y]=0x186A},
+        .cycles = {[EXTENDED]=6, [INDEXDED_X]=6, [INDEXDED_Y]=7},
+        .func =  {
+            [EXTENDED]=INST_DEC_EXT,
+            [INDEXDED_X]=INST_DEC_IDX,
+            [INDEXDED_Y]=INST_DEC_IDY,
+        },
+        .operands = { EXTENDED, INDEXDED_X, INDEXDED_Y },
     },
     {
         .names = {"deca"}, .name_count = 1,
         .codes = {[INHERENT]=0x4A},
+        .cycles = {[INHERENT]=2},
         .func = { [INHERENT]=INST_DECA_INH},
         .operands = { INHERENT },
     },
     {
         .names = {"decb"}, .name_count = 1,
         .codes = {[INHERENT]=0x5A},
+        .cycles = {[INHERENT]=2},
         .func = { [INHERENT]=INST_DECB_INH},
         .operands = { INHERENT },
     },
     {
         .names = {"des"}, .name_count = 1,
         .codes = {[INHERENT]=0x34},
+        .cycles = {[INHERENT]=3},
         .func = { [INHERENT]=INST_DES_INH},
         .operands = { INHERENT },
     },
     {
         .names = {"inc"}, .name_count = 1,
-        .codes = {[EXTENDED]=0x7C},
-        .func = { [EXTENDED]=INST_INC_EXT},
-        .operands = { EXTENDED },
+        .codes = {[EXTENDED]=0x7C, [INDEXDED_X]=0x6C, [INDEXDED_Y]=0x186C},
+        .cycles = {[EXTENDED]=6, [INDEXDED_X]=6, [INDEXDED_Y]=7},
+        .func =  {
+            [EXTENDED]=INST_INC_EXT,
+            [INDEXDED_X]=INST_INC_IDX,
+            [INDEXDED_Y]=INST_INC_IDY,
+        },
+        .operands = { EXTENDED, INDEXDED_X, INDEXDED_Y },
     },
     {
         .names = {"inca"}, .name_count = 1,
         .codes = {[INHERENT]=0x4C},
+        .cycles = {[INHERENT]=2},
         .func = { [INHERENT]=INST_INCA_INH},
         .operands = { INHERENT },
     },
     {
         .names = {"incb"}, .name_count = 1,
         .codes = {[INHERENT]=0x5C},
+        .cycles = {[INHERENT]=2},
         .func = { [INHERENT]=INST_INCB_INH},
         .operands = { INHERENT },
     },
     {
         .names = {"neg"}, .name_count = 1,
-        .codes = {[EXTENDED]=0x70},
-        .func = { [EXTENDED]=INST_NEG_EXT},
-        .operands = { EXTENDED },
+        .codes = {[EXTENDED]=0x70, [INDEXDED_X]=0x60, [INDEXDED_Y]=0x1860},
+        .cycles = {[EXTENDED]=6, [INDEXDED_X]=6, [INDEXDED_Y]=7},
+        .func =  {
+            [EXTENDED]=INST_NEG_EXT,
+            [INDEXDED_X]=INST_NEG_IDX,
+            [INDEXDED_Y]=INST_NEG_IDY,
+        },
+        .operands = { EXTENDED, INDEXDED_X, INDEXDED_Y },
     },
     {
         .names = {"nega"}, .name_count = 1,
         .codes = {[INHERENT]=0x40},
+        .cycles = {[INHERENT]=2},
         .func = { [INHERENT]=INST_NEGA_INH},
         .operands = { INHERENT },
     },
     {
         .names = {"negb"}, .name_count = 1,
         .codes = {[INHERENT]=0x50},
+        .cycles = {[INHERENT]=2},
         .func = { [INHERENT]=INST_NEGB_INH},
         .operands = { INHERENT },
     },
     {
         .names = {"nop"}, .name_count = 1,
         .codes = {[INHERENT]=0x01},
+        .cycles = {[INHERENT]=2},
         .func = { [INHERENT]=INST_NOP_INH},
         .operands = { INHERENT },
     },
     {
         .names = {"oraa", "ora"}, .name_count = 2,
-        .codes = {[IMMEDIATE]=0x8A, [DIRECT]=0x9A, [EXTENDED]=0xBA},
+        .codes = {[IMMEDIATE]=0x8A, [DIRECT]=0x9A, [EXTENDED]=0xBA, [INDEXDED_X]=0xAA, [INDEXDED_Y]=0x18AA},
+        .cycles = {[IMMEDIATE]=2, [DIRECT]=3, [EXTENDED]=4, [INDEXDED_X]=4, [INDEXDED_Y]=5},
         .func =  {
             [IMMEDIATE]=INST_ORAA_IMM,
             [DIRECT]=INST_ORAA_DIR,
             [EXTENDED]=INST_ORAA_EXT,
+            [INDEXDED_X]=INST_ORAA_IDX,
+            [INDEXDED_Y]=INST_ORAA_IDY,
         },
-        .operands = { IMMEDIATE, EXTENDED, DIRECT },
+        .operands = { IMMEDIATE, DIRECT, EXTENDED, INDEXDED_X, INDEXDED_Y },
     },
     {
         .names = {"orab", "orb"}, .name_count = 2,
-        .codes = {[IMMEDIATE]=0xCA, [DIRECT]=0xDA, [EXTENDED]=0xFA},
+        .codes = {[IMMEDIATE]=0xCA, [DIRECT]=0xDA, [EXTENDED]=0xFA, [INDEXDED_X]=0xEA, [INDEXDED_Y]=0x18EA},
+        .cycles = {[IMMEDIATE]=2, [DIRECT]=3, [EXTENDED]=4, [INDEXDED_X]=4, [INDEXDED_Y]=5},
         .func =  {
             [IMMEDIATE]=INST_ORAB_IMM,
             [DIRECT]=INST_ORAB_DIR,
             [EXTENDED]=INST_ORAB_EXT,
+            [INDEXDED_X]=INST_ORAB_IDX,
+            [INDEXDED_Y]=INST_ORAB_IDY,
         },
-        .operands = { IMMEDIATE, EXTENDED, DIRECT },
+        .operands = { IMMEDIATE, DIRECT, EXTENDED, INDEXDED_X, INDEXDED_Y },
     },
     {
         .names = {"suba"}, .name_count = 1,
-        .codes = {[IMMEDIATE]=0x80, [DIRECT]=0x90, [EXTENDED]=0xB0},
+        .codes = {[IMMEDIATE]=0x80, [DIRECT]=0x90, [EXTENDED]=0xB0, [INDEXDED_X]=0xA0, [INDEXDED_Y]=0x18A0},
+        .cycles = {[IMMEDIATE]=2, [DIRECT]=3, [EXTENDED]=4, [INDEXDED_X]=4, [INDEXDED_Y]=5},
         .func =  {
             [IMMEDIATE]=INST_SUBA_IMM,
             [DIRECT]=INST_SUBA_DIR,
             [EXTENDED]=INST_SUBA_EXT,
+            [INDEXDED_X]=INST_SUBA_IDX,
+            [INDEXDED_Y]=INST_SUBA_IDY,
         },
-        .operands = { IMMEDIATE, EXTENDED, DIRECT },
+        .operands = { IMMEDIATE, DIRECT, EXTENDED, INDEXDED_X, INDEXDED_Y },
     },
     {
         .names = {"subb"}, .name_count = 1,
-        .codes = {[IMMEDIATE]=0xC0, [DIRECT]=0xD0, [EXTENDED]=0xF0},
+        .codes = {[IMMEDIATE]=0xC0, [DIRECT]=0xD0, [EXTENDED]=0xF0, [INDEXDED_X]=0xE0, [INDEXDED_Y]=0x18E0},
+        .cycles = {[IMMEDIATE]=2, [DIRECT]=3, [EXTENDED]=4, [INDEXDED_X]=4, [INDEXDED_Y]=5},
         .func =  {
             [IMMEDIATE]=INST_SUBB_IMM,
             [DIRECT]=INST_SUBB_DIR,
             [EXTENDED]=INST_SUBB_EXT,
+            [INDEXDED_X]=INST_SUBB_IDX,
+            [INDEXDED_Y]=INST_SUBB_IDY,
         },
-        .operands = { IMMEDIATE, EXTENDED, DIRECT },
+        .operands = { IMMEDIATE, DIRECT, EXTENDED, INDEXDED_X, INDEXDED_Y },
     },
     {
         .names = {"subd"}, .name_count = 1,
-        .codes = {[IMMEDIATE]=0x83, [DIRECT]=0x93, [EXTENDED]=0xB3},
+        .codes = {[IMMEDIATE]=0x83, [DIRECT]=0x93, [EXTENDED]=0xB3, [INDEXDED_X]=0xA3, [INDEXDED_Y]=0x18A3},
+        .cycles = {[IMMEDIATE]=4, [DIRECT]=5, [EXTENDED]=6, [INDEXDED_X]=6, [INDEXDED_Y]=7},
         .func =  {
             [IMMEDIATE]=INST_SUBD_IMM,
             [DIRECT]=INST_SUBD_DIR,
             [EXTENDED]=INST_SUBD_EXT,
+            [INDEXDED_X]=INST_SUBD_IDX,
+            [INDEXDED_Y]=INST_SUBD_IDY,
         },
-        .operands = { IMMEDIATE, EXTENDED, DIRECT },
-        .immediate_16 = 1
+        .operands = { IMMEDIATE, DIRECT, EXTENDED, INDEXDED_X, INDEXDED_Y },
+        .immediate_16 = 1,
     },
     {
         .names = {"clr"}, .name_count = 1,
-        .codes = {[EXTENDED]=0x7F},
-        .func =  {[EXTENDED]=INST_CLR_EXT},
-        .operands = { EXTENDED },
+        .codes = {[EXTENDED]=0x7F, [INDEXDED_X]=0x6F, [INDEXDED_Y]=0x186F},
+        .cycles = {[EXTENDED]=6, [INDEXDED_X]=6, [INDEXDED_Y]=7},
+        .func =  {
+            [EXTENDED]=INST_CLR_EXT,
+            [INDEXDED_X]=INST_CLR_IDX,
+            [INDEXDED_Y]=INST_CLR_IDY,
+        },
+        .operands = { EXTENDED, INDEXDED_X, INDEXDED_Y },
     },
     {
         .names = {"clra"}, .name_count = 1,
         .codes = {[INHERENT]=0x4F},
+        .cycles = {[INHERENT]=2},
         .func =  {[INHERENT]=INST_CLRA_INH},
         .operands = { INHERENT },
     },
     {
         .names = {"clrb"}, .name_count = 1,
         .codes = {[INHERENT]=0x5F},
+        .cycles = {[INHERENT]=2},
         .func =  {[INHERENT]=INST_CLRB_INH},
         .operands = { INHERENT },
     },
-    {
-        .names = {"clv"}, .name_count = 1,
-        .codes = {[INHERENT]=0x5F},
-        .func =  {[INHERENT]=INST_CLV_INH},
-        .operands = { INHERENT },
-    },
     {
         .names = {"jmp"}, .name_count = 1,
-        .codes = {[EXTENDED]=0x7E},
-        .func =  {[EXTENDED]=INST_JMP_EXT},
-        .operands = { EXTENDED },
+        .codes = {[EXTENDED]=0x7E, [INDEXDED_X]=0x6E, [INDEXDED_Y]=0x186E},
+        .cycles = {[EXTENDED]=3, [INDEXDED_X]=3, [INDEXDED_Y]=4},
+        .func =  {
+            [EXTENDED]=INST_JMP_EXT,
+            [INDEXDED_X]=INST_JMP_IDX,
+            [INDEXDED_Y]=INST_JMP_IDY,
+        },
+        .operands = { EXTENDED, INDEXDED_X, INDEXDED_Y },
     },
     {
         .names = {"mul"}, .name_count = 1,
         .codes = {[INHERENT]=0x3D},
+        .cycles = {[INHERENT]=10},
         .func =  {[INHERENT]=INST_MUL_INH},
         .operands = { INHERENT },
     },
     {
         .names = {"sts"}, .name_count = 1,
-        .codes = {[DIRECT]=0x9F, [EXTENDED]=0xBF},
+        .codes = {[DIRECT]=0x9F, [EXTENDED]=0xBF, [INDEXDED_X]=0xAF, [INDEXDED_Y]=0x18AF},
+        .cycles = {[DIRECT]=4, [EXTENDED]=5, [INDEXDED_X]=5, [INDEXDED_Y]=6},
         .func =  {
             [DIRECT]=INST_STS_DIR,
             [EXTENDED]=INST_STS_EXT,
+            [INDEXDED_X]=INST_STS_IDX,
+            [INDEXDED_Y]=INST_STS_IDY,
         },
-        .operands = { DIRECT, EXTENDED },
+        .operands = { DIRECT, EXTENDED, INDEXDED_X, INDEXDED_Y },
     },
     {
         .names = {"tpa"}, .name_count = 1,
         .codes = {[INHERENT]=0x07},
+        .cycles = {[INHERENT]=2},
         .func =  {[INHERENT]=INST_TPA_INH},
         .operands = { INHERENT },
     },
     {
         .names = {"tst"}, .name_count = 1,
-        .codes = {[EXTENDED]=0x7D},
-        .func =  {[EXTENDED]=INST_TST_EXT},
-        .operands = { EXTENDED },
+        .codes = {[EXTENDED]=0x7D, [INDEXDED_X]=0x6D, [INDEXDED_Y]=0x186D},
+        .cycles = {[EXTENDED]=6, [INDEXDED_X]=6, [INDEXDED_Y]=7},
+        .func =  {
+            [EXTENDED]=INST_TST_EXT,
+            [INDEXDED_X]=INST_TST_IDX,
+            [INDEXDED_Y]=INST_TST_IDY,
+        },
+        .operands = { EXTENDED, INDEXDED_X, INDEXDED_Y },
     },
     {
         .names = {"tsta"}, .name_count = 1,
         .codes = {[INHERENT]=0x4D},
+        .cycles = {[INHERENT]=2},
         .func =  {[INHERENT]=INST_TSTA_INH},
         .operands = { INHERENT },
     },
     {
-        .names = {"tst"}, .name_count = 1,
+        .names = {"tstb"}, .name_count = 1,
         .codes = {[INHERENT]=0x5D},
+        .cycles = {[INHERENT]=2},
         .func =  {[INHERENT]=INST_TSTB_INH},
         .operands = { INHERENT },
     },
     {
-        .names = {"tst"}, .name_count = 1,
-        .codes = {[EXTENDED]=0x07},
-        .func =  {[EXTENDED]=INST_TST_EXT},
-        .operands = { EXTENDED },
+        .names = {"eora"}, .name_count = 1,
+        .codes = {[IMMEDIATE]=0x88, [DIRECT]=0x98, [EXTENDED]=0xB8, [INDEXDED_X]=0xA8, [INDEXDED_Y]=0x18A8},
+        .cycles = {[IMMEDIATE]=2, [DIRECT]=3, [EXTENDED]=4, [INDEXDED_X]=4, [INDEXDED_Y]=5},
+        .func =  {
+            [IMMEDIATE]=INST_EORA_IMM,
+            [DIRECT]=INST_EORA_DIR,
+            [EXTENDED]=INST_EORA_EXT,
+            [INDEXDED_X]=INST_EORA_IDX,
+            [INDEXDED_Y]=INST_EORA_IDY,
+        },
+        .operands = { IMMEDIATE, DIRECT, EXTENDED, INDEXDED_X, INDEXDED_Y },
     },
     {
-        .names = {"tst"}, .name_count = 1,
-        .codes = {[EXTENDED]=0x07},
-        .func =  {[EXTENDED]=INST_TST_EXT},
-        .operands = { EXTENDED },
+        .names = {"eorb"}, .name_count = 1,
+        .codes = {[IMMEDIATE]=0xC8, [DIRECT]=0xD8, [EXTENDED]=0xF8, [INDEXDED_X]=0xE8, [INDEXDED_Y]=0x18E8},
+        .cycles = {[IMMEDIATE]=2, [DIRECT]=3, [EXTENDED]=4, [INDEXDED_X]=4, [INDEXDED_Y]=5},
+        .func =  {
+            [IMMEDIATE]=INST_EORB_IMM,
+            [DIRECT]=INST_EORB_DIR,
+            [EXTENDED]=INST_EORB_EXT,
+            [INDEXDED_X]=INST_EORB_IDX,
+            [INDEXDED_Y]=INST_EORB_IDY,
+        },
+        .operands = { IMMEDIATE, DIRECT, EXTENDED, INDEXDED_X, INDEXDED_Y },
     },
     {
-        .names = {"tst"}, .name_count = 1,
-        .codes = {[EXTENDED]=0x07},
-        .func =  {[EXTENDED]=INST_TST_EXT},
-        .operands = { EXTENDED },
+        .names = {"ins"}, .name_count = 1,
+        .codes = {[INHERENT]=0x31 },
+        .cycles = {[INHERENT]=3},
+        .func =  { [INHERENT]=INST_INS_INH },
+        .operands = { INHERENT },
     },
     {
-        .names = {"tst"}, .name_count = 1,
-        .codes = {[EXTENDED]=0x07},
-        .func =  {[EXTENDED]=INST_TST_EXT},
-        .operands = { EXTENDED },
+        .names = {"sba"}, .name_count = 1,
+        .codes = {[INHERENT]=0x10},
+        .cycles = {[INHERENT]=2},
+        .func =  { [INHERENT]=INST_SBA_INH },
+        .operands = { INHERENT },
     },
     {
-        .names = {"tst"}, .name_count = 1,
-        .codes = {[EXTENDED]=0x07},
-        .func =  {[EXTENDED]=INST_TST_EXT},
-        .operands = { EXTENDED },
+        .names = {"bclr"}, .name_count = 1,
+        .codes = {[DIRECT]=0x15},
+        .cycles = {[DIRECT]=6},
+        .func =  { [DIRECT]=INST_BCLR_DIR },
+        .operands = { DIRECT },
+        .multiple_operands = 1,
     },
     {
-        .names = {"tst"}, .name_count = 1,
-        .codes = {[EXTENDED]=0x07},
-        .func =  {[EXTENDED]=INST_TST_EXT},
-        .operands = { EXTENDED },
+        .names = {"wai"}, .name_count = 1,
+        .codes = {[INHERENT]=0x3E},
+        .cycles = {[INHERENT]=14},
+        .func =  { [INHERENT]=INST_WAI_INH },
+        .operands = { INHERENT },
     },
     {
-        .names = {"tst"}, .name_count = 1,
-        .codes = {[EXTENDED]=0x07},
-        .func =  {[EXTENDED]=INST_TST_EXT},
-        .operands = { EXTENDED },
+        .names = {"stop"}, .name_count = 1,
+        .codes = {[INHERENT]=0xCF},
+        .cycles = {[INHERENT]=2},
+        .func =  { [INHERENT]=INST_STOP_INH },
+        .operands = { INHERENT },
     },
     {
-        .names = {"tst"}, .name_count = 1,
-        .codes = {[EXTENDED]=0x07},
-        .func =  {[EXTENDED]=INST_TST_EXT},
-        .operands = { EXTENDED },
+        .names = {"swi"}, .name_count = 1,
+        .codes = {[INHERENT]=0x3F},
+        .cycles = {[INHERENT]=14},
+        .func =  { [INHERENT]=INST_SWI_INH },
+        .operands = { INHERENT },
     },
     {
-        .names = {"tst"}, .name_count = 1,
-        .codes = {[EXTENDED]=0x07},
-        .func =  {[EXTENDED]=INST_TST_EXT},
-        .operands = { EXTENDED },
+        .names = {"rti"}, .name_count = 1,
+        .codes = {[INHERENT]=0x3B},
+        .cycles = {[INHERENT]=12},
+        .func =  { [INHERENT]=INST_RTI_INH },
+        .operands = { INHERENT },
     },
     {
-        .names = {"tst"}, .name_count = 1,
-        .codes = {[EXTENDED]=0x07},
-        .func =  {[EXTENDED]=INST_TST_EXT},
-        .operands = { EXTENDED },
+        .names = {"cpd"}, .name_count = 1,
+        .codes = {[IMMEDIATE]=0x1A83, [DIRECT]=0x1A93, [EXTENDED]=0x1AB3, [INDEXDED_X]=0x1AA3, [INDEXDED_Y]=0xCDA3},
+        .cycles = {[IMMEDIATE]=5, [DIRECT]=6, [EXTENDED]=7, [INDEXDED_X]=7, [INDEXDED_Y]=7},
+        .func =  {
+            [IMMEDIATE]=INST_CPD_IMM,
+            [DIRECT]=INST_CPD_DIR,
+            [EXTENDED]=INST_CPD_EXT,
+            [INDEXDED_X]=INST_CPD_IDX,
+            [INDEXDED_Y]=INST_CPD_IDY,
+        },
+        .operands = { IMMEDIATE, DIRECT, EXTENDED, INDEXDED_X, INDEXDED_Y },
+        .immediate_16 = 1,
     },
     {
-        .names = {"tst"}, .name_count = 1,
-        .codes = {[EXTENDED]=0x07},
-        .func =  {[EXTENDED]=INST_TST_EXT},
-        .operands = { EXTENDED },
+        .names = {"ldx"}, .name_count = 1,
+        .codes = {[IMMEDIATE]=0xCE, [DIRECT]=0xDE, [EXTENDED]=0xFE, [INDEXDED_X]=0xEE, [INDEXDED_Y]=0xCDEE},
+        .cycles = {[IMMEDIATE]=3, [DIRECT]=4, [EXTENDED]=5, [INDEXDED_X]=5, [INDEXDED_Y]=6},
+        .func =  {
+            [IMMEDIATE]=INST_LDX_IMM,
+            [DIRECT]=INST_LDX_DIR,
+            [EXTENDED]=INST_LDX_EXT,
+            [INDEXDED_X]=INST_LDX_IDX,
+            [INDEXDED_Y]=INST_LDX_IDY,
+        },
+        .operands = { IMMEDIATE, DIRECT, EXTENDED, INDEXDED_X, INDEXDED_Y },
+        .immediate_16 = 1,
     },
     {
-        .names = {"tst"}, .name_count = 1,
-        .codes = {[EXTENDED]=0x07},
-        .func =  {[EXTENDED]=INST_TST_EXT},
-        .operands = { EXTENDED },
+        .names = {"ldy"}, .name_count = 1,
+        .codes = {[IMMEDIATE]=0x18CE, [DIRECT]=0x18DE, [EXTENDED]=0x18FE, [INDEXDED_X]=0x1AEE, [INDEXDED_Y]=0x18EE},
+        .cycles = {[IMMEDIATE]=4, [DIRECT]=5, [EXTENDED]=6, [INDEXDED_X]=6, [INDEXDED_Y]=6},
+        .func =  {
+            [IMMEDIATE]=INST_LDY_IMM,
+            [DIRECT]=INST_LDY_DIR,
+            [EXTENDED]=INST_LDY_EXT,
+            [INDEXDED_X]=INST_LDY_IDX,
+            [INDEXDED_Y]=INST_LDY_IDY,
+        },
+        .operands = { IMMEDIATE, DIRECT, EXTENDED, INDEXDED_X, INDEXDED_Y },
+        .immediate_16 = 1,
     },
     {
-        .names = {"tst"}, .name_count = 1,
-        .codes = {[EXTENDED]=0x07},
-        .func =  {[EXTENDED]=INST_TST_EXT},
-        .operands = { EXTENDED },
+        .names = {"stx"}, .name_count = 1,
+        .codes = {[DIRECT]=0xDF, [EXTENDED]=0xFF, [INDEXDED_X]=0xEF, [INDEXDED_Y]=0xCDEF},
+        .cycles = {[DIRECT]=4, [EXTENDED]=5, [INDEXDED_X]=5, [INDEXDED_Y]=6},
+        .func =  {
+            [DIRECT]=INST_STX_DIR,
+            [EXTENDED]=INST_STX_EXT,
+            [INDEXDED_X]=INST_STX_IDX,
+            [INDEXDED_Y]=INST_STX_IDY,
+        },
+        .operands = { DIRECT, EXTENDED, INDEXDED_X, INDEXDED_Y },
     },
     {
-        .names = {"tst"}, .name_count = 1,
-        .codes = {[EXTENDED]=0x07},
-        .func =  {[EXTENDED]=INST_TST_EXT},
-        .operands = { EXTENDED },
+        .names = {"sty"}, .name_count = 1,
+        .codes = {[DIRECT]=0x18DF, [EXTENDED]=0x18FF, [INDEXDED_X]=0x1AEF, [INDEXDED_Y]=0x18EF},
+        .cycles = {[DIRECT]=5, [EXTENDED]=6, [INDEXDED_X]=6, [INDEXDED_Y]=6},
+        .func =  {
+            [DIRECT]=INST_STY_DIR,
+            [EXTENDED]=INST_STY_EXT,
+            [INDEXDED_X]=INST_STY_IDX,
+            [INDEXDED_Y]=INST_STY_IDY,
+        },
+        .operands = { DIRECT, EXTENDED, INDEXDED_X, INDEXDED_Y },
     },
     {
-        .names = {"tst"}, .name_count = 1,
-        .codes = {[EXTENDED]=0x07},
-        .func =  {[EXTENDED]=INST_TST_EXT},
-        .operands = { EXTENDED },
+        .names = {"cpx"}, .name_count = 1,
+        .codes = {[IMMEDIATE]=0x8C, [DIRECT]=0x9C, [EXTENDED]=0xBC, [INDEXDED_X]=0xAC, [INDEXDED_Y]=0xCDAC},
+        .cycles = {[IMMEDIATE]=4, [DIRECT]=5, [EXTENDED]=6, [INDEXDED_X]=6, [INDEXDED_Y]=7},
+        .func =  {
+            [IMMEDIATE]=INST_CPX_IMM,
+            [DIRECT]=INST_CPX_DIR,
+            [EXTENDED]=INST_CPX_EXT,
+            [INDEXDED_X]=INST_CPX_IDX,
+            [INDEXDED_Y]=INST_CPX_IDY,
+        },
+        .operands = { IMMEDIATE, DIRECT, EXTENDED, INDEXDED_X, INDEXDED_Y },
+        .immediate_16 = 1,
     },
     {
-        .names = {"tst"}, .name_count = 1,
-        .codes = {[EXTENDED]=0x07},
-        .func =  {[EXTENDED]=INST_TST_EXT},
-        .operands = { EXTENDED },
+        .names = {"cpy"}, .name_count = 1,
+        .codes = {[IMMEDIATE]=0x188C, [DIRECT]=0x189C, [EXTENDED]=0x18BC, [INDEXDED_X]=0x1AAC, [INDEXDED_Y]=0x18AC},
+        .cycles = {[IMMEDIATE]=5, [DIRECT]=6, [EXTENDED]=7, [INDEXDED_X]=7, [INDEXDED_Y]=7},
+        .func =  {
+            [IMMEDIATE]=INST_CPY_IMM,
+            [DIRECT]=INST_CPY_DIR,
+            [EXTENDED]=INST_CPY_EXT,
+            [INDEXDED_X]=INST_CPY_IDX,
+            [INDEXDED_Y]=INST_CPY_IDY,
+        },
+        .operands = { IMMEDIATE, DIRECT, EXTENDED, INDEXDED_X, INDEXDED_Y },
+        .immediate_16 = 1,
     },
     {
-        .names = {"tst"}, .name_count = 1,
-        .codes = {[EXTENDED]=0x07},
-        .func =  {[EXTENDED]=INST_TST_EXT},
-        .operands = { EXTENDED },
+        .names = {"inx"}, .name_count = 1,
+        .codes = {[INHERENT]=0x08},
+        .cycles = {[INHERENT]=3},
+        .func =  { [INHERENT]=INST_INX_INH },
+        .operands = { INHERENT },
     },
     {
-        .names = {"tst"}, .name_count = 1,
-        .codes = {[EXTENDED]=0x07},
-        .func =  {[EXTENDED]=INST_TST_EXT},
-        .operands = { EXTENDED },
+        .names = {"dex"}, .name_count = 1,
+        .codes = {[INHERENT]=0x09},
+        .cycles = {[INHERENT]=3},
+        .func =  { [INHERENT]=INST_DEX_INH },
+        .operands = { INHERENT },
     },
     {
-        .names = {"tst"}, .name_count = 1,
-        .codes = {[EXTENDED]=0x07},
-        .func =  {[EXTENDED]=INST_TST_EXT},
-        .operands = { EXTENDED },
+        .names = {"abx"}, .name_count = 1,
+        .codes = {[INHERENT]=0x3A},
+        .cycles = {[INHERENT]=3},
+        .func =  { [INHERENT]=INST_ABX_INH },
+        .operands = { INHERENT },
     },
     {
-        .names = {"tst"}, .name_count = 1,
-        .codes = {[EXTENDED]=0x07},
-        .func =  {[EXTENDED]=INST_TST_EXT},
-        .operands = { EXTENDED },
+        .names = {"tsx"}, .name_count = 1,
+        .codes = {[INHERENT]=0x30},
+        .cycles = {[INHERENT]=3},
+        .func =  { [INHERENT]=INST_TSX_INH },
+        .operands = { INHERENT },
     },
     {
-        .names = {"eora"}, .name_count = 1,
-        .codes = {[IMMEDIATE]=0x88,[DIRECT]=0x98,[EXTENDED]=0xB8},
-        .func =  {
-            [IMMEDIATE]=INST_EORA_IMM,
-            [DIRECT]=INST_EORA_DIR,
-            [EXTENDED]=INST_EORA_EXT
-        },
-        .operands = { IMMEDIATE, DIRECT, EXTENDED },
+        .names = {"txs"}, .name_count = 1,
+        .codes = {[INHERENT]=0x35},
+        .cycles = {[INHERENT]=3},
+        .func =  { [INHERENT]=INST_TXS_INH },
+        .operands = { INHERENT },
     },
     {
-        .names = {"eorb"}, .name_count = 1,
-        .codes = {[IMMEDIATE]=0xC8,[DIRECT]=0xD8,[EXTENDED]=0xF8},
-        .func =  {
-            [IMMEDIATE]=INST_EORB_IMM,
-            [DIRECT]=INST_EORB_DIR,
-            [EXTENDED]=INST_EORB_EXT
-        },
-        .operands = { IMMEDIATE, DIRECT, EXTENDED },
+        .names = {"xgdx"}, .name_count = 1,
+        .codes = {[INHERENT]=0x8F},
+        .cycles = {[INHERENT]=3},
+        .func =  { [INHERENT]=INST_XGDX_INH },
+        .operands = { INHERENT },
     },
     {
-        .names = {"ins"}, .name_count = 1,
-        .codes = {[INHERENT]=0x31 },
-        .func =  { [INHERENT]=INST_INS_INH },
+        .names = {"iny"}, .name_count = 1,
+        .codes = {[INHERENT]=0x1808},
+        .cycles = {[INHERENT]=4},
+        .func =  { [INHERENT]=INST_INY_INH },
         .operands = { INHERENT },
     },
     {
-        .names = {"sba"}, .name_count = 1,
-        .codes = {[INHERENT]=0x10},
-        .func =  { [INHERENT]=INST_SBA_INH },
+        .names = {"dey"}, .name_count = 1,
+        .codes = {[INHERENT]=0x1809},
+        .cycles = {[INHERENT]=4},
+        .func =  { [INHERENT]=INST_DEY_INH },
         .operands = { INHERENT },
     },
     {
-        .names = {"bclr"}, .name_count = 1,
-        .codes = {[DIRECT]=0x15},
-        .func =  { [DIRECT]=INST_BCLR_DIR },
-        .operands = { DIRECT },
-        .multiple_operands = 1,
+        .names = {"aby"}, .name_count = 1,
+        .codes = {[INHERENT]=0x183A},
+        .cycles = {[INHERENT]=4},
+        .func =  { [INHERENT]=INST_ABY_INH },
+        .operands = { INHERENT },
+    },
+    {
+        .names = {"tsy"}, .name_count = 1,
+        .codes = {[INHERENT]=0x1830},
+        .cycles = {[INHERENT]=4},
+        .func =  { [INHERENT]=INST_TSY_INH },
+        .operands = { INHERENT },
+    },
+    {
+        .names = {"tys"}, .name_count = 1,
+        .codes = {[INHERENT]=0x1835},
+        .cycles = {[INHERENT]=4},
+        .func =  { [INHERENT]=INST_TYS_INH },
+        .operands = { INHERENT },
+    },
+    {
+        .names = {"xgdy"}, .name_count = 1,
+        .codes = {[INHERENT]=0x188F},
+        .cycles = {[INHERENT]=4},
+        .func =  { [INHERENT]=INST_XGDY_INH },
+        .operands = { INHERENT },
+    },
+    {
+        .names = {"pshy"}, .name_count = 1,
+        .codes = {[INHERENT]=0x183C},
+        .cycles = {[INHERENT]=5},
+        .func =  { [INHERENT]=INST_PSHY_INH },
+        .operands = { INHERENT },
+    },
+    {
+        .names = {"puly"}, .name_count = 1,
+        .codes = {[INHERENT]=0x1838},
+        .cycles = {[INHERENT]=6},
+        .func =  { [INHERENT]=INST_PULY_INH },
+        .operands = { INHERENT },
     },
 };
 
@@ -2310,10 +3184,34 @@ instruction instructions[] = {
 *           Utils            *
 *****************************/
 
+void release_shadow(cpu *cpu);
+void disable_undo(cpu *cpu);
+
 void free_cpu(cpu *cpu) {
     for (u8 i = 0; i < cpu->labels.count; ++i) {
         free((void *)cpu->label[i].label);
     }
+    free(cpu->decoded);
+    cpu->decoded = NULL;
+    free(cpu->traces);
+    cpu->traces = NULL;
+    free(cpu->code_map);
+    cpu->code_map = NULL;
+#ifdef EMULATOR_JIT
+    if (cpu->jit != NULL) {
+        munmap(cpu->jit->code, JIT_CODE_SIZE);
+        free(cpu->jit);
+        cpu->jit = NULL;
+    }
+#endif
+    release_shadow(cpu);
+    disable_undo(cpu);
+    stop_inputs(cpu);
+    end_trace(cpu);
+    clear_debug_points(cpu);
+#ifdef EMULATOR_PROFILE
+    stop_profile(cpu);
+#endif
 }
 
 void destroy_cpu(cpu *cpu) {
@@ -2321,38 +3219,285 @@ void destroy_cpu(cpu *cpu) {
     free(cpu);
 }
 
-void add_instructions_func() {
-    memset(instr_func, 0, 0x100 * sizeof(void*));
-    for (u8 i = 0; i < INSTRUCTION_COUNT; ++i) {
-        instruction *inst = &instructions[i];
-        operand_type *type = inst->operands;
-        while (*type != NONE) {
-            instr_func[inst->codes[*type]] = inst->func[*type];
-            type++;
-        }
-    }
-}
+/*****************************
+*         Snapshots          *
+*****************************/
 
-u8 str_prefix(const char *str, const char *pre)
-{
-    return strncmp(pre, str, strlen(pre)) == 0;
+// Pages are immutable once in a snapshot, whoever drops the last reference frees them.
+// Batch workers restore the same snapshots from several threads.
+static snapshot_page *page_ref(snapshot_page *page) {
+    atomic_fetch_add_explicit(&page->refs, 1, memory_order_relaxed);
+    return page;
 }
 
-u8 is_str_in_parts(const char *str, char **parts, u8 parts_count) {
-    for (u8 i = 0; i < parts_count; i++) {
-        if (parts[i] == NULL) continue;
-        if (strcmp(parts[i], str) == 0) return 1;
+static void page_unref(snapshot_page *page) {
+    if (page != NULL && atomic_fetch_sub_explicit(&page->refs, 1, memory_order_acq_rel) == 1) {
+        free(page);
     }
-    return 0;
 }
 
-const char *strdup(const char *base) {
-    size_t len = strlen(base);
-    char *str = malloc(len + 1);
-    if (str == NULL) {
+static snapshot_page *page_copy(const u8 *data) {
+    snapshot_page *page = malloc(sizeof(snapshot_page));
+    if (page == NULL) {
         ERROR("%s", "malloc");
     }
-    return memcpy(str, base, len+1);
+    atomic_init(&page->refs, 1);
+    memcpy(page->data, data, MEMORY_PAGE_SIZE);
+    return page;
+}
+
+// Memory that does not match its shadow page anymore. Register pages are written
+// directly by the ports and the timers, they are always treated as changed.
+static inline u8 page_changed(const cpu *cpu, u16 page) {
+    return cpu->shadow == NULL || cpu->shadow[page] == NULL || cpu->dirty[page]
+        || cpu->regions[page] == REGION_IO;
+}
+
+// Memory now matches `pages`
+static void set_shadow(cpu *cpu, snapshot_page *const *pages) {
+    if (cpu->shadow == NULL) {
+        cpu->shadow = calloc(MEMORY_PAGES, sizeof(snapshot_page *));
+        if (cpu->shadow == NULL) {
+            ERROR("%s", "calloc");
+        }
+    }
+    for (u16 p = 0; p < MEMORY_PAGES; ++p) {
+        if (cpu->shadow[p] != pages[p]) {
+            page_unref(cpu->shadow[p]);
+            cpu->shadow[p] = page_ref(pages[p]);
+        }
+    }
+    memset(cpu->dirty, 0, sizeof(cpu->dirty));
+}
+
+void release_shadow(cpu *cpu) {
+    if (cpu->shadow == NULL) {
+        return;
+    }
+    for (u16 p = 0; p < MEMORY_PAGES; ++p) {
+        page_unref(cpu->shadow[p]);
+    }
+    free(cpu->shadow);
+    cpu->shadow = NULL;
+}
+
+// Memory written directly instead of through WRITE8 (load_program, memcpy...) is not
+// seen as dirty, take a snapshot after loading a program rather than before.
+snapshot *take_snapshot(cpu *cpu) {
+    snapshot *s = malloc(sizeof(snapshot));
+    if (s == NULL) {
+        ERROR("%s", "malloc");
+    }
+    memcpy(s->head, cpu, sizeof(s->head));
+    memcpy(s->ports, cpu->ports, sizeof(s->ports));
+    memcpy(s->ddrx, cpu->ddrx, sizeof(s->ddrx));
+    for (u16 p = 0; p < MEMORY_PAGES; ++p) {
+        const u8 *data = cpu->memory + p * MEMORY_PAGE_SIZE;
+        // A page written back to the same bytes is still shared
+        if (!page_changed(cpu, p)
+            || (cpu->shadow != NULL && cpu->shadow[p] != NULL
+                && memcmp(cpu->shadow[p]->data, data, MEMORY_PAGE_SIZE) == 0)) {
+            s->pages[p] = page_ref(cpu->shadow[p]);
+        } else {
+            s->pages[p] = page_copy(data);
+        }
+    }
+    set_shadow(cpu, s->pages);
+    return s;
+}
+
+static void restore_page(cpu *cpu, u16 page, const u8 *data) {
+    u8 *mem = cpu->memory + page * MEMORY_PAGE_SIZE;
+    if (cpu->code_map != NULL) { // Drop the code built from bytes that change
+        for (u16 i = 0; i < MEMORY_PAGE_SIZE; ++i) {
+            u16 addr = page * MEMORY_PAGE_SIZE + i;
+            if (mem[i] != data[i] && (cpu->code_map[addr >> 3] >> (addr & 7)) & 1) {
+                mem[i] = data[i];
+                invalidate_code(cpu, addr);
+            }
+        }
+    }
+    memcpy(mem, data, MEMORY_PAGE_SIZE);
+}
+
+// Puts `cpu` back in the state of `s`. Only the pages that differ from it are copied,
+// `s` can come from another cpu. The cpu keeps its labels and caches.
+void restore_snapshot(cpu *cpu, const snapshot *s) {
+    memcpy(cpu, s->head, sizeof(s->head));
+    memcpy(cpu->ports, s->ports, sizeof(s->ports));
+    memcpy(cpu->ddrx, s->ddrx, sizeof(s->ddrx));
+    for (u16 p = 0; p < MEMORY_PAGES; ++p) {
+        if (page_changed(cpu, p) || cpu->shadow[p] != s->pages[p]) {
+            restore_page(cpu, p, s->pages[p]->data);
+        }
+    }
+    set_shadow(cpu, s->pages);
+    if (cpu->undo != NULL) { // The steps logged so far lead somewhere else
+        cpu->undo->floor = cpu->undo->head;
+    }
+}
+
+void free_snapshot(snapshot *s) {
+    for (u16 p = 0; p < MEMORY_PAGES; ++p) {
+        page_unref(s->pages[p]);
+    }
+    free(s);
+}
+
+// Number of bytes following the opcode for this addressing mode
+u8 operand_size(const instruction *inst, operand_type type) {
+    u8 size = 0;
+    switch (type) {
+        case IMMEDIATE:  size = inst->immediate_16 ? 2 : 1; break;
+        case EXTENDED:   size = 2; break;
+        case DIRECT:
+        case INDEXDED_X:
+        case INDEXDED_Y:
+        case RELATIVE:   size = 1; break;
+        default:         return 0;
+    }
+    return size + inst->multiple_operands;
+}
+
+// Handlers that write nothing but registers. A loop made of them can only end through its inputs.
+#define PURE_MODE(OP, M) INST_##OP##_##M,
+#define PURE_FAMILY(OP) OPERAND_MODES(PURE_MODE, OP)
+static void (*const pure_handlers[]) (cpu *cpu) = {
+    INST_NOP, INST_NOP_INH, INST_CLV, INST_SEV, INST_CLC, INST_SEC, INST_SEI,
+    READ8_OPS(PURE_FAMILY)
+    READ16_OPS(PURE_FAMILY)
+    MODIFY_MODES(PURE_MODE, TST)
+    INST_ABA, INST_ASLA_INH, INST_ASLB_INH, INST_ASLD_INH, INST_ASRA_INH, INST_ASRB_INH,
+    INST_TAB_INH, INST_TBA_INH, INST_CBA_INH, INST_COMA_INH, INST_COMB_INH,
+    INST_LSLA_INH, INST_LSLB_INH, INST_LSLD_INH, INST_LSRA_INH, INST_LSRB_INH, INST_LSRD_INH,
+    INST_ROLA_INH, INST_ROLB_INH, INST_RORA_INH, INST_RORB_INH, INST_DECA_INH, INST_DECB_INH,
+    INST_DES_INH, INST_INCA_INH, INST_INCB_INH, INST_INS_INH, INST_NEGA_INH, INST_NEGB_INH,
+    INST_CLRA_INH, INST_CLRB_INH, INST_MUL_INH, INST_TPA_INH, INST_TSTA_INH, INST_TSTB_INH,
+    INST_SBA_INH, INST_INX_INH, INST_INY_INH, INST_DEX_INH, INST_DEY_INH, INST_ABX_INH, INST_ABY_INH,
+    INST_TSX_INH, INST_TSY_INH, INST_TXS_INH, INST_TYS_INH, INST_XGDX_INH, INST_XGDY_INH,
+    INST_BRA, INST_BCC, INST_BCS, INST_BEQ, INST_BGE, INST_BGT, INST_BHI, INST_BLE, INST_BLS,
+    INST_BLT, INST_BMI, INST_BNE, INST_BPL, INST_BRN, INST_BVC, INST_BVS,
+};
+#define PURE_HANDLER_COUNT (sizeof(pure_handlers) / sizeof(pure_handlers[0]))
+
+static void (*const slow_handlers[]) (cpu *cpu) = {
+    INST_SWI_INH, INST_RTI_INH, INST_CLI, INST_TAP_INH, INST_WAI_INH, INST_STOP_INH,
+};
+#define SLOW_HANDLER_COUNT (sizeof(slow_handlers) / sizeof(slow_handlers[0]))
+
+// Handlers generated with a DECODED_ version, see instr_exec
+#define DECODED_MODE(OP, M) {INST_##OP##_##M, DECODED_##OP##_##M},
+#define DECODED_OPERAND_FAMILY(OP) OPERAND_MODES(DECODED_MODE, OP)
+#define DECODED_MEMORY_FAMILY(OP) MEMORY_MODES(DECODED_MODE, OP)
+#define DECODED_MODIFY_FAMILY(OP) MODIFY_MODES(DECODED_MODE, OP)
+static const struct {
+    void (*func) (cpu *cpu);
+    void (*exec) (cpu *cpu, u16 operand);
+} decoded_handlers[] = {
+    READ8_OPS(DECODED_OPERAND_FAMILY)
+    READ16_OPS(DECODED_OPERAND_FAMILY)
+    DECODED_MEMORY_FAMILY(STA) DECODED_MEMORY_FAMILY(STB)
+    STORE16_OPS(DECODED_MEMORY_FAMILY)
+    MODIFY_OPS(DECODED_MODIFY_FAMILY)
+    DECODED_MODIFY_FAMILY(TST)
+};
+#define DECODED_HANDLER_COUNT (sizeof(decoded_handlers) / sizeof(decoded_handlers[0]))
+
+// Where an opcode (prefix in the high byte) lives in the instr_* tables
+static inline u16 code_index(u16 code) {
+    return code > 0xFF ? instr_page[code >> 8] | (code & 0xFF) : code;
+}
+
+static inline u8 opcode_size(u16 code) {
+    return code > 0xFF ? 2 : 1;
+}
+
+// Opcode of the instruction at addr, with its prefix in the high byte if it has one
+static inline u16 inst_code_at(const u8 *memory, u16 addr) {
+    u8 op = memory[addr];
+    return instr_page[op] != 0 ? op << 8 | memory[(u16)(addr + 1)] : op;
+}
+
+// Size of the instruction at addr, prefix included
+static inline u8 inst_len_at(const u8 *memory, u16 addr) {
+    u16 code = inst_code_at(memory, addr);
+    u8 len = instr_len[code_index(code)];
+    return len != 0 ? len : opcode_size(code); // Unknown opcodes are skipped
+}
+
+static void fill_instruction_tables(void) {
+    for (u8 i = 0; i < OPCODE_PAGE_COUNT - 1; ++i) {
+        instr_page[opcode_prefixes[i]] = (i + 1) << 8;
+        instr_func[opcode_prefixes[i]] = INST_PREFIX;
+        instr_len[opcode_prefixes[i]] = 2;
+    }
+    for (u8 i = 0; i < INSTRUCTION_COUNT; ++i) {
+        instruction *inst = &instructions[i];
+        operand_type *type = inst->operands;
+        // Instructions without operand (clc, sei...) only have the NONE entry
+        if (*type == NONE) {
+            u16 code = code_index(inst->codes[NONE]);
+            instr_func[code] = inst->func[NONE];
+            instr_len[code] = opcode_size(inst->codes[NONE]);
+            instr_cycles[code] = inst->cycles[NONE];
+            continue;
+        }
+        while (*type != NONE) {
+            u16 code = code_index(inst->codes[*type]);
+            instr_func[code] = inst->func[*type];
+            instr_len[code] = opcode_size(inst->codes[*type]) + operand_size(inst, *type);
+            instr_cycles[code] = inst->cycles[*type];
+            instr_taken_cycles[code] = inst->taken_cycles;
+            if (inst->cycles[*type] + inst->taken_cycles > instr_max_cycles) {
+                instr_max_cycles = inst->cycles[*type] + inst->taken_cycles;
+            }
+            type++;
+        }
+    }
+    for (u16 op = 0; op < 0x100; ++op) {
+        for (u16 i = 0; i < PURE_HANDLER_COUNT && instr_func[op] != NULL; ++i) {
+            instr_pure[op] |= instr_func[op] == pure_handlers[i];
+        }
+        for (u16 i = 0; i < SLOW_HANDLER_COUNT && instr_func[op] != NULL; ++i) {
+            instr_slow[op] |= instr_func[op] == slow_handlers[i];
+        }
+        instr_slow[op] |= op == 0x00;
+    }
+    for (u16 code = 0; code < OPCODE_PAGE_COUNT * 0x100; ++code) {
+        for (u16 i = 0; i < DECODED_HANDLER_COUNT && instr_func[code] != NULL; ++i) {
+            if (instr_func[code] == decoded_handlers[i].func) {
+                instr_exec[code] = decoded_handlers[i].exec;
+            }
+        }
+    }
+}
+
+// The opcode tables are only written once, after that every cpu can read them from any thread
+void add_instructions_func() {
+    static once_flag once = ONCE_FLAG_INIT;
+    call_once(&once, fill_instruction_tables);
+}
+
+u8 str_prefix(const char *str, const char *pre)
+{
+    return strncmp(pre, str, strlen(pre)) == 0;
+}
+
+u8 is_str_in_parts(const char *str, char **parts, u8 parts_count) {
+    for (u8 i = 0; i < parts_count; i++) {
+        if (parts[i] == NULL) continue;
+        if (strcmp(parts[i], str) == 0) return 1;
+    }
+    return 0;
+}
+
+const char *str_dup(const char *base) {
+    size_t len = strlen(base);
+    char *str = malloc(len + 1);
+    if (str == NULL) {
+        ERROR("%s", "malloc");
+    }
+    return memcpy(str, base, len+1);
 }
 
 u8 is_valid_operand_type(instruction *inst, operand_type type) {
@@ -2477,6 +3622,10 @@ instruction * opcode_str_to_hex(const char *str) {
 // Returns operand type based on prefix and operand_value
 operand_type get_operand_type(const char *str) {
     if (str == NULL) return NONE;
+    const char *comma = strchr(str, ',');
+    if (comma != NULL) {
+        return comma[1] == 'y' ? INDEXDED_Y : INDEXDED_X;
+    }
     if (str[0] == '#')                  return IMMEDIATE;
     if (str[0] == '<' && str[1] == '$') return DIRECT;
     if (str[0] == '>' && str[1] == '$') return EXTENDED;
@@ -2536,6 +3685,35 @@ u16 get_operand_value(const char *str) {
     return operand_value;
 }
 
+// Offset of an indexed operand: "$10,x", "16,y", "%101,x", "label,y" or ",x" for 0
+u8 get_index_offset(const char *str, labels *labels) {
+    const char *comma = strchr(str, ',');
+    if ((comma[1] != 'x' && comma[1] != 'y') || comma[2] != '\0') {
+        ERROR("%s is not indexed by x or y", str);
+    }
+    char offset[32] = {0};
+    if ((size_t) (comma - str) >= sizeof(offset)) {
+        ERROR("%s offset is too long", str);
+    }
+    memcpy(offset, str, comma - str);
+
+    u16 value = 0;
+    directive *directive = labels != NULL ? get_directive_by_label(offset, labels) : NULL;
+    if (directive != NULL) {
+        value = directive->operand.value;
+    } else if (offset[0] == '$') {
+        value = convert_str_from_base(offset + 1, 16);
+    } else if (offset[0] == '%') {
+        value = convert_str_from_base(offset + 1, 2);
+    } else if (offset[0] != '\0') {
+        value = convert_str_from_base(offset, 10);
+    }
+    if (value > 0xFF) {
+        ERROR("Indexed offsets go up to 0xFF, recieved "FMT16, value);
+    }
+    return value;
+}
+
 operand get_operand(const char *str, labels *labels) {
     if (labels) {
         directive *directive = get_directive_by_label(str, labels);
@@ -2544,8 +3722,11 @@ operand get_operand(const char *str, labels *labels) {
         }
     }
 
-    u16 operand_value = get_operand_value(str);
     operand_type type = get_operand_type(str);
+    if (type == INDEXDED_X || type == INDEXDED_Y) {
+        return (operand) {get_index_offset(str, labels), type, 0};
+    }
+    u16 operand_value = get_operand_value(str);
     if (type == DIRECT && operand_value > 0xFF) {
         ERROR("Direct addressing mode only allows value up to 0xFF, recieved "FMT16, operand_value);
     }
@@ -2629,7 +3810,10 @@ mnemonic line_to_mnemonic(char *line, labels *labels, u16 addr) {
 
 u8 add_mnemonic_to_memory(cpu *cpu, mnemonic *m, u16 addr) {
     u8 written = 0; // Number of bytes written
-    cpu->memory[addr + (written++)] = m->opcode;
+    if (m->opcode > 0xFF) {
+        cpu->memory[addr + (written++)] = m->opcode >> 8; // Prefix
+    }
+    cpu->memory[addr + (written++)] = m->opcode & 0xFF;
     if (m->operand.type != NONE && m->operand.type != INHERENT) {
         // TODO: Certain instruction such as CPX uses 2 operands even for immediate mode
         if (m->operand.value > 0xFF || m->operand.type == EXTENDED || (m->operand.type == IMMEDIATE && m->immediate_16)) {
@@ -2647,7 +3831,7 @@ directive line_to_directive(char *line, labels *labels) {
     char *parts[5] = {0};
     u8 nb_parts = split_by_space(line, parts, 5);
     if (nb_parts == 0) {
-        return (directive) {NULL, NULL, {0, NONE, 0}, NOT_A_DIRECTIVE};
+        return (directive) {NULL, NULL, {0, NONE, 0}, NOT_A_DIRECTIVE, NULL};
     }
 
     // If there is a label
@@ -2656,7 +3840,7 @@ directive line_to_directive(char *line, labels *labels) {
             ERROR("%s", "equ format : <LABEL> equ <VALUE>");
         }
         operand operand = get_operand(parts[2], labels);
-        return (directive) {strdup(parts[0]), NULL, {operand.value, operand.type, operand.from_label}, CONSTANT};
+        return (directive) {str_dup(parts[0]), NULL, {operand.value, operand.type, operand.from_label}, CONSTANT, NULL};
     }
     if (is_str_in_parts("org", parts, nb_parts)) {
         if (nb_parts != 3) {
@@ -2666,15 +3850,32 @@ directive line_to_directive(char *line, labels *labels) {
         if (operand.type == NONE) {
             ERROR("%s", "No operand found\n");
         }
-        return (directive) {NULL, NULL, {operand.value, EXTENDED, operand.from_label}, ORG};
+        return (directive) {NULL, NULL, {operand.value, EXTENDED, operand.from_label}, ORG, NULL};
     }
 
     if (parts[0] != NULL) {
-        return (directive) {strdup(parts[0]), parts[1], {0, EXTENDED, 1}, LABEL};
+        return (directive) {str_dup(parts[0]), parts[1], {0, EXTENDED, 1}, LABEL, parts[2]};
     }
 
     operand_type type = get_operand_type(parts[2]);
-    return (directive) {NULL, parts[1], {0, type, 0}, NOT_A_DIRECTIVE};
+    return (directive) {NULL, parts[1], {0, type, 0}, NOT_A_DIRECTIVE, parts[2]};
+}
+
+// Addressing mode used to size a line during the first pass, when labels defined further down are still unknown
+operand_type first_pass_operand_type(instruction *inst, const char *str, labels *labels) {
+    if (inst->operands[0] == RELATIVE) {
+        return RELATIVE;
+    }
+    if (str == NULL) {
+        return INHERENT;
+    }
+    directive *label = get_directive_by_label(str, labels);
+    if (label != NULL) {
+        return label->operand.type;
+    }
+    operand_type type = get_operand_type(str);
+    // Unknown labels are addresses of code further down
+    return type == NONE ? EXTENDED : type;
 }
 
 void load_program(cpu *cpu, const char *file_path) {
@@ -2714,12 +3915,8 @@ void load_program(cpu *cpu, const char *file_path) {
         if (d.opcode_str != NULL) {
             instruction *inst = opcode_str_to_hex(d.opcode_str);
             if (inst == NULL) { continue; } // Unknow instruction
-            addr++;
-            if (d.operand.type == DIRECT || (d.operand.type == IMMEDIATE && !inst->immediate_16)) {
-                addr += 1;
-            } else if (d.operand.type == EXTENDED || (d.operand.type == IMMEDIATE && inst->immediate_16)) {
-                addr += 2;
-            }
+            operand_type type = first_pass_operand_type(inst, d.operand_str, &cpu->labels);
+            addr += opcode_size(inst->codes[type]) + operand_size(inst, type);
         }
     }
 
@@ -2763,26 +3960,4188 @@ void load_program(cpu *cpu, const char *file_path) {
     fclose(f);
 }
 
-void exec_program(cpu *cpu) {
-    while (cpu->memory[cpu->pc] != 0x00) {
-        u8 inst = cpu->memory[cpu->pc];
-        if (instr_func[inst] != NULL) {
-            (*instr_func[inst])(cpu); // Call the function with this opcode
+// Instructions that may change pc, they end a block
+u8 is_block_end(u16 opcode) {
+    return (opcode >= 0x20 && opcode <= 0x2F) // Branches
+        || opcode == 0x8D  // BSR
+        || opcode == 0x9D || opcode == 0xBD || opcode == 0xAD || opcode == 0x18AD // JSR
+        || opcode == 0x39  // RTS
+        || opcode == 0x7E || opcode == 0x6E || opcode == 0x186E; // JMP
+}
+
+// Remembers that derived code was built from these bytes so WRITE8 can invalidate it
+void mark_code(cpu *cpu, u16 addr, u16 len) {
+    if (cpu->code_map == NULL) {
+        cpu->code_map = calloc(MAX_MEMORY / 8, 1);
+        if (cpu->code_map == NULL) {
+            ERROR("%s", "calloc");
+        }
+    }
+    for (u16 i = 0; i < len; ++i) {
+        u16 a = addr + i;
+        cpu->code_map[a >> 3] |= 1 << (a & 7);
+    }
+}
+
+// Drops the decoded entries of every instruction that could include this byte
+void invalidate_decoded(cpu *cpu, u16 addr) {
+    for (u8 i = 0; i < MAX_INST_LEN; ++i) {
+        cpu->decoded[(u16)(addr - i)].len = 0;
+    }
+}
+
+// Drops the traces going through this byte. A running trace stops after its current instruction.
+void invalidate_traces(cpu *cpu, u16 addr) {
+    trace_cache *tc = cpu->traces;
+    for (u16 i = 0; i < tc->count; ++i) {
+        trace *t = &tc->pool[i];
+        for (u16 j = 0; j < t->len; ++j) {
+            u16 offset = addr - t->insts[j].pc;
+            if (offset < t->insts[j].len) {
+                if (tc->entry[t->head] == t) {
+                    tc->entry[t->head] = NULL;
+                }
+                t->len = 0;
+                break;
+            }
+        }
+    }
+}
+
+#ifdef EMULATOR_JIT
+void jit_invalidate(cpu *cpu, u16 addr);
+#endif
+
+// Called by WRITE8 when a byte used to build code is modified
+void invalidate_code(cpu *cpu, u16 addr) {
+    cpu->code_map[addr >> 3] &= ~(1 << (addr & 7));
+    cpu->code_writes++;
+    if (cpu->decoded != NULL) {
+        invalidate_decoded(cpu, addr);
+    }
+    if (cpu->traces != NULL) {
+        invalidate_traces(cpu, addr);
+    }
+#ifdef EMULATOR_JIT
+    if (cpu->jit != NULL) {
+        jit_invalidate(cpu, addr);
+    }
+#endif
+}
+
+decoded_inst *get_decoded(cpu *cpu) {
+    if (cpu->decoded == NULL) {
+        cpu->decoded = calloc(MAX_MEMORY, sizeof(decoded_inst));
+        if (cpu->decoded == NULL) {
+            ERROR("%s", "calloc");
+        }
+    }
+    return cpu->decoded;
+}
+
+void decode_inst(cpu *cpu, u16 addr, decoded_inst *d) {
+    u8 opcode = cpu->memory[addr];
+    u16 code = inst_code_at(cpu->memory, addr);
+    u16 index = code_index(code);
+    if (instr_exec[index] != NULL) {
+        d->kind = DECODED_EXEC;
+        d->exec = instr_exec[index];
+    } else {
+        d->kind = instr_slow[opcode] ? DECODED_SLOW : DECODED_FUNC;
+        d->func = instr_func[opcode] != NULL ? instr_func[opcode] : INST_NOP;
+        index = opcode; // INST_PREFIX adds the cycles of the paged instruction itself
+    }
+    d->len = inst_len_at(cpu->memory, addr);
+    d->operand = 0;
+    for (u8 i = opcode_size(code); i < d->len; ++i) {
+        d->operand = (d->operand << 8) | cpu->memory[(u16)(addr + i)];
+    }
+    d->next = addr + d->len;
+    d->cycles = instr_cycles[index];
+    d->taken_cycles = instr_taken_cycles[index];
+    mark_code(cpu, addr, d->len);
+}
+
+decoded_inst *fetch_decoded(cpu *cpu, decoded_inst *decoded, u16 addr) {
+    decoded_inst *d = &decoded[addr];
+    if (d->len == 0) {
+        decode_inst(cpu, addr, d);
+    }
+    return d;
+}
+
+// Executes the loop starting at head while recording the path it takes.
+// The trace is kept if the path comes back to head within TRACE_MAX_LEN instructions.
+void record_trace(cpu *cpu, u16 head) {
+    trace_cache *tc = cpu->traces;
+    if (tc->count == MAX_TRACES) {
+        memset(tc->entry, 0, sizeof(tc->entry));
+        tc->count = 0;
+    }
+    trace *t = &tc->pool[tc->count++];
+    t->head = head;
+    t->len = 0;
+
+    decoded_inst *decoded = get_decoded(cpu);
+    for (u16 n = 0; n < TRACE_MAX_LEN; ++n) {
+        u16 pc = cpu->pc;
+        decoded_inst *d = fetch_decoded(cpu, decoded, pc);
+        if (d->kind == DECODED_SLOW) {
+            return; // Left to exec_program_predecoded
         }
+        // Traces keep calling the handlers that fetch their operand, the decoded ones did not
+        // make them any faster as trace_inst would have to grow to hold them
+        u8 opcode = cpu->memory[pc];
+        trace_inst inst = {instr_func[opcode] != NULL ? instr_func[opcode] : INST_NOP, pc, 0, d->len,
+                is_block_end(inst_code_at(cpu->memory, pc)), instr_cycles[opcode], instr_taken_cycles[opcode]};
+        u16 next = d->next;
+        inst.func(cpu);
         cpu->pc++;
+        cpu->cycles += inst.cycles;
+        if (cpu->pc != next) {
+            cpu->cycles += inst.taken_cycles;
+            inst.guard = 1;
+        }
+        inst.next = cpu->pc;
+        t->insts[t->len++] = inst;
+        if (t->len != n + 1) {
+            return; // The loop wrote over its own code
+        }
+        if (cpu->pc == head) {
+            tc->entry[head] = t;
+            return;
+        }
     }
+    t->len = 0;
 }
 
-void init_cpu(cpu *cpu, const char *fn) {
-    add_instructions_func();
-    set_default_ddr(cpu);
-    load_program(cpu, fn);
+// Nothing for the engines without run limits to look at between two blocks: no event due, no
+// interrupt pending and no break-in. Otherwise they go through between_blocks. Break-in is the
+// slowest to check and the least urgent, it is only looked at when *count wraps, every 256 calls.
+static inline u8 blocks_go_on(const cpu *cpu, u8 *count) {
+    return cpu->cycles < cpu->next_event && !cpu->pending
+        && (++*count != 0 || cpu->break_in == NULL || !atomic_load_explicit(cpu->break_in, memory_order_relaxed));
 }
 
-cpu *new_cpu(const char *fn) {
-    cpu *c = calloc(1, sizeof(cpu));
-    init_cpu(c, fn);
-    return c;
+static u8 between_blocks(cpu *cpu);
+
+// Runs a recorded loop until one of its branches leaves the recorded path, or until something
+// has to be looked at between two passes. Instructions in between are called back to back
+// without going through the decoder.
+void run_trace(cpu *cpu, trace *t) {
+    u8 passes = 0;
+    for (;;) {
+        for (u16 i = 0; i < t->len; ++i) {
+            trace_inst *inst = &t->insts[i];
+            cpu->pc = inst->pc;
+            inst->func(cpu);
+            cpu->pc++;
+            cpu->cycles += inst->cycles;
+            if (inst->guard) {
+                if (cpu->pc != (u16)(inst->pc + inst->len)) {
+                    cpu->cycles += inst->taken_cycles;
+                }
+                if (cpu->pc != inst->next) {
+                    return; // Side exit
+                }
+            }
+        }
+        if (t->len == 0 || !blocks_go_on(cpu, &passes)) {
+            return; // Invalidated while running, or back to exec_program_predecoded
+        }
+    }
+}
+
+// Called on taken backward branches, head being the branch target
+void hot_loop(cpu *cpu, u16 head) {
+    trace_cache *tc = cpu->traces;
+    trace *t = tc->entry[head];
+    if (t != NULL) {
+        run_trace(cpu, t);
+    } else if (++tc->hot[head] >= TRACE_HOT_THRESHOLD) {
+        tc->hot[head] = 0;
+        record_trace(cpu, head);
+    }
+}
+
+// Same as exec_program, but each address is only decoded the first time it is reached,
+// operand included, so that the handlers having a DECODED_ version do not fetch it again.
+// Entries are dropped by WRITE8 when the code they were decoded from is modified.
+// When trace recording is enabled, hot loops are handed to hot_loop. Events, interrupts and
+// break-in are looked at after taken branches, WAI and STOP.
+void exec_program_predecoded(cpu *cpu) {
+    decoded_inst *decoded = get_decoded(cpu);
+    u8 blocks = 0;
+    for (;;) {
+        u16 pc = cpu->pc;
+        decoded_inst *d = fetch_decoded(cpu, decoded, pc);
+        if (d->kind == DECODED_EXEC) {
+            // pc does not need to be read back from the handler
+            cpu->pc = d->next - 1;
+            d->exec(cpu, d->operand);
+            cpu->pc = d->next;
+            cpu->cycles += d->cycles;
+            continue;
+        }
+        if (d->kind == DECODED_SLOW) {
+            if (cpu->memory[pc] == 0x00) {
+                break;
+            }
+            d->func(cpu); // WAI or STOP
+            cpu->pc++;
+            cpu->cycles += d->cycles;
+            if (!between_blocks(cpu)) {
+                break;
+            }
+            continue;
+        }
+        d->func(cpu);
+        cpu->pc++;
+        cpu->cycles += d->cycles;
+        if (cpu->pc != d->next) {
+            cpu->cycles += d->taken_cycles;
+            if (cpu->pc <= pc && cpu->traces != NULL) { // Self-branches included
+                hot_loop(cpu, cpu->pc);
+            }
+            if (!blocks_go_on(cpu, &blocks) && !between_blocks(cpu)) {
+                break;
+            }
+        }
+    }
+}
+
+void exec_program_traces(cpu *cpu) {
+    if (cpu->traces == NULL) {
+        cpu->traces = calloc(1, sizeof(trace_cache));
+        if (cpu->traces == NULL) {
+            ERROR("%s", "calloc");
+        }
+    }
+    exec_program_predecoded(cpu);
+}
+
+/*****************************
+*         Interrupts         *
+*****************************/
+
+static const u16 irq_vectors[IRQ_SOURCE_COUNT] = {
+    [IRQ_XIRQ] = XIRQ_VECTOR,
+    [IRQ_IRQ] = IRQ_VECTOR,
+    [IRQ_RTI] = RTI_VECTOR,
+    [IRQ_TOF] = TOF_VECTOR,
+    [IRQ_SCI] = SCI_VECTOR,
+};
+
+static void sift_down_event(cpu *cpu, u8 i) {
+    event *e = cpu->events;
+    for (;;) {
+        u8 first = i;
+        u8 l = 2 * i + 1, r = 2 * i + 2;
+        if (l < cpu->event_count && e[l].at < e[first].at) {
+            first = l;
+        }
+        if (r < cpu->event_count && e[r].at < e[first].at) {
+            first = r;
+        }
+        if (first == i) {
+            break;
+        }
+        event tmp = e[i];
+        e[i] = e[first];
+        e[first] = tmp;
+        i = first;
+    }
+}
+
+// Queues source to be raised at cycle at, then every period cycles if period is not 0
+void schedule_event(cpu *cpu, u64 at, irq_source source, u64 period, u8 data) {
+    if (cpu->event_count == MAX_EVENTS) {
+        ERROR("More than %d events scheduled", MAX_EVENTS);
+    }
+    event *e = cpu->events;
+    u8 i = cpu->event_count++;
+    e[i] = (event) {at, period, source, data};
+    while (i > 0 && e[(i - 1) / 2].at > e[i].at) {
+        event tmp = e[i];
+        e[i] = e[(i - 1) / 2];
+        e[(i - 1) / 2] = tmp;
+        i = (i - 1) / 2;
+    }
+    cpu->next_event = e[0].at;
+}
+
+void raise_interrupt(cpu *cpu, irq_source source) {
+    cpu->pending |= 1 << source;
+}
+
+// What an event does to the peripheral it comes from before asking for its interrupt
+static void fire_event(cpu *cpu, const event *e) {
+    switch ((irq_source) e->source) {
+        case IRQ_XIRQ:
+        case IRQ_IRQ:
+            raise_interrupt(cpu, e->source);
+            break;
+        case IRQ_RTI:
+            WRITE8(cpu, TFLG2, cpu->memory[TFLG2] | 0x40);
+            if (cpu->memory[TMSK2] & 0x40) {
+                raise_interrupt(cpu, IRQ_RTI);
+            }
+            break;
+        case IRQ_TOF:
+            WRITE8(cpu, TFLG2, cpu->memory[TFLG2] | 0x80);
+            if (cpu->memory[TMSK2] & 0x80) {
+                raise_interrupt(cpu, IRQ_TOF);
+            }
+            break;
+        case IRQ_SCI:
+            WRITE8(cpu, SCDR, e->data);
+            WRITE8(cpu, SCSR, cpu->memory[SCSR] | 0x20);
+            if (cpu->memory[SCCR2] & 0x20) {
+                raise_interrupt(cpu, IRQ_SCI);
+            }
+            break;
+        case IRQ_SOURCE_COUNT:
+            break;
+    }
+}
+
+// Fires every event due by now, periodic ones are queued again
+static void run_due_events(cpu *cpu) {
+    while (cpu->event_count != 0 && cpu->events[0].at <= cpu->cycles) {
+        event e = cpu->events[0];
+        fire_event(cpu, &e);
+        if (e.period != 0) {
+            cpu->events[0].at += e.period;
+        } else {
+            cpu->events[0] = cpu->events[--cpu->event_count];
+        }
+        sift_down_event(cpu, 0);
+    }
+    cpu->next_event = cpu->event_count != 0 ? cpu->events[0].at : UINT64_MAX;
+}
+
+// Fires due events, then takes the highest priority interrupt that is not masked. Run loops
+// call it when next_event is reached or after an instruction from instr_slow, never in between.
+COLD_PATH static void check_interrupts(cpu *cpu) {
+    if (cpu->cycles >= cpu->next_event) {
+        run_due_events(cpu);
+    }
+    u8 masked = (cpu->x ? 1 << IRQ_XIRQ : 0) | (cpu->i ? ~(1 << IRQ_XIRQ) : 0);
+    if (cpu->sleep == SLEEP_STOP && (cpu->pending & masked & (1 << IRQ_XIRQ))) {
+        cpu->sleep = AWAKE; // A masked XIRQ only restarts the clocks
+    }
+    u8 ready = cpu->pending & ~masked;
+    if (cpu->sleep == SLEEP_STOP) {
+        ready &= STOP_WAKE_SOURCES; // The timer and SCI ones wait for the clocks
+    }
+    if (ready == 0) {
+        return;
+    }
+    u8 source = 0;
+    while (!(ready >> source & 1)) {
+        source++;
+    }
+    cpu->pending &= ~(1 << source);
+    if (cpu->sleep != SLEEP_WAI) { // WAI stacked the registers already
+        STACK_REGISTERS(cpu, cpu->pc);
+        cpu->cycles += INTERRUPT_CYCLES;
+    }
+    cpu->sleep = AWAKE;
+    cpu->i = 1;
+    if (source == IRQ_XIRQ) {
+        cpu->x = 1;
+    }
+    cpu->pc = join_addr16(cpu, irq_vectors[source]);
+    PROFILE_INTERRUPT(cpu, cpu->pc, cpu->sp + INTERRUPT_FRAME);
+}
+
+// Executes the instruction at pc and counts its cycles. Inline so run_cpu's loop stays tight.
+static ALWAYS_INLINE void exec_inst(cpu *cpu) {
+    u16 pc = cpu->pc;
+    u8 inst = cpu->memory[pc];
+    if (instr_func[inst] != NULL) {
+        (*instr_func[inst])(cpu); // Call the function with this opcode
+    }
+    cpu->pc++;
+    u8 cycles = instr_cycles[inst];
+    if (cpu->pc != (u16)(pc + instr_len[inst])) {
+        cycles += instr_taken_cycles[inst];
+    }
+    cpu->cycles += cycles;
+    PROFILE_COUNT(cpu, executions, pc, 1);
+    PROFILE_COUNT(cpu, cycles, pc, cycles);
+    PROFILE_STEP(cpu);
+}
+
+// Steps through pure instructions from pc looking for pc to come back with every register as
+// it was. Returns how many instructions ran, *loop tells whether they were an idle loop.
+static u64 idle_probe(cpu *cpu, u32 until, idle_loop *loop) {
+    SYNC_FLAGS(cpu);
+    const u16 pc = cpu->pc, sp = cpu->sp, ix = cpu->ix, iy = cpu->iy;
+    const u8 a = cpu->a, b = cpu->b, status = cpu->status;
+    const u64 cycles = cpu->cycles;
+    u64 n = 0;
+    *loop = (idle_loop) {0, 0};
+    while (n < IDLE_MAX_LOOP && instr_pure[cpu->memory[cpu->pc]] && (n == 0 || cpu->pc != until)) {
+        exec_inst(cpu);
+        n++;
+        if (cpu->pc == pc) {
+            SYNC_FLAGS(cpu);
+            if (cpu->a == a && cpu->b == b && cpu->sp == sp && cpu->ix == ix && cpu->iy == iy
+                    && cpu->status == status) {
+                *loop = (idle_loop) {n, cpu->cycles - cycles};
+            }
+            break;
+        }
+    }
+    return n;
+}
+
+// What is left before a limit, UINT64_MAX stays unlimited
+static inline u64 limit_left(u64 end, u64 now) {
+    return end == UINT64_MAX ? UINT64_MAX : end - now;
+}
+
+// Looks for an idle loop at pc and skips the whole iterations that fit before deadline, the next
+// event or cycle limit. Only an event can change what such a loop reads: without any and without
+// limits, *forever is set. Returns the instructions run or skipped.
+static u64 idle_skip(cpu *cpu, u32 until, u64 inst_left, u64 deadline, u64 *idle_cycles, u8 *forever) {
+    idle_loop loop;
+    u64 n = idle_probe(cpu, until, &loop);
+    *forever = 0;
+    if (loop.instructions == 0) {
+        return n;
+    }
+    if (inst_left == UINT64_MAX && deadline == UINT64_MAX) {
+        *forever = 1;
+        return n;
+    }
+    inst_left -= n;
+    u64 cycles_left = limit_left(deadline, cpu->cycles);
+    u64 k = inst_left / loop.instructions;
+    if (cycles_left / loop.cycles < k) {
+        k = cycles_left / loop.cycles;
+    }
+    cpu->cycles += k * loop.cycles;
+    *idle_cycles += k * loop.cycles;
+    // The skipped iterations are put on the loop's first instruction
+    PROFILE_COUNT(cpu, executions, cpu->pc, k);
+    PROFILE_COUNT(cpu, cycles, cpu->pc, k * loop.cycles);
+    PROFILE_ADD(cpu, instructions, k * loop.instructions);
+    return n + k * loop.instructions;
+}
+
+// Worth looking for an idle loop, the probe can not overrun a limit from there. Not while
+// recording or replaying inputs: every port read counts there, skipped ones included. Nor while
+// tracing, each iteration gets its record.
+#define IDLE_PROBE_FITS(cpu, inst_left, cycles_left) \
+    ((cpu)->inputs == NULL && (cpu)->trace == NULL && (inst_left) > IDLE_MAX_LOOP \
+        && (cycles_left) > (u64) IDLE_MAX_LOOP * instr_max_cycles)
+
+// The clocks do not run while stopped: puts the timer and SCI events off by the delta cycles
+// slept, so that they neither fire nor fall behind. Returns when the first IRQ or XIRQ event is due.
+static u64 stop_clocks(cpu *cpu, u64 delta) {
+    u64 wake = UINT64_MAX;
+    for (u8 i = 0; i < cpu->event_count; i++) {
+        event *e = &cpu->events[i];
+        if (STOP_WAKE_SOURCES >> e->source & 1) {
+            wake = e->at < wake ? e->at : wake;
+        } else {
+            e->at += delta;
+        }
+    }
+    if (delta != 0) {
+        for (u8 i = cpu->event_count / 2; i-- > 0;) {
+            sift_down_event(cpu, i);
+        }
+        cpu->next_event = cpu->event_count != 0 ? cpu->events[0].at : UINT64_MAX;
+    }
+    return wake;
+}
+
+// Lets the time a sleeping cpu waits go by at once, up to the next event or the cycle limit.
+// Stopped, only IRQ and XIRQ events count. Returns 1 when an event is due, which may wake the
+// cpu up, otherwise *reason says why the run stops.
+static u8 sleep_until(cpu *cpu, u64 cycle_end, u64 *idle_cycles, stop_reason *reason) {
+    u64 wake = cpu->sleep == SLEEP_STOP ? stop_clocks(cpu, 0) : cpu->next_event;
+    u64 to = wake < cycle_end ? wake : cycle_end;
+    if (to == UINT64_MAX) {
+        *reason = STOP_SLEEP;
+        return 0;
+    }
+    if (cpu->cycles < to) {
+        if (cpu->sleep == SLEEP_STOP) {
+            stop_clocks(cpu, to - cpu->cycles);
+        }
+        *idle_cycles += to - cpu->cycles;
+        cpu->cycles = to;
+    }
+    *reason = STOP_CYCLES;
+    return wake < cycle_end;
+}
+
+// For the engines without run limits, when blocks_go_on fails or after WAI and STOP: takes
+// the interrupts due and lets a sleeping cpu wait for its next event. Returns 0 when the run
+// ends, on break-in or asleep with nothing left to wake the cpu up.
+static u8 between_blocks(cpu *cpu) {
+    u64 idle_cycles = 0;
+    stop_reason reason;
+    for (;;) {
+        if (cpu->cycles >= cpu->next_event || cpu->pending) {
+            check_interrupts(cpu);
+        }
+        if (break_requested(cpu)) {
+            return 0;
+        }
+        if (cpu->sleep == AWAKE) {
+            return 1;
+        }
+        if (!sleep_until(cpu, UINT64_MAX, &idle_cycles, &reason)) {
+            return 0;
+        }
+    }
+}
+
+#ifdef EMULATOR_THREADED
+// Direct-threaded interpreter: every handler ends with its own indirect jump to the next one
+// instead of returning to a central loop. pc, a, b and sp live in locals and are only written back
+// to the cpu when falling back to instr_func, for the opcodes without a handler here and for port
+// reads. Flags, ix and iy stay in the cpu and go through the same helpers as the handlers.
+// Labels as values are a GNU extension, hence the build switch.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+run_result run_threaded(cpu *cpu, const run_limits *limits) {
+    void *dispatch[0x100];
+    for (u16 i = 0; i < 0x100; ++i) {
+        dispatch[i] = &&op_generic;
+    }
+    dispatch[0x00] = &&op_end;
+    dispatch[0x01] = &&op_nop;
+    dispatch[0x86] = &&op_ldaa_imm;
+    dispatch[0xC6] = &&op_ldab_imm;
+    dispatch[0x96] = &&op_ldaa_dir;
+    dispatch[0xD6] = &&op_ldab_dir;
+    dispatch[0x97] = &&op_staa_dir;
+    dispatch[0x4A] = &&op_deca;
+    dispatch[0x5A] = &&op_decb;
+    dispatch[0x4C] = &&op_inca;
+    dispatch[0x5C] = &&op_incb;
+    dispatch[0x16] = &&op_tab;
+    dispatch[0x17] = &&op_tba;
+    dispatch[0x8B] = &&op_adda_imm;
+    dispatch[0xCB] = &&op_addb_imm;
+    dispatch[0x84] = &&op_anda_imm;
+    dispatch[0x81] = &&op_cmpa_imm;
+    dispatch[0xC1] = &&op_cmpb_imm;
+    dispatch[0x36] = &&op_psha;
+    dispatch[0x37] = &&op_pshb;
+    dispatch[0x32] = &&op_pula;
+    dispatch[0x33] = &&op_pulb;
+    dispatch[0x31] = &&op_ins;
+    dispatch[0x34] = &&op_des;
+    dispatch[0x20] = &&op_bra;
+    dispatch[0x21] = &&op_brn;
+    dispatch[0x22] = &&op_bhi;
+    dispatch[0x23] = &&op_bls;
+    dispatch[0x24] = &&op_bcc;
+    dispatch[0x25] = &&op_bcs;
+    dispatch[0x26] = &&op_bne;
+    dispatch[0x28] = &&op_bvc;
+    dispatch[0x29] = &&op_bvs;
+    dispatch[0x2A] = &&op_bpl;
+    dispatch[0x2B] = &&op_bmi;
+    dispatch[0x2C] = &&op_bge;
+    dispatch[0x2E] = &&op_bgt;
+    dispatch[0x27] = &&op_beq;
+    dispatch[0x2D] = &&op_blt;
+    dispatch[0x2F] = &&op_ble;
+    dispatch[0x80] = &&op_suba_imm;
+    dispatch[0xC0] = &&op_subb_imm;
+    dispatch[0xC4] = &&op_andb_imm;
+    dispatch[0x8A] = &&op_oraa_imm;
+    dispatch[0x88] = &&op_eora_imm;
+    dispatch[0x9B] = &&op_adda_dir;
+    dispatch[0xD7] = &&op_stab_dir;
+    dispatch[0xB6] = &&op_ldaa_ext;
+    dispatch[0xF6] = &&op_ldab_ext;
+    dispatch[0xB7] = &&op_staa_ext;
+    dispatch[0xF7] = &&op_stab_ext;
+    dispatch[0xA6] = &&op_ldaa_idx;
+    dispatch[0xE6] = &&op_ldab_idx;
+    dispatch[0xA7] = &&op_staa_idx;
+    dispatch[0xE7] = &&op_stab_idx;
+    dispatch[0x4F] = &&op_clra;
+    dispatch[0x5F] = &&op_clrb;
+    dispatch[0x4D] = &&op_tsta;
+    dispatch[0x5D] = &&op_tstb;
+    dispatch[0xCC] = &&op_ldd_imm;
+    dispatch[0xDC] = &&op_ldd_dir;
+    dispatch[0xDD] = &&op_std_dir;
+    dispatch[0xC3] = &&op_addd_imm;
+    dispatch[0x83] = &&op_subd_imm;
+    dispatch[0xCE] = &&op_ldx_imm;
+    dispatch[0xDE] = &&op_ldx_dir;
+    dispatch[0xDF] = &&op_stx_dir;
+    dispatch[0x08] = &&op_inx;
+    dispatch[0x09] = &&op_dex;
+    dispatch[0x8C] = &&op_cpx_imm;
+    dispatch[0x3A] = &&op_abx;
+    dispatch[0x7E] = &&op_jmp_ext;
+    dispatch[0x8D] = &&op_bsr;
+    dispatch[0xBD] = &&op_jsr_ext;
+    dispatch[0x39] = &&op_rts;
+    for (u16 i = 1; i < 0x100; ++i) {
+        if (instr_slow[i]) {
+            dispatch[i] = &&op_slow;
+        }
+    }
+    // The Y page, what is not inlined runs both bytes through INST_PREFIX
+    void *page18[0x100];
+    for (u16 i = 0; i < 0x100; ++i) {
+        page18[i] = &&op_generic;
+    }
+    page18[0xCE] = &&op_ldy_imm;
+    page18[0x08] = &&op_iny;
+    page18[0x09] = &&op_dey;
+    page18[0x8C] = &&op_cpy_imm;
+    page18[0x3A] = &&op_aby;
+    page18[0xA6] = &&op_ldaa_idy;
+    page18[0xA7] = &&op_staa_idy;
+    dispatch[0x18] = &&op_page18;
+    const u16 page18_index = instr_page[0x18];
+
+    u8 *mem = cpu->memory;
+    u16 pc = cpu->pc;
+    u8 a = cpu->a;
+    u8 b = cpu->b;
+    u16 sp = cpu->sp;
+    u64 cycles = cpu->cycles;
+
+    // Both budgets are turned into a number of instructions that surely fits in them, so
+    // dispatch only counts it down. It is worked out again from the exact counts once spent.
+    const u64 start = cycles;
+    const u32 until = limits->until;
+    const u64 cycle_end = limits->max_cycles != 0 ? start + limits->max_cycles : UINT64_MAX;
+    const u64 inst_end = limits->max_instructions != 0 ? limits->max_instructions : UINT64_MAX;
+    u64 fuel = 0;
+    u64 granted = 0; // Instructions executed once fuel runs out
+    u64 idle_cycles = 0;
+    u8 probed = 0;
+
+    // Only the opcode found at until goes through op_until, which compares pc. Stores that
+    // change this byte move the check to the new opcode.
+    void *handlers[0x100];
+    memcpy(handlers, dispatch, sizeof(handlers));
+    const u16 until_addr = until;
+    u8 until_op = mem[until_addr];
+    if (until != NO_STOP_PC) {
+        dispatch[until_op] = &&op_until;
+    }
+
+#define OPERAND8 (mem[(u16)(pc + 1)])
+#define OPERAND16 join(mem[(u16)(pc + 1)], mem[(u16)(pc + 2)])
+#define WATCH_UNTIL() if (mem[until_addr] != until_op) goto op_move_until
+// A port read needs the cpu up to date: such an instruction is left to op_generic, which runs
+// it from the start. Every other page is read with a single load, as READ8 does.
+#define LOAD8(addr) ({ \
+    u16 at_ = (addr); \
+    if (cpu->regions[at_ >> 8] == REGION_IO) goto op_generic; \
+    mem[at_]; \
+})
+// Paged instructions are only counted once known not to go through op_generic
+#define PAGED_CYCLES(op) cycles += instr_cycles[page18_index | (op)]
+#define DISPATCH() \
+    if (fuel == 0) goto op_limit; \
+    fuel--; \
+    cycles += instr_cycles[mem[pc]]; \
+    goto *dispatch[mem[pc]]
+#define BRANCH_IF(cond) \
+    if (cond) { \
+        cycles += instr_taken_cycles[mem[pc]]; \
+        pc += 2 + (i8) OPERAND8; \
+    } else { \
+        pc += 2; \
+    } \
+    DISPATCH()
+
+    DISPATCH();
+
+op_generic: {
+    u8 inst = mem[pc];
+    cpu->pc = pc; cpu->a = a; cpu->b = b; cpu->sp = sp; cpu->cycles = cycles;
+    if (instr_func[inst] != NULL) {
+        (*instr_func[inst])(cpu);
+    }
+    if (cpu->pc + 1 != pc + instr_len[inst]) {
+        cpu->cycles += instr_taken_cycles[inst];
+    }
+    pc = cpu->pc + 1; a = cpu->a; b = cpu->b; sp = cpu->sp; cycles = cpu->cycles;
+    WATCH_UNTIL();
+    DISPATCH();
+}
+op_slow: // Interrupts are looked at right after these, in op_limit
+    cpu->pc = pc; cpu->a = a; cpu->b = b; cpu->sp = sp; cpu->cycles = cycles;
+    (*instr_func[mem[pc]])(cpu);
+    pc = cpu->pc + 1; a = cpu->a; b = cpu->b; sp = cpu->sp;
+    if (until != NO_STOP_PC && mem[until_addr] != until_op) {
+        dispatch[until_op] = handlers[until_op];
+        dispatch[mem[until_addr]] = &&op_until;
+        until_op = mem[until_addr];
+    }
+    goto op_limit;
+op_until:
+    if (pc == until) {
+        fuel++;
+        cycles -= instr_cycles[mem[pc]];
+        goto op_limit;
+    }
+    goto *handlers[mem[pc]];
+op_move_until:
+    if (until != NO_STOP_PC) {
+        dispatch[until_op] = handlers[until_op];
+        dispatch[mem[until_addr]] = &&op_until;
+    }
+    until_op = mem[until_addr];
+    DISPATCH();
+op_nop:
+    pc += 1;
+    DISPATCH();
+op_ldaa_imm:
+    a = OPERAND8;
+    SET_LD_FLAGS(cpu, a);
+    pc += 2;
+    DISPATCH();
+op_ldab_imm:
+    b = OPERAND8;
+    SET_LD_FLAGS(cpu, b);
+    pc += 2;
+    DISPATCH();
+op_ldaa_dir:
+    a = LOAD8(OPERAND8);
+    SET_LD_FLAGS(cpu, a);
+    pc += 2;
+    DISPATCH();
+op_ldab_dir:
+    b = LOAD8(OPERAND8);
+    SET_LD_FLAGS(cpu, b);
+    pc += 2;
+    DISPATCH();
+op_staa_dir:
+    STORE8(cpu, OPERAND8, a);
+    SET_LD_FLAGS(cpu, a);
+    pc += 2;
+    WATCH_UNTIL();
+    DISPATCH();
+op_deca:
+    a--;
+    SET_DEC_FLAGS(cpu, a);
+    pc += 1;
+    DISPATCH();
+op_decb:
+    b--;
+    SET_DEC_FLAGS(cpu, b);
+    pc += 1;
+    DISPATCH();
+op_inca:
+    a++;
+    SET_INC_FLAGS(cpu, a);
+    pc += 1;
+    DISPATCH();
+op_incb:
+    b++;
+    SET_INC_FLAGS(cpu, b);
+    pc += 1;
+    DISPATCH();
+op_tab:
+    b = a;
+    SET_LD_FLAGS(cpu, b);
+    pc += 1;
+    DISPATCH();
+op_tba:
+    a = b;
+    SET_LD_FLAGS(cpu, a);
+    pc += 1;
+    DISPATCH();
+op_adda_imm: {
+    u16 result = a + OPERAND8;
+    SET_ADD_FLAGS(cpu, a, OPERAND8, result);
+    a = result & 0xFF;
+    pc += 2;
+    DISPATCH();
+}
+op_addb_imm: {
+    u16 result = b + OPERAND8;
+    SET_ADD_FLAGS(cpu, b, OPERAND8, result);
+    b = result & 0xFF;
+    pc += 2;
+    DISPATCH();
+}
+op_anda_imm:
+    a &= OPERAND8;
+    SET_LD_FLAGS(cpu, a);
+    pc += 2;
+    DISPATCH();
+op_cmpa_imm:
+    SET_CMP_FLAGS(cpu, a, OPERAND8);
+    pc += 2;
+    DISPATCH();
+op_cmpb_imm:
+    SET_CMP_FLAGS(cpu, b, OPERAND8);
+    pc += 2;
+    DISPATCH();
+op_psha:
+    WRITE8(cpu, sp--, a);
+    pc += 1;
+    WATCH_UNTIL();
+    DISPATCH();
+op_pshb:
+    WRITE8(cpu, sp--, b);
+    pc += 1;
+    WATCH_UNTIL();
+    DISPATCH();
+op_pula:
+    a = mem[++sp];
+    pc += 1;
+    DISPATCH();
+op_pulb:
+    b = mem[++sp];
+    pc += 1;
+    DISPATCH();
+op_ins:
+    sp++;
+    pc += 1;
+    DISPATCH();
+op_des:
+    sp--;
+    pc += 1;
+    DISPATCH();
+op_bra: BRANCH_IF(1);
+op_brn: BRANCH_IF(0);
+op_bhi: BRANCH_IF((FLAG_C(cpu) | FLAG_Z(cpu)) == 0);
+op_bls: BRANCH_IF((FLAG_C(cpu) | FLAG_Z(cpu)) != 0);
+op_bcc: BRANCH_IF(FLAG_C(cpu) == 0);
+op_bcs: BRANCH_IF(FLAG_C(cpu) == 1);
+op_bne: BRANCH_IF(FLAG_Z(cpu) == 0);
+op_bvc: BRANCH_IF(FLAG_V(cpu) == 0);
+op_bvs: BRANCH_IF(FLAG_V(cpu) == 1);
+op_bpl: BRANCH_IF(FLAG_N(cpu) == 0);
+op_bmi: BRANCH_IF(FLAG_N(cpu) == 1);
+op_bge: BRANCH_IF((FLAG_N(cpu) ^ FLAG_V(cpu)) == 0);
+op_bgt: BRANCH_IF((FLAG_Z(cpu) | (FLAG_N(cpu) ^ FLAG_V(cpu))) == 0);
+op_beq: BRANCH_IF(FLAG_Z(cpu) == 1);
+op_blt: BRANCH_IF((FLAG_N(cpu) ^ FLAG_V(cpu)) == 1);
+op_ble: BRANCH_IF((FLAG_Z(cpu) | (FLAG_N(cpu) ^ FLAG_V(cpu))) == 1);
+op_suba_imm: {
+    u16 result = a - OPERAND8;
+    SET_SUB_FLAGS(cpu, a, OPERAND8, result);
+    a = result & 0xFF;
+    pc += 2;
+    DISPATCH();
+}
+op_subb_imm: {
+    u16 result = b - OPERAND8;
+    SET_SUB_FLAGS(cpu, b, OPERAND8, result);
+    b = result & 0xFF;
+    pc += 2;
+    DISPATCH();
+}
+op_andb_imm:
+    b &= OPERAND8;
+    SET_LD_FLAGS(cpu, b);
+    pc += 2;
+    DISPATCH();
+op_oraa_imm:
+    a |= OPERAND8;
+    SET_LD_FLAGS(cpu, a);
+    pc += 2;
+    DISPATCH();
+op_eora_imm:
+    a ^= OPERAND8;
+    SET_LD_FLAGS(cpu, a);
+    pc += 2;
+    DISPATCH();
+op_adda_dir: {
+    u8 v = LOAD8(OPERAND8);
+    u16 result = a + v;
+    SET_ADD_FLAGS(cpu, a, v, result);
+    a = result & 0xFF;
+    pc += 2;
+    DISPATCH();
+}
+op_stab_dir:
+    STORE8(cpu, OPERAND8, b);
+    SET_LD_FLAGS(cpu, b);
+    pc += 2;
+    WATCH_UNTIL();
+    DISPATCH();
+op_ldaa_ext:
+    a = LOAD8(OPERAND16);
+    SET_LD_FLAGS(cpu, a);
+    pc += 3;
+    DISPATCH();
+op_ldab_ext:
+    b = LOAD8(OPERAND16);
+    SET_LD_FLAGS(cpu, b);
+    pc += 3;
+    DISPATCH();
+op_staa_ext:
+    STORE8(cpu, OPERAND16, a);
+    SET_LD_FLAGS(cpu, a);
+    pc += 3;
+    WATCH_UNTIL();
+    DISPATCH();
+op_stab_ext:
+    STORE8(cpu, OPERAND16, b);
+    SET_LD_FLAGS(cpu, b);
+    pc += 3;
+    WATCH_UNTIL();
+    DISPATCH();
+op_ldaa_idx:
+    a = LOAD8(cpu->ix + OPERAND8);
+    SET_LD_FLAGS(cpu, a);
+    pc += 2;
+    DISPATCH();
+op_ldab_idx:
+    b = LOAD8(cpu->ix + OPERAND8);
+    SET_LD_FLAGS(cpu, b);
+    pc += 2;
+    DISPATCH();
+op_staa_idx:
+    STORE8(cpu, cpu->ix + OPERAND8, a);
+    SET_LD_FLAGS(cpu, a);
+    pc += 2;
+    WATCH_UNTIL();
+    DISPATCH();
+op_stab_idx:
+    STORE8(cpu, cpu->ix + OPERAND8, b);
+    SET_LD_FLAGS(cpu, b);
+    pc += 2;
+    WATCH_UNTIL();
+    DISPATCH();
+op_clra:
+    a = 0;
+    SET_TST_FLAGS(cpu, 0, 0);
+    pc += 1;
+    DISPATCH();
+op_clrb:
+    b = 0;
+    SET_TST_FLAGS(cpu, 0, 0);
+    pc += 1;
+    DISPATCH();
+op_tsta:
+    SET_TST_FLAGS(cpu, a, 0);
+    pc += 1;
+    DISPATCH();
+op_tstb:
+    SET_TST_FLAGS(cpu, b, 0);
+    pc += 1;
+    DISPATCH();
+op_ldd_imm:
+    a = mem[(u16)(pc + 1)];
+    b = mem[(u16)(pc + 2)];
+    SET_LD16_FLAGS(cpu, join(a, b));
+    pc += 3;
+    DISPATCH();
+op_ldd_dir: {
+    u16 v = join(LOAD8(OPERAND8), LOAD8(OPERAND8 + 1));
+    a = v >> 8;
+    b = v & 0xFF;
+    SET_LD16_FLAGS(cpu, v);
+    pc += 2;
+    DISPATCH();
+}
+op_std_dir:
+    STORE16(cpu, OPERAND8, join(a, b));
+    SET_LD16_FLAGS(cpu, join(a, b));
+    pc += 2;
+    WATCH_UNTIL();
+    DISPATCH();
+op_addd_imm: {
+    u16 d = join(a, b);
+    u16 v = OPERAND16;
+    u32 result = d + v;
+    SET_ADD16_FLAGS(cpu, d, v, result);
+    a = result >> 8;
+    b = result & 0xFF;
+    pc += 3;
+    DISPATCH();
+}
+op_subd_imm: {
+    u16 d = join(a, b);
+    u16 v = OPERAND16;
+    u32 result = d - v;
+    SET_SUB16_FLAGS(cpu, d, v, result);
+    a = result >> 8;
+    b = result & 0xFF;
+    pc += 3;
+    DISPATCH();
+}
+op_ldx_imm:
+    OP_LDX(cpu, OPERAND16);
+    pc += 3;
+    DISPATCH();
+op_ldx_dir:
+    OP_LDX(cpu, join(LOAD8(OPERAND8), LOAD8(OPERAND8 + 1)));
+    pc += 2;
+    DISPATCH();
+op_stx_dir:
+    STORE16(cpu, OPERAND8, OP_STX(cpu));
+    pc += 2;
+    WATCH_UNTIL();
+    DISPATCH();
+op_inx:
+    INST_INX_INH(cpu);
+    pc += 1;
+    DISPATCH();
+op_dex:
+    INST_DEX_INH(cpu);
+    pc += 1;
+    DISPATCH();
+op_cpx_imm:
+    OP_CPX(cpu, OPERAND16);
+    pc += 3;
+    DISPATCH();
+op_abx:
+    cpu->ix += b;
+    pc += 1;
+    DISPATCH();
+op_jmp_ext:
+    pc = OPERAND16;
+    DISPATCH();
+op_bsr: {
+    u16 ret = pc + 2;
+    WRITE8(cpu, sp--, ret & 0xFF);
+    WRITE8(cpu, sp--, ret >> 8);
+    pc = ret + (i8) OPERAND8;
+    WATCH_UNTIL();
+    DISPATCH();
+}
+op_jsr_ext: {
+    u16 ret = pc + 3;
+    u16 to = OPERAND16;
+    WRITE8(cpu, sp--, ret & 0xFF);
+    WRITE8(cpu, sp--, ret >> 8);
+    pc = to;
+    WATCH_UNTIL();
+    DISPATCH();
+}
+op_rts:
+    pc = join(mem[(u16)(sp + 1)], mem[(u16)(sp + 2)]);
+    sp += 2;
+    DISPATCH();
+op_page18:
+    goto *page18[OPERAND8];
+op_ldy_imm:
+    PAGED_CYCLES(0xCE);
+    OP_LDY(cpu, join(mem[(u16)(pc + 2)], mem[(u16)(pc + 3)]));
+    pc += 4;
+    DISPATCH();
+op_iny:
+    PAGED_CYCLES(0x08);
+    INST_INY_INH(cpu);
+    pc += 2;
+    DISPATCH();
+op_dey:
+    PAGED_CYCLES(0x09);
+    INST_DEY_INH(cpu);
+    pc += 2;
+    DISPATCH();
+op_cpy_imm:
+    PAGED_CYCLES(0x8C);
+    OP_CPY(cpu, join(mem[(u16)(pc + 2)], mem[(u16)(pc + 3)]));
+    pc += 4;
+    DISPATCH();
+op_aby:
+    PAGED_CYCLES(0x3A);
+    cpu->iy += b;
+    pc += 2;
+    DISPATCH();
+op_ldaa_idy:
+    a = LOAD8(cpu->iy + mem[(u16)(pc + 2)]);
+    PAGED_CYCLES(0xA6);
+    SET_LD_FLAGS(cpu, a);
+    pc += 3;
+    DISPATCH();
+op_staa_idy:
+    PAGED_CYCLES(0xA7);
+    STORE8(cpu, cpu->iy + mem[(u16)(pc + 2)], a);
+    SET_LD_FLAGS(cpu, a);
+    pc += 3;
+    WATCH_UNTIL();
+    DISPATCH();
+
+op_end:
+    fuel++; // Opcode 0x00 went through DISPATCH but is not executed
+    cycles -= instr_cycles[0x00];
+op_limit: {
+    u64 executed = granted - fuel;
+    stop_reason reason = STOP_HALT;
+    if (cycles >= cpu->next_event || cpu->pending) {
+        cpu->pc = pc; cpu->a = a; cpu->b = b; cpu->sp = sp; cpu->cycles = cycles;
+        check_interrupts(cpu);
+        pc = cpu->pc; sp = cpu->sp; cycles = cpu->cycles;
+    }
+    const u64 deadline = cpu->next_event < cycle_end ? cpu->next_event : cycle_end;
+    if (cpu->sleep != AWAKE) {
+        cpu->cycles = cycles;
+        u8 woken = sleep_until(cpu, cycle_end, &idle_cycles, &reason);
+        cycles = cpu->cycles;
+        if (woken) {
+            goto op_limit;
+        }
+    } else if (mem[pc] != 0x00) {
+        if (pc == until) {
+            reason = STOP_PC;
+        } else if (executed >= inst_end) {
+            reason = STOP_INSTRUCTIONS;
+        } else if (cycles >= cycle_end) {
+            reason = STOP_CYCLES;
+        } else if (break_requested(cpu)) {
+            reason = STOP_BREAK_IN;
+        } else if (!probed && IDLE_PROBE_FITS(cpu, inst_end - executed, deadline - cycles)) {
+            cpu->pc = pc; cpu->a = a; cpu->b = b; cpu->sp = sp; cpu->cycles = cycles;
+            u8 forever;
+            u64 n = idle_skip(cpu, until, limit_left(inst_end, executed),
+                    deadline, &idle_cycles, &forever);
+            granted += n;
+            pc = cpu->pc; a = cpu->a; b = cpu->b; sp = cpu->sp; cycles = cpu->cycles;
+            if (forever) {
+                executed += n;
+                reason = STOP_IDLE;
+            } else {
+                probed = 1;
+                goto op_limit;
+            }
+        } else {
+            probed = 0;
+            fuel = (deadline - cycles) / instr_max_cycles;
+            if (fuel > inst_end - executed) {
+                fuel = inst_end - executed;
+            }
+            if (fuel > IDLE_CHECK_INTERVAL) {
+                fuel = IDLE_CHECK_INTERVAL;
+            }
+            if (fuel == 0) {
+                fuel = 1; // Close to the cycle budget or an event, go one instruction at a time
+            }
+            granted = executed + fuel;
+            fuel--;
+            cycles += instr_cycles[mem[pc]];
+            goto *dispatch[mem[pc]];
+        }
+    }
+    cpu->pc = pc; cpu->a = a; cpu->b = b; cpu->sp = sp; cpu->cycles = cycles;
+    return (run_result) {reason, executed, cycles - start, idle_cycles};
+}
+
+#undef BRANCH_IF
+#undef DISPATCH
+#undef PAGED_CYCLES
+#undef LOAD8
+#undef WATCH_UNTIL
+#undef OPERAND16
+#undef OPERAND8
+}
+#pragma GCC diagnostic pop
+#endif // EMULATOR_THREADED
+
+/*****************************
+*          Undo log          *
+*****************************/
+
+// With an undo log, run_cpu goes one step at a time and appends what the step changed to a
+// ring, so the cpu can be walked back one step or up to an address. A record is:
+//   header      UNDO_* bits
+//   extra       UNDO_X_* bits and the number of bytes written, only with UNDO_EXTRA
+//   pc          old pc - new pc on one byte, the old pc on two with UNDO_PC_LONG
+//   registers   old value of each one flagged in header
+//   cycles      cycles the step took, 7 bits per byte
+//   ports and scheduler state when flagged in extra
+//   written     count on a byte when it does not fit in extra, then address and old value of each
+//   length      of the whole record, 0 after a two byte length when it does not fit
+// A step that only moves pc and counts cycles takes 4 bytes.
+#define UNDO_PC_LONG 0x01
+#define UNDO_A 0x02
+#define UNDO_B 0x04
+#define UNDO_IX 0x08
+#define UNDO_IY 0x10
+#define UNDO_SP 0x20
+#define UNDO_CCR 0x40
+#define UNDO_EXTRA 0x80
+
+#define UNDO_X_PORTS 0x01
+#define UNDO_X_EVENTS 0x02
+#define UNDO_X_WRITES_SHIFT 2 // Bytes written in the upper bits, UNDO_X_WRITES_BYTE when more
+#define UNDO_X_WRITES_BYTE 0x3F
+
+#define UNDO_MIN_SIZE 0x1000
+#define UNDO_MAX_RECORD (32 + MAX_PORTS + 11 + MAX_EVENTS * sizeof(event) + 1 + UNDO_MAX_WRITES * 3)
+
+// Keeps the last `size` bytes of records, rounded up to a power of two
+void enable_undo(cpu *cpu, u32 size) {
+    disable_undo(cpu);
+    u64 ring = UNDO_MIN_SIZE;
+    while (ring < size) {
+        ring <<= 1;
+    }
+    cpu->undo = calloc(1, sizeof(undo_log));
+    if (cpu->undo == NULL || (cpu->undo->ring = malloc(ring)) == NULL) {
+        ERROR("%s", "malloc");
+    }
+    cpu->undo->mask = ring - 1;
+}
+
+void disable_undo(cpu *cpu) {
+    if (cpu->undo != NULL) {
+        free(cpu->undo->ring);
+        free(cpu->undo);
+        cpu->undo = NULL;
+    }
+}
+
+// Called by WRITE8 before the byte changes. Only the first value of a byte is needed.
+void undo_note(cpu *cpu, u16 addr) {
+    undo_log *log = cpu->undo;
+    for (u8 i = 0; i < log->write_count; ++i) {
+        if (log->write_addr[i] == addr) {
+            return;
+        }
+    }
+    if (log->write_count < UNDO_MAX_WRITES) {
+        log->write_addr[log->write_count] = addr;
+        log->write_old[log->write_count++] = cpu->memory[addr];
+    }
+}
+
+static void undo_begin(cpu *cpu) {
+    undo_log *log = cpu->undo;
+    if (log == NULL) {
+        return;
+    }
+    SYNC_FLAGS(cpu);
+    log->pc = cpu->pc;
+    log->sp = cpu->sp;
+    log->ix = cpu->ix;
+    log->iy = cpu->iy;
+    log->a = cpu->a;
+    log->b = cpu->b;
+    log->status = cpu->status;
+    log->cycles = cpu->cycles;
+    memcpy(log->ports, cpu->ports, MAX_PORTS);
+    log->next_event = cpu->next_event;
+    log->pending = cpu->pending;
+    log->sleep = cpu->sleep;
+    log->event_count = cpu->event_count;
+    memcpy(log->events, cpu->events, cpu->event_count * sizeof(event));
+    log->write_count = 0;
+}
+
+static inline u8 *undo_put16(u8 *p, u16 v) {
+    *p++ = v >> 8;
+    *p++ = v & 0xFF;
+    return p;
+}
+
+static inline u16 undo_get16(const u8 **p) {
+    u16 v = join((*p)[0], (*p)[1]);
+    *p += 2;
+    return v;
+}
+
+// Appends what changed since undo_begin, nothing when the step did not do anything
+static void undo_end(cpu *cpu) {
+    undo_log *log = cpu->undo;
+    if (log == NULL) {
+        return;
+    }
+    SYNC_FLAGS(cpu);
+    u8 writes = log->write_count < UNDO_X_WRITES_BYTE ? log->write_count : UNDO_X_WRITES_BYTE;
+    u8 extra = writes << UNDO_X_WRITES_SHIFT;
+    extra |= memcmp(log->ports, cpu->ports, MAX_PORTS) != 0 ? UNDO_X_PORTS : 0;
+    // Events only change when one fires, which moves next_event
+    if (log->next_event != cpu->next_event || log->pending != cpu->pending
+            || log->sleep != cpu->sleep || log->event_count != cpu->event_count) {
+        extra |= UNDO_X_EVENTS;
+    }
+    u16 back = log->pc - cpu->pc;
+    u8 header = (extra != 0 ? UNDO_EXTRA : 0)
+        | ((u16)(back + 0x80) > 0xFF ? UNDO_PC_LONG : 0)
+        | (log->a != cpu->a ? UNDO_A : 0)
+        | (log->b != cpu->b ? UNDO_B : 0)
+        | (log->ix != cpu->ix ? UNDO_IX : 0)
+        | (log->iy != cpu->iy ? UNDO_IY : 0)
+        | (log->sp != cpu->sp ? UNDO_SP : 0)
+        | (log->status != cpu->status ? UNDO_CCR : 0);
+    u64 cycles = cpu->cycles - log->cycles;
+    if (back == 0 && (header & ~UNDO_PC_LONG) == 0 && cycles == 0) {
+        return;
+    }
+
+    u8 rec[UNDO_MAX_RECORD];
+    u8 *p = rec;
+    *p++ = header;
+    if (header & UNDO_EXTRA) {
+        *p++ = extra;
+    }
+    if (header & UNDO_PC_LONG) {
+        p = undo_put16(p, log->pc);
+    } else {
+        *p++ = back;
+    }
+    if (header & UNDO_A) *p++ = log->a;
+    if (header & UNDO_B) *p++ = log->b;
+    if (header & UNDO_IX) p = undo_put16(p, log->ix);
+    if (header & UNDO_IY) p = undo_put16(p, log->iy);
+    if (header & UNDO_SP) p = undo_put16(p, log->sp);
+    if (header & UNDO_CCR) *p++ = log->status;
+    do {
+        *p++ = (cycles & 0x7F) | (cycles > 0x7F ? 0x80 : 0);
+        cycles >>= 7;
+    } while (cycles != 0);
+    if (extra & UNDO_X_PORTS) {
+        memcpy(p, log->ports, MAX_PORTS);
+        p += MAX_PORTS;
+    }
+    if (extra & UNDO_X_EVENTS) {
+        *p++ = log->event_count;
+        memcpy(p, &log->next_event, sizeof(u64));
+        p += sizeof(u64);
+        *p++ = log->pending;
+        *p++ = log->sleep;
+        memcpy(p, log->events, log->event_count * sizeof(event));
+        p += log->event_count * sizeof(event);
+    }
+    if (writes == UNDO_X_WRITES_BYTE) {
+        *p++ = log->write_count;
+    }
+    for (u8 i = 0; i < log->write_count; ++i) {
+        p = undo_put16(p, log->write_addr[i]);
+        *p++ = log->write_old[i];
+    }
+    u32 len = p - rec + 1;
+    if (len <= 0xFF) {
+        *p++ = len;
+    } else {
+        len += 2;
+        p = undo_put16(p, len);
+        *p++ = 0;
+    }
+
+    for (u32 i = 0; i < len; ++i) {
+        log->ring[(log->head + i) & log->mask] = rec[i];
+    }
+    log->head += len;
+    if (log->head - log->floor > log->mask + 1) {
+        log->floor = log->head - (log->mask + 1);
+    }
+}
+
+// Puts the cpu back as it was before the last logged step, returns 0 when there is none left
+u8 undo_step(cpu *cpu) {
+    undo_log *log = cpu->undo;
+    if (log == NULL || log->head == log->floor) {
+        return 0;
+    }
+    u64 left = log->head - log->floor;
+    u32 len = log->ring[(log->head - 1) & log->mask];
+    if (len == 0 && left >= 3) {
+        len = join(log->ring[(log->head - 3) & log->mask], log->ring[(log->head - 2) & log->mask]);
+    }
+    if (len == 0 || len > left) { // Its start was overwritten
+        log->floor = log->head;
+        return 0;
+    }
+    u8 rec[UNDO_MAX_RECORD];
+    u64 start = log->head - len;
+    for (u32 i = 0; i < len; ++i) {
+        rec[i] = log->ring[(start + i) & log->mask];
+    }
+
+    const u8 *p = rec;
+    u8 header = *p++;
+    u8 extra = header & UNDO_EXTRA ? *p++ : 0;
+    cpu->pc = header & UNDO_PC_LONG ? undo_get16(&p) : cpu->pc + (i8) *p++;
+    SYNC_FLAGS(cpu);
+    if (header & UNDO_A) cpu->a = *p++;
+    if (header & UNDO_B) cpu->b = *p++;
+    if (header & UNDO_IX) cpu->ix = undo_get16(&p);
+    if (header & UNDO_IY) cpu->iy = undo_get16(&p);
+    if (header & UNDO_SP) cpu->sp = undo_get16(&p);
+    if (header & UNDO_CCR) cpu->status = *p++;
+    LOAD_FLAGS(cpu);
+    u64 cycles = 0;
+    for (u8 shift = 0; ; shift += 7) {
+        cycles |= (u64) (*p & 0x7F) << shift;
+        if (!(*p++ & 0x80)) {
+            break;
+        }
+    }
+    cpu->cycles -= cycles;
+    if (extra & UNDO_X_PORTS) {
+        memcpy(cpu->ports, p, MAX_PORTS);
+        p += MAX_PORTS;
+    }
+    if (extra & UNDO_X_EVENTS) {
+        cpu->event_count = *p++;
+        memcpy(&cpu->next_event, p, sizeof(u64));
+        p += sizeof(u64);
+        cpu->pending = *p++;
+        cpu->sleep = *p++;
+        memcpy(cpu->events, p, cpu->event_count * sizeof(event));
+        p += cpu->event_count * sizeof(event);
+    }
+    u8 count = extra >> UNDO_X_WRITES_SHIFT;
+    if (count == UNDO_X_WRITES_BYTE) {
+        count = *p++;
+    }
+    for (u8 i = 0; i < count; ++i) {
+        u16 addr = undo_get16(&p);
+        POKE8(cpu, addr, *p++); // Going back is not a write of the program
+    }
+    log->head = start;
+    return 1;
+}
+
+// Steps back until pc is `until` (NO_STOP_PC for none) or the log runs out, returns the steps undone
+u64 undo_until(cpu *cpu, u32 until) {
+    u64 n = 0;
+    while (undo_step(cpu)) {
+        n++;
+        if (cpu->pc == until) {
+            break;
+        }
+    }
+    return n;
+}
+
+/*****************************
+*        Trace stream        *
+*****************************/
+
+// With a trace attached run_cpu fills a trace_capture per instruction into fixed size buffers,
+// doing as little as it can: the lazy flags are kept as they are and the code bytes are not
+// decoded. A writer thread compresses the full buffers and appends them to the file while the
+// cpu goes on, read_trace makes the trace_records. The file is the magic, then blocks of:
+//   records     u32, little endian
+//   size        u32, bytes of data
+//   data        each capture is predicted from the last one that came after the same pc plus
+//               what was added to the one before it. Runs of right predictions are only
+//               counted: a LEB128 count, then the next capture XORed with its prediction and
+//               cut in u16 lanes, 2 bytes of mask with bit i set when lane i is not 0 and those
+//               lanes in host byte order. A block may end on a count. Predictions go on from
+//               one block to the next.
+#define TRACE_MAGIC "HCT3"
+#define TRACE_BUFFER_RECORDS 0x1000
+#define TRACE_BUFFERS 4
+#define TRACE_WORDS 3
+#define TRACE_MASK_BYTES 2
+#define TRACE_CONTEXTS 0x400 // Predictions, picked by the low bits of the previous pc
+// Largest capture once packed: the count before it, the mask and every lane
+#define TRACE_PACKED_MAX (2 + TRACE_MASK_BYTES + TRACE_WORDS * 8)
+
+// What run_cpu keeps of a traced instruction, registers and flags being the ones after it.
+// From the low bits:
+//   word 0   B, IX, A, IY, SP
+//   word 1   the 4 bytes from pc as a host u32, write_addr, write_value, writes (stops at 255)
+//   word 2   pc, cycles, status, the low 17 bits of cc_nz (the ones above are copies of
+//            bit 16), cc_v, then one bit each for cc_c and the sign of cc_dst and cc_src, all that
+//            FLAG_* look at
+// Fields next to each other in cpu are not next to each other here, or the compiler would
+// merge their loads, and a load wider than the stores the instruction just did waits for them.
+typedef struct {
+    u64 words[TRACE_WORDS];
+} trace_capture;
+
+static_assert(TRACE_WORDS * 4 <= TRACE_MASK_BYTES * 8, "one mask bit per lane");
+
+typedef struct {
+    trace_capture records[TRACE_BUFFER_RECORDS];
+    u32 count;
+} trace_buffer;
+
+// Last capture that came after a given pc, and what was added to the one before to get it
+typedef struct {
+    u64 last[TRACE_WORDS];
+    u64 step[TRACE_WORDS];
+} trace_context;
+
+typedef struct {
+    trace_context contexts[TRACE_CONTEXTS];
+    u16 pc; // Of the previous capture
+} trace_predictor;
+
+typedef struct trace_stream {
+    FILE *file;
+    trace_filter filter;
+    trace_buffer buffers[TRACE_BUFFERS]; // Ring, the writer drains the full ones in order
+    u64 filled;   // Buffers handed to the writer
+    u64 written;  // Buffers the writer is done with
+    u8 closing;
+    mtx_t lock;
+    cnd_t full;   // Half the ring is full or the stream closes
+    cnd_t free;   // The writer is done with a buffer
+    thrd_t writer;
+    u8 *packed;   // Writer's output, TRACE_BUFFER_RECORDS worst case captures
+    trace_predictor predictor; // Writer's
+    trace_capture *current;
+    trace_capture *end;   // Past the current buffer's records
+    u8 filtered;  // The filter lets some instructions out
+    u64 records;  // In the buffers handed to the writer
+} trace_stream;
+
+// Bit k set when the 16 bit lane k of x is not 0: bit 15 of each lane is set by the carry of
+// its low bits or by itself, then the four bits are gathered by one multiplication
+static inline u8 trace_lanes(u64 x) {
+    u64 nz = (((x & 0x7FFF7FFF7FFF7FFFull) + 0x7FFF7FFF7FFF7FFFull) | x) & 0x8000800080008000ull;
+    return ((nz >> 15) * 0x0001000200040008ull) >> 48 & 0xF;
+}
+
+// Stores the lanes of x, p only moving past the ones set in m. Each store is overwritten by
+// the next lane when its own is not kept, no branch to mispredict.
+static inline u8 *trace_put_lanes(u8 *p, u64 x, u8 m) {
+    for (u8 k = 0; k < 4; ++k) {
+        u16 h = x >> (16 * k);
+        memcpy(p, &h, 2);
+        p += (m >> k & 1) * 2;
+    }
+    return p;
+}
+
+static u8 *trace_put_count(u8 *p, u32 n) {
+    while (n >= 0x80) {
+        *p++ = n | 0x80;
+        n >>= 7;
+    }
+    *p++ = n;
+    return p;
+}
+
+static const u8 *trace_get_count(const u8 *p, u32 *n) {
+    *n = 0;
+    for (u8 shift = 0; shift < 32; shift += 7) {
+        *n |= (u32)(*p & 0x7F) << shift;
+        if (!(*p++ & 0x80)) {
+            break;
+        }
+    }
+    return p;
+}
+
+// Takes w, which was not the prediction, as the context's last capture
+static void trace_learn(trace_context *tc, const u64 *w) {
+    for (u8 k = 0; k < TRACE_WORDS; ++k) {
+        tc->step[k] = w[k] - tc->last[k];
+        tc->last[k] = w[k];
+    }
+}
+
+static u32 trace_pack(trace_predictor *pr, const trace_buffer *buf, u8 *out) {
+    u8 *p = out;
+    u32 run = 0;
+    u16 pc = pr->pc;
+    const u32 count = buf->count;
+    for (u32 i = 0; i < count; ++i) {
+        const u64 *w = buf->records[i].words;
+        trace_context *tc = &pr->contexts[pc % TRACE_CONTEXTS];
+        pc = w[2];
+        // Most captures are right, written out so that this is all they cost even unoptimized
+        u64 x0 = w[0] ^ (tc->last[0] + tc->step[0]);
+        u64 x1 = w[1] ^ (tc->last[1] + tc->step[1]);
+        u64 x2 = w[2] ^ (tc->last[2] + tc->step[2]);
+        if ((x0 | x1 | x2) == 0) {
+            tc->last[0] = w[0];
+            tc->last[1] = w[1];
+            tc->last[2] = w[2];
+            run++;
+            continue;
+        }
+        p = trace_put_count(p, run);
+        run = 0;
+        u8 m0 = trace_lanes(x0), m1 = trace_lanes(x1), m2 = trace_lanes(x2);
+        u16 bits = m0 | m1 << 4 | m2 << 8;
+        p[0] = bits;
+        p[1] = bits >> 8;
+        p = trace_put_lanes(p + TRACE_MASK_BYTES, x0, m0);
+        p = trace_put_lanes(p, x1, m1);
+        p = trace_put_lanes(p, x2, m2);
+        trace_learn(tc, w);
+    }
+    if (run != 0) {
+        p = trace_put_count(p, run);
+    }
+    pr->pc = pc;
+    return p - out;
+}
+
+static void trace_put32(u8 *p, u32 v) {
+    for (u8 i = 0; i < 4; ++i) {
+        p[i] = v >> (i * 8);
+    }
+}
+
+static u32 trace_get32(const u8 *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (u32) p[3] << 24;
+}
+
+static int trace_writer(void *arg) {
+    trace_stream *t = arg;
+    for (;;) {
+        mtx_lock(&t->lock);
+        while (t->written == t->filled && !t->closing) {
+            cnd_wait(&t->full, &t->lock);
+        }
+        if (t->written == t->filled) {
+            mtx_unlock(&t->lock);
+            return 0;
+        }
+        const trace_buffer *buf = &t->buffers[t->written % TRACE_BUFFERS];
+        mtx_unlock(&t->lock);
+
+        u32 size = trace_pack(&t->predictor, buf, t->packed);
+        u8 header[8];
+        trace_put32(header, buf->count);
+        trace_put32(header + 4, size);
+        fwrite(header, 1, sizeof(header), t->file);
+        fwrite(t->packed, 1, size, t->file);
+
+        mtx_lock(&t->lock);
+        t->written++;
+        cnd_signal(&t->free);
+        mtx_unlock(&t->lock);
+    }
+}
+
+// Hands the current buffer to the writer and waits for a free one. The writer is only woken
+// once half the ring is full and then drains all of it, fewer switches when both threads
+// share a core.
+static void trace_flush(trace_stream *t) {
+    mtx_lock(&t->lock);
+    t->filled++;
+    if (t->filled - t->written >= TRACE_BUFFERS / 2) {
+        cnd_signal(&t->full);
+    }
+    while (t->filled - t->written == TRACE_BUFFERS) {
+        cnd_wait(&t->free, &t->lock);
+    }
+    mtx_unlock(&t->lock);
+    trace_buffer *next = &t->buffers[t->filled % TRACE_BUFFERS];
+    next->count = 0;
+    t->current = next->records;
+    t->end = next->records + TRACE_BUFFER_RECORDS;
+}
+
+// Traces every instruction run_cpu runs from now on into `path`. NULL traces everything.
+void start_trace(cpu *cpu, const char *path, const trace_filter *filter) {
+    end_trace(cpu);
+    trace_stream *t = calloc(1, sizeof(trace_stream));
+    if (t == NULL) {
+        ERROR("%s", "calloc");
+    }
+    t->packed = malloc(TRACE_BUFFER_RECORDS * TRACE_PACKED_MAX);
+    t->file = fopen(path, "wb");
+    if (t->packed == NULL || t->file == NULL) {
+        ERROR("Error while opennig file : %s\n", path);
+    }
+    fwrite(TRACE_MAGIC, 1, 4, t->file);
+    if (filter != NULL) {
+        t->filter = *filter;
+        t->filtered = 1;
+    }
+    t->current = t->buffers[0].records;
+    t->end = t->current + TRACE_BUFFER_RECORDS;
+    mtx_init(&t->lock, mtx_plain);
+    cnd_init(&t->full);
+    cnd_init(&t->free);
+    if (thrd_create(&t->writer, trace_writer, t) != thrd_success) {
+        ERROR("%s", "thrd_create");
+    }
+    cpu->trace = t;
+}
+
+// Writes what is left and closes the file. Returns the number of records written.
+u64 end_trace(cpu *cpu) {
+    trace_stream *t = cpu->trace;
+    if (t == NULL) {
+        return 0;
+    }
+    trace_buffer *buf = &t->buffers[t->filled % TRACE_BUFFERS];
+    buf->count = t->current - buf->records;
+    mtx_lock(&t->lock);
+    if (buf->count != 0) {
+        t->filled++;
+    }
+    t->closing = 1;
+    cnd_signal(&t->full);
+    mtx_unlock(&t->lock);
+    thrd_join(t->writer, NULL);
+    u64 records = t->records + buf->count;
+    fclose(t->file);
+    mtx_destroy(&t->lock);
+    cnd_destroy(&t->full);
+    cnd_destroy(&t->free);
+    free(t->packed);
+    free(t);
+    cpu->trace = NULL;
+    return records;
+}
+
+// Called by WRITE8
+void trace_note(cpu *cpu, u16 addr, u8 v) {
+    u64 *w = &cpu->trace->current->words[1];
+    u8 writes = *w >> 56;
+    if (writes == 0) {
+        *w |= (u64) addr << 32 | (u64) v << 48;
+    }
+    if (writes != 0xFF) {
+        *w += 1ull << 56;
+    }
+}
+
+// Lets the instruction `code`, prefix in the high byte, through the filter
+void trace_filter_opcode(trace_filter *filter, u16 code) {
+    u16 i = code_index(code);
+    filter->opcodes[i >> 3] |= 1 << (i & 7);
+}
+
+static inline u8 trace_passes(const trace_filter *filter, u16 pc, u16 code) {
+    u16 i = code_index(code);
+    return pc >= filter->first && pc <= filter->last && ((filter->opcodes[i >> 3] >> (i & 7)) & 1);
+}
+
+// exec_inst that fills a capture if the filter lets the instruction through. Inlined with
+// filtered constant where it can be, so a trace without filter tests nothing more.
+static ALWAYS_INLINE void exec_inst_traced(cpu *cpu, trace_stream *t, const u8 filtered) {
+    const u16 pc = cpu->pc;
+    const u8 *m = cpu->memory;
+    u64 *w = t->current->words;
+    if (filtered && !trace_passes(&t->filter, pc, inst_code_at(m, pc))) {
+        w[1] = 0;
+        exec_inst(cpu); // Its writes are cleared by the next capture
+        return;
+    }
+    u32 code;
+    if (pc <= MAX_MEMORY - 4) {
+        memcpy(&code, &m[pc], 4);
+    } else {
+        u8 bytes[4] = {m[pc], m[(u16)(pc + 1)], m[(u16)(pc + 2)], m[(u16)(pc + 3)]};
+        memcpy(&code, bytes, 4);
+    }
+    w[1] = code;
+    const u64 cycles = cpu->cycles;
+    exec_inst(cpu);
+    w[0] = cpu->b | (u32) cpu->ix << 8 | (u32) cpu->a << 24 | (u64) cpu->iy << 32 | (u64) cpu->sp << 48;
+    w[2] = pc | (u32)(u8)(cpu->cycles - cycles) << 16 | (u32) cpu->status << 24
+            | (u64)(cpu->cc_nz & 0x1FFFF) << 32 | (u64) cpu->cc_v << 49
+            | (u64)(cpu->cc_c & 1) << 57 | (u64)(cpu->cc_dst >> 15) << 58 | (u64)(cpu->cc_src >> 15) << 59;
+    if (++t->current == t->end) {
+        t->buffers[t->filled % TRACE_BUFFERS].count = TRACE_BUFFER_RECORDS;
+        t->records += TRACE_BUFFER_RECORDS;
+        trace_flush(t);
+    }
+}
+
+// The record of a capture. state is only there to read the flags with FLAG_*.
+static void trace_record_of(const u64 *w, cpu *state, trace_record *r) {
+    r->b = w[0];
+    r->ix = w[0] >> 8;
+    r->a = w[0] >> 24;
+    r->iy = w[0] >> 32;
+    r->sp = w[0] >> 48;
+    const u32 bytes = w[1];
+    u8 code[4];
+    memcpy(code, &bytes, 4);
+    r->opcode = inst_code_at(code, 0);
+    const u8 at = opcode_size(r->opcode);
+    r->operand = join(code[at], code[at + 1]);
+    r->write_addr = w[1] >> 32;
+    r->write_value = w[1] >> 48;
+    r->writes = w[1] >> 56;
+    r->pc = w[2];
+    r->cycles = w[2] >> 16;
+    state->status = w[2] >> 24;
+    state->cc_nz = w[2] >> 32 & 0x1FFFF;
+    state->cc_v = w[2] >> 49;
+    state->cc_c = w[2] >> 57 & 1;
+    state->cc_dst = (w[2] >> 58 & 1) << 15;
+    state->cc_src = (w[2] >> 59 & 1) << 15;
+    r->ccr = (state->status & 0xF0) | FLAG_N(state) << 3 | FLAG_Z(state) << 2 | FLAG_V(state) << 1
+            | FLAG_C(state);
+}
+
+// Calls f on each record of the trace at `path`, returns how many there were
+u64 read_trace(const char *path, void (*f) (const trace_record *r, void *ctx), void *ctx) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        ERROR("Error while opennig file : %s\n", path);
+    }
+    char magic[4];
+    if (fread(magic, 1, 4, file) != 4 || memcmp(magic, TRACE_MAGIC, 4) != 0) {
+        ERROR("%s is not a trace", path);
+    }
+    u8 *packed = malloc(TRACE_BUFFER_RECORDS * TRACE_PACKED_MAX);
+    trace_predictor *pr = calloc(1, sizeof(trace_predictor));
+    cpu *state = calloc(1, sizeof(cpu));
+    if (packed == NULL || pr == NULL || state == NULL) {
+        ERROR("%s", "malloc");
+    }
+    u64 total = 0;
+    u8 header[8];
+    while (fread(header, 1, sizeof(header), file) == sizeof(header)) {
+        u32 count = trace_get32(header);
+        u32 size = trace_get32(header + 4);
+        if (count > TRACE_BUFFER_RECORDS || size > TRACE_BUFFER_RECORDS * TRACE_PACKED_MAX
+                || fread(packed, 1, size, file) != size) {
+            ERROR("%s is truncated", path);
+        }
+        const u8 *p = packed;
+        u32 run = 0;
+        u8 counted = 0; // run read, for the captures before the next explicit one
+        for (u32 i = 0; i < count; ++i) {
+            if (!counted) {
+                p = trace_get_count(p, &run);
+                if (run > count - i) {
+                    ERROR("%s is damaged", path);
+                }
+                counted = 1;
+            }
+            trace_context *tc = &pr->contexts[pr->pc % TRACE_CONTEXTS];
+            u64 w[TRACE_WORDS];
+            for (u8 k = 0; k < TRACE_WORDS; ++k) {
+                w[k] = tc->last[k] + tc->step[k];
+            }
+            if (run != 0) {
+                run--;
+                memcpy(tc->last, w, sizeof(w));
+            } else {
+                u16 bits = p[0] | p[1] << 8;
+                p += TRACE_MASK_BYTES;
+                for (u8 j = 0; j < TRACE_WORDS * 4; ++j) {
+                    if ((bits >> j) & 1) {
+                        u16 x;
+                        memcpy(&x, p, 2);
+                        w[j / 4] ^= (u64) x << (16 * (j % 4));
+                        p += 2;
+                    }
+                }
+                trace_learn(tc, w);
+                counted = 0;
+            }
+            pr->pc = w[2];
+            trace_record r;
+            trace_record_of(w, state, &r);
+            f(&r, ctx);
+        }
+        total += count;
+    }
+    free(state);
+    free(pr);
+    free(packed);
+    fclose(file);
+    return total;
+}
+
+#ifdef EMULATOR_PROFILE
+/*****************************
+*          Profiler          *
+*****************************/
+
+// Counts what run_cpu executes, reads and writes from now on, per address, and the calls
+// made from the current pc. The predecoded, traces and JIT engines do not count.
+void start_profile(cpu *cpu) {
+    stop_profile(cpu);
+    cpu->profile = calloc(1, sizeof(profile));
+    if (cpu->profile == NULL) {
+        ERROR("%s", "calloc");
+    }
+    // The code running now is the root of the call graph, it never returns
+    cpu->profile->frames[0] = (profile_frame) {cpu->pc, UINT32_MAX, {0, cpu->cycles}, {0, 0}};
+    cpu->profile->functions[cpu->pc].active = 1;
+    cpu->profile->depth = 1;
+}
+
+void stop_profile(cpu *cpu) {
+    if (cpu->profile != NULL) {
+        free(cpu->profile->edges);
+    }
+    free(cpu->profile);
+    cpu->profile = NULL;
+}
+
+static profile_edge *profile_edge_to(profile *p, u16 caller, u16 callee) {
+    profile_function *f = &p->functions[caller];
+    for (u32 i = f->first_edge; i != 0; i = p->edges[i - 1].next) {
+        if (p->edges[i - 1].callee == callee) {
+            return &p->edges[i - 1];
+        }
+    }
+    if (p->edge_count == p->edge_capacity) {
+        p->edge_capacity = p->edge_capacity ? p->edge_capacity * 2 : 0x100;
+        p->edges = realloc(p->edges, p->edge_capacity * sizeof(profile_edge));
+        if (p->edges == NULL) {
+            ERROR("%s", "realloc");
+        }
+    }
+    p->edges[p->edge_count] = (profile_edge) {callee, f->first_edge, 0, {0, 0}};
+    f->first_edge = ++p->edge_count;
+    return &p->edges[p->edge_count - 1];
+}
+
+// Ends the frame on top of the call stack and gives its cost to the function and its caller
+static void profile_leave(profile *p, u64 cycles) {
+    profile_frame *frame = &p->frames[--p->depth];
+    profile_function *f = &p->functions[frame->function];
+    profile_cost cost = {p->instructions - frame->start.instructions, cycles - frame->start.cycles};
+    f->exclusive.instructions += cost.instructions - frame->callees.instructions;
+    f->exclusive.cycles += cost.cycles - frame->callees.cycles;
+    if (--f->active == 0) {
+        f->inclusive.instructions += cost.instructions;
+        f->inclusive.cycles += cost.cycles;
+    }
+    if (p->depth != 0) {
+        profile_frame *caller = &p->frames[p->depth - 1];
+        caller->callees.instructions += cost.instructions;
+        caller->callees.cycles += cost.cycles;
+        profile_edge *e = profile_edge_to(p, caller->function, frame->function);
+        e->calls++;
+        e->inclusive.instructions += cost.instructions;
+        e->inclusive.cycles += cost.cycles;
+    }
+}
+
+// Frames whose return address is no longer on the stack are over, however they were left:
+// a return, or a routine that pulled its return address and jumped
+static void profile_unwind(cpu *cpu, u32 sp) {
+    profile *p = cpu->profile;
+    while (p->depth != 0 && p->frames[p->depth - 1].ret_sp <= sp) {
+        profile_leave(p, cpu->cycles);
+    }
+}
+
+// Enters entry, ret_sp is the sp its return will leave
+void profile_call(cpu *cpu, u16 entry, u32 ret_sp) {
+    profile *p = cpu->profile;
+    profile_unwind(cpu, ret_sp);
+    if (p->depth == CALL_STACK_DEPTH) {
+        p->untracked++;
+        return;
+    }
+    p->functions[entry].calls++;
+    p->functions[entry].active++;
+    p->frames[p->depth++] = (profile_frame) {entry, ret_sp, {p->instructions, cpu->cycles}, {0, 0}};
+}
+
+// Called after each instruction. Whatever put sp back up to where a call left it ended the
+// call: RTS, RTI, or PULX and a jump. A return that does not go that far is a computed jump.
+void profile_step(cpu *cpu) {
+    profile *p = cpu->profile;
+    p->instructions++;
+    if (p->depth != 0 && cpu->sp >= p->frames[p->depth - 1].ret_sp) {
+        profile_unwind(cpu, cpu->sp);
+    }
+    if (p->calling) {
+        p->calling = 0;
+        profile_call(cpu, p->call_entry, p->call_ret_sp);
+    }
+}
+
+// Closest label at or before addr, NULL when there is none
+const directive *label_before(const labels *labels, u16 addr) {
+    const directive *best = NULL;
+    for (u8 i = 0; i < labels->count; ++i) {
+        const directive *d = &labels->label[i];
+        if (d->operand.value <= addr && (best == NULL || d->operand.value > best->operand.value)) {
+            best = d;
+        }
+    }
+    return best;
+}
+
+typedef struct {
+    u64 key;
+    u16 addr;
+} profile_entry;
+
+static int profile_hotter(const void *x, const void *y) {
+    const profile_entry *a = x, *b = y;
+    if (a->key != b->key) {
+        return a->key < b->key ? 1 : -1;
+    }
+    return (int) a->addr - (int) b->addr;
+}
+
+// Name of addr, `none` or the address itself when no label comes before it
+static void print_profile_label(FILE *out, const labels *labels, u16 addr, const char *none) {
+    const directive *d = label_before(labels, addr);
+    if (d == NULL && none != NULL) {
+        fprintf(out, "%s", none);
+    } else if (d == NULL) {
+        fprintf(out, "0x%04x", addr);
+    } else if (d->operand.value == addr) {
+        fprintf(out, "%s", d->label);
+    } else {
+        fprintf(out, "%s+%x", d->label, addr - d->operand.value);
+    }
+}
+
+static u8 profile_has_function(const profile *p, u16 addr) {
+    const profile_function *f = &p->functions[addr];
+    return f->calls != 0 || f->exclusive.cycles != 0 || f->first_edge != 0;
+}
+
+// Every address that was executed, hottest first by cycles, every subroutine by inclusive
+// cycles, then every address read or written, by accesses. Each one is named after the
+// closest label before it. The calls still running are ended first.
+void write_profile(cpu *cpu, FILE *out) {
+    profile *p = cpu->profile;
+    profile_unwind(cpu, UINT32_MAX);
+    profile_entry *entries = malloc(MAX_MEMORY * sizeof(profile_entry));
+    if (entries == NULL) {
+        ERROR("%s", "malloc");
+    }
+    u32 n = 0;
+    u64 counted = 0;
+    for (u32 addr = 0; addr < MAX_MEMORY; ++addr) {
+        if (p->executions[addr] != 0) {
+            entries[n++] = (profile_entry) {p->cycles[addr], addr};
+            counted += p->cycles[addr];
+        }
+    }
+    qsort(entries, n, sizeof(profile_entry), profile_hotter);
+    fprintf(out, "# %llu of %llu cycles were spent running instructions\n",
+            (unsigned long long) counted, (unsigned long long) cpu->cycles);
+    fprintf(out, "# code address, executions, cycles, share of the cycles, label\n");
+    for (u32 i = 0; i < n; ++i) {
+        u16 addr = entries[i].addr;
+        fprintf(out, "%04x %llu %llu %.2f%% ", addr, (unsigned long long) p->executions[addr],
+                (unsigned long long) p->cycles[addr], counted ? 100.0 * p->cycles[addr] / counted : 0);
+        print_profile_label(out, &cpu->labels, addr, "-");
+        fprintf(out, "\n");
+    }
+
+    n = 0;
+    for (u32 addr = 0; addr < MAX_MEMORY; ++addr) {
+        if (profile_has_function(p, addr)) {
+            entries[n++] = (profile_entry) {p->functions[addr].inclusive.cycles, addr};
+        }
+    }
+    qsort(entries, n, sizeof(profile_entry), profile_hotter);
+    fprintf(out, "# subroutine, calls, inclusive instructions and cycles, exclusive instructions and cycles, label\n");
+    for (u32 i = 0; i < n; ++i) {
+        u16 addr = entries[i].addr;
+        const profile_function *f = &p->functions[addr];
+        fprintf(out, "%04x %llu %llu %llu %llu %llu ", addr, (unsigned long long) f->calls,
+                (unsigned long long) f->inclusive.instructions, (unsigned long long) f->inclusive.cycles,
+                (unsigned long long) f->exclusive.instructions, (unsigned long long) f->exclusive.cycles);
+        print_profile_label(out, &cpu->labels, addr, "-");
+        fprintf(out, "\n");
+    }
+    if (p->untracked != 0) {
+        fprintf(out, "# %llu calls deeper than %d were counted in their caller\n",
+                (unsigned long long) p->untracked, CALL_STACK_DEPTH);
+    }
+
+    n = 0;
+    for (u32 addr = 0; addr < MAX_MEMORY; ++addr) {
+        if (p->reads[addr] != 0 || p->writes[addr] != 0) {
+            entries[n++] = (profile_entry) {p->reads[addr] + p->writes[addr], addr};
+        }
+    }
+    qsort(entries, n, sizeof(profile_entry), profile_hotter);
+    fprintf(out, "# data address, reads, writes, label\n");
+    for (u32 i = 0; i < n; ++i) {
+        u16 addr = entries[i].addr;
+        fprintf(out, "%04x %llu %llu ", addr, (unsigned long long) p->reads[addr],
+                (unsigned long long) p->writes[addr]);
+        print_profile_label(out, &cpu->labels, addr, "-");
+        fprintf(out, "\n");
+    }
+    free(entries);
+}
+
+// The call graph in the format of valgrind's callgrind, for kcachegrind and the like. Each
+// subroutine's exclusive cost is put on its entry address. The calls still running are ended first.
+void write_callgrind(cpu *cpu, FILE *out) {
+    profile *p = cpu->profile;
+    profile_unwind(cpu, UINT32_MAX);
+    profile_cost total = {0, 0};
+    for (u32 addr = 0; addr < MAX_MEMORY; ++addr) {
+        total.instructions += p->functions[addr].exclusive.instructions;
+        total.cycles += p->functions[addr].exclusive.cycles;
+    }
+    fprintf(out, "# callgrind format\nversion: 1\ncreator: 6811 emulator\npositions: instr\n"
+            "events: Instructions Cycles\nsummary: %llu %llu\n",
+            (unsigned long long) total.instructions, (unsigned long long) total.cycles);
+    for (u32 addr = 0; addr < MAX_MEMORY; ++addr) {
+        if (!profile_has_function(p, addr)) {
+            continue;
+        }
+        const profile_function *f = &p->functions[addr];
+        fprintf(out, "\nfn=");
+        print_profile_label(out, &cpu->labels, addr, NULL);
+        fprintf(out, "\n0x%04x %llu %llu\n", addr, (unsigned long long) f->exclusive.instructions,
+                (unsigned long long) f->exclusive.cycles);
+        for (u32 i = f->first_edge; i != 0; i = p->edges[i - 1].next) {
+            const profile_edge *e = &p->edges[i - 1];
+            fprintf(out, "cfn=");
+            print_profile_label(out, &cpu->labels, e->callee, NULL);
+            fprintf(out, "\ncalls=%llu 0x%04x\n0x%04x %llu %llu\n", (unsigned long long) e->calls,
+                    e->callee, addr, (unsigned long long) e->inclusive.instructions,
+                    (unsigned long long) e->inclusive.cycles);
+        }
+    }
+}
+#endif // EMULATOR_PROFILE
+
+// Traces up to fuel instructions back to back, as run_cpu's inner loop does. Returns the fuel left.
+static ALWAYS_INLINE u64 run_traced(cpu *cpu, u64 fuel, u32 until, const u8 filtered) {
+    trace_stream *t = cpu->trace;
+    struct debug_points *debug = cpu->debug;
+    do {
+        exec_inst_traced(cpu, t, filtered);
+        fuel--;
+    } while (fuel != 0 && !instr_slow[cpu->memory[cpu->pc]] && cpu->pc != until
+            && !(debug != NULL && (debug->hit || DEBUG_BIT(debug->breaks, cpu->pc))));
+    return fuel;
+}
+
+// run_cpu with an undo log or a trace, one instruction at a time. For the undo log each
+// instruction, interrupt taken, sleep or skipped idle loop is one step.
+static run_result run_instrumented(cpu *cpu, const run_limits *limits) {
+    const u64 start = cpu->cycles;
+    const u32 until = limits->until;
+    const u64 cycle_end = limits->max_cycles != 0 ? start + limits->max_cycles : UINT64_MAX;
+    const u64 inst_end = limits->max_instructions != 0 ? limits->max_instructions : UINT64_MAX;
+    u64 executed = 0;
+    u64 idle_cycles = 0;
+    u64 next_probe = 0;
+    stop_reason reason = STOP_HALT;
+    if (cpu->debug != NULL) {
+        cpu->debug->hit = DEBUG_NONE;
+    }
+    for (;;) {
+        // As in run_interpreter, before an interrupt or the halt moves pc
+        if (cpu->debug != NULL && cpu->debug->hit) {
+            reason = cpu->debug->hit == DEBUG_RETURN ? STOP_RETURN : STOP_WATCH;
+            break;
+        }
+        undo_begin(cpu);
+        if (cpu->cycles >= cpu->next_event || cpu->pending) {
+            check_interrupts(cpu);
+            if (cpu->undo != NULL && cpu->pc != cpu->undo->pc) { // Taken, the handler's first instruction is a step of its own
+                undo_end(cpu);
+                undo_begin(cpu);
+            }
+        }
+        if (cpu->sleep != AWAKE) {
+            u8 woken = sleep_until(cpu, cycle_end, &idle_cycles, &reason);
+            undo_end(cpu);
+            if (woken) {
+                continue;
+            }
+            break;
+        }
+        u8 stop = 1;
+        if (cpu->memory[cpu->pc] == 0x00) {
+            reason = STOP_HALT;
+        } else if (cpu->pc == until) {
+            reason = STOP_PC;
+        } else if (executed >= inst_end) {
+            reason = STOP_INSTRUCTIONS;
+        } else if (cpu->cycles >= cycle_end) {
+            reason = STOP_CYCLES;
+        } else if (break_requested(cpu)) {
+            reason = STOP_BREAK_IN;
+        } else if (cpu->debug != NULL && executed != 0 && DEBUG_BIT(cpu->debug->breaks, cpu->pc)
+                && breakpoint_holds(cpu)) {
+            reason = STOP_BREAK;
+        } else {
+            stop = 0;
+        }
+        if (stop) {
+            undo_end(cpu); // An interrupt may have been taken
+            break;
+        }
+        const u64 deadline = cpu->next_event < cycle_end ? cpu->next_event : cycle_end;
+        if (cpu->debug == NULL && executed >= next_probe && !instr_slow[cpu->memory[cpu->pc]]
+                && IDLE_PROBE_FITS(cpu, inst_end - executed, deadline - cpu->cycles)) {
+            next_probe = executed + IDLE_CHECK_INTERVAL;
+            // The probe's instructions are pure, they are rewound and logged one by one
+            // unless they turn out to be an idle loop
+            cpu_head regs;
+            memcpy(regs, cpu, sizeof(regs));
+            idle_loop loop;
+            idle_probe(cpu, until, &loop);
+            memcpy(cpu, regs, sizeof(regs));
+            if (loop.instructions != 0) {
+                u8 forever;
+                executed += idle_skip(cpu, until, limit_left(inst_end, executed),
+                        deadline, &idle_cycles, &forever);
+                undo_end(cpu);
+                if (forever) {
+                    reason = STOP_IDLE;
+                    break;
+                }
+                continue;
+            }
+        }
+        if (cpu->undo == NULL) {
+            // Only traced, no step to delimit: as many instructions as surely fit before the next
+            // event or limit run back to back, as in run_cpu
+            u64 fuel = (deadline - cpu->cycles) / instr_max_cycles;
+            if (fuel > inst_end - executed) {
+                fuel = inst_end - executed;
+            }
+            if (fuel > IDLE_CHECK_INTERVAL) {
+                fuel = IDLE_CHECK_INTERVAL;
+            }
+            if (fuel == 0 || instr_slow[cpu->memory[cpu->pc]]) {
+                fuel = 1;
+            }
+            executed += fuel;
+            if (cpu->trace->filtered) {
+                fuel = run_traced(cpu, fuel, until, 1);
+            } else {
+                fuel = run_traced(cpu, fuel, until, 0);
+            }
+            executed -= fuel;
+            continue;
+        }
+        if (cpu->trace != NULL) {
+            exec_inst_traced(cpu, cpu->trace, cpu->trace->filtered);
+        } else {
+            exec_inst(cpu);
+        }
+        executed++;
+        undo_end(cpu);
+    }
+    return (run_result) {reason, executed, cpu->cycles - start, idle_cycles};
+}
+
+// run_cpu's interpreter loop. With debug it also stops on breakpoints, watchpoints and
+// returns, and does not skip idle loops. Inlined once with each value so the loop without
+// the debugger tests nothing more.
+static ALWAYS_INLINE run_result run_interpreter(cpu *cpu, const run_limits *limits, const u8 debug) {
+    const u64 start = cpu->cycles;
+    const u32 until = limits->until;
+    const u64 cycle_end = limits->max_cycles != 0 ? start + limits->max_cycles : UINT64_MAX;
+    const u64 inst_end = limits->max_instructions != 0 ? limits->max_instructions : UINT64_MAX;
+    u64 executed = 0;
+    u64 idle_cycles = 0;
+    u8 probed = 0;
+    stop_reason reason = STOP_HALT;
+    if (debug) {
+        cpu->debug->hit = DEBUG_NONE;
+    }
+    for (;;) {
+        // Before anything else moves pc, an interrupt or the halt after the instruction
+        if (debug && cpu->debug->hit) {
+            reason = cpu->debug->hit == DEBUG_RETURN ? STOP_RETURN : STOP_WATCH;
+            break;
+        }
+        if (cpu->cycles >= cpu->next_event || cpu->pending) {
+            check_interrupts(cpu);
+        }
+        if (cpu->sleep != AWAKE) {
+            if (sleep_until(cpu, cycle_end, &idle_cycles, &reason)) {
+                continue;
+            }
+            break;
+        }
+        if (cpu->memory[cpu->pc] == 0x00) {
+            reason = STOP_HALT;
+            break;
+        }
+        if (cpu->pc == until) {
+            reason = STOP_PC;
+            break;
+        }
+        if (executed >= inst_end) {
+            reason = STOP_INSTRUCTIONS;
+            break;
+        }
+        if (cpu->cycles >= cycle_end) {
+            reason = STOP_CYCLES;
+            break;
+        }
+        if (break_requested(cpu)) {
+            reason = STOP_BREAK_IN;
+            break;
+        }
+        // The breakpoint a run starts on is the one it stopped on last time
+        if (debug && executed != 0 && DEBUG_BIT(cpu->debug->breaks, cpu->pc) && breakpoint_holds(cpu)) {
+            reason = STOP_BREAK;
+            break;
+        }
+        if (instr_slow[cpu->memory[cpu->pc]]) {
+            exec_inst(cpu); // Interrupts are looked at right after
+            executed++;
+            continue;
+        }
+        const u64 deadline = cpu->next_event < cycle_end ? cpu->next_event : cycle_end;
+        if (!debug && !probed && IDLE_PROBE_FITS(cpu, inst_end - executed, deadline - cpu->cycles)) {
+            u8 forever;
+            executed += idle_skip(cpu, until, limit_left(inst_end, executed),
+                    deadline, &idle_cycles, &forever);
+            if (forever) {
+                reason = STOP_IDLE;
+                break;
+            }
+            probed = 1;
+            continue;
+        }
+        probed = 0;
+        // As many instructions as surely fit before the next event or limit run without looking at them
+        u64 fuel = (deadline - cpu->cycles) / instr_max_cycles;
+        if (fuel > inst_end - executed) {
+            fuel = inst_end - executed;
+        }
+        if (fuel > IDLE_CHECK_INTERVAL) {
+            fuel = IDLE_CHECK_INTERVAL;
+        }
+        if (fuel == 0) {
+            fuel = 1;
+        }
+        executed += fuel;
+        // The checks above hold for the first one
+        do {
+            exec_inst(cpu);
+            fuel--;
+        } while (fuel != 0 && !instr_slow[cpu->memory[cpu->pc]] && cpu->pc != until
+                && !(debug && (cpu->debug->hit || (DEBUG_BIT(cpu->debug->breaks, cpu->pc) && breakpoint_holds(cpu)))));
+        executed -= fuel;
+    }
+    return (run_result) {reason, executed, cpu->cycles - start, idle_cycles};
+}
+
+// Runs until opcode 0x00 or one of the limits, whichever comes first
+run_result run_cpu(cpu *cpu, const run_limits *limits) {
+    if (cpu->undo != NULL || cpu->trace != NULL) {
+        return run_instrumented(cpu, limits);
+    }
+    if (cpu->debug != NULL) {
+        return run_interpreter(cpu, limits, 1);
+    }
+#if defined(EMULATOR_THREADED) && !defined(EMULATOR_PROFILE) // Its handlers do not count
+    return run_threaded(cpu, limits);
+#else
+    return run_interpreter(cpu, limits, 0);
+#endif
+}
+
+void exec_program(cpu *cpu) {
+    run_limits none = {0, 0, NO_STOP_PC};
+    run_cpu(cpu, &none);
+}
+
+/*****************************
+*  Breakpoints, watchpoints   *
+*****************************/
+
+// Once a cpu has some, run_cpu checks them at every instruction with the interpreter loop,
+// even in the threaded build, or with the instrumented loop when an undo log or a trace is attached.
+
+static debug_points *debug_points_of(cpu *cpu) {
+    if (cpu->debug == NULL) {
+        cpu->debug = calloc(1, sizeof(debug_points));
+        if (cpu->debug == NULL) {
+            ERROR("%s", "calloc");
+        }
+        cpu->debug->out_sp = UINT32_MAX;
+    }
+    return cpu->debug;
+}
+
+static void set_debug_bit(u8 *bits, u16 addr, u8 on) {
+    if (on) {
+        bits[addr >> 3] |= 1 << (addr & 7);
+    } else {
+        bits[addr >> 3] &= ~(1 << (addr & 7));
+    }
+}
+
+static condition *find_condition(const debug_points *d, u16 addr) {
+    for (u8 i = 0; i < d->condition_count; ++i) {
+        if (d->conditions[i].addr == addr) {
+            return (condition *) &d->conditions[i];
+        }
+    }
+    return NULL;
+}
+
+// run_cpu stops before the instruction at addr, unless it starts there. 0 removes it, and
+// either way the breakpoint no longer has a condition.
+void set_breakpoint(cpu *cpu, u16 addr, u8 on) {
+    debug_points *d = debug_points_of(cpu);
+    set_debug_bit(d->breaks, addr, on);
+    if (DEBUG_BIT(d->conditional, addr)) {
+        condition *c = find_condition(d, addr);
+        *c = d->conditions[--d->condition_count];
+        set_debug_bit(d->conditional, addr, 0);
+    }
+}
+
+// run_cpu stops after an instruction that reads (WATCH_READ) or writes (WATCH_WRITE) the
+// byte at addr, stack included. 0 removes it.
+void set_watchpoint(cpu *cpu, u16 addr, u8 kinds) {
+    debug_points *d = debug_points_of(cpu);
+    set_debug_bit(d->reads, addr, kinds & WATCH_READ);
+    set_debug_bit(d->writes, addr, kinds & WATCH_WRITE);
+}
+
+typedef enum {
+    COND_END,
+    COND_CONST, // Followed by the value, low byte first
+    COND_A,
+    COND_B,
+    COND_D,
+    COND_X,
+    COND_Y,
+    COND_SP,
+    COND_PC,
+    COND_CCR,
+    COND_FLAG_C,
+    COND_FLAG_V,
+    COND_FLAG_Z,
+    COND_FLAG_N,
+    COND_FLAG_I, // The flags status always holds
+    COND_FLAG_H,
+    COND_MEMORY, // Replaces the address on the stack with the byte there
+    COND_PORT,
+    COND_NOT,
+    COND_COMPL,
+    COND_NEG,
+    COND_ADD,
+    COND_SUB,
+    COND_AND,
+    COND_OR,
+    COND_XOR,
+    COND_EQ,
+    COND_NE,
+    COND_LT,
+    COND_LE,
+    COND_GT,
+    COND_GE,
+    COND_LAND,
+    COND_LOR,
+} condition_op;
+
+// Values a condition can read by name
+static const struct {
+    const char *name;
+    u8 op;
+} condition_names[] = {
+    {"a", COND_A}, {"b", COND_B}, {"d", COND_D}, {"x", COND_X}, {"ix", COND_X},
+    {"y", COND_Y}, {"iy", COND_Y}, {"sp", COND_SP}, {"pc", COND_PC}, {"ccr", COND_CCR},
+    {"c", COND_FLAG_C}, {"v", COND_FLAG_V}, {"z", COND_FLAG_Z}, {"n", COND_FLAG_N},
+    {"i", COND_FLAG_I}, {"h", COND_FLAG_H},
+};
+
+// Binary operators from the loosest to the tightest level, longer spellings first
+static const struct {
+    const char *text;
+    u8 op;
+    u8 level;
+} condition_operators[] = {
+    {"||", COND_LOR, 0}, {"&&", COND_LAND, 1},
+    {"==", COND_EQ, 2}, {"!=", COND_NE, 2}, {"<=", COND_LE, 2}, {">=", COND_GE, 2},
+    {"<", COND_LT, 2}, {">", COND_GT, 2},
+    {"|", COND_OR, 3}, {"^", COND_XOR, 3}, {"&", COND_AND, 4},
+    {"+", COND_ADD, 5}, {"-", COND_SUB, 5},
+};
+#define CONDITION_LEVELS 6
+
+typedef struct {
+    cpu *cpu;
+    const char *s;
+    condition *c;
+    u8 len;
+    u8 depth;  // Values on the stack once the code so far ran
+    const char *error;
+} condition_parser;
+
+static void condition_emit(condition_parser *p, u8 op, i32 stack_change) {
+    if (p->len >= CONDITION_SIZE - 1) {
+        p->error = "Condition is too long";
+        return;
+    }
+    p->depth += stack_change;
+    if (p->depth > CONDITION_STACK) {
+        p->error = "Condition is too deep";
+        return;
+    }
+    p->c->code[p->len++] = op;
+}
+
+static u8 condition_accept(condition_parser *p, const char *text) {
+    while (isspace((unsigned char) *p->s)) {
+        p->s++;
+    }
+    size_t n = strlen(text);
+    if (strncmp(p->s, text, n) != 0) {
+        return 0;
+    }
+    p->s += n;
+    return 1;
+}
+
+static void condition_binary(condition_parser *p, u8 level);
+
+static void condition_unary(condition_parser *p) {
+    if (p->error != NULL) {
+        return;
+    }
+    u8 op = COND_END;
+    if (condition_accept(p, "!")) {
+        op = COND_NOT;
+    } else if (condition_accept(p, "~")) {
+        op = COND_COMPL;
+    } else if (condition_accept(p, "-")) {
+        op = COND_NEG;
+    }
+    if (op != COND_END) {
+        condition_unary(p);
+        condition_emit(p, op, 0);
+        return;
+    }
+
+    if (condition_accept(p, "(")) {
+        condition_binary(p, 0);
+        if (p->error == NULL && !condition_accept(p, ")")) {
+            p->error = "Missing )";
+        }
+        return;
+    }
+    const char *start = p->s;
+    if (*start == '$' || isdigit((unsigned char) *start)) {
+        char *end;
+        long v = *start == '$' ? strtol(start + 1, &end, 16) : strtol(start, &end, 0);
+        if (end == start + (*start == '$') || v > 0xFFFF) {
+            p->error = "Invalid number";
+            return;
+        }
+        p->s = end;
+        condition_emit(p, COND_CONST, 1);
+        condition_emit(p, v & 0xFF, 0);
+        condition_emit(p, v >> 8, 0);
+        return;
+    }
+
+    char name[32];
+    size_t n = 0;
+    while ((isalnum((unsigned char) p->s[n]) || p->s[n] == '_') && n < sizeof(name) - 1) {
+        name[n] = tolower((unsigned char) p->s[n]); // Like the assembler, which lowercases labels
+        n++;
+    }
+    name[n] = '\0';
+    if (n == 0) {
+        p->error = "Expected a value";
+        return;
+    }
+    p->s += n;
+    u8 is_memory = strcmp(name, "memory") == 0 || strcmp(name, "m") == 0;
+    if ((is_memory || strcmp(name, "ports") == 0) && condition_accept(p, "[")) {
+        condition_binary(p, 0);
+        if (p->error == NULL && !condition_accept(p, "]")) {
+            p->error = "Missing ]";
+        }
+        condition_emit(p, is_memory ? COND_MEMORY : COND_PORT, 0);
+        return;
+    }
+    for (size_t i = 0; i < sizeof(condition_names) / sizeof(condition_names[0]); ++i) {
+        if (strcmp(name, condition_names[i].name) == 0) {
+            condition_emit(p, condition_names[i].op, 1);
+            return;
+        }
+    }
+    directive *label = get_directive_by_label(name, &p->cpu->labels);
+    if (label == NULL) {
+        p->error = "Unknown name, expected a register, a flag, memory[], ports[] or a label";
+        return;
+    }
+    condition_emit(p, COND_CONST, 1);
+    condition_emit(p, label->operand.value & 0xFF, 0);
+    condition_emit(p, label->operand.value >> 8, 0);
+}
+
+// Operators of a level and the tighter ones, left to right. Comparisons do not chain.
+static void condition_binary(condition_parser *p, u8 level) {
+    if (level == CONDITION_LEVELS) {
+        condition_unary(p);
+        return;
+    }
+    condition_binary(p, level + 1);
+    u8 matched = 1;
+    while (p->error == NULL && matched) {
+        matched = 0;
+        for (size_t i = 0; i < sizeof(condition_operators) / sizeof(condition_operators[0]); ++i) {
+            const char *text = condition_operators[i].text;
+            const char *before = p->s;
+            if (condition_operators[i].level != level || !condition_accept(p, text)) {
+                continue;
+            }
+            // & is not the start of &&
+            if (text[1] == '\0' && *p->s == text[0]) {
+                p->s = before;
+                continue;
+            }
+            condition_binary(p, level + 1);
+            condition_emit(p, condition_operators[i].op, -1);
+            matched = level != 2;
+            break;
+        }
+    }
+}
+
+// Compiles text into c, with the labels of cpu. Returns NULL, or what is wrong with the text.
+// A condition is an expression like in C over the registers (a, b, d, x, y, sp, pc, ccr),
+// the flags (c, v, z, n, i, h), memory[addr], ports[n], numbers and labels. & | ^ bind
+// tighter than the comparisons.
+const char *compile_condition(cpu *cpu, const char *text, condition *c) {
+    condition_parser p = {cpu, text, c, 0, 0, NULL};
+    if (strlen(text) >= CONDITION_SIZE) {
+        return "Condition is too long";
+    }
+    condition_binary(&p, 0);
+    while (isspace((unsigned char) *p.s)) {
+        p.s++;
+    }
+    if (p.error == NULL && *p.s != '\0') {
+        p.error = "Unexpected text after the condition";
+    }
+    condition_emit(&p, COND_END, 0);
+    if (p.error == NULL) {
+        strcpy(c->text, text);
+    }
+    return p.error;
+}
+
+// Runs the bytecode of c on the current state, memory and ports are read without side effects
+u8 condition_holds(const cpu *cpu, const condition *c) {
+    i32 stack[CONDITION_STACK];
+    i32 *top = stack - 1;
+    const u8 *ip = c->code;
+    for (;;) {
+        switch (*ip++) {
+            case COND_END: return *top != 0;
+            case COND_CONST: *++top = ip[0] | ip[1] << 8; ip += 2; break;
+            case COND_A: *++top = cpu->a; break;
+            case COND_B: *++top = cpu->b; break;
+            case COND_D: *++top = cpu->d; break;
+            case COND_X: *++top = cpu->ix; break;
+            case COND_Y: *++top = cpu->iy; break;
+            case COND_SP: *++top = cpu->sp; break;
+            case COND_PC: *++top = cpu->pc; break;
+            case COND_CCR:
+                *++top = (cpu->status & 0xF0) | FLAG_N(cpu) << 3 | FLAG_Z(cpu) << 2 | FLAG_V(cpu) << 1 | FLAG_C(cpu);
+                break;
+            case COND_FLAG_C: *++top = FLAG_C(cpu); break;
+            case COND_FLAG_V: *++top = FLAG_V(cpu); break;
+            case COND_FLAG_Z: *++top = FLAG_Z(cpu); break;
+            case COND_FLAG_N: *++top = FLAG_N(cpu); break;
+            case COND_FLAG_I: *++top = cpu->i; break;
+            case COND_FLAG_H: *++top = cpu->h; break;
+            case COND_MEMORY: *top = cpu->memory[(u16) *top]; break;
+            case COND_PORT: *top = *top >= 0 && *top < MAX_PORTS ? cpu->ports[*top] : 0; break;
+            case COND_NOT: *top = !*top; break;
+            case COND_COMPL: *top = ~*top; break;
+            case COND_NEG: *top = -*top; break;
+            case COND_ADD: top--; *top = top[0] + top[1]; break;
+            case COND_SUB: top--; *top = top[0] - top[1]; break;
+            case COND_AND: top--; *top = top[0] & top[1]; break;
+            case COND_OR: top--; *top = top[0] | top[1]; break;
+            case COND_XOR: top--; *top = top[0] ^ top[1]; break;
+            case COND_EQ: top--; *top = top[0] == top[1]; break;
+            case COND_NE: top--; *top = top[0] != top[1]; break;
+            case COND_LT: top--; *top = top[0] < top[1]; break;
+            case COND_LE: top--; *top = top[0] <= top[1]; break;
+            case COND_GT: top--; *top = top[0] > top[1]; break;
+            case COND_GE: top--; *top = top[0] >= top[1]; break;
+            case COND_LAND: top--; *top = top[0] && top[1]; break;
+            case COND_LOR: top--; *top = top[0] || top[1]; break;
+        }
+    }
+}
+
+// The breakpoint at pc stops the run, when it has a condition only if it holds
+u8 breakpoint_holds(const cpu *cpu) {
+    if (!DEBUG_BIT(cpu->debug->conditional, cpu->pc)) {
+        return 1;
+    }
+    return condition_holds(cpu, find_condition(cpu->debug, cpu->pc));
+}
+
+// Breakpoint at addr that only stops when text holds, see compile_condition. Returns NULL,
+// or what is wrong with the condition and nothing changes.
+const char *set_conditional_breakpoint(cpu *cpu, u16 addr, const char *text) {
+    debug_points *d = debug_points_of(cpu);
+    condition c = {addr, {0}, {0}};
+    const char *error = compile_condition(cpu, text, &c);
+    if (error != NULL) {
+        return error;
+    }
+    condition *slot = find_condition(d, addr);
+    if (slot == NULL) {
+        if (d->condition_count == MAX_CONDITIONS) {
+            return "Too many conditional breakpoints";
+        }
+        slot = &d->conditions[d->condition_count++];
+    }
+    *slot = c;
+    set_debug_bit(d->breaks, addr, 1);
+    set_debug_bit(d->conditional, addr, 1);
+    return NULL;
+}
+
+// Every breakpoint and watchpoint is removed, run_cpu goes back to its usual loop
+void clear_debug_points(cpu *cpu) {
+    free(cpu->debug);
+    cpu->debug = NULL;
+}
+
+static run_result run_to_return(cpu *cpu, u32 out_sp) {
+    debug_points_of(cpu)->out_sp = out_sp;
+    run_result r = run_cpu(cpu, &(run_limits) {0, 0, NO_STOP_PC});
+    cpu->debug->out_sp = UINT32_MAX;
+    return r;
+}
+
+// Runs the instruction at pc. A call, JSR, BSR or SWI, runs until it returns, or until
+// something else stops it.
+run_result step_over(cpu *cpu) {
+    u16 code = inst_code_at(cpu->memory, cpu->pc);
+    if (code == 0x8D || code == 0x9D || code == 0xAD || code == 0xBD || code == 0x18AD || code == 0x3F) {
+        return run_to_return(cpu, cpu->sp); // Returning puts sp back where it is
+    }
+    return run_cpu(cpu, &(run_limits) {1, 0, NO_STOP_PC});
+}
+
+// Runs until the subroutine pc is in returns. Returns of the calls it makes leave sp
+// where it is now, its own goes above.
+run_result step_out(cpu *cpu) {
+    return run_to_return(cpu, (u32) cpu->sp + 1);
+}
+
+const char *stop_reason_name(stop_reason reason) {
+    switch (reason) {
+        case STOP_HALT: return "halt";
+        case STOP_INSTRUCTIONS: return "instructions";
+        case STOP_CYCLES: return "cycles";
+        case STOP_PC: return "pc";
+        case STOP_IDLE: return "idle";
+        case STOP_SLEEP: return "sleep";
+        case STOP_BREAK: return "breakpoint";
+        case STOP_WATCH: return "watchpoint";
+        case STOP_RETURN: return "return";
+        case STOP_BREAK_IN: return "break-in";
+    }
+    return "?";
+}
+
+// Time the executed cycles take on hardware clocked by a xtal_hz crystal
+double cycles_to_seconds(u64 cycles, double xtal_hz) {
+    return cycles * 4.0 / xtal_hz;
+}
+
+/*****************************
+*          GDB stub          *
+*****************************/
+
+// Remote serial protocol packets, the connection itself is left to the caller (see gdb_serve
+// in main.c). Registers go in the order of GDB's m68hc11 target, big endian: x d y sp pc
+// (2 bytes) then a b ccr (1 byte).
+
+#define GDB_PACKET_SIZE 4096
+#define GDB_REGISTERS 8
+
+typedef enum {
+    GDB_REPLY,    // The reply is ready to send
+    GDB_CONTINUE, // Run, the reply is the stop that ends it
+    GDB_STEP,
+    GDB_DETACH,   // Reply, then end the session
+    GDB_KILL,     // End the session without a reply
+} gdb_action;
+
+typedef struct {
+    u8 no_ack; // After QStartNoAckMode, packets are neither acknowledged nor expected to be
+} gdb_session;
+
+static void gdb_put_hex(char **out, u32 v, u8 bytes) {
+    static const char digits[] = "0123456789abcdef";
+    for (int shift = bytes * 8 - 4; shift >= 0; shift -= 4) {
+        *(*out)++ = digits[(v >> shift) & 0xF];
+    }
+    **out = '\0';
+}
+
+// Reads hex digits from *s, at most max of them, 0 for any number. Returns 0 when there is none.
+static u8 gdb_get_hex(const char **s, u32 *v, u8 max) {
+    u8 n = 0;
+    *v = 0;
+    while ((max == 0 || n < max) && isxdigit((unsigned char) **s)) {
+        char c = tolower((unsigned char) *(*s)++);
+        *v = *v << 4 | (u32) (c <= '9' ? c - '0' : c - 'a' + 10);
+        n++;
+    }
+    return n != 0;
+}
+
+static u32 gdb_register(cpu *cpu, u8 n) {
+    switch (n) {
+        case 0: return cpu->ix;
+        case 1: return cpu->d;
+        case 2: return cpu->iy;
+        case 3: return cpu->sp;
+        case 4: return cpu->pc;
+        case 5: return cpu->a;
+        case 6: return cpu->b;
+        default:
+            SYNC_FLAGS(cpu);
+            return cpu->status;
+    }
+}
+
+static void gdb_set_register(cpu *cpu, u8 n, u32 v) {
+    switch (n) {
+        case 0: cpu->ix = v; break;
+        case 1: cpu->d = v; break;
+        case 2: cpu->iy = v; break;
+        case 3: cpu->sp = v; break;
+        case 4: cpu->pc = v; break;
+        case 5: cpu->a = v; break;
+        case 6: cpu->b = v; break;
+        default:
+            cpu->status = v;
+            LOAD_FLAGS(cpu);
+    }
+}
+
+static u8 gdb_register_size(u8 n) {
+    return n < 5 ? 2 : 1;
+}
+
+// Writes like a store would, without the watchpoints, the undo log or the I/O registers
+static void gdb_poke(cpu *cpu, u16 addr, u8 v) {
+    cpu->memory[addr] = v;
+    cpu->dirty[addr >> 8] = 1;
+    if (cpu->code_map != NULL && (cpu->code_map[addr >> 3] >> (addr & 7)) & 1) {
+        invalidate_code(cpu, addr);
+    }
+}
+
+// Z and z packets: type 0 and 1 are breakpoints, 2 3 4 write, read and access watchpoints
+static u8 gdb_debug_point(cpu *cpu, const char *args, u8 insert) {
+    u32 type, addr, len;
+    if (!gdb_get_hex(&args, &type, 1) || *args++ != ',' || !gdb_get_hex(&args, &addr, 4)
+            || *args++ != ',' || !gdb_get_hex(&args, &len, 4) || type > 4) {
+        return 0;
+    }
+    if (type <= 1) {
+        set_breakpoint(cpu, addr, insert);
+        return 1;
+    }
+    u8 kinds = type == 2 ? WATCH_WRITE : (type == 3 ? WATCH_READ : WATCH_READ | WATCH_WRITE);
+    for (u32 i = 0; i < len && addr + i < MAX_MEMORY; ++i) {
+        u16 a = addr + i;
+        u8 set = 0;
+        if (cpu->debug != NULL) {
+            set = DEBUG_BIT(cpu->debug->reads, a) * WATCH_READ | DEBUG_BIT(cpu->debug->writes, a) * WATCH_WRITE;
+        }
+        set_watchpoint(cpu, a, insert ? set | kinds : set & ~kinds);
+    }
+    return 1;
+}
+
+// Answers packet, its data without $ and checksum, in reply which holds GDB_PACKET_SIZE bytes.
+// Packets that are not supported get the empty reply.
+gdb_action gdb_handle_packet(cpu *cpu, gdb_session *session, const char *packet, char *reply) {
+    const char *args = packet + 1;
+    char *out = reply;
+    u32 addr, len, v;
+    *reply = '\0';
+    switch (packet[0]) {
+        case '?': strcpy(reply, "S05"); break;
+        case 'g':
+            for (u8 n = 0; n < GDB_REGISTERS; ++n) {
+                gdb_put_hex(&out, gdb_register(cpu, n), gdb_register_size(n));
+            }
+            break;
+        case 'G':
+            for (u8 n = 0; n < GDB_REGISTERS; ++n) {
+                if (!gdb_get_hex(&args, &v, gdb_register_size(n) * 2)) {
+                    strcpy(reply, "E01");
+                    return GDB_REPLY;
+                }
+                gdb_set_register(cpu, n, v);
+            }
+            strcpy(reply, "OK");
+            break;
+        case 'p':
+            if (!gdb_get_hex(&args, &v, 0) || v >= GDB_REGISTERS) {
+                strcpy(reply, "E01");
+                break;
+            }
+            gdb_put_hex(&out, gdb_register(cpu, v), gdb_register_size(v));
+            break;
+        case 'P': {
+            u32 n;
+            if (!gdb_get_hex(&args, &n, 0) || n >= GDB_REGISTERS || *args++ != '='
+                    || !gdb_get_hex(&args, &v, gdb_register_size(n) * 2)) {
+                strcpy(reply, "E01");
+                break;
+            }
+            gdb_set_register(cpu, n, v);
+            strcpy(reply, "OK");
+        } break;
+        case 'm':
+            if (!gdb_get_hex(&args, &addr, 0) || *args++ != ',' || !gdb_get_hex(&args, &len, 0)
+                    || len > (GDB_PACKET_SIZE - 1) / 2) {
+                strcpy(reply, "E01");
+                break;
+            }
+            for (u32 i = 0; i < len; ++i) {
+                gdb_put_hex(&out, cpu->memory[(u16) (addr + i)], 1);
+            }
+            break;
+        case 'M':
+            if (!gdb_get_hex(&args, &addr, 0) || *args++ != ',' || !gdb_get_hex(&args, &len, 0)
+                    || *args++ != ':') {
+                strcpy(reply, "E01");
+                break;
+            }
+            for (u32 i = 0; i < len; ++i) {
+                if (!gdb_get_hex(&args, &v, 2)) {
+                    strcpy(reply, "E01");
+                    return GDB_REPLY;
+                }
+                gdb_poke(cpu, addr + i, v);
+            }
+            strcpy(reply, "OK");
+            break;
+        case 'c':
+        case 's':
+            if (gdb_get_hex(&args, &addr, 0)) {
+                cpu->pc = addr;
+            }
+            return packet[0] == 'c' ? GDB_CONTINUE : GDB_STEP;
+        case 'Z':
+        case 'z':
+            if (gdb_debug_point(cpu, args, packet[0] == 'Z')) {
+                strcpy(reply, "OK");
+            }
+            break;
+        case 'H': strcpy(reply, "OK"); break;
+        case 'D': strcpy(reply, "OK"); return GDB_DETACH;
+        case 'k': return GDB_KILL;
+        case 'q':
+            if (strncmp(packet, "qSupported", 10) == 0) {
+                sprintf(reply, "PacketSize=%x;QStartNoAckMode+", GDB_PACKET_SIZE);
+            } else if (strcmp(packet, "qAttached") == 0) {
+                strcpy(reply, "1");
+            }
+            break;
+        case 'Q':
+            if (strcmp(packet, "QStartNoAckMode") == 0) {
+                session->no_ack = 1; // This packet itself was acknowledged already
+                strcpy(reply, "OK");
+            }
+            break;
+        default: break;
+    }
+    return GDB_REPLY;
+}
+
+// Stop reply once a continue or a step ends with r. A halt on opcode 0x00 is reported as a
+// trap too so the final state can still be read.
+void gdb_stop_reply(const cpu *cpu, run_result r, char *reply) {
+    if (r.reason == STOP_WATCH) {
+        sprintf(reply, "T05%swatch:%04x;", cpu->debug->hit == DEBUG_READ ? "r" : "", cpu->debug->hit_addr);
+    } else {
+        strcpy(reply, "S05");
+    }
+}
+
+// Writes data as a packet, $data#checksum, in frame which holds GDB_PACKET_SIZE + 4 bytes.
+// Returns the length of the frame.
+size_t gdb_frame_packet(const char *data, char *frame) {
+    u8 sum = 0;
+    size_t len = strlen(data);
+    for (size_t i = 0; i < len; ++i) {
+        sum += (u8) data[i];
+    }
+    snprintf(frame, GDB_PACKET_SIZE + 4, "$%s#%02x", data, sum);
+    return len + 4;
+}
+
+/*****************************
+*            JIT             *
+*****************************/
+#ifdef EMULATOR_JIT
+#ifndef __x86_64__
+#error "EMULATOR_JIT only targets x86-64"
+#endif
+
+// Field offsets in cpu, the type name is shadowed by the cpu parameters below
+static const u32 jit_pc = offsetof(cpu, pc);
+static const u32 jit_sp = offsetof(cpu, sp);
+static const u32 jit_a = offsetof(cpu, a);
+static const u32 jit_b = offsetof(cpu, b);
+static const u32 jit_status = offsetof(cpu, status);
+static const u32 jit_cycles = offsetof(cpu, cycles);
+static const u32 jit_cc_nz = offsetof(cpu, cc_nz);
+static const u32 jit_cc_v = offsetof(cpu, cc_v);
+static const u32 jit_cc_c = offsetof(cpu, cc_c);
+
+static void jit_emit8(u8 **p, u8 v) {
+    *(*p)++ = v;
+}
+
+static void jit_emit16(u8 **p, u16 v) {
+    jit_emit8(p, v & 0xFF);
+    jit_emit8(p, v >> 8);
+}
+
+static void jit_emit32(u8 **p, u32 v) {
+    jit_emit16(p, v & 0xFFFF);
+    jit_emit16(p, v >> 16);
+}
+
+static void jit_emit64(u8 **p, uint64_t v) {
+    jit_emit32(p, v & 0xFFFFFFFF);
+    jit_emit32(p, v >> 32);
+}
+
+// All memory operands are [rbx + disp32], rbx holding the cpu pointer for the whole block
+static void jit_emit_mov_mem8(u8 **p, u32 disp, u8 imm) {
+    jit_emit8(p, 0xC6); jit_emit8(p, 0x83); jit_emit32(p, disp); jit_emit8(p, imm);
+}
+
+static void jit_emit_mov_mem16(u8 **p, u32 disp, u16 imm) {
+    jit_emit8(p, 0x66); jit_emit8(p, 0xC7); jit_emit8(p, 0x83); jit_emit32(p, disp); jit_emit16(p, imm);
+}
+
+static void jit_emit_mov_mem32(u8 **p, u32 disp, u32 imm) {
+    jit_emit8(p, 0xC7); jit_emit8(p, 0x83); jit_emit32(p, disp); jit_emit32(p, imm);
+}
+
+static void jit_emit_and_mem8(u8 **p, u32 disp, u8 imm) {
+    jit_emit8(p, 0x80); jit_emit8(p, 0xA3); jit_emit32(p, disp); jit_emit8(p, imm);
+}
+
+static void jit_emit_or_mem8(u8 **p, u32 disp, u8 imm) {
+    jit_emit8(p, 0x80); jit_emit8(p, 0x8B); jit_emit32(p, disp); jit_emit8(p, imm);
+}
+
+static void jit_emit_add_mem64(u8 **p, u32 disp, u32 imm) {
+    jit_emit8(p, 0x48); jit_emit8(p, 0x81); jit_emit8(p, 0x83); jit_emit32(p, disp); jit_emit32(p, imm);
+}
+
+static void jit_emit_inc_mem16(u8 **p, u32 disp) {
+    jit_emit8(p, 0x66); jit_emit8(p, 0xFF); jit_emit8(p, 0x83); jit_emit32(p, disp);
+}
+
+static void jit_emit_dec_mem16(u8 **p, u32 disp) {
+    jit_emit8(p, 0x66); jit_emit8(p, 0xFF); jit_emit8(p, 0x8B); jit_emit32(p, disp);
+}
+
+// mov rax, imm64
+static void jit_emit_mov_rax(u8 **p, const void *ptr) {
+    uint64_t v = 0;
+    memcpy(&v, &ptr, sizeof(ptr));
+    jit_emit8(p, 0x48); jit_emit8(p, 0xB8); jit_emit64(p, v);
+}
+
+// Calls the interpreter handler of the instruction at addr
+static void jit_emit_call(u8 **p, u16 addr, void (*func) (cpu *cpu)) {
+    const void *ptr = NULL;
+    memcpy(&ptr, &func, sizeof(ptr));
+    jit_emit_mov_mem16(p, jit_pc, addr);
+    jit_emit8(p, 0x48); jit_emit8(p, 0x89); jit_emit8(p, 0xDF); // mov rdi, rbx
+    jit_emit_mov_rax(p, ptr);
+    jit_emit8(p, 0xFF); jit_emit8(p, 0xD0); // call rax
+}
+
+// Leaves the block with pc pointing at the next instruction to execute
+static void jit_emit_exit(u8 **p, u16 next) {
+    jit_emit_mov_mem16(p, jit_pc, next);
+    jit_emit8(p, 0x5B); // pop rbx
+    jit_emit8(p, 0xC3); // ret
+}
+
+// Leaves the block if the last handler wrote over translated code
+static void jit_emit_check_invalidated(u8 **p, jit_state *jit, u16 next) {
+    jit_emit_mov_rax(p, &jit->invalidated);
+    jit_emit8(p, 0x80); jit_emit8(p, 0x38); jit_emit8(p, 0x00); // cmp byte [rax], 0
+    jit_emit8(p, 0x74); jit_emit8(p, 11);                       // je over the exit
+    jit_emit_exit(p, next);
+}
+
+// Native translation of the simplest instructions, returns 0 if the handler has to be called
+static u8 jit_emit_inline(u8 **p, u8 opcode, u8 operand) {
+    switch (opcode) {
+        case 0x01: return 1; // NOP
+        case 0x31: jit_emit_inc_mem16(p, jit_sp); return 1; // INS
+        case 0x34: jit_emit_dec_mem16(p, jit_sp); return 1; // DES
+        case 0x0E: jit_emit_and_mem8(p, jit_status, (u8) ~IRQ); return 1; // CLI
+        case 0x0F: jit_emit_or_mem8(p, jit_status, IRQ); return 1;  // SEI
+        case 0x86:   // LDAA #
+        case 0xC6:   // LDAB #
+            // Flags only depend on the immediate value, they are known at translation time
+            jit_emit_mov_mem8(p, opcode == 0x86 ? jit_a : jit_b, operand);
+            jit_emit_mov_mem32(p, jit_cc_nz, SEXT8(operand));
+            jit_emit_mov_mem8(p, jit_cc_v, V_CLEAR);
+            return 1;
+        case 0x4F:   // CLRA
+        case 0x5F:   // CLRB
+            jit_emit_mov_mem8(p, opcode == 0x4F ? jit_a : jit_b, 0);
+            jit_emit_mov_mem32(p, jit_cc_nz, 0);
+            jit_emit_mov_mem8(p, jit_cc_v, V_CLEAR);
+            jit_emit_mov_mem8(p, jit_cc_c, 0);
+            return 1;
+        default: return 0;
+    }
+}
+
+jit_state *get_jit(cpu *cpu) {
+    if (cpu->jit != NULL) {
+        return cpu->jit;
+    }
+    jit_state *jit = calloc(1, sizeof(jit_state));
+    if (jit == NULL) {
+        ERROR("%s", "calloc");
+    }
+    jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->code == MAP_FAILED) {
+        ERROR("%s", "mmap");
+    }
+
+    cpu->jit = jit;
+    return jit;
+}
+
+void jit_flush(cpu *cpu) {
+    jit_state *jit = cpu->jit;
+    jit->code_used = 0;
+    jit->block_count = 0;
+    memset(jit->entry, 0, sizeof(jit->entry));
+    jit->invalidated = 1;
+}
+
+// Drops every block containing addr
+void jit_invalidate(cpu *cpu, u16 addr) {
+    jit_state *jit = cpu->jit;
+    for (u16 i = 0; i < jit->block_count; ++i) {
+        jit_block *block = &jit->blocks[i];
+        if (block->live && addr >= block->start && addr < block->end) {
+            block->live = 0;
+            jit->entry[block->start] = NULL;
+            jit->invalidated = 1;
+        }
+    }
+}
+
+// Translates the basic block starting at start. Returns NULL if its first instruction is unknown.
+jit_block *jit_translate(cpu *cpu, u16 start) {
+    jit_state *jit = cpu->jit;
+    if (jit->block_count == JIT_MAX_BLOCKS
+            || jit->code_used + (JIT_MAX_BLOCK_INSTS + 1) * JIT_MAX_INST_BYTES > JIT_CODE_SIZE) {
+        jit_flush(cpu);
+    }
+
+    u8 *begin = jit->code + jit->code_used;
+    u8 *p = begin;
+    jit_emit8(&p, 0x53);                                    // push rbx
+    jit_emit8(&p, 0x48); jit_emit8(&p, 0x89); jit_emit8(&p, 0xFB); // mov rbx, rdi
+
+    u32 addr = start;
+    u16 count = 0;
+    for (;;) {
+        u8 opcode = cpu->memory[(u16) addr];
+        if (instr_slow[opcode] || instr_func[opcode] == NULL || count == JIT_MAX_BLOCK_INSTS || addr > 0xFFFF) {
+            // Left to the dispatcher
+            if (count == 0) {
+                return NULL;
+            }
+            jit_emit_exit(&p, addr);
+            break;
+        }
+        u8 len = inst_len_at(cpu->memory, addr);
+        if (instr_cycles[opcode] != 0) {
+            jit_emit_add_mem64(&p, jit_cycles, instr_cycles[opcode]);
+        }
+        if (is_block_end(inst_code_at(cpu->memory, addr))) {
+            jit_emit_call(&p, addr, instr_func[opcode]);
+            if (instr_taken_cycles[opcode] != 0) {
+                u16 last = addr + len - 1; // Where pc is left when the branch is not taken
+                jit_emit8(&p, 0x0F); jit_emit8(&p, 0xB7); jit_emit8(&p, 0x83); jit_emit32(&p, jit_pc); // movzx eax, word [rbx + pc]
+                jit_emit8(&p, 0x66); jit_emit8(&p, 0x3D); jit_emit16(&p, last); // cmp ax, last
+                jit_emit8(&p, 0x74); jit_emit8(&p, 11);                         // je over the add
+                jit_emit_add_mem64(&p, jit_cycles, instr_taken_cycles[opcode]);
+            }
+            jit_emit_inc_mem16(&p, jit_pc);
+            jit_emit8(&p, 0x5B); // pop rbx
+            jit_emit8(&p, 0xC3); // ret
+            addr += len;
+            break;
+        }
+        if (!jit_emit_inline(&p, opcode, cpu->memory[(u16)(addr + 1)])) {
+            jit_emit_call(&p, addr, instr_func[opcode]);
+            jit_emit_check_invalidated(&p, jit, addr + len);
+        }
+        addr += len;
+        count++;
+    }
+
+    jit_block *block = &jit->blocks[jit->block_count++];
+    memcpy(&block->code, &begin, sizeof(begin));
+    block->start = start;
+    block->end = addr;
+    block->live = 1;
+    jit->code_used += p - begin;
+    jit->entry[start] = block;
+    mark_code(cpu, start, addr - start);
+    return block;
+}
+
+// Runs the program through translated blocks, each block ends on a branch, JSR, RTS or JMP.
+// Instructions without a native translation are executed by calling their handler from the block.
+// Events, interrupts and break-in are looked at between blocks, as exec_program_predecoded does.
+void exec_program_jit(cpu *cpu) {
+    jit_state *jit = get_jit(cpu);
+    u8 blocks = 0;
+    while (cpu->memory[cpu->pc] != 0x00) {
+        if (instr_slow[cpu->memory[cpu->pc]]) { // WAI or STOP
+            exec_inst(cpu);
+            if (!between_blocks(cpu)) {
+                break;
+            }
+            continue;
+        }
+        jit_block *block = jit->entry[cpu->pc];
+        if (block == NULL) {
+            block = jit_translate(cpu, cpu->pc);
+        }
+        if (block == NULL) { // Unknown opcode, skipped like exec_program does
+            cpu->pc++;
+            continue;
+        }
+        jit->invalidated = 0;
+        block->code(cpu);
+        if (!blocks_go_on(cpu, &blocks) && !between_blocks(cpu)) {
+            break;
+        }
+    }
+}
+#endif // EMULATOR_JIT
+
+void init_cpu(cpu *cpu, const char *fn) {
+    add_instructions_func();
+    cpu->next_event = UINT64_MAX;
+    set_default_regions(cpu);
+    set_default_ddr(cpu);
+    LOAD_FLAGS(cpu);
+    load_program(cpu, fn);
+}
+
+cpu *new_cpu(const char *fn) {
+    cpu *c = calloc(1, sizeof(cpu));
+    init_cpu(c, fn);
+    return c;
+}
+
+/*****************************
+*           BATCH            *
+*****************************/
+
+#define BATCH_MAX_RANGES 4
+#define BATCH_MAX_THREADS 256
+
+typedef struct {
+    u16 program;    // Index in batch.programs
+    u8 ports[MAX_PORTS];
+    u8 ports_set;   // One bit per port given in the manifest
+    u64 budget;     // Maximum number of instructions, 0 runs until opcode 0x00
+    u16 ranges[BATCH_MAX_RANGES][2]; // Inclusive memory ranges copied to the result
+    u8 range_count;
+} batch_job;
+
+typedef struct {
+    u8 a, b, status;
+    u16 sp, pc;
+    u64 cycles;
+    u64 instructions;
+    stop_reason reason; // STOP_HALT, STOP_INSTRUCTIONS when the budget ran out or STOP_IDLE
+    u8 *memory;     // The job's ranges one after the other
+} batch_result;
+
+typedef struct {
+    char **paths;
+    snapshot **programs; // Assembled once, restored into the worker cpu for every job
+    u16 program_count;
+    batch_job *jobs;
+    batch_result *results;
+    u32 job_count;
+} batch;
+
+// Jobs of one worker. The owner pops from the tail, idle workers steal from the head.
+typedef struct {
+    mtx_t lock;
+    u32 *jobs;
+    u32 head;
+    u32 tail;
+} batch_queue;
+
+typedef struct {
+    batch *batch;
+    batch_queue *queues;
+    u32 count;
+    u32 id;
+} batch_worker;
+
+static u16 batch_program(batch *b, const char *path) {
+    for (u16 i = 0; i < b->program_count; ++i) {
+        if (strcmp(b->paths[i], path) == 0) {
+            return i;
+        }
+    }
+    b->paths = realloc(b->paths, (b->program_count + 1) * sizeof(*b->paths));
+    b->programs = realloc(b->programs, (b->program_count + 1) * sizeof(*b->programs));
+    if (b->paths == NULL || b->programs == NULL) {
+        ERROR("%s", "realloc");
+    }
+    u32 line = file_line;
+    b->paths[b->program_count] = (char *) str_dup(path);
+    cpu *cpu = new_cpu(path);
+    b->programs[b->program_count] = take_snapshot(cpu);
+    destroy_cpu(cpu);
+    file_line = line;
+    return b->program_count++;
+}
+
+// <name>=<value> pairs separated by commas, names being the port letters a to e
+static void batch_parse_ports(batch_job *job, char *str) {
+    if (strcmp(str, "-") == 0) {
+        return;
+    }
+    for (char *p = str; *p;) {
+        u8 port = tolower(*p) - 'a';
+        if (port >= MAX_PORTS || p[1] != '=') {
+            ERROR("Invalid port `%s`, expected <a-e>=<value>", p);
+        }
+        char *end;
+        long value = strtol(p + 2, &end, 0);
+        if (end == p + 2 || value < 0 || value > 0xFF || (*end != ',' && *end != '\0')) {
+            ERROR("Invalid port value `%s`", p + 2);
+        }
+        job->ports[port] = value;
+        job->ports_set |= 1 << port;
+        p = *end == ',' ? end + 1 : end;
+    }
+}
+
+// <start>-<end> ranges separated by commas
+static void batch_parse_ranges(batch_job *job, char *str) {
+    if (strcmp(str, "-") == 0) {
+        return;
+    }
+    for (char *p = str; *p;) {
+        if (job->range_count == BATCH_MAX_RANGES) {
+            ERROR("At most %d memory ranges per job", BATCH_MAX_RANGES);
+        }
+        char *end;
+        long start = strtol(p, &end, 0);
+        long last = start;
+        if (*end == '-') {
+            char *sep = end;
+            last = strtol(sep + 1, &end, 0);
+            if (end == sep + 1) {
+                ERROR("Invalid memory range `%s`", p);
+            }
+        }
+        if (end == p || start < 0 || last < start || last >= MAX_MEMORY || (*end != ',' && *end != '\0')) {
+            ERROR("Invalid memory range `%s`", p);
+        }
+        job->ranges[job->range_count][0] = start;
+        job->ranges[job->range_count][1] = last;
+        job->range_count++;
+        p = *end == ',' ? end + 1 : end;
+    }
+}
+
+// One job per line: <program> <ports|-> <instruction budget> [ranges|-]
+// Each distinct program is assembled once.
+batch *load_batch(const char *manifest_path) {
+    FILE *f = fopen(manifest_path, "r");
+    if (!f) {
+        ERROR("Error while opennig file : %s\n", manifest_path);
+    }
+    batch *b = calloc(1, sizeof(batch));
+    if (b == NULL) {
+        ERROR("%s", "calloc");
+    }
+
+    char buf[256];
+    file_line = 0;
+    while (fgets(buf, sizeof(buf), f) != NULL) {
+        file_line++;
+        buf[strcspn(buf, "#")] = '\0';
+        char *parts[5] = {0};
+        // split_by_space keeps the first column for labels, a line always starts with a space
+        char line[sizeof(buf) + 1] = " ";
+        strcat(line, buf);
+        u8 nb_parts = split_by_space(line, parts, 5);
+        if (nb_parts <= 1) {
+            continue; // Empty line or only a comment
+        }
+        if (nb_parts < 4) {
+            ERROR("%s", "Job format : <program> <ports|-> <instruction budget> [ranges|-]");
+        }
+
+        b->jobs = realloc(b->jobs, (b->job_count + 1) * sizeof(batch_job));
+        if (b->jobs == NULL) {
+            ERROR("%s", "realloc");
+        }
+        batch_job *job = &b->jobs[b->job_count++];
+        memset(job, 0, sizeof(*job));
+        batch_parse_ports(job, parts[2]);
+        char *end;
+        job->budget = strtoull(parts[3], &end, 0);
+        if (*end != '\0') {
+            ERROR("Invalid instruction budget `%s`", parts[3]);
+        }
+        if (nb_parts > 4) {
+            batch_parse_ranges(job, parts[4]);
+        }
+        job->program = batch_program(b, parts[1]);
+    }
+    fclose(f);
+
+    b->results = calloc(b->job_count, sizeof(batch_result));
+    if (b->results == NULL && b->job_count != 0) {
+        ERROR("%s", "calloc");
+    }
+    return b;
+}
+
+static void batch_run_job(batch *b, u32 index, cpu *cpu) {
+    batch_job *job = &b->jobs[index];
+    batch_result *res = &b->results[index];
+
+    // Only the pages the previous job wrote are copied back, the caches built from
+    // code that did not change are kept
+    restore_snapshot(cpu, b->programs[job->program]);
+    for (u8 i = 0; i < MAX_PORTS; ++i) {
+        if ((job->ports_set >> i) & 1) {
+            cpu->ports[i] = job->ports[i];
+        }
+    }
+
+    run_limits limits = {job->budget, 0, NO_STOP_PC};
+    run_result run = run_cpu(cpu, &limits);
+
+    SYNC_FLAGS(cpu);
+    res->a = cpu->a;
+    res->b = cpu->b;
+    res->status = cpu->status;
+    res->sp = cpu->sp;
+    res->pc = cpu->pc;
+    res->cycles = cpu->cycles;
+    res->instructions = run.instructions;
+    res->reason = run.reason;
+
+    u32 size = 0;
+    for (u8 i = 0; i < job->range_count; ++i) {
+        size += job->ranges[i][1] - job->ranges[i][0] + 1;
+    }
+    res->memory = malloc(size != 0 ? size : 1);
+    if (res->memory == NULL) {
+        ERROR("%s", "malloc");
+    }
+    u8 *out = res->memory;
+    for (u8 i = 0; i < job->range_count; ++i) {
+        u32 len = job->ranges[i][1] - job->ranges[i][0] + 1;
+        memcpy(out, cpu->memory + job->ranges[i][0], len);
+        out += len;
+    }
+}
+
+static u8 batch_pop(batch_queue *q, u32 *job) {
+    mtx_lock(&q->lock);
+    u8 found = q->head != q->tail;
+    if (found) {
+        *job = q->jobs[--q->tail];
+    }
+    mtx_unlock(&q->lock);
+    return found;
+}
+
+static u8 batch_steal(batch_queue *q, u32 *job) {
+    mtx_lock(&q->lock);
+    u8 found = q->head != q->tail;
+    if (found) {
+        *job = q->jobs[q->head++];
+    }
+    mtx_unlock(&q->lock);
+    return found;
+}
+
+static int batch_worker_main(void *arg) {
+    batch_worker *w = arg;
+    cpu *cpu = calloc(1, sizeof(*cpu));
+    if (cpu == NULL) {
+        ERROR("%s", "calloc");
+    }
+    for (;;) {
+        u32 job;
+        u8 found = batch_pop(&w->queues[w->id], &job);
+        for (u32 i = 1; !found && i < w->count; ++i) {
+            found = batch_steal(&w->queues[(w->id + i) % w->count], &job);
+        }
+        if (!found) {
+            break; // Jobs never create new jobs, every queue is empty for good
+        }
+        batch_run_job(w->batch, job, cpu);
+    }
+    destroy_cpu(cpu);
+    return 0;
+}
+
+// Runs every job of the batch on `threads` workers, each with its own cpu
+void run_batch(batch *b, u32 threads) {
+    if (threads == 0) {
+        threads = 1;
+    }
+    if (threads > BATCH_MAX_THREADS) {
+        threads = BATCH_MAX_THREADS;
+    }
+    batch_queue *queues = calloc(threads, sizeof(batch_queue));
+    batch_worker *workers = calloc(threads, sizeof(batch_worker));
+    thrd_t *ids = calloc(threads, sizeof(thrd_t));
+    if (queues == NULL || workers == NULL || ids == NULL) {
+        ERROR("%s", "calloc");
+    }
+
+    // Jobs are dealt round robin, stealing evens out programs that run longer than others
+    for (u32 i = 0; i < threads; ++i) {
+        queues[i].jobs = malloc((b->job_count / threads + 1) * sizeof(u32));
+        if (queues[i].jobs == NULL) {
+            ERROR("%s", "malloc");
+        }
+        mtx_init(&queues[i].lock, mtx_plain);
+    }
+    for (u32 i = b->job_count; i-- > 0;) {
+        batch_queue *q = &queues[i % threads];
+        q->jobs[q->tail++] = i;
+    }
+
+    for (u32 i = 0; i < threads; ++i) {
+        workers[i] = (batch_worker) {b, queues, threads, i};
+        if (thrd_create(&ids[i], batch_worker_main, &workers[i]) != thrd_success) {
+            ERROR("%s", "thrd_create");
+        }
+    }
+    for (u32 i = 0; i < threads; ++i) {
+        thrd_join(ids[i], NULL);
+    }
+
+    for (u32 i = 0; i < threads; ++i) {
+        mtx_destroy(&queues[i].lock);
+        free(queues[i].jobs);
+    }
+    free(queues);
+    free(workers);
+    free(ids);
+}
+
+// One line per job, in manifest order
+void write_batch_results(const batch *b, FILE *out) {
+    for (u32 i = 0; i < b->job_count; ++i) {
+        const batch_job *job = &b->jobs[i];
+        const batch_result *res = &b->results[i];
+        fprintf(out, "%u %s %s inst=%llu cycles=%llu a=%02x b=%02x sp=%04x pc=%04x ccr=%02x",
+                i, b->paths[job->program], stop_reason_name(res->reason),
+                (unsigned long long) res->instructions, (unsigned long long) res->cycles,
+                res->a, res->b, res->sp, res->pc, res->status);
+        const u8 *mem = res->memory;
+        for (u8 r = 0; r < job->range_count; ++r) {
+            fprintf(out, " %04x:", job->ranges[r][0]);
+            for (u32 addr = job->ranges[r][0]; addr <= job->ranges[r][1]; ++addr) {
+                fprintf(out, "%02x", *mem++);
+            }
+        }
+        fprintf(out, "\n");
+    }
+}
+
+void free_batch(batch *b) {
+    for (u16 i = 0; i < b->program_count; ++i) {
+        free(b->paths[i]);
+        free_snapshot(b->programs[i]);
+    }
+    for (u32 i = 0; i < b->job_count; ++i) {
+        free(b->results[i].memory);
+    }
+    free(b->paths);
+    free(b->programs);
+    free(b->jobs);
+    free(b->results);
+    free(b);
+}
+
+/*****************************
+*          LOCKSTEP          *
+*****************************/
+
+// Runs many copies of a program side by side with their registers in
+// structure-of-arrays layout. While every lane is at the same pc the common
+// ALU instructions run as one vector operation over all lanes, anything else
+// is executed lane by lane. Lanes that take another path leave the group and
+// finish on their own.
+
+#define LOCKSTEP_ALIGN 32 // Lanes per AVX2 register
+
+typedef enum {
+    LS_SCALAR = 0, // Run lane by lane with exec_inst
+    LS_LD,
+    LS_ADD,
+    LS_ADC,
+    LS_SUB,
+    LS_CMP,
+    LS_AND,
+    LS_OR,
+    LS_EOR,
+    LS_ASL,
+    LS_LSR,
+    LS_ASR,
+    LS_ROL,
+    LS_ROR,
+    LS_INC,
+    LS_DEC,
+    LS_CLR,
+    LS_TST,
+    LS_COM,
+    LS_NEG,
+    LS_BRANCH,
+} lockstep_kind;
+
+typedef enum {
+    LS_REG_A,
+    LS_REG_B,
+    LS_OPERAND, // Immediate or memory operand, one byte per lane
+} lockstep_src;
+
+typedef enum {
+    LS_ALWAYS, LS_NEVER, LS_HI, LS_LS, LS_CC, LS_CS, LS_NE, LS_EQ,
+    LS_VC, LS_VS, LS_PL, LS_MI, LS_GE, LS_LT, LS_GT, LS_LE,
+} lockstep_cond;
+
+typedef struct {
+    void (*func) (cpu *cpu);
+    u8 kind;
+    u8 reg; // Register written, or the condition of a branch
+    u8 src;
+} lockstep_map;
+
+static const lockstep_map lockstep_maps[] = {
+    {INST_LDA_IMM, LS_LD, LS_REG_A, LS_OPERAND}, {INST_LDA_DIR, LS_LD, LS_REG_A, LS_OPERAND},
+    {INST_LDB_IMM, LS_LD, LS_REG_B, LS_OPERAND}, {INST_LDB_DIR, LS_LD, LS_REG_B, LS_OPERAND},
+    {INST_ADDA_IMM, LS_ADD, LS_REG_A, LS_OPERAND}, {INST_ADDA_DIR, LS_ADD, LS_REG_A, LS_OPERAND},
+    {INST_ADDA_EXT, LS_ADD, LS_REG_A, LS_OPERAND}, {INST_ADDB_IMM, LS_ADD, LS_REG_B, LS_OPERAND},
+    {INST_ADDB_DIR, LS_ADD, LS_REG_B, LS_OPERAND}, {INST_ADDB_EXT, LS_ADD, LS_REG_B, LS_OPERAND},
+    {INST_ADCA_IMM, LS_ADC, LS_REG_A, LS_OPERAND}, {INST_ADCA_DIR, LS_ADC, LS_REG_A, LS_OPERAND},
+    {INST_ADCA_EXT, LS_ADC, LS_REG_A, LS_OPERAND}, {INST_ADCB_IMM, LS_ADC, LS_REG_B, LS_OPERAND},
+    {INST_ADCB_DIR, LS_ADC, LS_REG_B, LS_OPERAND}, {INST_ADCB_EXT, LS_ADC, LS_REG_B, LS_OPERAND},
+    {INST_SUBA_IMM, LS_SUB, LS_REG_A, LS_OPERAND}, {INST_SUBA_DIR, LS_SUB, LS_REG_A, LS_OPERAND},
+    {INST_SUBA_EXT, LS_SUB, LS_REG_A, LS_OPERAND}, {INST_SUBB_IMM, LS_SUB, LS_REG_B, LS_OPERAND},
+    {INST_SUBB_DIR, LS_SUB, LS_REG_B, LS_OPERAND}, {INST_SUBB_EXT, LS_SUB, LS_REG_B, LS_OPERAND},
+    {INST_CMPA_IMM, LS_CMP, LS_REG_A, LS_OPERAND}, {INST_CMPA_DIR, LS_CMP, LS_REG_A, LS_OPERAND},
+    {INST_CMPA_EXT, LS_CMP, LS_REG_A, LS_OPERAND}, {INST_CMPB_IMM, LS_CMP, LS_REG_B, LS_OPERAND},
+    {INST_CMPB_DIR, LS_CMP, LS_REG_B, LS_OPERAND}, {INST_CMPB_EXT, LS_CMP, LS_REG_B, LS_OPERAND},
+    {INST_ANDA_IMM, LS_AND, LS_REG_A, LS_OPERAND}, {INST_ANDA_DIR, LS_AND, LS_REG_A, LS_OPERAND},
+    {INST_ANDA_EXT, LS_AND, LS_REG_A, LS_OPERAND}, {INST_ANDB_IMM, LS_AND, LS_REG_B, LS_OPERAND},
+    {INST_ANDB_DIR, LS_AND, LS_REG_B, LS_OPERAND}, {INST_ANDB_EXT, LS_AND, LS_REG_B, LS_OPERAND},
+    {INST_ORAA_IMM, LS_OR, LS_REG_A, LS_OPERAND}, {INST_ORAA_DIR, LS_OR, LS_REG_A, LS_OPERAND},
+    {INST_ORAA_EXT, LS_OR, LS_REG_A, LS_OPERAND}, {INST_ORAB_IMM, LS_OR, LS_REG_B, LS_OPERAND},
+    {INST_ORAB_DIR, LS_OR, LS_REG_B, LS_OPERAND}, {INST_ORAB_EXT, LS_OR, LS_REG_B, LS_OPERAND},
+    {INST_EORA_IMM, LS_EOR, LS_REG_A, LS_OPERAND}, {INST_EORA_DIR, LS_EOR, LS_REG_A, LS_OPERAND},
+    {INST_EORA_EXT, LS_EOR, LS_REG_A, LS_OPERAND}, {INST_EORB_IMM, LS_EOR, LS_REG_B, LS_OPERAND},
+    {INST_EORB_DIR, LS_EOR, LS_REG_B, LS_OPERAND}, {INST_EORB_EXT, LS_EOR, LS_REG_B, LS_OPERAND},
+    {INST_ABA, LS_ADD, LS_REG_A, LS_REG_B}, {INST_SBA_INH, LS_SUB, LS_REG_A, LS_REG_B},
+    {INST_CBA_INH, LS_CMP, LS_REG_A, LS_REG_B},
+    {INST_TAB_INH, LS_LD, LS_REG_B, LS_REG_A}, {INST_TBA_INH, LS_LD, LS_REG_A, LS_REG_B},
+    {INST_ASLA_INH, LS_ASL, LS_REG_A, LS_REG_A}, {INST_ASLB_INH, LS_ASL, LS_REG_B, LS_REG_B},
+    {INST_LSLA_INH, LS_ASL, LS_REG_A, LS_REG_A}, {INST_LSLB_INH, LS_ASL, LS_REG_B, LS_REG_B},
+    {INST_LSRA_INH, LS_LSR, LS_REG_A, LS_REG_A}, {INST_LSRB_INH, LS_LSR, LS_REG_B, LS_REG_B},
+    {INST_ASRA_INH, LS_ASR, LS_REG_A, LS_REG_A}, {INST_ASRB_INH, LS_ASR, LS_REG_B, LS_REG_B},
+    {INST_ROLA_INH, LS_ROL, LS_REG_A, LS_REG_A}, {INST_ROLB_INH, LS_ROL, LS_REG_B, LS_REG_B},
+    {INST_RORA_INH, LS_ROR, LS_REG_A, LS_REG_A}, {INST_RORB_INH, LS_ROR, LS_REG_B, LS_REG_B},
+    {INST_INCA_INH, LS_INC, LS_REG_A, LS_REG_A}, {INST_INCB_INH, LS_INC, LS_REG_B, LS_REG_B},
+    {INST_DECA_INH, LS_DEC, LS_REG_A, LS_REG_A}, {INST_DECB_INH, LS_DEC, LS_REG_B, LS_REG_B},
+    {INST_CLRA_INH, LS_CLR, LS_REG_A, LS_REG_A}, {INST_CLRB_INH, LS_CLR, LS_REG_B, LS_REG_B},
+    {INST_TSTA_INH, LS_TST, LS_REG_A, LS_REG_A}, {INST_TSTB_INH, LS_TST, LS_REG_B, LS_REG_B},
+    {INST_COMA_INH, LS_COM, LS_REG_A, LS_REG_A}, {INST_COMB_INH, LS_COM, LS_REG_B, LS_REG_B},
+    {INST_NEGA_INH, LS_NEG, LS_REG_A, LS_REG_A}, {INST_NEGB_INH, LS_NEG, LS_REG_B, LS_REG_B},
+    {INST_BRA, LS_BRANCH, LS_ALWAYS, 0}, {INST_BRN, LS_BRANCH, LS_NEVER, 0},
+    {INST_BHI, LS_BRANCH, LS_HI, 0}, {INST_BLS, LS_BRANCH, LS_LS, 0},
+    {INST_BCC, LS_BRANCH, LS_CC, 0}, {INST_BCS, LS_BRANCH, LS_CS, 0},
+    {INST_BNE, LS_BRANCH, LS_NE, 0}, {INST_BEQ, LS_BRANCH, LS_EQ, 0},
+    {INST_BVC, LS_BRANCH, LS_VC, 0}, {INST_BVS, LS_BRANCH, LS_VS, 0},
+    {INST_BPL, LS_BRANCH, LS_PL, 0}, {INST_BMI, LS_BRANCH, LS_MI, 0},
+    {INST_BGE, LS_BRANCH, LS_GE, 0}, {INST_BLT, LS_BRANCH, LS_LT, 0},
+    {INST_BGT, LS_BRANCH, LS_GT, 0}, {INST_BLE, LS_BRANCH, LS_LE, 0},
+};
+#define LOCKSTEP_MAP_COUNT (sizeof(lockstep_maps) / sizeof(lockstep_maps[0]))
+
+typedef struct {
+    u8 kind;
+    u8 reg;
+    u8 src;
+    u8 mode; // Addressing mode, tells how the operand is fetched
+} lockstep_op;
+
+static lockstep_op lockstep_ops[0x100];
+
+static void fill_lockstep_ops(void) {
+    add_instructions_func();
+    for (u8 i = 0; i < INSTRUCTION_COUNT; ++i) {
+        instruction *inst = &instructions[i];
+        for (operand_type type = NONE; type < OPERAND_TYPE_COUNT; ++type) {
+            if (inst->func[type] == NULL || inst->codes[type] > 0xFF) {
+                continue; // Prefixed instructions run lane by lane
+            }
+            for (u16 j = 0; j < LOCKSTEP_MAP_COUNT; ++j) {
+                const lockstep_map *m = &lockstep_maps[j];
+                if (m->func == inst->func[type]) {
+                    lockstep_ops[inst->codes[type]] = (lockstep_op) {m->kind, m->reg, m->src, type};
+                }
+            }
+        }
+    }
+}
+
+typedef struct {
+    u32 count;     // Lanes
+    u32 stride;    // count rounded up to LOCKSTEP_ALIGN, length of each array below
+    u16 pc;        // Shared by every lane still in the group
+    u8 *a;
+    u8 *b;
+    // One byte per flag and lane, 0 or 1
+    u8 *n;
+    u8 *z;
+    u8 *v;
+    u8 *c;
+    u8 *h;
+    u8 *operand;
+    u8 *active;    // Lane still runs with the group
+    u64 *instructions;
+    // Memory, ports and the rest of the machine state of every lane, the
+    // registers above are only copied in there when a lane leaves the group
+    cpu *lanes;
+    u8 *code_map;  // Bytes the group ran, a lane storing there leaves it
+    u64 steps;     // Instructions run by the group
+    u64 cycles;    // Cycles of the instructions run as vectors
+    u64 vector_steps;
+    u64 scalar_steps;
+    u32 splits;    // Lanes that left the group
+} lockstep;
+
+// Lanes start as copies of `program`, set their inputs in lanes[i] before run_lockstep
+lockstep *new_lockstep(const cpu *program, u32 count) {
+    static once_flag once = ONCE_FLAG_INIT;
+    call_once(&once, fill_lockstep_ops);
+
+    assert(count > 0);
+    lockstep *ls = calloc(1, sizeof(lockstep));
+    if (ls == NULL) {
+        ERROR("%s", "calloc");
+    }
+    ls->count = count;
+    ls->stride = (count + LOCKSTEP_ALIGN - 1) / LOCKSTEP_ALIGN * LOCKSTEP_ALIGN;
+    u8 **arrays[] = {&ls->a, &ls->b, &ls->n, &ls->z, &ls->v, &ls->c, &ls->h, &ls->operand, &ls->active};
+    for (u8 i = 0; i < sizeof(arrays) / sizeof(arrays[0]); ++i) {
+        *arrays[i] = aligned_alloc(LOCKSTEP_ALIGN, ls->stride);
+        if (*arrays[i] == NULL) {
+            ERROR("%s", "aligned_alloc");
+        }
+        memset(*arrays[i], 0, ls->stride);
+    }
+    ls->instructions = calloc(ls->stride, sizeof(u64));
+    ls->lanes = malloc(count * sizeof(cpu));
+    ls->code_map = calloc(MAX_MEMORY / 8, 1);
+    if (ls->instructions == NULL || ls->lanes == NULL || ls->code_map == NULL) {
+        ERROR("%s", "alloc");
+    }
+
+    cpu tpl = *program;
+    SYNC_FLAGS(&tpl);
+    ls->pc = tpl.pc;
+    for (u32 i = 0; i < count; ++i) {
+        cpu *lane = &ls->lanes[i];
+        memcpy(lane, &tpl, sizeof(cpu));
+        // Labels and caches stay with the program
+        lane->labels.count = 0;
+        lane->decoded = NULL;
+        lane->jit = NULL;
+        lane->traces = NULL;
+        lane->code_map = ls->code_map;
+        lane->code_writes = 0;
+        lane->shadow = NULL;
+        lane->undo = NULL;
+        lane->inputs = NULL;
+        lane->trace = NULL;
+        lane->debug = NULL;
+        lane->break_in = NULL;
+#ifdef EMULATOR_PROFILE
+        lane->profile = NULL;
+#endif
+        ls->a[i] = tpl.a;
+        ls->b[i] = tpl.b;
+        ls->n[i] = tpl.n;
+        ls->z[i] = tpl.z;
+        ls->v[i] = tpl.v;
+        ls->c[i] = tpl.c;
+        ls->h[i] = tpl.h;
+        ls->active[i] = 1;
+    }
+    return ls;
+}
+
+void free_lockstep(lockstep *ls) {
+    free(ls->a);
+    free(ls->b);
+    free(ls->n);
+    free(ls->z);
+    free(ls->v);
+    free(ls->c);
+    free(ls->h);
+    free(ls->operand);
+    free(ls->active);
+    free(ls->instructions);
+    free(ls->lanes);
+    free(ls->code_map);
+    free(ls);
+}
+
+// Copies the group registers of a lane into its cpu
+static void lockstep_store(lockstep *ls, u32 i) {
+    cpu *lane = &ls->lanes[i];
+    lane->a = ls->a[i];
+    lane->b = ls->b[i];
+    lane->n = ls->n[i];
+    lane->z = ls->z[i];
+    lane->v = ls->v[i];
+    lane->c = ls->c[i];
+    lane->h = ls->h[i];
+    lane->pc = ls->pc;
+    LOAD_FLAGS(lane);
+}
+
+static void lockstep_load(lockstep *ls, u32 i) {
+    cpu *lane = &ls->lanes[i];
+    SYNC_FLAGS(lane);
+    ls->a[i] = lane->a;
+    ls->b[i] = lane->b;
+    ls->n[i] = lane->n;
+    ls->z[i] = lane->z;
+    ls->v[i] = lane->v;
+    ls->c[i] = lane->c;
+    ls->h[i] = lane->h;
+}
+
+// The lane carries on alone from its cpu, which must be up to date
+static void lockstep_leave(lockstep *ls, u32 i) {
+    cpu *lane = &ls->lanes[i];
+    lane->code_map = NULL;
+    lane->cycles += ls->cycles;
+    ls->instructions[i] = ls->steps;
+    ls->active[i] = 0;
+}
+
+#ifdef __AVX2__
+#define LS_LOAD(p) _mm256_load_si256((const __m256i *) (p))
+#define LS_STORE(p, x) _mm256_store_si256((__m256i *) (p), (x))
+
+// 32 lanes per iteration, flags are kept as 0 or 1 bytes like in the scalar version
+static void lockstep_alu(lockstep *ls, u8 kind, u8 *reg, const u8 *src) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+    const __m256i ones = _mm256_set1_epi8(-1);
+    const __m256i low7 = _mm256_set1_epi8(0x7F);
+    const __m256i sign = _mm256_set1_epi8((char) 0x80);
+    for (u32 i = 0; i < ls->stride; i += LOCKSTEP_ALIGN) {
+        __m256i d = LS_LOAD(reg + i);
+        __m256i s = LS_LOAD(src + i);
+        __m256i c = LS_LOAD(ls->c + i);
+        __m256i v = LS_LOAD(ls->v + i);
+        __m256i r = d;
+        __m256i k;
+        switch (kind) {
+            case LS_LD: r = s; v = zero; break;
+            case LS_ADD:
+            case LS_ADC:
+                r = _mm256_add_epi8(d, s);
+                if (kind == LS_ADC) {
+                    r = _mm256_add_epi8(r, c);
+                }
+                k = _mm256_or_si256(_mm256_and_si256(d, s), _mm256_andnot_si256(r, _mm256_or_si256(d, s)));
+                LS_STORE(ls->h + i, _mm256_and_si256(_mm256_srli_epi16(k, 3), one));
+                v = _mm256_and_si256(_mm256_xor_si256(d, r), _mm256_xor_si256(s, r));
+                v = _mm256_and_si256(_mm256_cmpgt_epi8(zero, v), one);
+                c = _mm256_and_si256(_mm256_cmpgt_epi8(zero, k), one);
+                break;
+            case LS_SUB:
+            case LS_CMP:
+                r = _mm256_sub_epi8(d, s);
+                k = _mm256_or_si256(_mm256_andnot_si256(d, s), _mm256_and_si256(_mm256_or_si256(_mm256_xor_si256(d, ones), s), r));
+                v = _mm256_and_si256(_mm256_xor_si256(d, s), _mm256_xor_si256(d, r));
+                v = _mm256_and_si256(_mm256_cmpgt_epi8(zero, v), one);
+                c = _mm256_and_si256(_mm256_cmpgt_epi8(zero, k), one);
+                break;
+            case LS_AND: r = _mm256_and_si256(d, s); v = zero; break;
+            case LS_OR:  r = _mm256_or_si256(d, s); v = zero; break;
+            case LS_EOR: r = _mm256_xor_si256(d, s); v = zero; break;
+            case LS_ASL:
+                r = _mm256_add_epi8(d, d);
+                c = _mm256_and_si256(_mm256_cmpgt_epi8(zero, d), one);
+                break;
+            case LS_LSR:
+                r = _mm256_and_si256(_mm256_srli_epi16(d, 1), low7);
+                c = _mm256_and_si256(d, one);
+                break;
+            case LS_ASR:
+                r = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(d, 1), low7), _mm256_and_si256(d, sign));
+                c = _mm256_and_si256(d, one);
+                break;
+            case LS_ROL:
+                r = _mm256_or_si256(_mm256_add_epi8(d, d), c);
+                c = _mm256_and_si256(_mm256_cmpgt_epi8(zero, d), one);
+                break;
+            case LS_ROR:
+                r = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(d, 1), low7), _mm256_and_si256(_mm256_cmpeq_epi8(c, one), sign));
+                c = _mm256_and_si256(d, one);
+                break;
+            case LS_INC:
+                r = _mm256_add_epi8(d, one);
+                v = _mm256_and_si256(_mm256_cmpeq_epi8(r, sign), one);
+                break;
+            case LS_DEC:
+                r = _mm256_sub_epi8(d, one);
+                v = _mm256_and_si256(_mm256_cmpeq_epi8(r, low7), one);
+                break;
+            case LS_CLR: r = zero; v = zero; c = zero; break;
+            case LS_TST: v = zero; c = zero; break;
+            case LS_COM: r = _mm256_xor_si256(d, ones); v = zero; c = one; break;
+            case LS_NEG:
+                r = _mm256_sub_epi8(zero, d);
+                v = _mm256_and_si256(_mm256_cmpeq_epi8(r, sign), one);
+                c = _mm256_andnot_si256(_mm256_cmpeq_epi8(r, zero), one);
+                break;
+        }
+        __m256i n = _mm256_and_si256(_mm256_cmpgt_epi8(zero, r), one);
+        if (kind >= LS_ASL && kind <= LS_ROR) {
+            v = _mm256_xor_si256(n, c);
+        }
+        LS_STORE(ls->n + i, n);
+        LS_STORE(ls->z + i, _mm256_and_si256(_mm256_cmpeq_epi8(r, zero), one));
+        LS_STORE(ls->v + i, v);
+        LS_STORE(ls->c + i, c);
+        if (kind != LS_CMP && kind != LS_TST) {
+            LS_STORE(reg + i, r);
+        }
+    }
+}
+#else
+static void lockstep_alu(lockstep *ls, u8 kind, u8 *reg, const u8 *src) {
+    for (u32 i = 0; i < ls->stride; ++i) {
+        u8 d = reg[i];
+        u8 s = src[i];
+        u8 r = d;
+        u8 k; // Carries or borrows out of each bit
+        switch (kind) {
+            case LS_LD: r = s; ls->v[i] = 0; break;
+            case LS_ADD:
+            case LS_ADC:
+                r = d + s + (kind == LS_ADC ? ls->c[i] : 0);
+                k = (d & s) | ((d | s) & ~r);
+                ls->h[i] = (k >> 3) & 1;
+                ls->v[i] = ((d ^ r) & (s ^ r)) >> 7;
+                ls->c[i] = k >> 7;
+                break;
+            case LS_SUB:
+            case LS_CMP:
+                r = d - s;
+                k = (~d & s) | ((~d | s) & r);
+                ls->v[i] = ((d ^ s) & (d ^ r)) >> 7;
+                ls->c[i] = k >> 7;
+                break;
+            case LS_AND: r = d & s; ls->v[i] = 0; break;
+            case LS_OR:  r = d | s; ls->v[i] = 0; break;
+            case LS_EOR: r = d ^ s; ls->v[i] = 0; break;
+            case LS_ASL: r = d << 1; ls->c[i] = d >> 7; break;
+            case LS_LSR: r = d >> 1; ls->c[i] = d & 1; break;
+            case LS_ASR: r = (d >> 1) | (d & 0x80); ls->c[i] = d & 1; break;
+            case LS_ROL: r = (d << 1) | ls->c[i]; ls->c[i] = d >> 7; break;
+            case LS_ROR: r = (d >> 1) | (ls->c[i] << 7); ls->c[i] = d & 1; break;
+            case LS_INC: r = d + 1; ls->v[i] = r == 0x80; break;
+            case LS_DEC: r = d - 1; ls->v[i] = r == 0x7F; break;
+            case LS_CLR: r = 0; ls->v[i] = 0; ls->c[i] = 0; break;
+            case LS_TST: ls->v[i] = 0; ls->c[i] = 0; break;
+            case LS_COM: r = ~d; ls->v[i] = 0; ls->c[i] = 1; break;
+            case LS_NEG: r = -d; ls->v[i] = r == 0x80; ls->c[i] = r != 0; break;
+        }
+        ls->n[i] = r >> 7;
+        ls->z[i] = r == 0;
+        if (kind >= LS_ASL && kind <= LS_ROR) {
+            ls->v[i] = ls->n[i] ^ ls->c[i];
+        }
+        if (kind != LS_CMP && kind != LS_TST) {
+            reg[i] = r;
+        }
+    }
+}
+#endif
+
+static u8 lockstep_taken(u8 cond, u8 n, u8 z, u8 v, u8 c) {
+    switch (cond) {
+        case LS_ALWAYS: return 1;
+        case LS_HI: return (c | z) == 0;
+        case LS_LS: return (c | z) != 0;
+        case LS_CC: return c == 0;
+        case LS_CS: return c == 1;
+        case LS_NE: return z == 0;
+        case LS_EQ: return z == 1;
+        case LS_VC: return v == 0;
+        case LS_VS: return v == 1;
+        case LS_PL: return n == 0;
+        case LS_MI: return n == 1;
+        case LS_GE: return (n ^ v) == 0;
+        case LS_LT: return (n ^ v) != 0;
+        case LS_GT: return (z | (n ^ v)) == 0;
+        case LS_LE: return (z | (n ^ v)) != 0;
+        default: return 0;
+    }
+}
+
+// Lanes agreeing with the majority stay in the group, the others leave at their own target
+static void lockstep_branch(lockstep *ls, u8 cond, u16 next, u16 target, u8 taken_cycles) {
+    u32 taken = 0;
+    u32 total = 0;
+    for (u32 i = 0; i < ls->count; ++i) {
+        if (ls->active[i]) {
+            ls->operand[i] = lockstep_taken(cond, ls->n[i], ls->z[i], ls->v[i], ls->c[i]);
+            taken += ls->operand[i];
+            total++;
+        }
+    }
+    u8 group = taken * 2 >= total;
+    if (taken != 0 && taken != total) {
+        for (u32 i = 0; i < ls->count; ++i) {
+            if (ls->active[i] && ls->operand[i] != group) {
+                lockstep_store(ls, i);
+                ls->lanes[i].pc = group ? next : target;
+                ls->lanes[i].cycles += group ? 0 : taken_cycles;
+                lockstep_leave(ls, i);
+                ls->splits++;
+            }
+        }
+    }
+    ls->pc = group ? target : next;
+    ls->cycles += group ? taken_cycles : 0;
+}
+
+// Runs each lane through the instruction with the scalar handlers
+static void lockstep_scalar(lockstep *ls, u32 lead) {
+    u8 code_written = 0;
+    for (u32 i = 0; i < ls->count; ++i) {
+        if (ls->active[i]) {
+            cpu *lane = &ls->lanes[i];
+            u32 writes = lane->code_writes;
+            lockstep_store(ls, i);
+            exec_inst(lane);
+            lockstep_load(ls, i);
+            code_written |= lane->code_writes != writes;
+        }
+    }
+
+    u16 pc = ls->lanes[lead].pc;
+    for (u32 i = 0; i < ls->count; ++i) {
+        // Lanes may now run different code, none of them can be trusted to follow the group
+        if (ls->active[i] && (code_written || ls->lanes[i].pc != pc)) {
+            lockstep_leave(ls, i); // The lane already counted the cycles of this step
+            ls->splits++;
+        }
+    }
+    ls->pc = pc;
+}
+
+// Runs until the group reaches opcode 0x00 or `budget` instructions (0 for no limit),
+// then every lane that left finishes on its own. Results are in lanes[] and instructions[].
+void run_lockstep(lockstep *ls, u64 budget) {
+    u32 lead = 0;
+    while (lead < ls->count) {
+        cpu *ref = &ls->lanes[lead];
+        u16 pc = ls->pc;
+        u8 opcode = ref->memory[pc];
+        if (instr_slow[opcode] || (budget != 0 && ls->steps >= budget)) {
+            break;
+        }
+
+        u8 len = inst_len_at(ref->memory, pc);
+        for (u8 j = 0; j < len; ++j) {
+            u16 addr = pc + j;
+            ls->code_map[addr >> 3] |= 1 << (addr & 7);
+        }
+
+        const lockstep_op *op = &lockstep_ops[opcode];
+        if (op->kind == LS_SCALAR) {
+            ls->steps++;
+            ls->scalar_steps++;
+            lockstep_scalar(ls, lead);
+        } else {
+            ls->steps++;
+            ls->vector_steps++;
+            ls->cycles += instr_cycles[opcode];
+            if (op->kind == LS_BRANCH) {
+                u16 next = pc + 2;
+                lockstep_branch(ls, op->reg, next, next + (i8) ref->memory[(u16)(pc + 1)], instr_taken_cycles[opcode]);
+            } else {
+                const u8 *src = op->src == LS_REG_A ? ls->a : op->src == LS_REG_B ? ls->b : ls->operand;
+                if (op->src == LS_OPERAND) {
+                    if (op->mode == IMMEDIATE) {
+                        memset(ls->operand, ref->memory[(u16)(pc + 1)], ls->stride);
+                    } else {
+                        u16 addr = op->mode == DIRECT ? ref->memory[(u16)(pc + 1)]
+                                                      : join(ref->memory[(u16)(pc + 1)], ref->memory[(u16)(pc + 2)]);
+                        for (u32 i = 0; i < ls->count; ++i) {
+                            ls->operand[i] = READ8(&ls->lanes[i], addr);
+                        }
+                    }
+                }
+                lockstep_alu(ls, op->kind, op->reg == LS_REG_A ? ls->a : ls->b, src);
+                ls->pc = pc + len;
+            }
+        }
+
+        while (lead < ls->count && !ls->active[lead]) {
+            lead++;
+        }
+    }
+
+    // The group stopped, its lanes take their registers back
+    for (u32 i = 0; i < ls->count; ++i) {
+        if (ls->active[i]) {
+            lockstep_store(ls, i);
+            lockstep_leave(ls, i);
+        }
+    }
+
+    for (u32 i = 0; i < ls->count; ++i) {
+        cpu *lane = &ls->lanes[i];
+        if (budget == 0 || ls->instructions[i] < budget) {
+            run_limits limits = {budget != 0 ? budget - ls->instructions[i] : 0, 0, NO_STOP_PC};
+            ls->instructions[i] += run_cpu(lane, &limits).instructions;
+        }
+        SYNC_FLAGS(lane);
+    }
 }
 
 #endif // EMULATOR_IMPLEMENTATION
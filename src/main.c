@@ -1,5 +1,17 @@
+#define _DEFAULT_SOURCE // mkfifo and the sockets of the GDB server
 #define EMULATOR_IMPLEMENTATION
 #include "emulator.h"
+#include <errno.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#define MAX_TRACE_OPS 16
 
 typedef struct {
     struct {
@@ -8,7 +20,32 @@ typedef struct {
         uint8_t from_dump     : 1;
         uint8_t readable_dump : 1;
         uint8_t print_info    : 1;
+        uint8_t predecode     : 1;
+        uint8_t jit           : 1;
+        uint8_t traces        : 1;
+        uint8_t interactive   : 1;
     };
+    double xtal; // Crystal frequency in Hz
+    const char *batch;  // Manifest of jobs to run instead of f.asm
+    const char *output; // Where batch results go, stdout when NULL
+    uint32_t threads;
+    char sweep;         // Port letter swept over its 256 values, 0 when not sweeping
+    uint64_t max_inst;  // 0 for no limit
+    uint64_t max_cycles;
+    const char *until;  // Address or label to stop at
+    const char *record; // Port input log written after the run
+    const char *replay; // Port input log fed back instead of the ports
+    const char *trace;  // Instruction trace written during the run
+    const char *trace_print; // Trace printed instead of running f.asm
+    const char *trace_range; // <from>,<to> the traced instructions are in
+    uint16_t trace_ops[MAX_TRACE_OPS]; // Opcodes traced, all of them when there are none
+    uint8_t trace_op_count;
+    const char *profile; // Per address counters written there at exit
+    const char *callgrind; // Call graph written there at exit
+    const char *gdb;     // Port or Unix socket path a debugger connects to
+    const char *control; // Named pipe that can break into the running program
+    event events[MAX_EVENTS]; // Scheduled on the cpu once it is loaded
+    uint8_t event_count;
 } args;
 
 typedef enum {
@@ -24,6 +61,13 @@ typedef enum {
     LABELS,
     PORTS,
     CONTINUE,
+    REVERSE_STEP,
+    REVERSE_CONTINUE,
+    BREAK,
+    WATCH,
+    STEP,
+    STEP_OVER,
+    STEP_OUT,
     COMMAND_COUNT
 } command_type;
 
@@ -45,6 +89,13 @@ const command commands[] = {
     {"labels", "ls", LABELS},
     {"ports", "ps", PORTS},
     {"continue", "c", CONTINUE},
+    {"reverse-step", "rs", REVERSE_STEP},
+    {"reverse-continue", "rc", REVERSE_CONTINUE},
+    {"break", "b", BREAK},
+    {"watch", "w", WATCH},
+    {"step", "si", STEP},
+    {"step-over", "so", STEP_OVER},
+    {"step-out", "sf", STEP_OUT},
 };
 
 void print_memory_range(cpu *cpu, uint16_t from, uint16_t len) {
@@ -61,10 +112,13 @@ void print_cpu_state(cpu *cpu) {
     printf("ACC A: "FMT8"\n", cpu->a);
     printf("ACC B: "FMT8"\n", cpu->b);
     printf("ACC D: "FMT16"\n", cpu->d);
+    printf("IX: "FMT16"\n", cpu->ix);
+    printf("IY: "FMT16"\n", cpu->iy);
     printf("SP: "FMT16"\n", cpu->sp);
     printf("PC: "FMT16"\n", cpu->pc);
-    printf("Status : ");
-    for (int i = 0; i < 8; ++i) {
+    SYNC_FLAGS(cpu);
+    printf("Status (SXHINZVC): ");
+    for (int i = 7; i >= 0; --i) {
         printf("%d", cpu->status >> i & 0x1);
     }
     printf("\n");
@@ -85,6 +139,86 @@ void dump_memory(const cpu *c, args *args) {
     printf("\n");
 }
 
+// Numbers are read like in the assembler ($c000) or in C (0xc000), anything else is a label.
+// Returns -1 when str is neither.
+long parse_address(cpu *c, const char *str) {
+    char *end;
+    long addr = str[0] == '$' ? strtol(str + 1, &end, 16) : strtol(str, &end, 0);
+    if (end != str && *end == '\0') {
+        return addr >= 0 && addr <= 0xFFFF ? addr : -1;
+    }
+    directive *label = get_directive_by_label(str, &c->labels);
+    return label == NULL ? -1 : label->operand.value;
+}
+
+void print_debug_points(const cpu *cpu) {
+    if (cpu->debug == NULL) {
+        printf("No breakpoints or watchpoints\n");
+        return;
+    }
+    for (uint32_t addr = 0; addr < MAX_MEMORY; ++addr) {
+        if (DEBUG_BIT(cpu->debug->conditional, addr)) {
+            for (u8 i = 0; i < cpu->debug->condition_count; ++i) {
+                if (cpu->debug->conditions[i].addr == addr) {
+                    printf("\tbreak "FMT16" if %s\n", addr, cpu->debug->conditions[i].text);
+                }
+            }
+        } else if (DEBUG_BIT(cpu->debug->breaks, addr)) {
+            printf("\tbreak "FMT16"\n", addr);
+        }
+        u8 read = DEBUG_BIT(cpu->debug->reads, addr);
+        u8 write = DEBUG_BIT(cpu->debug->writes, addr);
+        if (read || write) {
+            printf("\twatch "FMT16" %s%s\n", addr, read ? "r" : "", write ? "w" : "");
+        }
+    }
+}
+
+// `break <addr|label> [off|if <condition>]` and `watch <addr|label> [r|w|rw|off]`, a lone
+// `break` lists them
+void set_debug_point(cpu *cpu, command_type type, char *buf) {
+    char *arg = strtok(strchr(buf, ' '), " ");
+    if (arg == NULL) {
+        print_debug_points(cpu);
+        return;
+    }
+    long addr = parse_address(cpu, arg);
+    if (addr < 0) {
+        printf("`%s` is neither an address nor a label\n", arg);
+        return;
+    }
+    const char *mode = strtok(NULL, " ");
+    u8 off = mode != NULL && strcmp(mode, "off") == 0;
+    if (type == BREAK && mode != NULL && strcmp(mode, "if") == 0) {
+        const char *text = strtok(NULL, "");
+        const char *error = text != NULL ? set_conditional_breakpoint(cpu, addr, text) : "Missing condition";
+        if (error != NULL) {
+            printf("%s\n", error);
+        }
+        return;
+    }
+    if (type == BREAK) {
+        if (mode != NULL && !off) {
+            printf("Invalid argument\n");
+            return;
+        }
+        set_breakpoint(cpu, addr, !off);
+        return;
+    }
+    u8 kinds = WATCH_WRITE;
+    if (off) {
+        kinds = 0;
+    } else if (mode != NULL && strcmp(mode, "r") == 0) {
+        kinds = WATCH_READ;
+    } else if (mode != NULL && strcmp(mode, "rw") == 0) {
+        kinds = WATCH_READ | WATCH_WRITE;
+    } else if (mode != NULL && strcmp(mode, "w") != 0) {
+        printf("Invalid argument\n");
+        return;
+    }
+    set_watchpoint(cpu, addr, kinds);
+}
+
 static int cmp_name(const char *s1, const char *s2) {
     while (*s1 || *s2) {
         if (*s1 == ' ') return 1;
@@ -95,13 +229,14 @@ static int cmp_name(const char *s1, const char *s2) {
     return 1;
 }
 
-void handle_commands(cpu *cpu) {
+// Returns the command that resumes the program: CONTINUE, STEP, STEP_OVER or STEP_OUT
+command_type handle_commands(cpu *cpu) {
     static command_type last_type = NO_COMMAND;
     static int last_arg = 0xFFFF;
     while (1) {
-        char buf[20] = {0};
+        char buf[128] = {0};
         printf("> ");
-        if (fgets(buf, 20, stdin) == NULL) {
+        if (fgets(buf, sizeof(buf), stdin) == NULL) {
             exit(1);
         }
 
@@ -182,7 +317,35 @@ void handle_commands(cpu *cpu) {
                     printf("\tPORT%c: "FMT8"\n", 'a' + i, cpu->ports[i]);
                 }
             } break;
-            case CONTINUE: return;
+            case CONTINUE:
+            case STEP:
+            case STEP_OVER:
+            case STEP_OUT: return cmd_type;
+            case BREAK:
+            case WATCH: set_debug_point(cpu, cmd_type, buf); break;
+            case REVERSE_STEP: {
+                if (undo_step(cpu)) {
+                    printf("Back to "FMT16", next inst : "FMT8"\n", cpu->pc, cpu->memory[cpu->pc]);
+                } else {
+                    printf("Nothing to undo\n");
+                }
+            } break;
+            case REVERSE_CONTINUE: { // Back to an address if one is given, else as far as the log goes
+                const char *arg = strchr(buf, ' ');
+                uint32_t until = NO_STOP_PC;
+                if (arg != NULL) {
+                    char *end;
+                    long l = strtol(arg, &end, 0);
+                    if (end == arg || l < 0 || l > 0xFFFF) {
+                        printf("Invalid argument\n");
+                        continue;
+                    }
+                    until = l;
+                }
+                uint64_t n = undo_until(cpu, until);
+                printf("%llu steps back, next inst : "FMT8" at "FMT16"\n",
+                        (unsigned long long) n, cpu->memory[cpu->pc], cpu->pc);
+            } break;
             default: break;
         }
     }
@@ -194,10 +357,78 @@ void print_help() {
             "Where options are:\n"
             "\t--dump     -d  Dumps whole program's memory when completelly loaded.\n"
             "\t--readable -r  Dumps whole program's memory in a more human reable format when completelly loaded.\n"
-            "\t--step     -s  Execute the program instruction per instruction.\n");
+            "\t--step     -s  Execute the program instruction per instruction.\n"
+            "\t--interactive -i Run at full speed, Ctrl-C stops the program and opens the --step prompt.\n"
+            "\t--control <pipe> Same as -i, writing `break` to this named pipe also stops the program.\n"
+            "\t--predecode -p  Decode each instruction once and execute from the decoded cache.\n"
+            "\t--traces   -t  Record hot loops as traces and run them without dispatch.\n"
+            "\t--jit      -j  Translate basic blocks to x86-64 (requires building with `make jit`).\n"
+            "\t--xtal <MHz>   Crystal frequency used to convert cycles to time (default 8MHz).\n"
+            "\t--batch <file> Run every job of a manifest, see README.\n"
+            "\t--output <file> File batch results are written to (default stdout).\n"
+            "\t--threads <n>  Number of batch workers (default 4).\n"
+            "\t--sweep <port> Run f.asm once per value of a port (a to e), in lockstep.\n"
+            "\t--max-inst <n>     Stop after n instructions.\n"
+            "\t--max-cycles <n>   Stop once n E-clock cycles have elapsed.\n"
+            "\t--until <addr|label> Stop before executing this address.\n"
+            "\t--irq <cycle>[,<period>]  Raise IRQ at this cycle, then every period cycles.\n"
+            "\t--xirq <cycle>[,<period>] Same for XIRQ.\n"
+            "\t--timer <period>          Overflow the timer every period cycles.\n"
+            "\t--sci <cycle>,<byte>      Receive a byte on the SCI.\n"
+            "\t--record <file> Save the values read on the input ports.\n"
+            "\t--replay <file> Read the input ports from a saved log.\n"
+            "\t--trace <file>  Write every instruction run to a binary trace.\n"
+            "\t--trace-range <from>,<to> Only trace the instructions at these addresses or labels.\n"
+            "\t--trace-op <opcode>       Only trace this opcode, prefix included (0x18a6), can be repeated.\n"
+            "\t--trace-print <file>      Print the instructions of a trace.\n"
+            "\t--profile <file> Count executions and accesses per address (requires building with `make profile`).\n"
+            "\t--callgrind <file> Write the call graph in callgrind format (requires building with `make profile`).\n"
+            "\t--gdb <port|path> Wait for GDB on this loopback TCP port or Unix socket and let it drive the program.\n"
+            "Exits with status 2 when an instruction or cycle limit stopped the program.\n");
     exit(0);
 }
 
+// Fills e from the value of an event option, returns 0 when it does not parse
+int parse_event(const char *opt, const char *value, event *e) {
+    if (value == NULL) {
+        return 0;
+    }
+    char *end = NULL;
+    unsigned long long first = strtoull(value, &end, 0);
+    if (end == value) {
+        return 0;
+    }
+    unsigned long long second = 0;
+    int has_second = *end == ',';
+    if (has_second) {
+        const char *s = end + 1;
+        second = strtoull(s, &end, 0);
+        if (end == s) {
+            return 0;
+        }
+    }
+    if (*end != '\0') {
+        return 0;
+    }
+
+    if (strcmp(opt, "--timer") == 0) {
+        e->source = IRQ_TOF;
+        e->at = first;
+        e->period = first;
+        return !has_second && first != 0;
+    }
+    if (strcmp(opt, "--sci") == 0) {
+        e->source = IRQ_SCI;
+        e->at = first;
+        e->data = second;
+        return has_second && second <= 0xFF;
+    }
+    e->source = opt[2] == 'x' ? IRQ_XIRQ : IRQ_IRQ;
+    e->at = first;
+    e->period = second;
+    return 1;
+}
+
 void handle_args(args *args, int argc, char **argv) {
     // Skip the first argument which is the program name itself
     argc--;
@@ -211,6 +442,10 @@ void handle_args(args *args, int argc, char **argv) {
                     case 's': args->step = 1; break;
                     case 'd': args->dump = 1; break;
                     case 'r': args->readable_dump = 1; break;
+                    case 'p': args->predecode = 1; break;
+                    case 'j': args->jit = 1; break;
+                    case 't': args->traces = 1; break;
+                    case 'i': args->interactive = 1; break;
                     default: ERROR("Unknown argument `%c`", *str);
                 }
                 str++;
@@ -226,6 +461,149 @@ void handle_args(args *args, int argc, char **argv) {
         else if (strcmp(argv[i], "--readable") == 0 || strcmp(argv[i], "-r") == 0) {
             args->readable_dump = 1;
         }
+        else if (strcmp(argv[i], "--predecode") == 0 || strcmp(argv[i], "-p") == 0) {
+            args->predecode = 1;
+        }
+        else if (strcmp(argv[i], "--traces") == 0 || strcmp(argv[i], "-t") == 0) {
+            args->traces = 1;
+        }
+        else if (strcmp(argv[i], "--jit") == 0 || strcmp(argv[i], "-j") == 0) {
+            args->jit = 1;
+        }
+        else if (strcmp(argv[i], "--interactive") == 0 || strcmp(argv[i], "-i") == 0) {
+            args->interactive = 1;
+        }
+        else if (strcmp(argv[i], "--xtal") == 0) {
+            char *end = NULL;
+            double mhz = i + 1 < argc ? strtod(argv[i + 1], &end) : 0;
+            if (end == NULL || end == argv[i + 1] || mhz <= 0) {
+                ERROR("%s", "--xtal expects a frequency in MHz");
+            }
+            args->xtal = mhz * 1e6;
+            i++;
+        }
+        else if (strcmp(argv[i], "--batch") == 0 || strcmp(argv[i], "--output") == 0) {
+            if (i + 1 >= argc) {
+                ERROR("%s expects a file", argv[i]);
+            }
+            if (argv[i][2] == 'b') {
+                args->batch = argv[i + 1];
+            } else {
+                args->output = argv[i + 1];
+            }
+            i++;
+        }
+        else if (strcmp(argv[i], "--sweep") == 0) {
+            if (i + 1 >= argc || argv[i + 1][1] != '\0' || tolower(argv[i + 1][0]) < 'a' || tolower(argv[i + 1][0]) >= 'a' + MAX_PORTS) {
+                ERROR("%s", "--sweep expects a port between a and e");
+            }
+            args->sweep = tolower(argv[i + 1][0]);
+            i++;
+        }
+        else if (strcmp(argv[i], "--max-inst") == 0 || strcmp(argv[i], "--max-cycles") == 0) {
+            char *end = NULL;
+            unsigned long long n = i + 1 < argc ? strtoull(argv[i + 1], &end, 0) : 0;
+            if (end == NULL || end == argv[i + 1] || *end != '\0' || n == 0) {
+                ERROR("%s expects a positive number", argv[i]);
+            }
+            if (argv[i][6] == 'i') {
+                args->max_inst = n;
+            } else {
+                args->max_cycles = n;
+            }
+            i++;
+        }
+        else if (strcmp(argv[i], "--record") == 0 || strcmp(argv[i], "--replay") == 0) {
+            if (i + 1 >= argc) {
+                ERROR("%s expects a file", argv[i]);
+            }
+            if (argv[i][4] == 'c') {
+                args->record = argv[i + 1];
+            } else {
+                args->replay = argv[i + 1];
+            }
+            i++;
+        }
+        else if (strcmp(argv[i], "--trace") == 0 || strcmp(argv[i], "--trace-print") == 0
+                || strcmp(argv[i], "--trace-range") == 0) {
+            if (i + 1 >= argc) {
+                ERROR("%s expects an argument", argv[i]);
+            }
+            if (argv[i][7] == '\0') {
+                args->trace = argv[i + 1];
+            } else if (argv[i][8] == 'p') {
+                args->trace_print = argv[i + 1];
+            } else {
+                args->trace_range = argv[i + 1];
+            }
+            i++;
+        }
+        else if (strcmp(argv[i], "--trace-op") == 0) {
+            char *end = NULL;
+            long code = i + 1 < argc ? strtol(argv[i + 1], &end, 0) : -1;
+            if (end == NULL || end == argv[i + 1] || *end != '\0' || code < 0 || code > 0xFFFF) {
+                ERROR("%s", "--trace-op expects an opcode");
+            }
+            if (args->trace_op_count == MAX_TRACE_OPS) {
+                ERROR("At most %d opcodes can be traced", MAX_TRACE_OPS);
+            }
+            args->trace_ops[args->trace_op_count++] = code;
+            i++;
+        }
+        else if (strcmp(argv[i], "--profile") == 0 || strcmp(argv[i], "--callgrind") == 0) {
+            if (i + 1 >= argc) {
+                ERROR("%s expects a file", argv[i]);
+            }
+            if (argv[i][2] == 'p') {
+                args->profile = argv[i + 1];
+            } else {
+                args->callgrind = argv[i + 1];
+            }
+            i++;
+        }
+        else if (strcmp(argv[i], "--gdb") == 0) {
+            if (i + 1 >= argc) {
+                ERROR("%s", "--gdb expects a port or a socket path");
+            }
+            args->gdb = argv[i + 1];
+            i++;
+        }
+        else if (strcmp(argv[i], "--control") == 0) {
+            if (i + 1 >= argc) {
+                ERROR("%s", "--control expects a pipe path");
+            }
+            args->control = argv[i + 1];
+            args->interactive = 1;
+            i++;
+        }
+        else if (strcmp(argv[i], "--until") == 0) {
+            if (i + 1 >= argc) {
+                ERROR("%s", "--until expects an address or a label");
+            }
+            args->until = argv[i + 1];
+            i++;
+        }
+        else if (strcmp(argv[i], "--irq") == 0 || strcmp(argv[i], "--xirq") == 0
+                || strcmp(argv[i], "--timer") == 0 || strcmp(argv[i], "--sci") == 0) {
+            if (args->event_count == MAX_EVENTS) {
+                ERROR("At most %d events can be given", MAX_EVENTS);
+            }
+            event *e = &args->events[args->event_count++];
+            *e = (event) {0, 0, IRQ_IRQ, 0};
+            if (!parse_event(argv[i], i + 1 < argc ? argv[i + 1] : NULL, e)) {
+                ERROR("%s", "--irq and --xirq expect <cycle>[,<period>], --timer <period>, --sci <cycle>,<byte>");
+            }
+            i++;
+        }
+        else if (strcmp(argv[i], "--threads") == 0) {
+            char *end = NULL;
+            long n = i + 1 < argc ? strtol(argv[i + 1], &end, 0) : 0;
+            if (end == NULL || end == argv[i + 1] || *end != '\0' || n <= 0 || n > BATCH_MAX_THREADS) {
+                ERROR("--threads expects a number between 1 and %d", BATCH_MAX_THREADS);
+            }
+            args->threads = n;
+            i++;
+        }
         else if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
             print_help();
         } else {
@@ -240,35 +618,525 @@ void handle_args(args *args, int argc, char **argv) {
     }
 }
 
-void exec_program_step(cpu *cpu) {
-    while (cpu->memory[cpu->pc] != 0x00) {
-        printf("Next inst : "FMT8"\n", cpu->memory[cpu->pc]);
-        handle_commands(cpu);
+#define STEP_UNDO_SIZE (1 << 20)
 
-        uint8_t inst = cpu->memory[cpu->pc];
-        if (instr_func[inst] != NULL) {
-            (*instr_func[inst])(cpu); // Call the function with this opcode
+// Set by Ctrl-C or by the control pipe, the running program stops at the end of its block
+static atomic_uchar break_in;
+
+static void on_sigint(int sig) {
+    (void) sig;
+    atomic_store(&break_in, 1);
+}
+
+// Reads the lines written to the control pipe, `break` does what Ctrl-C does. Writers can
+// come and go.
+static int read_control_pipe(void *path) {
+    for (;;) {
+        FILE *f = fopen(path, "r");
+        if (f == NULL) {
+            fprintf(stderr, "Cannot open control pipe %s\n", (const char *) path);
+            return 1;
         }
-        cpu->pc++;
+        char line[64];
+        while (fgets(line, sizeof(line), f) != NULL) {
+            line[strcspn(line, "\n")] = '\0';
+            if (strcmp(line, "break") == 0) {
+                atomic_store(&break_in, 1);
+            }
+        }
+        fclose(f);
     }
-    printf("Execution ended, you can still see last values\n");
-    handle_commands(cpu);
+}
+
+void start_control_pipe(const char *path) {
+    if (mkfifo(path, 0600) != 0 && errno != EEXIST) {
+        ERROR("Cannot create control pipe %s", path);
+    }
+    thrd_t t;
+    if (thrd_create(&t, read_control_pipe, (void *) path) != thrd_success) {
+        ERROR("%s", "thrd_create");
+    }
+    thrd_detach(t);
+}
+
+#define GDB_RUN_SLICE (1 << 20) // Instructions run between two looks for a Ctrl-C
+
+// A debugger connected to gdb_serve, the packets themselves are gdb_handle_packet's
+typedef struct {
+    int fd;
+    gdb_session session;
+    uint8_t buf[GDB_PACKET_SIZE];
+    uint32_t pos;
+    uint32_t len;
+} gdb_connection;
+
+static int gdb_getc(gdb_connection *c) {
+    if (c->pos == c->len) {
+        ssize_t n = recv(c->fd, c->buf, sizeof(c->buf), 0);
+        if (n <= 0) {
+            return -1;
+        }
+        c->pos = 0;
+        c->len = n;
+    }
+    return c->buf[c->pos++];
+}
+
+// Looks at what the debugger sent while running, without waiting. A 0x03 is a Ctrl-C.
+static int gdb_interrupted(gdb_connection *c) {
+    if (c->pos == c->len) {
+        ssize_t n = recv(c->fd, c->buf, sizeof(c->buf), MSG_DONTWAIT);
+        if (n <= 0) {
+            return 0;
+        }
+        c->pos = 0;
+        c->len = n;
+    }
+    if (c->buf[c->pos] == 0x03) {
+        c->pos++;
+        return 1;
+    }
+    return 0;
+}
+
+// Reads the next packet into packet, acknowledging it. Returns 0 once the debugger is gone.
+static int gdb_read_packet(gdb_connection *c, char *packet) {
+    for (;;) {
+        int ch;
+        do {
+            ch = gdb_getc(c);
+        } while (ch != '$' && ch != -1); // Acks and Ctrl-C outside of a run mean nothing
+        if (ch == -1) {
+            return 0;
+        }
+        uint32_t len = 0;
+        uint8_t sum = 0;
+        while ((ch = gdb_getc(c)) != '#' && ch != -1) {
+            if (len < GDB_PACKET_SIZE - 1) {
+                packet[len++] = ch;
+            }
+            sum += ch;
+        }
+        int hi = gdb_getc(c);
+        int lo = gdb_getc(c);
+        if (ch == -1 || hi == -1 || lo == -1) {
+            return 0;
+        }
+        packet[len] = '\0';
+        char check[3] = {hi, lo, '\0'};
+        int ok = strtol(check, NULL, 16) == sum;
+        if (!c->session.no_ack) {
+            send(c->fd, ok ? "+" : "-", 1, 0);
+        }
+        if (ok || c->session.no_ack) {
+            return 1;
+        }
+    }
+}
+
+static int gdb_send_packet(gdb_connection *c, const char *data) {
+    char frame[GDB_PACKET_SIZE + 4];
+    size_t len = gdb_frame_packet(data, frame);
+    for (;;) {
+        if (send(c->fd, frame, len, 0) < 0) {
+            return 0;
+        }
+        if (c->session.no_ack) {
+            return 1;
+        }
+        int ch;
+        do {
+            ch = gdb_getc(c);
+        } while (ch != '+' && ch != '-' && ch != -1);
+        if (ch != '-') {
+            return ch == '+';
+        }
+    }
+}
+
+static run_result gdb_continue(cpu *cpu, gdb_connection *c, int *interrupted) {
+    run_result total = {STOP_HALT, 0, 0, 0};
+    *interrupted = 0;
+    for (;;) {
+        run_result r = run_cpu(cpu, &(run_limits) {GDB_RUN_SLICE, 0, NO_STOP_PC});
+        total.reason = r.reason;
+        total.instructions += r.instructions;
+        if (r.reason != STOP_INSTRUCTIONS) {
+            return total;
+        }
+        if (gdb_interrupted(c)) {
+            *interrupted = 1;
+            return total;
+        }
+    }
+}
+
+// Serves the debugger connected on fd until it detaches, kills the program or goes away
+static void gdb_serve_fd(cpu *cpu, int fd) {
+    gdb_connection *c = calloc(1, sizeof(gdb_connection));
+    char *packet = malloc(GDB_PACKET_SIZE);
+    char *reply = malloc(GDB_PACKET_SIZE);
+    if (c == NULL || packet == NULL || reply == NULL) {
+        ERROR("%s", "malloc");
+    }
+    c->fd = fd;
+    while (gdb_read_packet(c, packet)) {
+        gdb_action action = gdb_handle_packet(cpu, &c->session, packet, reply);
+        if (action == GDB_CONTINUE || action == GDB_STEP) {
+            int interrupted = 0;
+            run_result r = action == GDB_STEP
+                ? run_cpu(cpu, &(run_limits) {1, 0, NO_STOP_PC}) : gdb_continue(cpu, c, &interrupted);
+            if (interrupted) {
+                strcpy(reply, "S02");
+            } else {
+                gdb_stop_reply(cpu, r, reply);
+            }
+        }
+        if (action == GDB_KILL || !gdb_send_packet(c, reply) || action == GDB_DETACH) {
+            break;
+        }
+    }
+    free(reply);
+    free(packet);
+    free(c);
+}
+
+// where is a TCP port on the loopback interface, or else the path of a Unix socket.
+// Waits for one debugger and serves it.
+void gdb_serve(cpu *cpu, const char *where) {
+    char *end;
+    long port = strtol(where, &end, 10);
+    int tcp = *end == '\0' && end != where;
+    int fd = socket(tcp ? AF_INET : AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        ERROR("%s", "socket");
+    }
+    int bound;
+    if (tcp) {
+        if (port <= 0 || port > 0xFFFF) {
+            ERROR("Invalid port %s", where);
+        }
+        int yes = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        struct sockaddr_in addr = {0};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        bound = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+    } else {
+        struct sockaddr_un addr = {0};
+        addr.sun_family = AF_UNIX;
+        if (strlen(where) >= sizeof(addr.sun_path)) {
+            ERROR("Socket path %s is too long", where);
+        }
+        strcpy(addr.sun_path, where);
+        unlink(where);
+        bound = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+    }
+    if (bound < 0 || listen(fd, 1) < 0) {
+        ERROR("Cannot listen on %s", where);
+    }
+    INFO("Waiting for GDB on %s", where);
+    int client = accept(fd, NULL, NULL);
+    if (client < 0) {
+        ERROR("%s", "accept");
+    }
+    if (tcp) {
+        int yes = 1; // Packets are small, each one is waited for
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    }
+    gdb_serve_fd(cpu, client);
+    close(client);
+    close(fd);
+    if (!tcp) {
+        unlink(where);
+    }
+}
+
+static int step_ended(const cpu *cpu) {
+    return cpu->memory[cpu->pc] == 0x00 || cpu->sleep != AWAKE;
+}
+
+// Every step is logged so the commands can go backward, even once the program ended or
+// across runs to a breakpoint: one log lasts the whole session. free_running starts with a
+// continue instead of the prompt. Ctrl-C stops any run and comes back to the prompt.
+void exec_program_step(cpu *cpu, uint8_t free_running) {
+    enable_undo(cpu, STEP_UNDO_SIZE);
+    cpu->break_in = &break_in;
+    signal(SIGINT, on_sigint);
+    for (;;) {
+        command_type resume = CONTINUE;
+        if (!free_running) {
+            if (step_ended(cpu)) {
+                printf("Execution ended, you can still see last values\n");
+            } else {
+                printf("Next inst : "FMT8"\n", cpu->memory[cpu->pc]);
+            }
+            resume = handle_commands(cpu);
+            if (step_ended(cpu)) {
+                break;
+            }
+        }
+        free_running = 0;
+        atomic_store(&break_in, 0); // Ctrl-C at the prompt does not stop what comes next
+        if (resume == STEP) {
+            run_cpu(cpu, &(run_limits) {1, 0, NO_STOP_PC});
+            continue;
+        }
+        run_result r;
+        if (resume == STEP_OVER) {
+            r = step_over(cpu);
+        } else if (resume == STEP_OUT) {
+            r = step_out(cpu);
+        } else {
+            r = run_cpu(cpu, &(run_limits) {0, 0, NO_STOP_PC});
+        }
+        printf("Stopped on %s after %llu instructions, pc = "FMT16, stop_reason_name(r.reason),
+                (unsigned long long) r.instructions, cpu->pc);
+        if (r.reason == STOP_WATCH) {
+            printf(", %s "FMT16, cpu->debug->hit == DEBUG_READ ? "read" : "wrote", cpu->debug->hit_addr);
+        }
+        printf("\n");
+    }
+    signal(SIGINT, SIG_DFL);
+    cpu->break_in = NULL;
+}
+
+// --predecode, --traces and --jit have no prompt to come back to, Ctrl-C just stops the program
+// between two blocks. Its timing is printed as when it ends.
+static void run_engine(void (*engine) (cpu *), cpu *cpu) {
+    cpu->break_in = &break_in;
+    signal(SIGINT, on_sigint);
+    engine(cpu);
+    signal(SIGINT, SIG_DFL);
+    cpu->break_in = NULL;
+    if (cpu->memory[cpu->pc] != 0x00 && cpu->sleep == AWAKE) {
+        INFO("Stopped on break-in, pc = "FMT16, cpu->pc);
+    }
+}
+
+int run_batch_file(args *args) {
+    batch *b = load_batch(args->batch);
+    FILE *out = stdout;
+    if (args->output != NULL) {
+        out = fopen(args->output, "w");
+        if (out == NULL) {
+            ERROR("Error while opennig file : %s\n", args->output);
+        }
+    }
+    run_batch(b, args->threads);
+    write_batch_results(b, out);
+    if (out != stdout) {
+        fclose(out);
+    }
+    free_batch(b);
+    return 0;
+}
+
+int run_sweep(cpu *c, args *args) {
+    u8 port = args->sweep - 'a';
+    lockstep *ls = new_lockstep(c, 0x100);
+    for (u32 i = 0; i < 0x100; ++i) {
+        ls->lanes[i].ports[port] = i;
+    }
+    run_lockstep(ls, 0);
+    for (u32 i = 0; i < 0x100; ++i) {
+        const cpu *lane = &ls->lanes[i];
+        printf("%c=%02x a=%02x b=%02x sp=%04x pc=%04x ccr=%02x inst=%llu cycles=%llu\n",
+                args->sweep, i, lane->a, lane->b, lane->sp, lane->pc, lane->status,
+                (unsigned long long) ls->instructions[i], (unsigned long long) lane->cycles);
+    }
+    INFO("%llu vector steps, %llu scalar steps, %u lanes left the group",
+            (unsigned long long) ls->vector_steps, (unsigned long long) ls->scalar_steps, ls->splits);
+    free_lockstep(ls);
+    destroy_cpu(c);
+    return 0;
+}
+
+uint32_t parse_stop_pc(cpu *c, const char *str) {
+    long addr = parse_address(c, str);
+    if (addr < 0) {
+        ERROR("`%s` is neither an address nor a label", str);
+    }
+    return addr;
+}
+
+// --trace-range and --trace-op give the filter, everything is traced without them
+void start_trace_args(cpu *c, args *args) {
+    trace_filter filter = {0, 0xFFFF, {0}};
+    if (args->trace_range != NULL) {
+        char range[64];
+        char *comma = strchr(args->trace_range, ',');
+        if (comma == NULL || strlen(args->trace_range) >= sizeof(range)) {
+            ERROR("%s", "--trace-range expects <from>,<to>");
+        }
+        strcpy(range, args->trace_range);
+        range[comma - args->trace_range] = '\0';
+        filter.first = parse_stop_pc(c, range);
+        filter.last = parse_stop_pc(c, range + (comma - args->trace_range) + 1);
+    }
+    if (args->trace_op_count == 0) {
+        memset(filter.opcodes, 0xFF, sizeof(filter.opcodes));
+    }
+    for (uint8_t i = 0; i < args->trace_op_count; ++i) {
+        trace_filter_opcode(&filter, args->trace_ops[i]);
+    }
+    start_trace(c, args->trace, &filter);
+}
+
+void print_trace_record(const trace_record *r, void *ctx) {
+    (void) ctx;
+    printf("pc=%04x op=%0*x operand=%04x a=%02x b=%02x x=%04x y=%04x sp=%04x ccr=%02x cycles=%u",
+            r->pc, r->opcode > 0xFF ? 4 : 2, r->opcode, r->operand, r->a, r->b, r->ix, r->iy,
+            r->sp, r->ccr, r->cycles);
+    if (r->writes != 0) {
+        printf(" writes=%u [%04x]=%02x", r->writes, r->write_addr, r->write_value);
+    }
+    printf("\n");
+}
+
+#ifdef EMULATOR_PROFILE
+void write_profile_file(cpu *c, const char *path, void (*write) (cpu *cpu, FILE *out)) {
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        ERROR("Error while opennig file : %s\n", path);
+    }
+    write(c, out);
+    fclose(out);
+}
+#endif
+
+void print_timing(const cpu *cpu, double xtal) {
+    double us = cycles_to_seconds(cpu->cycles, xtal) * 1e6;
+    printf("[INFO] %llu E-clock cycles, %.3f us at %g MHz crystal (E = %g MHz)\n",
+            (unsigned long long) cpu->cycles, us, xtal / 1e6, xtal / 4e6);
 }
 
 int main(int argc, char **argv) {
     args args = {0};
+    args.xtal = DEFAULT_XTAL_HZ;
+    args.threads = 4;
     handle_args(&args, argc, argv);
 
+    if (args.batch != NULL) {
+        return run_batch_file(&args);
+    }
+    if (args.trace_print != NULL) {
+        u64 n = read_trace(args.trace_print, print_trace_record, NULL);
+        INFO("%llu instructions in %s", (unsigned long long) n, args.trace_print);
+        return 0;
+    }
+
     cpu *c = new_cpu("f.asm");
+    for (uint8_t i = 0; i < args.event_count; ++i) {
+        const event *e = &args.events[i];
+        schedule_event(c, e->at, e->source, e->period, e->data);
+    }
+    if (args.sweep) {
+        return run_sweep(c, &args);
+    }
+    if (args.replay) {
+        replay_inputs_file(c, args.replay);
+    } else if (args.record) {
+        record_inputs(c);
+    }
+
+    if (args.trace) {
+        if (args.step || args.traces || args.predecode || args.jit || args.dump) {
+            ERROR("%s", "--trace only works with the interpreter");
+        }
+        start_trace_args(c, &args);
+    }
 
+    if (args.profile || args.callgrind) {
+#ifdef EMULATOR_PROFILE
+        if (args.traces || args.predecode || args.jit) {
+            ERROR("%s", "--profile and --callgrind only work with the interpreter");
+        }
+        start_profile(c);
+#else
+        fprintf(stderr, "This build has no profiler, rebuild with `make profile`\n");
+        destroy_cpu(c);
+        return 1;
+#endif
+    }
+
+    int status = 0;
     if (args.dump) {
         dump_memory(c, &args);
+    } else if (args.gdb) {
+        if (args.step || args.traces || args.predecode || args.jit) {
+            ERROR("%s", "--gdb only works with the interpreter");
+        }
+        gdb_serve(c, args.gdb);
+    } else if (args.max_inst || args.max_cycles || args.until) {
+        if (args.step || args.traces || args.predecode || args.jit) {
+            ERROR("%s", "--max-inst, --max-cycles and --until only work with the interpreter");
+        }
+        run_limits limits = {args.max_inst, args.max_cycles, NO_STOP_PC};
+        if (args.until) {
+            limits.until = parse_stop_pc(c, args.until);
+        }
+        run_result r = run_cpu(c, &limits);
+        INFO("Stopped on %s after %llu instructions, pc = "FMT16, stop_reason_name(r.reason),
+                (unsigned long long) r.instructions, c->pc);
+        if (r.idle_cycles != 0) {
+            INFO("%llu cycles skipped while idle or asleep", (unsigned long long) r.idle_cycles);
+        }
+        print_timing(c, args.xtal);
+        status = r.reason == STOP_HALT || r.reason == STOP_PC || r.reason == STOP_SLEEP ? 0 : 2;
     } else {
-        if (args.step) {
-            exec_program_step(c);
+        if (args.step || args.interactive) {
+            if (args.control) {
+                start_control_pipe(args.control);
+            }
+            exec_program_step(c, !args.step);
+        } else if (args.traces) {
+            run_engine(exec_program_traces, c);
+        } else if (args.predecode) {
+            run_engine(exec_program_predecoded, c);
+        } else if (args.jit) {
+#ifdef EMULATOR_JIT
+            run_engine(exec_program_jit, c);
+#else
+            fprintf(stderr, "This build has no JIT, rebuild with `make jit`\n");
+            destroy_cpu(c);
+            return 1;
+#endif
         } else {
-            exec_program(c);
+            run_result r = run_cpu(c, &(run_limits) {0, 0, NO_STOP_PC});
+            if (r.reason == STOP_IDLE) {
+                INFO("Stuck in an idle loop at pc = "FMT16", nothing can end it", c->pc);
+                status = 2;
+            } else if (r.reason == STOP_SLEEP) {
+                INFO("Asleep on %s before pc = "FMT16", nothing can wake it up",
+                        c->sleep == SLEEP_WAI ? "WAI" : "STOP", c->pc);
+            }
         }
+        print_timing(c, args.xtal);
+    }
+#ifdef EMULATOR_PROFILE
+    if (args.profile) {
+        write_profile_file(c, args.profile, write_profile);
+        INFO("Profile written to %s", args.profile);
+    }
+    if (args.callgrind) {
+        write_profile_file(c, args.callgrind, write_callgrind);
+        INFO("Call graph written to %s", args.callgrind);
+    }
+#endif
+    if (args.trace) {
+        INFO("%llu instructions traced to %s", (unsigned long long) end_trace(c), args.trace);
+    }
+    if (args.record && !args.replay) {
+        save_inputs(c, args.record);
+        INFO("%llu port reads, %u bytes of inputs saved to %s",
+                (unsigned long long) c->inputs->reads, c->inputs->size, args.record);
+    }
+    if (args.replay && c->inputs->mismatches != 0) {
+        INFO("%llu replayed reads happened at another cycle count than recorded",
+                (unsigned long long) c->inputs->mismatches);
     }
     destroy_cpu(c);
+    return status;
 }
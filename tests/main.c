@@ -28,7 +28,7 @@ int cmp_mnemonic(mnemonic *m1, mnemonic *m2) {
 }
 
 mnemonic new_mnemonic(u8 opcode, u16 operand_value, operand_type type, u8 immediate_16) {
-    return (mnemonic){opcode, {operand_value, type, 0}, immediate_16};
+    return (mnemonic){opcode, {operand_value, type, 0}, immediate_16, 0xFFFF};
 }
 
 void strcopy(char **s, const char *dup) {
@@ -43,9 +43,152 @@ void strcopy(char **s, const char *dup) {
     memcpy(*s, dup, strlen(dup) + 1);
 }
 
+// Second machine for the snapshot test, main's cpu hides the type name
+static cpu other;
+
+// What the trace stream test checks in the records read back
+typedef struct {
+    u32 count;
+    u32 stores;   // staa records that wrote where x pointed
+    u32 bad_flags; // cpx records whose N and Z are wrong
+    u16 last_pc;
+} trace_check;
+
+void check_record(const trace_record *r, void *ctx) {
+    trace_check *c = ctx;
+    c->count++;
+    c->last_pc = r->pc;
+    if (r->opcode == 0xA7 && r->writes == 1 && r->write_addr == 0x2000 + c->stores
+            && r->ix == r->write_addr && r->write_value == r->a) {
+        c->stores++;
+    }
+    if (r->opcode == 0x8C && (r->ccr & 0x0C) != (r->ix == 0x2800 ? 0x04 : 0x08)) {
+        c->bad_flags++;
+    }
+}
+
+#ifdef EMULATOR_THREADED
+// Instructions the threaded test draws its programs from, inlined by run_threaded or not.
+// Their addresses stay in RAM, so the ports are never written.
+typedef enum { OPERAND_NONE, OPERAND_IMM8, OPERAND_IMM16, OPERAND_DIR, OPERAND_EXT, OPERAND_IDX, OPERAND_REL } operand_kind;
+
+static const struct { u16 code; operand_kind kind; } random_insts[] = {
+    {0x86, OPERAND_IMM8}, {0xC6, OPERAND_IMM8}, {0x8B, OPERAND_IMM8}, {0xCB, OPERAND_IMM8},
+    {0x80, OPERAND_IMM8}, {0xC0, OPERAND_IMM8}, {0x84, OPERAND_IMM8}, {0xC4, OPERAND_IMM8},
+    {0x8A, OPERAND_IMM8}, {0x88, OPERAND_IMM8}, {0x81, OPERAND_IMM8}, {0xC1, OPERAND_IMM8},
+    {0x89, OPERAND_IMM8}, {0xC2, OPERAND_IMM8},
+    {0x96, OPERAND_DIR}, {0xD6, OPERAND_DIR}, {0x97, OPERAND_DIR}, {0xD7, OPERAND_DIR},
+    {0x9B, OPERAND_DIR}, {0xDC, OPERAND_DIR}, {0xDD, OPERAND_DIR}, {0xDF, OPERAND_DIR},
+    {0xB6, OPERAND_EXT}, {0xF6, OPERAND_EXT}, {0xB7, OPERAND_EXT}, {0xF7, OPERAND_EXT},
+    {0x7C, OPERAND_EXT},
+    {0xA6, OPERAND_IDX}, {0xE6, OPERAND_IDX}, {0xA7, OPERAND_IDX}, {0xE7, OPERAND_IDX},
+    {0x18A6, OPERAND_IDX}, {0x18A7, OPERAND_IDX}, {0x18E6, OPERAND_IDX}, {0x6C, OPERAND_IDX},
+    {0xCC, OPERAND_IMM16}, {0xC3, OPERAND_IMM16}, {0x83, OPERAND_IMM16}, {0x8C, OPERAND_IMM16},
+    {0x188C, OPERAND_IMM16},
+    {0x4A, OPERAND_NONE}, {0x5A, OPERAND_NONE}, {0x4C, OPERAND_NONE}, {0x5C, OPERAND_NONE},
+    {0x16, OPERAND_NONE}, {0x17, OPERAND_NONE}, {0x4F, OPERAND_NONE}, {0x5F, OPERAND_NONE},
+    {0x4D, OPERAND_NONE}, {0x5D, OPERAND_NONE}, {0x36, OPERAND_NONE}, {0x37, OPERAND_NONE},
+    {0x32, OPERAND_NONE}, {0x33, OPERAND_NONE}, {0x08, OPERAND_NONE}, {0x09, OPERAND_NONE},
+    {0x3A, OPERAND_NONE}, {0x1808, OPERAND_NONE}, {0x1809, OPERAND_NONE}, {0x183A, OPERAND_NONE},
+    {0x01, OPERAND_NONE}, {0x1B, OPERAND_NONE}, {0x48, OPERAND_NONE}, {0x54, OPERAND_NONE},
+    {0x40, OPERAND_NONE}, {0x43, OPERAND_NONE}, {0x0E, OPERAND_NONE}, {0x0F, OPERAND_NONE},
+    {0x20, OPERAND_REL}, {0x22, OPERAND_REL}, {0x23, OPERAND_REL}, {0x24, OPERAND_REL},
+    {0x25, OPERAND_REL}, {0x26, OPERAND_REL}, {0x27, OPERAND_REL}, {0x28, OPERAND_REL},
+    {0x29, OPERAND_REL}, {0x2A, OPERAND_REL}, {0x2B, OPERAND_REL}, {0x2C, OPERAND_REL},
+    {0x2D, OPERAND_REL}, {0x2E, OPERAND_REL}, {0x2F, OPERAND_REL},
+};
+
+static u32 next_random(u32 *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+// Writes count random instructions at 0xC000 and a 0x00 after them, branches land on one of them
+static u16 random_program(u8 *memory, u32 *seed, u8 count) {
+    u16 at[256];
+    u8 pick[256];
+    u16 pc = 0xC000;
+    for (u16 i = 0; i < count; ++i) {
+        pick[i] = next_random(seed) % (sizeof(random_insts) / sizeof(random_insts[0]));
+        at[i] = pc;
+        u16 code = random_insts[pick[i]].code;
+        operand_kind kind = random_insts[pick[i]].kind;
+        pc += (code > 0xFF ? 2 : 1) + (kind == OPERAND_NONE ? 0 : (kind == OPERAND_IMM16 || kind == OPERAND_EXT ? 2 : 1));
+    }
+    at[count] = pc;
+    for (u16 i = 0; i < count; ++i) {
+        u16 code = random_insts[pick[i]].code;
+        u8 *p = memory + at[i];
+        if (code > 0xFF) {
+            *p++ = code >> 8;
+        }
+        *p++ = code;
+        u16 v = next_random(seed);
+        switch (random_insts[pick[i]].kind) {
+            case OPERAND_NONE: break;
+            case OPERAND_IMM8: *p = v; break;
+            case OPERAND_IMM16: p[0] = v >> 8; p[1] = v; break;
+            case OPERAND_DIR: *p = 0x40 + v % 0x80; break;
+            case OPERAND_EXT: p[0] = 0x20; p[1] = v; break;
+            case OPERAND_IDX: *p = v; break;
+            case OPERAND_REL: *p = at[next_random(seed) % (count + 1)] - (at[i] + 2); break;
+        }
+    }
+    memory[pc] = 0x00;
+    return pc;
+}
+
+static void reset_for_program(cpu *cpu, const u8 *code, u16 end, u8 a, u8 b) {
+    memset(cpu->memory, 0, MAX_MEMORY);
+    memcpy(cpu->memory + 0xC000, code + 0xC000, end + 1 - 0xC000);
+    cpu->pc = 0xC000;
+    cpu->sp = 0x01FF;
+    cpu->ix = 0x2000;
+    cpu->iy = 0x2400;
+    cpu->a = a;
+    cpu->b = b;
+    cpu->status = 0x10;
+    LOAD_FLAGS(cpu);
+    cpu->cycles = 0;
+    cpu->sleep = AWAKE;
+    cpu->pending = 0;
+    cpu->event_count = 0;
+    cpu->next_event = UINT64_MAX;
+}
+
+// Runs the program at 0xC000 with run_threaded on one cpu, the portable loop on the other.
+// Returns 1 when they end in the same state.
+static u8 same_run(cpu *threaded, cpu *portable, const u8 *code, u16 end, u8 a, u8 b, u64 max_instructions) {
+    const run_limits limits = {max_instructions, 0, NO_STOP_PC};
+    reset_for_program(threaded, code, end, a, b);
+    reset_for_program(portable, code, end, a, b);
+    run_result r1 = run_threaded(threaded, &limits);
+    run_result r2 = run_interpreter(portable, &limits, 0);
+    SYNC_FLAGS(threaded);
+    SYNC_FLAGS(portable);
+    return r1.reason == r2.reason && r1.instructions == r2.instructions && r1.cycles == r2.cycles
+        && r1.idle_cycles == r2.idle_cycles && threaded->pc == portable->pc && threaded->a == portable->a
+        && threaded->b == portable->b && threaded->ix == portable->ix && threaded->iy == portable->iy
+        && threaded->sp == portable->sp && threaded->status == portable->status
+        && threaded->cycles == portable->cycles
+        && memcmp(threaded->memory, portable->memory, MAX_MEMORY) == 0;
+}
+#endif
+
+// Breaks into the run of the break-in test from another thread, like Ctrl-C would
+static int break_in_later(void *flag) {
+    thrd_sleep(&(struct timespec) {.tv_nsec = 10000000}, NULL);
+    atomic_store((atomic_uchar *) flag, 1);
+    return 0;
+}
+
 int main() {
     cpu cpu = {0};
     add_instructions_func();
+    set_default_regions(&cpu);
+    set_default_regions(&other);
 
     TEST ("Mneominic parsing") {
         char *s = NULL;
@@ -53,91 +196,1346 @@ int main() {
 
         //LDA
         strcopy(&s, " lda #$FF");
-        m = line_to_mnemonic(s, NULL, 0, 0);
+        m = line_to_mnemonic(s, NULL, 0);
         e = new_mnemonic(0x86, 0xFF, IMMEDIATE, 0);
         ASSERT(cmp_mnemonic(&m, &e));
 
         strcopy(&s, " lda <$FF");
-        m = line_to_mnemonic(s, NULL, 0, 0);
+        m = line_to_mnemonic(s, NULL, 0);
         e = new_mnemonic(0x96, 0xFF, DIRECT, 0);
         ASSERT(cmp_mnemonic(&m, &e));
 
         strcopy(&s, " lda $FF");
-        m = line_to_mnemonic(s, NULL, 0, 0);
+        m = line_to_mnemonic(s, NULL, 0);
         e = new_mnemonic(0xB6, 0xFF, EXTENDED, 0);
         ASSERT(cmp_mnemonic(&m, &e));
 
         //LDB
         strcopy(&s, " ldb #$FF");
-        m = line_to_mnemonic(s, NULL, 0, 0);
+        m = line_to_mnemonic(s, NULL, 0);
         e = new_mnemonic(0xC6, 0xFF, IMMEDIATE, 0);
         ASSERT(cmp_mnemonic(&m, &e));
 
         strcopy(&s, " ldb <$FF");
-        m = line_to_mnemonic(s, NULL, 0, 0);
+        m = line_to_mnemonic(s, NULL, 0);
         e = new_mnemonic(0xD6, 0xFF, DIRECT, 0);
         ASSERT(cmp_mnemonic(&m, &e));
 
         strcopy(&s, " ldb $FF");
-        m = line_to_mnemonic(s, NULL, 0, 0);
+        m = line_to_mnemonic(s, NULL, 0);
         e = new_mnemonic(0xF6, 0xFF, EXTENDED, 0);
         ASSERT(cmp_mnemonic(&m, &e));
 
         //LDD
         strcopy(&s, " ldd #$FFFF");
-        m = line_to_mnemonic(s, NULL, 0, 0);
+        m = line_to_mnemonic(s, NULL, 0);
         e = new_mnemonic(0xCC, 0xFFFF, IMMEDIATE, 0);
         ASSERT(cmp_mnemonic(&m, &e));
 
         strcopy(&s, " ldd <$FF");
-        m = line_to_mnemonic(s, NULL, 0, 0);
+        m = line_to_mnemonic(s, NULL, 0);
         e = new_mnemonic(0xDC, 0xFF, DIRECT, 0);
         ASSERT(cmp_mnemonic(&m, &e));
 
         strcopy(&s, " ldd $FF");
-        m = line_to_mnemonic(s, NULL, 0, 0);
+        m = line_to_mnemonic(s, NULL, 0);
         e = new_mnemonic(0xFC, 0xFF, EXTENDED, 0);
         ASSERT(cmp_mnemonic(&m, &e));
 
         //STA
         strcopy(&s, " ldd <$FF");
-        m = line_to_mnemonic(s, NULL, 0, 0);
+        m = line_to_mnemonic(s, NULL, 0);
         e = new_mnemonic(0xDC, 0xFF, DIRECT, 0);
         ASSERT(cmp_mnemonic(&m, &e));
 
         strcopy(&s, " ldd $FF");
-        m = line_to_mnemonic(s, NULL, 0, 0);
+        m = line_to_mnemonic(s, NULL, 0);
         e = new_mnemonic(0xFC, 0xFF, EXTENDED, 0);
         ASSERT(cmp_mnemonic(&m, &e));
     }
 
     TEST ("Shift tests tests") {
         cpu.a = 0xFF;
-        mnemonic m = line_to_mnemonic((char[]){" lsla"}, NULL, 0, 0);
+        mnemonic m = line_to_mnemonic((char[]){" lsla"}, NULL, 0);
         exec_instr(&cpu, m.opcode);
+        SYNC_FLAGS(&cpu);
         ASSERT_EQ(cpu.a, ((0xFF << 1) & 0xFF));
         ASSERT_EQ(cpu.c, 1);
 
         cpu.d = 0xFFF0;
-        m = line_to_mnemonic((char[]){" lsrd"}, NULL, 0, 0);
+        m = line_to_mnemonic((char[]){" lsrd"}, NULL, 0);
         exec_instr(&cpu, m.opcode);
+        SYNC_FLAGS(&cpu);
         ASSERT_EQ(cpu.d, (0xFFF0 >> 1));
         ASSERT_EQ(cpu.c, 0);
 
-        cpu.c = 1;
+        cpu.cc_c = 1;
         cpu.a = 0x7F;
-        m = line_to_mnemonic((char[]){" rora"}, NULL, 0, 0);
+        m = line_to_mnemonic((char[]){" rora"}, NULL, 0);
         exec_instr(&cpu, m.opcode);
+        SYNC_FLAGS(&cpu);
         ASSERT_EQ(cpu.a, (0x7F >> 1) | (cpu.c << 7));
         ASSERT_EQ(cpu.c, 1);
 
-        cpu.c = 1;
+        cpu.cc_c = 1;
         cpu.a = 0x0;
-        m = line_to_mnemonic((char[]){" rola"}, NULL, 0, 0);
+        m = line_to_mnemonic((char[]){" rola"}, NULL, 0);
         exec_instr(&cpu, m.opcode);
+        SYNC_FLAGS(&cpu);
         ASSERT_EQ(cpu.a, 1);
         ASSERT_EQ(cpu.c, 0);
     }
 
-    return 0;
+    TEST ("Lazy condition codes") {
+        memset(cpu.memory, 0, MAX_MEMORY);
+        cpu.status = 0;
+        LOAD_FLAGS(&cpu);
+
+        // ldaa #$7F; adda #1; tpa
+        u8 add[] = {0x86, 0x7F, 0x8B, 0x01, 0x07, 0x00};
+        memcpy(cpu.memory + 0xC000, add, sizeof(add));
+        cpu.pc = 0xC000;
+        exec_program(&cpu);
+        ASSERT_EQ(cpu.a, HALFC | NEG | OFLOW);
+
+        // ldaa #$FF; adda #1; inca; tpa
+        // INC leaves C alone so the carry of the ADD has to survive it
+        u8 inc[] = {0x86, 0xFF, 0x8B, 0x01, 0x4C, 0x07, 0x00};
+        memcpy(cpu.memory + 0xC000, inc, sizeof(inc));
+        cpu.pc = 0xC000;
+        exec_program(&cpu);
+        ASSERT_EQ(cpu.a, HALFC | CARRY);
+
+        // ldaa #$80; cmpa #1; clc
+        // V of the compare is computed lazily and must not change with C
+        u8 cmp[] = {0x86, 0x80, 0x81, 0x01, 0x0C, 0x00};
+        memcpy(cpu.memory + 0xC000, cmp, sizeof(cmp));
+        cpu.pc = 0xC000;
+        exec_program(&cpu);
+        ASSERT_EQ(FLAG_V(&cpu), 1);
+        ASSERT_EQ(FLAG_N(&cpu), 0);
+        ASSERT_EQ(FLAG_Z(&cpu), 0);
+        ASSERT_EQ(FLAG_C(&cpu), 0);
+
+        // ldaa #$40; asla; clc; tpa
+        // V of a shift is N ^ C, it is kept when C is cleared afterwards
+        u8 shift[] = {0x86, 0x40, 0x48, 0x0C, 0x07, 0x00};
+        memcpy(cpu.memory + 0xC000, shift, sizeof(shift));
+        cpu.pc = 0xC000;
+        exec_program(&cpu);
+        ASSERT_EQ(cpu.a & 0x0F, NEG | OFLOW);
+
+        // ldaa #5; cmpa #5; beq +2; ldab #1; cmpa #9; blt +2; ldab #2
+        u8 branch[] = {0x86, 0x05, 0x81, 0x05, 0x27, 0x02, 0xC6, 0x01, 0x81, 0x09, 0x2D, 0x02, 0xC6, 0x02, 0x00};
+        memcpy(cpu.memory + 0xC000, branch, sizeof(branch));
+        cpu.pc = 0xC000;
+        cpu.b = 0x33;
+        exec_program(&cpu);
+        ASSERT_EQ(cpu.b, 0x33);
+
+        // Every value written by TAP reads back the same with TPA, N along with Z included
+        u32 round_trip_errors = 0;
+        for (u32 v = 0; v < 0x100; v++) {
+            cpu.status = 0xFF; // X can only be cleared
+            LOAD_FLAGS(&cpu);
+            cpu.a = v;
+            exec_instr(&cpu, 0x06);
+            cpu.a = 0;
+            exec_instr(&cpu, 0x07);
+            round_trip_errors += cpu.a != v;
+        }
+        ASSERT_EQ(round_trip_errors, 0);
+
+        // ldaa #$0C; tap; tpa
+        u8 tap[] = {0x86, 0x0C, 0x06, 0x07, 0x00};
+        memcpy(cpu.memory + 0xC000, tap, sizeof(tap));
+        cpu.pc = 0xC000;
+        exec_program(&cpu);
+        ASSERT_EQ(cpu.a & 0x0F, NEG | ZERO);
+
+        // ldx #$FFFF; ldaa #$08; tap; inx; tpa
+        // INX reaching zero sets Z and leaves N as it was
+        u8 inx[] = {0xCE, 0xFF, 0xFF, 0x86, 0x08, 0x06, 0x08, 0x07, 0x00};
+        memcpy(cpu.memory + 0xC000, inx, sizeof(inx));
+        cpu.pc = 0xC000;
+        exec_program(&cpu);
+        ASSERT_EQ(cpu.a & 0x0F, NEG | ZERO);
+        ASSERT_EQ(FLAG_N(&cpu), 1);
+        ASSERT_EQ(FLAG_Z(&cpu), 1);
+
+        // ldy #1; ldaa #$08; tap; dey; tpa, the same through the prefixed page
+        u8 dey[] = {0x18, 0xCE, 0x00, 0x01, 0x86, 0x08, 0x06, 0x18, 0x09, 0x07, 0x00};
+        memcpy(cpu.memory + 0xC000, dey, sizeof(dey));
+        cpu.pc = 0xC000;
+        exec_program(&cpu);
+        ASSERT_EQ(cpu.a & 0x0F, NEG | ZERO);
+    }
+
+    TEST ("Cycle counting") {
+        memset(cpu.memory, 0, MAX_MEMORY);
+        // ldab #3; loop: decb; bne loop; ldaa #$2A
+        // 2 + 3 * (2 + 3) + 2 cycles
+        u8 prog[] = {0xC6, 0x03, 0x5A, 0x26, 0xFD, 0x86, 0x2A, 0x00};
+        memcpy(cpu.memory + 0xC000, prog, sizeof(prog));
+        cpu.pc = 0xC000;
+        cpu.cycles = 0;
+        exec_program(&cpu);
+        ASSERT(cpu.cycles == 19);
+
+        cpu.pc = 0xC000;
+        cpu.cycles = 0;
+        exec_program_predecoded(&cpu);
+        ASSERT(cpu.cycles == 19);
+        free_cpu(&cpu);
+
+        // 8MHz crystal, 2MHz E clock
+        ASSERT(cycles_to_seconds(19, DEFAULT_XTAL_HZ) == 19 / 2e6);
+    }
+
+    TEST ("Prefixed opcodes") {
+        memset(cpu.memory, 0, MAX_MEMORY);
+        mnemonic m = line_to_mnemonic((char[]){" cpd #$1235"}, NULL, 0);
+        ASSERT_EQ(m.opcode, 0x1A83);
+        // ldd #$1234; cpd #$1235; unknown 18 01, skipped; cpd $40
+        cpu.memory[0xC000] = 0xCC; cpu.memory[0xC001] = 0x12; cpu.memory[0xC002] = 0x34;
+        ASSERT_EQ(add_mnemonic_to_memory(&cpu, &m, 0xC003), 4);
+        u8 rest[] = {0x18, 0x01, 0x1A, 0x93, 0x40, 0x00};
+        memcpy(cpu.memory + 0xC007, rest, sizeof(rest));
+        cpu.memory[0x40] = 0x12; cpu.memory[0x41] = 0x34;
+
+        cpu.pc = 0xC000;
+        cpu.cycles = 0;
+        exec_inst(&cpu);
+        exec_inst(&cpu);
+        SYNC_FLAGS(&cpu);
+        ASSERT_EQ(cpu.pc, 0xC007);
+        ASSERT(cpu.cycles == 3 + 5);
+        ASSERT_EQ(cpu.c, 1);
+        ASSERT_EQ(cpu.z, 0);
+
+        cpu.pc = 0xC000;
+        cpu.cycles = 0;
+        run_result r = run_cpu(&cpu, &(run_limits) {0, 0, NO_STOP_PC});
+        SYNC_FLAGS(&cpu);
+        ASSERT_EQ(r.reason, STOP_HALT);
+        ASSERT(r.cycles == 3 + 5 + 6);
+        ASSERT_EQ(cpu.z, 1);
+        ASSERT_EQ(cpu.d, 0x1234);
+
+        cpu.pc = 0xC000;
+        cpu.cycles = 0;
+        exec_program_predecoded(&cpu);
+        ASSERT(cpu.cycles == 3 + 5 + 6);
+        ASSERT_EQ(cpu.decoded[0xC003].len, 4);
+        ASSERT_EQ(cpu.decoded[0xC003].next, 0xC007);
+        ASSERT_EQ(cpu.decoded[0xC007].len, 2);
+        free_cpu(&cpu);
+    }
+
+    TEST ("Indexed addressing") {
+        char *s = NULL;
+        strcopy(&s, " ldaa ,y");
+        mnemonic m = line_to_mnemonic(s, NULL, 0);
+        mnemonic e = new_mnemonic(0, 0, INDEXDED_Y, 0);
+        e.opcode = 0x18A6;
+        ASSERT(cmp_mnemonic(&m, &e));
+        strcopy(&s, " stx $10,x");
+        m = line_to_mnemonic(s, NULL, 0);
+        e = new_mnemonic(0xEF, 0x10, INDEXDED_X, 0);
+        ASSERT(cmp_mnemonic(&m, &e));
+
+        memset(cpu.memory, 0, MAX_MEMORY);
+        const char *prog[] = {
+            " ldx #$40", " ldy #$50", " ldaa 2,x", " adda 1,y", " staa 3,x", " inx", " cpx #$41",
+            " sty ,x", " jsr $C040",
+        };
+        u16 addr = 0xC000;
+        for (u8 i = 0; i < sizeof(prog) / sizeof(prog[0]); ++i) {
+            strcopy(&s, prog[i]);
+            m = line_to_mnemonic(s, NULL, addr);
+            addr += add_mnemonic_to_memory(&cpu, &m, addr);
+        }
+        // sub: inc 0,y; rts
+        u8 sub[] = {0x18, 0x6C, 0x00, 0x39};
+        memcpy(cpu.memory + 0xC040, sub, sizeof(sub));
+        cpu.memory[0x42] = 0x10;
+        cpu.memory[0x51] = 0x05;
+        free(s);
+
+        cpu.pc = 0xC000;
+        cpu.sp = 0x00FF;
+        cpu.cycles = 0;
+        run_result r = run_cpu(&cpu, &(run_limits) {0, 0, NO_STOP_PC});
+        ASSERT_EQ(r.reason, STOP_HALT);
+        ASSERT_EQ(cpu.a, 0x15);
+        ASSERT_EQ(cpu.memory[0x43], 0x15);
+        ASSERT_EQ(cpu.ix, 0x41);
+        ASSERT_EQ(cpu.iy, 0x50);
+        ASSERT_EQ(cpu.memory[0x41], 0x00);
+        ASSERT_EQ(cpu.memory[0x42], 0x50);
+        ASSERT_EQ(cpu.memory[0x50], 0x01);
+        ASSERT_EQ(cpu.sp, 0x00FF);
+        ASSERT_EQ(cpu.pc, 0xC018);
+        ASSERT(r.cycles == 3 + 4 + 4 + 5 + 4 + 3 + 4 + 6 + 6 + 7 + 5);
+
+        // Same with the operands decoded ahead of time, prefixed ones included
+        cpu.memory[0x42] = 0x10;
+        cpu.memory[0x43] = 0x00;
+        cpu.memory[0x50] = 0x00;
+        cpu.pc = 0xC000;
+        cpu.cycles = 0;
+        exec_program_predecoded(&cpu);
+        ASSERT_EQ(cpu.decoded[0xC009].kind, DECODED_EXEC);
+        ASSERT(cpu.decoded[0xC009].exec == DECODED_ADDA_IDY);
+        ASSERT_EQ(cpu.decoded[0xC009].operand, 0x01);
+        ASSERT_EQ(cpu.a, 0x15);
+        ASSERT_EQ(cpu.memory[0x43], 0x15);
+        ASSERT_EQ(cpu.memory[0x42], 0x50);
+        ASSERT_EQ(cpu.memory[0x50], 0x01);
+        ASSERT_EQ(cpu.sp, 0x00FF);
+        ASSERT_EQ(cpu.pc, 0xC018);
+        ASSERT(cpu.cycles == 3 + 4 + 4 + 5 + 4 + 3 + 4 + 6 + 6 + 7 + 5);
+        free_cpu(&cpu);
+    }
+
+    TEST ("Memory regions") {
+        memset(cpu.memory, 0, MAX_MEMORY);
+        memset(cpu.ports, 0, sizeof(cpu.ports));
+        map_memory(&cpu, 0xD000, 0xD0FF, REGION_ROM);
+        // ldab #$5A; stab $1004; ldaa #$F0; staa $1007; staa $1006; staa $D000; inc $D001; ldab $100A
+        u8 prog[] = {
+            0xC6, 0x5A, 0xF7, 0x10, 0x04, 0x86, 0xF0, 0xB7, 0x10, 0x07, 0xB7, 0x10, 0x06,
+            0xB7, 0xD0, 0x00, 0x7C, 0xD0, 0x01, 0xF6, 0x10, 0x0A, 0x00,
+        };
+        memcpy(cpu.memory + 0xC000, prog, sizeof(prog));
+        cpu.memory[0xD001] = 0x11;
+        cpu.ports[PORTE] = 0x33;
+        cpu.pc = 0xC000;
+        run_cpu(&cpu, &(run_limits) {0, 0, NO_STOP_PC});
+        // The map belongs to the cpu, a snapshot carries it to another one
+        ASSERT_EQ(other.regions[0xD0], REGION_RAM);
+        snapshot *rom = take_snapshot(&cpu);
+        restore_snapshot(&other, rom);
+        ASSERT_EQ(other.regions[0xD0], REGION_ROM);
+        ASSERT_EQ(other.regions[0x10], REGION_IO);
+        free_snapshot(rom);
+        free_cpu(&other);
+        map_memory(&other, 0xD000, 0xD0FF, REGION_RAM);
+        map_memory(&cpu, 0xD000, 0xD0FF, REGION_RAM);
+        ASSERT_EQ(cpu.ports[PORTB], 0x5A); // Written from B, not A
+        ASSERT_EQ(cpu.memory[PORTB_ADDR], 0x00);
+        ASSERT_EQ(cpu.ports[PORTC], 0xF0);
+        ASSERT_EQ(cpu.memory[0xD000], 0x00);
+        ASSERT_EQ(cpu.memory[0xD001], 0x11);
+        ASSERT_EQ(cpu.b, 0x33);
+        free_cpu(&cpu);
+    }
+
+    TEST ("Snapshots") {
+        memset(cpu.memory, 0, MAX_MEMORY);
+        // ldaa #$11; staa $40; staa $2000
+        u8 prog[] = {0x86, 0x11, 0x97, 0x40, 0xB7, 0x20, 0x00, 0x00};
+        memcpy(cpu.memory + 0xC000, prog, sizeof(prog));
+        cpu.pc = 0xC000;
+        cpu.a = 0;
+        snapshot *start = take_snapshot(&cpu);
+        run_cpu(&cpu, &(run_limits) {0, 0, NO_STOP_PC});
+        snapshot *end = take_snapshot(&cpu);
+        // Only the pages written in between are copied
+        ASSERT(end->pages[0x00] != start->pages[0x00]);
+        ASSERT(end->pages[0x20] != start->pages[0x20]);
+        ASSERT(end->pages[0xC0] == start->pages[0xC0]);
+        ASSERT(end->pages[0x10] == start->pages[0x10]);
+        ASSERT_EQ(atomic_load(&start->pages[0xC0]->refs), 3);
+
+        restore_snapshot(&cpu, start);
+        ASSERT_EQ(cpu.pc, 0xC000);
+        ASSERT_EQ(cpu.a, 0);
+        ASSERT_EQ(cpu.memory[0x40], 0);
+        ASSERT_EQ(cpu.memory[0x2000], 0);
+        ASSERT_EQ(cpu.dirty[0x00], 0);
+
+        // Another cpu can branch from a snapshot taken on this one
+        restore_snapshot(&other, end);
+        free_snapshot(end);
+        ASSERT_EQ(other.a, 0x11);
+        ASSERT_EQ(other.memory[0x40], 0x11);
+        ASSERT_EQ(other.memory[0x2000], 0x11);
+        ASSERT_EQ(other.memory[0xC000], 0x86);
+        free_cpu(&other);
+        free_snapshot(start);
+        free_cpu(&cpu);
+    }
+
+    TEST ("Undo log") {
+        memset(cpu.memory, 0, MAX_MEMORY);
+        // ldx #$40; ldaa #3; loop: staa 0,x; inx; deca; bne loop; psha
+        u8 prog[] = {0xCE, 0x00, 0x40, 0x86, 0x03, 0xA7, 0x00, 0x08, 0x4A, 0x26, 0xFA, 0x36, 0x00};
+        memcpy(cpu.memory + 0xC000, prog, sizeof(prog));
+        memset(cpu.memory + 0x40, 0x77, 3);
+        cpu.memory[0xFF] = 0x55;
+        cpu.pc = 0xC000;
+        cpu.sp = 0xFF;
+        cpu.a = 0x99;
+        cpu.ix = 0;
+        cpu.cycles = 0;
+        cpu.next_event = UINT64_MAX;
+        enable_undo(&cpu, 0);
+        run_result r = run_cpu(&cpu, &(run_limits) {0, 0, NO_STOP_PC});
+        ASSERT(r.instructions == 15);
+        ASSERT_EQ(cpu.memory[0x42], 1);
+        ASSERT(cpu.undo->head <= 15 * 7); // A few bytes per instruction
+
+        // Going back puts the bytes back in place without writing them as the program does
+        set_watchpoint(&cpu, 0xFF, WATCH_WRITE); // psha wrote it
+        ASSERT(undo_until(&cpu, 0xC007) == 4); // Back to the last inx
+        ASSERT(cpu.debug->hit == DEBUG_NONE);
+        set_watchpoint(&cpu, 0xFF, 0);
+        ASSERT_EQ(cpu.ix, 0x42);
+        ASSERT_EQ(cpu.a, 1);
+        ASSERT_EQ(cpu.memory[0x42], 1);
+        ASSERT_EQ(cpu.memory[0xFF], 0x55);
+        ASSERT_EQ(cpu.sp, 0xFF);
+
+        ASSERT(undo_until(&cpu, NO_STOP_PC) == 11);
+        ASSERT_EQ(cpu.pc, 0xC000);
+        ASSERT_EQ(cpu.a, 0x99);
+        ASSERT_EQ(cpu.ix, 0);
+        ASSERT_EQ(cpu.memory[0x40], 0x77);
+        ASSERT_EQ(cpu.memory[0x42], 0x77);
+        ASSERT(cpu.cycles == 0);
+        ASSERT_EQ(undo_step(&cpu), 0);
+
+        // Running again gives the same result
+        r = run_cpu(&cpu, &(run_limits) {0, 0, NO_STOP_PC});
+        ASSERT(r.instructions == 15);
+        ASSERT_EQ(cpu.memory[0x41], 2);
+        free_cpu(&cpu);
+    }
+
+    TEST ("Input record and replay") {
+        // ldab #8; loop: ldaa $100A; adda $41; staa $41; decb; bne loop
+        u8 prog[] = {0xC6, 0x08, 0xB6, 0x10, 0x0A, 0x9B, 0x41, 0x97, 0x41, 0x5A, 0x26, 0xF6, 0x00};
+        u8 sum = 0;
+        u8 *log = NULL;
+        u32 size = 0;
+        for (u8 replay = 0; replay < 2; ++replay) {
+            memset(cpu.memory, 0, MAX_MEMORY);
+            memcpy(cpu.memory + 0xC000, prog, sizeof(prog));
+            cpu.pc = 0xC000;
+            cpu.cycles = 0;
+            cpu.next_event = UINT64_MAX;
+            cpu.ports[PORTE] = 0xEE;
+            if (replay) {
+                replay_inputs(&cpu, log, size);
+                run_cpu(&cpu, &(run_limits) {0, 0, NO_STOP_PC});
+                ASSERT_EQ(cpu.memory[0x41], sum);
+                ASSERT(cpu.inputs->reads == 8);
+                ASSERT(cpu.inputs->mismatches == 0);
+            } else {
+                // The port changes every other iteration
+                record_inputs(&cpu);
+                for (u8 i = 0; cpu.memory[cpu.pc] != 0x00; ++i) {
+                    cpu.ports[PORTE] = i / 2 * 3;
+                    sum += cpu.ports[PORTE];
+                    run_cpu(&cpu, &(run_limits) {5, 0, NO_STOP_PC});
+                }
+                sum -= cpu.ports[PORTE]; // The last slice only ran bne
+                ASSERT_EQ(cpu.memory[0x41], sum);
+                ASSERT(cpu.inputs->size <= 5 * 3);
+                size = cpu.inputs->size;
+                log = malloc(size);
+                memcpy(log, cpu.inputs->data, size);
+            }
+            free_cpu(&cpu);
+        }
+        free(log);
+    }
+
+    TEST ("Trace stream") {
+        // ldx #$2000; ldaa #$5A; loop: staa 0,x; inx; cpx #$2800; bne loop
+        u8 prog[] = {0xCE, 0x20, 0x00, 0x86, 0x5A, 0xA7, 0x00, 0x08, 0x8C, 0x28, 0x00, 0x26, 0xF8, 0x00};
+        trace_filter stores = {0xC005, 0xC006, {0}};
+        trace_filter inx = {0, 0xFFFF, {0}};
+        memset(stores.opcodes, 0xFF, sizeof(stores.opcodes));
+        trace_filter_opcode(&inx, 0x08);
+        const trace_filter *filters[] = {NULL, &stores, &inx};
+        // More records than a buffer holds so the writer packs several blocks
+        const u32 expected[] = {2 + 0x800 * 4, 0x800, 0x800};
+        for (u8 i = 0; i < 3; ++i) {
+            memset(cpu.memory, 0, MAX_MEMORY);
+            memcpy(cpu.memory + 0xC000, prog, sizeof(prog));
+            cpu.pc = 0xC000;
+            cpu.next_event = UINT64_MAX;
+            start_trace(&cpu, "trace_test.bin", filters[i]);
+            run_cpu(&cpu, &(run_limits) {0, 0, NO_STOP_PC});
+            ASSERT(end_trace(&cpu) == expected[i]);
+            trace_check c = {0, 0, 0, 0};
+            ASSERT(read_trace("trace_test.bin", check_record, &c) == expected[i]);
+            ASSERT(c.count == expected[i]);
+            ASSERT(c.stores == (i == 2 ? 0 : 0x800));
+            ASSERT(c.bad_flags == 0);
+            ASSERT(c.last_pc == (i == 0 ? 0xC00B : (i == 1 ? 0xC005 : 0xC007)));
+        }
+
+        // An idle loop is not skipped while tracing: bra *, every iteration has its record
+        cpu.memory[0xC000] = 0x20;
+        cpu.memory[0xC001] = 0xFE;
+        cpu.pc = 0xC000;
+        start_trace(&cpu, "trace_test.bin", NULL);
+        run_result r = run_cpu(&cpu, &(run_limits) {10000, 0, NO_STOP_PC});
+        ASSERT_EQ(r.reason, STOP_INSTRUCTIONS);
+        ASSERT(r.idle_cycles == 0);
+        ASSERT(end_trace(&cpu) == 10000);
+        remove("trace_test.bin");
+        free_cpu(&cpu);
+    }
+
+#ifdef EMULATOR_PROFILE
+    TEST ("Profiler") {
+        // ldab #3; loop: ldaa $41; staa $42; decb; bne loop
+        u8 prog[] = {0xC6, 0x03, 0x96, 0x41, 0x97, 0x42, 0x5A, 0x26, 0xF9, 0x00};
+        memset(cpu.memory, 0, MAX_MEMORY);
+        memcpy(cpu.memory + 0xC000, prog, sizeof(prog));
+        cpu.pc = 0xC000;
+        cpu.next_event = UINT64_MAX;
+        start_profile(&cpu);
+        run_cpu(&cpu, &(run_limits) {0, 0, NO_STOP_PC});
+        ASSERT(cpu.profile->executions[0xC000] == 1);
+        ASSERT(cpu.profile->executions[0xC002] == 3);
+        ASSERT(cpu.profile->cycles[0xC002] == 3 * 3);
+        ASSERT(cpu.profile->cycles[0xC007] == 3 * 3);
+        ASSERT(cpu.profile->reads[0x41] == 3);
+        ASSERT(cpu.profile->writes[0x42] == 3);
+        ASSERT(cpu.profile->reads[0xC003] == 0); // Operands are not data
+        free_cpu(&cpu);
+        ASSERT(cpu.profile == NULL);
+    }
+
+    TEST ("Call graph") {
+        // main: lds #$FF; ldab #3; loop: jsr work; bsr twice; decb; bne loop; bsr trick; bra end
+        // work: ldaa #1; rts    twice: jsr work; jsr work; rts    trick: pulx; jmp 0,x
+        u8 prog[] = {0x8E, 0x00, 0xFF, 0xC6, 0x03, 0xBD, 0xC0, 0x11, 0x8D, 0x0A, 0x5A, 0x26, 0xF8,
+            0x8D, 0x0C, 0x20, 0x0E, 0x86, 0x01, 0x39, 0xBD, 0xC0, 0x11, 0xBD, 0xC0, 0x11, 0x39,
+            0x38, 0x6E, 0x00, 0x01, 0x00};
+        memset(cpu.memory, 0, MAX_MEMORY);
+        memcpy(cpu.memory + 0xC000, prog, sizeof(prog));
+        cpu.pc = 0xC000;
+        cpu.next_event = UINT64_MAX;
+        start_profile(&cpu);
+        run_cpu(&cpu, &(run_limits) {0, 0, NO_STOP_PC});
+        const profile_function *work = &cpu.profile->functions[0xC011];
+        const profile_function *twice = &cpu.profile->functions[0xC014];
+        ASSERT(work->calls == 9);
+        ASSERT(work->exclusive.instructions == 2 * 9);
+        ASSERT(work->exclusive.cycles == (2 + 5) * 9);
+        ASSERT(twice->calls == 3);
+        ASSERT(twice->exclusive.cycles == (6 + 6 + 5) * 3);
+        ASSERT(twice->inclusive.cycles == twice->exclusive.cycles + 6 * 7);
+        const profile_edge *e = &cpu.profile->edges[twice->first_edge - 1];
+        ASSERT(e->callee == 0xC011 && e->calls == 6);
+        // trick pulled its return address, it ends there and the jmp is its caller's
+        ASSERT(cpu.profile->functions[0xC01B].inclusive.instructions == 1);
+        ASSERT(cpu.profile->depth == 1);
+        free_cpu(&cpu);
+    }
+#endif
+
+    TEST ("Predecoded execution") {
+        cpu.pc = 0xC000;
+        // ldab #3; loop: decb; bne loop; ldaa #$2A
+        u8 prog[] = {0xC6, 0x03, 0x5A, 0x26, 0xFD, 0x86, 0x2A, 0x00};
+        memcpy(cpu.memory + 0xC000, prog, sizeof(prog));
+        exec_program_predecoded(&cpu);
+        ASSERT_EQ(cpu.b, 0);
+        ASSERT_EQ(cpu.a, 0x2A);
+        ASSERT_EQ(cpu.decoded[0xC003].len, 2);
+        ASSERT_EQ(cpu.decoded[0xC003].operand, 0xFD);
+        ASSERT_EQ(cpu.decoded[0xC003].next, 0xC005);
+
+        // Storing over the code drops the entries covering that byte
+        WRITE8(&cpu, 0xC006, 0x15);
+        ASSERT_EQ(cpu.decoded[0xC005].len, 0);
+        ASSERT_NEQ(cpu.decoded[0xC002].len, 0);
+        cpu.pc = 0xC000;
+        exec_program_predecoded(&cpu);
+        ASSERT_EQ(cpu.a, 0x15);
+        free_cpu(&cpu);
+    }
+
+    TEST ("Hot traces") {
+        memset(cpu.memory, 0, MAX_MEMORY);
+        cpu.pc = 0xC000;
+        // ldaa #3; outer: ldab #200; inner: decb; bne inner; deca; bne outer
+        u8 prog[] = {0x86, 0x03, 0xC6, 0xC8, 0x5A, 0x26, 0xFD, 0x4A, 0x26, 0xF8, 0x00};
+        memcpy(cpu.memory + 0xC000, prog, sizeof(prog));
+        cpu.cycles = 0;
+        exec_program_traces(&cpu);
+        ASSERT(cpu.cycles == 2 + 3 * (2 + 200 * 5 + 5));
+        ASSERT_EQ(cpu.a, 0);
+        ASSERT_EQ(cpu.b, 0);
+        ASSERT_EQ(cpu.pc, 0xC00A);
+        ASSERT(cpu.traces->entry[0xC004] != NULL);
+        ASSERT_EQ(cpu.traces->entry[0xC004]->len, 2);
+
+        // Writing inside the loop drops its trace
+        WRITE8(&cpu, 0xC004, 0x5A);
+        ASSERT(cpu.traces->entry[0xC004] == NULL);
+        free_cpu(&cpu);
+
+        cpu.pc = 0x0040;
+        // ldab #100; loop: ldaa #0; inc $0043; decb; bne loop
+        // The loop rewrites itself on every iteration so no trace can be kept
+        u8 smc[] = {0xC6, 0x64, 0x86, 0x00, 0x7C, 0x00, 0x43, 0x5A, 0x26, 0xF8, 0x00};
+        memcpy(cpu.memory + 0x0040, smc, sizeof(smc));
+        exec_program_traces(&cpu);
+        ASSERT_EQ(cpu.a, 99);
+        ASSERT_EQ(cpu.memory[0x0043], 100);
+        ASSERT(cpu.traces->entry[0x0042] == NULL);
+        free_cpu(&cpu);
+
+        // A recorded bra * only ends through what is looked at between two passes: first an
+        // IRQ at cycle 3000 whose handler is a halt, then a break-in
+        memset(cpu.memory, 0, MAX_MEMORY);
+        u8 spin[] = {0x0E, 0x20, 0xFE}; // cli; bra *
+        memcpy(cpu.memory + 0xC000, spin, sizeof(spin));
+        cpu.memory[IRQ_VECTOR] = 0xC1;
+        cpu.memory[IRQ_VECTOR + 1] = 0x00;
+        cpu.pc = 0xC000;
+        cpu.sp = 0x01FF;
+        cpu.cycles = 0;
+        cpu.status = 0;
+        LOAD_FLAGS(&cpu);
+        schedule_event(&cpu, 3000, IRQ_IRQ, 0, 0);
+        exec_program_traces(&cpu);
+        ASSERT_EQ(cpu.pc, 0xC100);
+        ASSERT(cpu.cycles >= 3000 && cpu.cycles < 3000 + 3 + INTERRUPT_CYCLES + 3);
+        ASSERT(cpu.traces->entry[0xC001] != NULL);
+
+        atomic_uchar flag = 0;
+        cpu.break_in = &flag;
+        cpu.pc = 0xC001;
+        thrd_t t;
+        ASSERT_EQ(thrd_create(&t, break_in_later, &flag), thrd_success);
+        exec_program_traces(&cpu);
+        thrd_join(t, NULL);
+        ASSERT_EQ(cpu.pc, 0xC001);
+        ASSERT_EQ(atomic_load(&flag), 0);
+        cpu.break_in = NULL;
+        free_cpu(&cpu);
+    }
+
+    TEST ("Bounded execution") {
+        memset(cpu.memory, 0, MAX_MEMORY);
+        // spin: inca; bra spin
+        u8 spin[] = {0x4C, 0x20, 0xFD};
+        memcpy(cpu.memory + 0xC000, spin, sizeof(spin));
+        cpu.pc = 0xC000;
+        cpu.a = 0;
+        cpu.cycles = 0;
+
+        run_result r = run_cpu(&cpu, &(run_limits) {1001, 0, NO_STOP_PC});
+        ASSERT_EQ(r.reason, STOP_INSTRUCTIONS);
+        ASSERT(r.instructions == 1001);
+        ASSERT_EQ(cpu.pc, 0xC001);
+        ASSERT_EQ(cpu.a, 501 & 0xFF);
+
+        // inca and bra take 5 cycles together, the last instruction may end past the budget
+        cpu.pc = 0xC000;
+        cpu.cycles = 0;
+        r = run_cpu(&cpu, &(run_limits) {0, 101, NO_STOP_PC});
+        ASSERT_EQ(r.reason, STOP_CYCLES);
+        ASSERT(r.instructions == 41);
+        ASSERT(r.cycles == 102);
+
+        cpu.pc = 0xC000;
+        r = run_cpu(&cpu, &(run_limits) {10, 0, 0xC001});
+        ASSERT_EQ(r.reason, STOP_PC);
+        ASSERT(r.instructions == 1);
+        ASSERT_EQ(cpu.pc, 0xC001);
+
+        // The opcode at the target is only written while running
+        // ldaa #$4c; staa $08; bra +2; nop at $08 turned into inca
+        u8 smc[] = {0x86, 0x4C, 0x97, 0x08, 0x20, 0x02, 0x00, 0x00, 0x01};
+        memcpy(cpu.memory, smc, sizeof(smc));
+        cpu.pc = 0x0000;
+        r = run_cpu(&cpu, &(run_limits) {100, 0, 0x0008});
+        ASSERT_EQ(r.reason, STOP_PC);
+        ASSERT(r.instructions == 3);
+        ASSERT_EQ(cpu.memory[0x0008], 0x4C);
+
+        cpu.pc = 0xC000;
+        cpu.memory[0xC001] = 0x00;
+        r = run_cpu(&cpu, &(run_limits) {0, 0, NO_STOP_PC});
+        ASSERT_EQ(r.reason, STOP_HALT);
+        ASSERT_EQ(cpu.pc, 0xC001);
+    }
+
+    TEST ("Breakpoints and watchpoints") {
+        memset(cpu.memory, 0, MAX_MEMORY);
+        // lds #$ff; jsr sub; ldaa #5; staa $0040
+        // sub: inc $0041; bsr inner; rts  inner: ldab $41; rts
+        u8 prog[] = {0x8E, 0x00, 0xFF, 0xBD, 0xC0, 0x0D, 0x86, 0x05, 0xB7, 0x00, 0x40, 0x00, 0x00,
+            0x7C, 0x00, 0x41, 0x8D, 0x02, 0x39, 0x00, 0xD6, 0x41, 0x39};
+        memcpy(cpu.memory + 0xC000, prog, sizeof(prog));
+        cpu.pc = 0xC000;
+        cpu.cycles = 0;
+        cpu.next_event = UINT64_MAX;
+        run_limits none = {0, 0, NO_STOP_PC};
+
+        set_breakpoint(&cpu, 0xC00D, 1);
+        run_result r = run_cpu(&cpu, &none);
+        ASSERT_EQ(r.reason, STOP_BREAK);
+        ASSERT(r.instructions == 2);
+        ASSERT_EQ(cpu.pc, 0xC00D);
+
+        // Returning from inner does not count, only from sub
+        r = step_out(&cpu);
+        ASSERT_EQ(r.reason, STOP_RETURN);
+        ASSERT(r.instructions == 5);
+        ASSERT_EQ(cpu.pc, 0xC006);
+        ASSERT_EQ(cpu.sp, 0xFF);
+        ASSERT_EQ(cpu.b, 1);
+
+        r = step_over(&cpu);
+        ASSERT(r.instructions == 1);
+        ASSERT_EQ(cpu.pc, 0xC008);
+
+        // Stepping over a call stops at a breakpoint inside it
+        cpu.pc = 0xC003;
+        r = step_over(&cpu);
+        ASSERT_EQ(r.reason, STOP_BREAK);
+        ASSERT_EQ(cpu.pc, 0xC00D);
+        set_breakpoint(&cpu, 0xC00D, 0);
+        cpu.pc = 0xC003;
+        cpu.sp = 0xFF;
+        r = step_over(&cpu);
+        ASSERT_EQ(r.reason, STOP_RETURN);
+        ASSERT_EQ(cpu.pc, 0xC006);
+        ASSERT_EQ(cpu.memory[0x41], 2);
+
+        // Watchpoints stop once the instruction that made the access is done
+        set_watchpoint(&cpu, 0x41, WATCH_READ);
+        cpu.pc = 0xC003;
+        r = run_cpu(&cpu, &none);
+        ASSERT_EQ(r.reason, STOP_WATCH);
+        ASSERT_EQ(cpu.pc, 0xC010);
+        ASSERT_EQ(cpu.debug->hit, DEBUG_READ);
+        ASSERT_EQ(cpu.debug->hit_addr, 0x41);
+        r = run_cpu(&cpu, &none);
+        ASSERT_EQ(r.reason, STOP_WATCH);
+        ASSERT_EQ(cpu.pc, 0xC016);
+        set_watchpoint(&cpu, 0x41, 0);
+        set_watchpoint(&cpu, 0x40, WATCH_WRITE);
+        r = run_cpu(&cpu, &none);
+        ASSERT_EQ(r.reason, STOP_WATCH);
+        ASSERT_EQ(cpu.pc, 0xC00B);
+        ASSERT_EQ(cpu.debug->hit, DEBUG_WRITE);
+        ASSERT_EQ(cpu.memory[0x40], 5);
+
+        // A run starting on a breakpoint leaves it first
+        set_breakpoint(&cpu, 0xC006, 1);
+        cpu.pc = 0xC006;
+        r = run_cpu(&cpu, &(run_limits) {0, 0, 0xC008});
+        ASSERT_EQ(r.reason, STOP_PC);
+
+        // The same stops with an undo log, which can go back past them
+        set_breakpoint(&cpu, 0xC006, 0);
+        set_breakpoint(&cpu, 0xC014, 1);
+        cpu.pc = 0xC003;
+        cpu.sp = 0xFF;
+        cpu.memory[0x41] = 0;
+        enable_undo(&cpu, 0);
+        r = run_cpu(&cpu, &none);
+        ASSERT_EQ(r.reason, STOP_BREAK);
+        ASSERT_EQ(cpu.pc, 0xC014);
+        r = step_out(&cpu);
+        ASSERT_EQ(r.reason, STOP_RETURN);
+        ASSERT_EQ(cpu.pc, 0xC012);
+        r = run_cpu(&cpu, &none);
+        ASSERT_EQ(r.reason, STOP_WATCH);
+        ASSERT_EQ(cpu.pc, 0xC00B);
+        ASSERT(undo_until(&cpu, NO_STOP_PC) == 8);
+        ASSERT_EQ(cpu.pc, 0xC003);
+        ASSERT_EQ(cpu.memory[0x41], 0);
+        disable_undo(&cpu);
+
+        // And with a trace, which has all the instructions up to the stop
+        start_trace(&cpu, "trace_test.bin", NULL);
+        r = run_cpu(&cpu, &none);
+        ASSERT_EQ(r.reason, STOP_BREAK);
+        ASSERT_EQ(cpu.pc, 0xC014);
+        ASSERT(end_trace(&cpu) == 3);
+        remove("trace_test.bin");
+        clear_debug_points(&cpu);
+        ASSERT(cpu.debug == NULL);
+    }
+
+    TEST ("Conditional breakpoints") {
+        memset(cpu.memory, 0, MAX_MEMORY);
+        // ldab #10; loop: inc $10; decb; bne loop
+        u8 prog[] = {0xC6, 0x0A, 0x7C, 0x00, 0x10, 0x5A, 0x26, 0xFA};
+        memcpy(cpu.memory + 0xC000, prog, sizeof(prog));
+        cpu.pc = 0xC000;
+        cpu.cycles = 0;
+        cpu.next_event = UINT64_MAX;
+        cpu.ports[2] = 0x81;
+        run_limits none = {0, 0, NO_STOP_PC};
+
+        condition c = {0};
+        ASSERT(compile_condition(&cpu, "B + 1 == 5 && m[$10] > 5 && ports[2] & $80", &c) == NULL);
+        ASSERT(compile_condition(&cpu, "(a", &c) != NULL);
+        ASSERT(compile_condition(&cpu, "a == 1 == 1", &c) != NULL);
+        ASSERT(compile_condition(&cpu, "a && nothing", &c) != NULL);
+        ASSERT(compile_condition(&cpu, "a &", &c) != NULL);
+
+        ASSERT(set_conditional_breakpoint(&cpu, 0xC002, "b == 4 && memory[$10] > 5") == NULL);
+        run_result r = run_cpu(&cpu, &none);
+        ASSERT_EQ(r.reason, STOP_BREAK);
+        ASSERT_EQ(cpu.pc, 0xC002);
+        ASSERT_EQ(cpu.b, 4);
+        ASSERT_EQ(cpu.memory[0x10], 6);
+
+        // z is the flag decb left, set once b reaches 0
+        ASSERT(set_conditional_breakpoint(&cpu, 0xC002, "z || -b == -1 || ~b == ~2") == NULL);
+        r = run_cpu(&cpu, &none);
+        ASSERT_EQ(r.reason, STOP_BREAK);
+        ASSERT_EQ(cpu.b, 2);
+
+        // Without its condition the breakpoint stops every time
+        set_breakpoint(&cpu, 0xC002, 1);
+        ASSERT_EQ(cpu.debug->condition_count, 0);
+        r = run_cpu(&cpu, &none);
+        ASSERT(r.instructions == 3);
+        ASSERT_EQ(cpu.b, 1);
+        clear_debug_points(&cpu);
+    }
+
+    TEST ("GDB stub") {
+        memset(cpu.memory, 0, MAX_MEMORY);
+        // ldab #10; loop: inc $10; decb; bne loop
+        u8 prog[] = {0xC6, 0x0A, 0x7C, 0x00, 0x10, 0x5A, 0x26, 0xFA};
+        memcpy(cpu.memory + 0xC000, prog, sizeof(prog));
+        cpu.ix = 0x1234;
+        cpu.d = 0x5678;
+        cpu.iy = 0x9ABC;
+        cpu.sp = 0x00FF;
+        cpu.pc = 0xC000;
+        cpu.status = 0xD0;
+        LOAD_FLAGS(&cpu);
+        cpu.next_event = UINT64_MAX;
+        gdb_session session = {0};
+        char reply[GDB_PACKET_SIZE];
+
+        ASSERT_EQ(gdb_handle_packet(&cpu, &session, "g", reply), GDB_REPLY);
+        ASSERT(strcmp(reply, "123456789abc00ffc0005678d0") == 0);
+        gdb_handle_packet(&cpu, &session, "m c000,3", reply);
+        ASSERT(strcmp(reply, "E01") == 0);
+        gdb_handle_packet(&cpu, &session, "mc000,3", reply);
+        ASSERT(strcmp(reply, "c60a7c") == 0);
+        gdb_handle_packet(&cpu, &session, "Mc001,1:03", reply);
+        ASSERT(strcmp(reply, "OK") == 0);
+        ASSERT_EQ(cpu.memory[0xC001], 3);
+        gdb_handle_packet(&cpu, &session, "P6=ff", reply);
+        ASSERT_EQ(cpu.b, 0xFF);
+        gdb_handle_packet(&cpu, &session, "vCont?", reply);
+        ASSERT_EQ(reply[0], '\0');
+
+        // The stop replies, the run itself is the server's
+        gdb_handle_packet(&cpu, &session, "Z2,10,1", reply);
+        ASSERT(strcmp(reply, "OK") == 0);
+        ASSERT_EQ(gdb_handle_packet(&cpu, &session, "c", reply), GDB_CONTINUE);
+        run_result r = run_cpu(&cpu, &(run_limits) {0, 0, NO_STOP_PC});
+        gdb_stop_reply(&cpu, r, reply);
+        ASSERT(strcmp(reply, "T05watch:0010;") == 0);
+        gdb_handle_packet(&cpu, &session, "z2,10,1", reply);
+        gdb_handle_packet(&cpu, &session, "Z0,c005,1", reply);
+        ASSERT_EQ(gdb_handle_packet(&cpu, &session, "sc000", reply), GDB_STEP);
+        ASSERT_EQ(cpu.pc, 0xC000);
+        r = run_cpu(&cpu, &(run_limits) {0, 0, NO_STOP_PC});
+        ASSERT_EQ(r.reason, STOP_BREAK);
+        ASSERT_EQ(cpu.pc, 0xC005);
+        clear_debug_points(&cpu);
+
+        // Framing, the connection itself is the CLI's
+        cpu.pc = 0xC000;
+        cpu.d = 0x5678;
+        cpu.status = 0xD0;
+        LOAD_FLAGS(&cpu);
+        char frame[GDB_PACKET_SIZE + 4];
+        ASSERT(gdb_frame_packet("g", frame) == 5);
+        ASSERT(strcmp(frame, "$g#67") == 0);
+        gdb_handle_packet(&cpu, &session, "g", reply);
+        gdb_frame_packet(reply, frame);
+        ASSERT(strcmp(frame, "$123456789abc00ffc0005678d0#90") == 0);
+    }
+
+    TEST ("Break-in") {
+        memset(cpu.memory, 0, MAX_MEMORY);
+        // loop: inc $10; bra loop
+        u8 prog[] = {0x7C, 0x00, 0x10, 0x20, 0xFB};
+        memcpy(cpu.memory + 0xC000, prog, sizeof(prog));
+        cpu.pc = 0xC000;
+        cpu.next_event = UINT64_MAX;
+        atomic_uchar flag = 1;
+        cpu.break_in = &flag;
+        run_result r = run_cpu(&cpu, &(run_limits) {0, 0, NO_STOP_PC});
+        ASSERT_EQ(r.reason, STOP_BREAK_IN);
+        ASSERT(r.instructions == 0);
+        ASSERT_EQ(atomic_load(&flag), 0);
+
+        thrd_t t;
+        ASSERT_EQ(thrd_create(&t, break_in_later, &flag), thrd_success);
+        r = run_cpu(&cpu, &(run_limits) {0, 0, NO_STOP_PC});
+        thrd_join(t, NULL);
+        ASSERT_EQ(r.reason, STOP_BREAK_IN);
+        ASSERT(r.instructions > 0);
+        ASSERT(cpu.pc == 0xC000 || cpu.pc == 0xC003);
+
+        // Resuming goes on from there
+        r = run_cpu(&cpu, &(run_limits) {10, 0, NO_STOP_PC});
+        ASSERT_EQ(r.reason, STOP_INSTRUCTIONS);
+        cpu.break_in = NULL;
+    }
+
+    TEST ("Idle loops") {
+        memset(cpu.memory, 0, MAX_MEMORY);
+        // wait: ldaa $100a; bne wait, port E never changes
+        u8 wait[] = {0xB6, 0x10, 0x0A, 0x26, 0xFB};
+        memcpy(cpu.memory + 0xC000, wait, sizeof(wait));
+        cpu.ports[PORTE] = 1;
+        cpu.pc = 0xC000;
+        cpu.cycles = 0;
+
+        // Skipped iterations must land exactly where stepping would: 4 + 7 * 142857 cycles
+        run_result r = run_cpu(&cpu, &(run_limits) {0, 1000000, NO_STOP_PC});
+        ASSERT_EQ(r.reason, STOP_CYCLES);
+        ASSERT(r.cycles == 1000003);
+        ASSERT(r.instructions == 285715);
+        ASSERT(r.idle_cycles > 0);
+        ASSERT_EQ(cpu.pc, 0xC003);
+
+        cpu.pc = 0xC000;
+        r = run_cpu(&cpu, &(run_limits) {0, 0, NO_STOP_PC});
+        ASSERT_EQ(r.reason, STOP_IDLE);
+        ASSERT_EQ(cpu.pc, 0xC000);
+
+        // bra *
+        cpu.memory[0xC000] = 0x20;
+        cpu.memory[0xC001] = 0xFE;
+        cpu.pc = 0xC000;
+        cpu.cycles = 0;
+        r = run_cpu(&cpu, &(run_limits) {1000001, 0, NO_STOP_PC});
+        ASSERT_EQ(r.reason, STOP_INSTRUCTIONS);
+        ASSERT(r.instructions == 1000001);
+        ASSERT(r.cycles == 3 * 1000001);
+
+        // inca; bra: a changes every time around, this is not idle
+        u8 count[] = {0x4C, 0x20, 0xFD};
+        memcpy(cpu.memory + 0xC000, count, sizeof(count));
+        cpu.pc = 0xC000;
+        cpu.a = 0;
+        r = run_cpu(&cpu, &(run_limits) {200000, 0, NO_STOP_PC});
+        ASSERT_EQ(r.reason, STOP_INSTRUCTIONS);
+        ASSERT(r.idle_cycles == 0);
+        ASSERT_EQ(cpu.a, 100000 & 0xFF);
+        cpu.ports[PORTE] = 0;
+    }
+
+    TEST ("Low power") {
+        memset(cpu.memory, 0, MAX_MEMORY);
+        // ldaa #$12; ldab #$34; wai; nop
+        u8 wai[] = {0x86, 0x12, 0xC6, 0x34, 0x3E, 0x01};
+        memcpy(cpu.memory + 0xC000, wai, sizeof(wai));
+        cpu.pc = 0xC000;
+        cpu.sp = 0x00FF;
+        cpu.cycles = 0;
+        cpu.sleep = AWAKE;
+
+        run_result r = run_cpu(&cpu, &(run_limits) {0, 0, NO_STOP_PC});
+        ASSERT_EQ(r.reason, STOP_SLEEP);
+        ASSERT_EQ(cpu.sleep, SLEEP_WAI);
+        ASSERT_EQ(cpu.pc, 0xC005);
+        ASSERT(cpu.cycles == 2 + 2 + 14);
+        // PC, IY, IX, A, B, CCR
+        ASSERT_EQ(cpu.sp, 0x00FF - 9);
+        ASSERT_EQ(cpu.memory[0x00FF], 0x05);
+        ASSERT_EQ(cpu.memory[0x00FE], 0xC0);
+        ASSERT_EQ(cpu.memory[0x00F9], 0x12);
+        ASSERT_EQ(cpu.memory[0x00F8], 0x34);
+
+        // Asleep, the clock goes straight to the limit without running anything
+        r = run_cpu(&cpu, &(run_limits) {0, 100000, NO_STOP_PC});
+        ASSERT_EQ(r.reason, STOP_CYCLES);
+        ASSERT(r.instructions == 0);
+        ASSERT(r.idle_cycles == 100000);
+        ASSERT(cpu.cycles == 18 + 100000);
+        ASSERT_EQ(cpu.pc, 0xC005);
+
+        cpu.pc = 0xC000;
+        cpu.sp = 0x00FF;
+        cpu.cycles = 0;
+        cpu.sleep = AWAKE;
+        exec_program_predecoded(&cpu);
+        ASSERT_EQ(cpu.sleep, SLEEP_WAI);
+        ASSERT_EQ(cpu.pc, 0xC005);
+        ASSERT(cpu.cycles == 18);
+        free(cpu.decoded);
+        cpu.decoded = NULL;
+
+        // stop is a NOP while S is set
+        cpu.memory[0xC004] = 0xCF;
+        cpu.memory[0xC005] = 0x00;
+        cpu.pc = 0xC004;
+        cpu.sleep = AWAKE;
+        cpu.s = 1;
+        r = run_cpu(&cpu, &(run_limits) {0, 0, NO_STOP_PC});
+        ASSERT_EQ(r.reason, STOP_HALT);
+        ASSERT_EQ(cpu.sleep, AWAKE);
+
+        cpu.pc = 0xC004;
+        cpu.s = 0;
+        r = run_cpu(&cpu, &(run_limits) {0, 0, NO_STOP_PC});
+        ASSERT_EQ(r.reason, STOP_SLEEP);
+        ASSERT_EQ(cpu.sleep, SLEEP_STOP);
+        ASSERT_EQ(cpu.pc, 0xC005);
+        cpu.sleep = AWAKE;
+    }
+
+    TEST ("Interrupts") {
+        memset(cpu.memory, 0, MAX_MEMORY);
+        // lds #$ff; cli; loop: inca; bra loop
+        u8 main_loop[] = {0x8E, 0x00, 0xFF, 0x0E, 0x4C, 0x20, 0xFD};
+        memcpy(cpu.memory + 0xC000, main_loop, sizeof(main_loop));
+        // isr: ldaa #$55; staa $20; rti
+        u8 isr[] = {0x86, 0x55, 0x97, 0x20, 0x3B};
+        memcpy(cpu.memory + 0xC100, isr, sizeof(isr));
+        cpu.memory[IRQ_VECTOR] = 0xC1;
+        cpu.memory[XIRQ_VECTOR] = 0xC1;
+        cpu.memory[SWI_VECTOR] = 0xC1;
+        cpu.pc = 0xC000;
+        cpu.cycles = 0;
+        cpu.status = 0;
+        LOAD_FLAGS(&cpu);
+        cpu.b = 0;
+        cpu.pending = 0;
+        cpu.event_count = 0;
+        cpu.next_event = UINT64_MAX;
+
+        // Taken at the first instruction boundary from cycle 100: lds 3, cli 2, then 5 per loop
+        schedule_event(&cpu, 100, IRQ_IRQ, 0, 0);
+        run_result r = run_cpu(&cpu, &(run_limits) {0, 1000, 0xC100});
+        ASSERT_EQ(r.reason, STOP_PC);
+        ASSERT(cpu.cycles == 100 + INTERRUPT_CYCLES);
+        ASSERT_EQ(cpu.i, 1);
+        ASSERT_EQ(cpu.sp, 0x00FF - 9);
+        ASSERT_EQ(cpu.memory[0x00FF], 0x04);
+        ASSERT_EQ(cpu.memory[0x00FE], 0xC0);
+
+        r = run_cpu(&cpu, &(run_limits) {0, 100, NO_STOP_PC});
+        ASSERT_EQ(r.reason, STOP_CYCLES);
+        ASSERT_EQ(cpu.memory[0x20], 0x55);
+        ASSERT_EQ(cpu.i, 0);
+        ASSERT_EQ(cpu.sp, 0x00FF);
+        ASSERT(cpu.next_event == UINT64_MAX);
+
+        // Masked by I, then taken as soon as cli runs
+        cpu.pc = 0xC003;
+        cpu.i = 1;
+        raise_interrupt(&cpu, IRQ_IRQ);
+        r = run_cpu(&cpu, &(run_limits) {0, 0, 0xC100});
+        ASSERT_EQ(r.reason, STOP_PC);
+        ASSERT(r.instructions == 1);
+
+        // XIRQ ignores I, goes first and sets X until rti
+        cpu.pc = 0xC004;
+        cpu.sp = 0x00FF;
+        cpu.i = 1;
+        cpu.x = 0;
+        cpu.pending = 0;
+        raise_interrupt(&cpu, IRQ_IRQ);
+        raise_interrupt(&cpu, IRQ_XIRQ);
+        r = run_cpu(&cpu, &(run_limits) {0, 0, 0xC100});
+        ASSERT_EQ(cpu.x, 1);
+        ASSERT_EQ(cpu.pending, 1 << IRQ_IRQ);
+        run_cpu(&cpu, &(run_limits) {0, 0, 0xC004});
+        ASSERT_EQ(cpu.x, 0);
+        ASSERT_EQ(cpu.i, 1);
+        cpu.pending = 0;
+
+        // swi; clra
+        cpu.memory[0xC004] = 0x3F;
+        cpu.memory[0xC005] = 0x4F;
+        cpu.pc = 0xC004;
+        cpu.memory[0x20] = 0;
+        r = run_cpu(&cpu, &(run_limits) {5, 0, NO_STOP_PC});
+        ASSERT_EQ(cpu.memory[0x20], 0x55);
+        ASSERT_EQ(cpu.pc, 0xC006);
+        ASSERT(r.cycles == 14 + 2 + 3 + 12 + 2);
+
+        // wai; ldaa #$77, woken up by the IRQ at 1000 without stacking again
+        u8 wai[] = {0x0E, 0x3E, 0x86, 0x77, 0x00};
+        memcpy(cpu.memory + 0xC003, wai, sizeof(wai));
+        cpu.pc = 0xC000;
+        cpu.cycles = 0;
+        cpu.memory[0x20] = 0;
+        schedule_event(&cpu, 1000, IRQ_IRQ, 0, 0);
+        r = run_cpu(&cpu, &(run_limits) {0, 0, NO_STOP_PC});
+        ASSERT_EQ(r.reason, STOP_HALT);
+        ASSERT_EQ(cpu.a, 0x77);
+        ASSERT_EQ(cpu.memory[0x20], 0x55);
+        ASSERT_EQ(cpu.sp, 0x00FF);
+        ASSERT(cpu.cycles == 1000 + 2 + 3 + 12 + 2);
+        ASSERT(r.idle_cycles == 1000 - 3 - 2 - 14);
+
+        // A masked XIRQ gets the cpu out of stop without taking the interrupt
+        cpu.memory[0xC004] = 0xCF;
+        cpu.pc = 0xC000;
+        cpu.cycles = 0;
+        cpu.x = 1;
+        cpu.s = 0;
+        schedule_event(&cpu, 500, IRQ_XIRQ, 0, 0);
+        r = run_cpu(&cpu, &(run_limits) {0, 0, NO_STOP_PC});
+        ASSERT_EQ(r.reason, STOP_HALT);
+        ASSERT(cpu.cycles == 500 + 2);
+        ASSERT_EQ(cpu.sp, 0x00FF);
+        ASSERT_EQ(cpu.a, 0x77);
+        cpu.pending = 0;
+        cpu.x = 0;
+
+        // Stopped, the enabled timer overflow neither fires nor wakes the cpu, only the IRQ at
+        // 1000 does. The timer is put off by the 993 cycles slept after lds, cli and stop.
+        cpu.memory[TOF_VECTOR] = 0xC1;
+        cpu.memory[TOF_VECTOR + 1] = 0x00;
+        cpu.memory[TMSK2] = 0x80;
+        cpu.memory[TFLG2] = 0;
+        cpu.memory[0x20] = 0;
+        cpu.pc = 0xC000;
+        cpu.cycles = 0;
+        schedule_event(&cpu, 100, IRQ_TOF, 100, 0);
+        schedule_event(&cpu, 1000, IRQ_IRQ, 0, 0);
+        r = run_cpu(&cpu, &(run_limits) {0, 0, NO_STOP_PC});
+        ASSERT_EQ(r.reason, STOP_HALT);
+        ASSERT_EQ(cpu.memory[TFLG2], 0);
+        ASSERT_EQ(cpu.memory[0x20], 0x55);
+        ASSERT(cpu.cycles == 1000 + 14 + 2 + 3 + 12 + 2);
+        ASSERT(r.idle_cycles == 1000 - 3 - 2 - 2);
+        ASSERT(cpu.next_event == 100 + 993);
+        cpu.event_count = 0;
+        cpu.next_event = UINT64_MAX;
+        cpu.memory[TMSK2] = 0;
+    }
+
+    TEST ("Timed events") {
+        memset(cpu.memory, 0, MAX_MEMORY);
+        // Polling the SCI: wait: ldaa SCSR; anda #$20; beq wait; ldab SCDR
+        u8 poll[] = {0xB6, 0x10, 0x2E, 0x84, 0x20, 0x27, 0xF9, 0xF6, 0x10, 0x2F, 0x00};
+        memcpy(cpu.memory + 0xC000, poll, sizeof(poll));
+        cpu.pc = 0xC000;
+        cpu.cycles = 0;
+        cpu.event_count = 0;
+        cpu.next_event = UINT64_MAX;
+        schedule_event(&cpu, 5000000, IRQ_SCI, 0, 0x42);
+        schedule_event(&cpu, 1000000, IRQ_TOF, 0, 0);
+        run_result r = run_cpu(&cpu, &(run_limits) {0, 0, NO_STOP_PC});
+        ASSERT_EQ(r.reason, STOP_HALT);
+        ASSERT_EQ(cpu.b, 0x42);
+        ASSERT_EQ(cpu.memory[TFLG2], 0x80); // Interrupts disabled, only the flag is set
+        ASSERT(r.cycles > 5000000 && r.cycles < 5000000 + 20);
+        ASSERT(r.idle_cycles > 4000000);
+        ASSERT_EQ(cpu.pending, 0);
+
+        // Periodic timer overflow: isr: inc $10 (as ldaa/inca/staa); rti
+        u8 loop[] = {0x8E, 0x00, 0xFF, 0x86, 0x80, 0xB7, 0x10, 0x24, 0x0E, 0x20, 0xFE};
+        memcpy(cpu.memory + 0xC000, loop, sizeof(loop));
+        u8 isr[] = {0x96, 0x10, 0x4C, 0x97, 0x10, 0x3B};
+        memcpy(cpu.memory + 0xC100, isr, sizeof(isr));
+        cpu.memory[TOF_VECTOR] = 0xC1;
+        cpu.memory[TOF_VECTOR + 1] = 0x00;
+        cpu.pc = 0xC000;
+        cpu.cycles = 0;
+        cpu.i = 1;
+        schedule_event(&cpu, 65536, IRQ_TOF, 65536, 0);
+        r = run_cpu(&cpu, &(run_limits) {0, 65536 * 4 + 100, NO_STOP_PC});
+        ASSERT_EQ(r.reason, STOP_CYCLES);
+        ASSERT_EQ(cpu.memory[0x10], 4);
+        ASSERT_EQ(cpu.sp, 0x00FF);
+        ASSERT(cpu.next_event == 65536 * 5);
+        cpu.event_count = 0;
+        cpu.next_event = UINT64_MAX;
+        cpu.pending = 0;
+    }
+
+    TEST ("Batch runner") {
+        FILE *f = fopen("batch_test.asm", "w");
+        fprintf(f, "    org $c000\n    ldaa $100a\n    adda #1\n    staa $20\nloop\n    deca\n    bne loop\n");
+        fclose(f);
+        f = fopen("batch_test.txt", "w");
+        fprintf(f, "# Same program three times, assembled once\n");
+        fprintf(f, "batch_test.asm e=5 0 0x20-0x21\n");
+        fprintf(f, "batch_test.asm e=0x10 2 0x20\n");
+        fprintf(f, "\nbatch_test.asm - 0\n");
+        fclose(f);
+
+        batch *b = load_batch("batch_test.txt");
+        ASSERT_EQ(b->job_count, 3);
+        ASSERT_EQ(b->program_count, 1);
+        run_batch(b, 2);
+
+        ASSERT_EQ(b->results[0].reason, STOP_HALT);
+        ASSERT_EQ(b->results[0].memory[0], 6);
+        ASSERT_EQ(b->results[0].memory[1], 0);
+        ASSERT_EQ(b->results[0].a, 0);
+        ASSERT(b->results[0].instructions == 3 + 2 * 6);
+        ASSERT(b->results[0].cycles == 4 + 2 + 4 + 6 * (2 + 3));
+
+        // The budget stops it before the store
+        ASSERT_EQ(b->results[1].reason, STOP_INSTRUCTIONS);
+        ASSERT_EQ(b->results[1].a, 0x11);
+        ASSERT_EQ(b->results[1].pc, 0xC005);
+        ASSERT_EQ(b->results[1].memory[0], 0);
+
+        ASSERT_EQ(b->results[2].reason, STOP_HALT);
+        ASSERT(b->results[2].instructions == 3 + 2 * 1);
+
+        free_batch(b);
+        remove("batch_test.asm");
+        remove("batch_test.txt");
+    }
+
+    TEST ("Lockstep lanes") {
+        memset(cpu.memory, 0, MAX_MEMORY);
+        // ldaa $100a; ldab #3; loop: adda #7; eora #$55; asla; cmpa #$40; bcs skip;
+        // anda #$0f; skip: decb; bne loop; staa $20
+        u8 prog[] = {0xB6, 0x10, 0x0A, 0xC6, 0x03, 0x8B, 0x07, 0x88, 0x55, 0x48, 0x81, 0x40,
+                     0x25, 0x02, 0x84, 0x0F, 0x5A, 0x26, 0xF2, 0x97, 0x20, 0x00};
+        memcpy(cpu.memory + 0xC000, prog, sizeof(prog));
+        cpu.pc = 0xC000;
+        cpu.a = cpu.b = 0;
+        cpu.status = 0;
+        LOAD_FLAGS(&cpu);
+        cpu.cycles = 0;
+        lockstep *ls = new_lockstep(&cpu, 256);
+        for (u32 i = 0; i < 256; ++i) {
+            ls->lanes[i].ports[PORTE] = i;
+        }
+        run_lockstep(ls, 0);
+        ASSERT(ls->vector_steps > 0);
+        ASSERT(ls->splits > 0);
+
+        // Every lane ends like the same input run on its own
+        u32 mismatches = 0;
+        for (u32 i = 0; i < 256; ++i) {
+            memset(cpu.memory, 0, MAX_MEMORY);
+            memcpy(cpu.memory + 0xC000, prog, sizeof(prog));
+            cpu.pc = 0xC000;
+            cpu.a = cpu.b = 0;
+            cpu.status = 0;
+            LOAD_FLAGS(&cpu);
+            cpu.cycles = 0;
+            cpu.ports[PORTE] = i;
+            exec_program(&cpu);
+            SYNC_FLAGS(&cpu);
+            mismatches += cpu.a != ls->lanes[i].a || cpu.b != ls->lanes[i].b
+                || cpu.status != ls->lanes[i].status || cpu.pc != ls->lanes[i].pc
+                || cpu.cycles != ls->lanes[i].cycles || cpu.memory[0x20] != ls->lanes[i].memory[0x20];
+        }
+        ASSERT_EQ(mismatches, 0);
+        free_lockstep(ls);
+        free_cpu(&cpu);
+    }
+
+#ifdef EMULATOR_THREADED
+    TEST ("Threaded against the portable loop") {
+        static u8 code[MAX_MEMORY];
+        // ldy #3; outer: ldx #$100; inner: dex; bne inner; bsr sub; dey; bne outer;
+        // ldx $40; jsr sub2; jmp end; sub: inca; rts; sub2: stx $42; rts; end: std $44
+        u8 loops[] = {0x18, 0xCE, 0x00, 0x03, 0xCE, 0x01, 0x00, 0x09, 0x26, 0xFD, 0x8D, 0x0C,
+                      0x18, 0x09, 0x26, 0xF4, 0xDE, 0x40, 0xBD, 0xC0, 0x1A, 0x7E, 0xC0, 0x1D,
+                      0x4C, 0x39, 0xDF, 0x42, 0x39, 0xDD, 0x44, 0x00};
+        memset(code, 0, MAX_MEMORY);
+        memcpy(code + 0xC000, loops, sizeof(loops));
+        ASSERT(same_run(&cpu, &other, code, 0xC000 + sizeof(loops) - 1, 0, 0, 0));
+        ASSERT_EQ(cpu.iy, 0);
+        ASSERT_EQ(cpu.a, 3);
+        ASSERT_EQ(cpu.pc, 0xC01F);
+
+        // Direct page accesses follow the memory map like the others
+        // ldaa #$55; staa $10; std $20; stx $30; ldab $10; ldaa $04; adda $21; ldd $30; ldx $20
+        u8 direct[] = {0x86, 0x55, 0x97, 0x10, 0xDD, 0x20, 0xDF, 0x30, 0xD6, 0x10, 0x96, 0x04,
+                       0x9B, 0x21, 0xDC, 0x30, 0xDE, 0x20, 0x00};
+        memset(code, 0, MAX_MEMORY);
+        memcpy(code + 0xC000, direct, sizeof(direct));
+        const region_kind page0[] = {REGION_IO, REGION_ROM};
+        for (u32 i = 0; i < sizeof(page0) / sizeof(page0[0]); ++i) {
+            map_memory(&cpu, 0x0000, 0x00FF, page0[i]);
+            map_memory(&other, 0x0000, 0x00FF, page0[i]);
+            ASSERT(same_run(&cpu, &other, code, 0xC000 + sizeof(direct) - 1, 0, 0, 0));
+        }
+        ASSERT_EQ(cpu.memory[0x10], 0); // The last run had page 0 as ROM
+        map_memory(&cpu, 0x0000, 0x00FF, REGION_RAM);
+        map_memory(&other, 0x0000, 0x00FF, REGION_RAM);
+
+        // Random programs, loops included, stopped by an instruction limit when they do not end
+        u32 seed = 0x2545F491;
+        u32 mismatches = 0;
+        for (u32 i = 0; i < 500; ++i) {
+            memset(code, 0, MAX_MEMORY);
+            u16 end = random_program(code, &seed, 48);
+            mismatches += !same_run(&cpu, &other, code, end, next_random(&seed), next_random(&seed), 5000);
+        }
+        ASSERT_EQ(mismatches, 0);
+        free_cpu(&cpu);
+        free_cpu(&other);
+    }
+#endif
+
+#ifdef EMULATOR_JIT
+    TEST ("JIT translation") {
+        memset(cpu.memory, 0, MAX_MEMORY);
+        cpu.pc = 0x0040;
+        // ldab #5; loop: ldaa #1; inc $0043; decb; bne loop
+        // The inc rewrites the immediate operand of the ldaa, so the block has to be translated again
+        u8 prog[] = {0xC6, 0x05, 0x86, 0x01, 0x7C, 0x00, 0x43, 0x5A, 0x26, 0xF8, 0x00};
+        memcpy(cpu.memory + 0x0040, prog, sizeof(prog));
+        cpu.cycles = 0;
+        exec_program_jit(&cpu);
+        ASSERT(cpu.cycles == 2 + 5 * (2 + 6 + 2 + 3));
+        ASSERT_EQ(cpu.b, 0);
+        ASSERT_EQ(cpu.a, 0x05);
+        ASSERT_EQ(cpu.memory[0x0043], 0x06);
+        ASSERT_EQ(cpu.pc, 0x004A);
+        free_cpu(&cpu);
+
+        // Interrupts and break-in are looked at between blocks: cli; bra *, the IRQ handler halts
+        memset(cpu.memory, 0, MAX_MEMORY);
+        u8 spin[] = {0x0E, 0x20, 0xFE};
+        memcpy(cpu.memory + 0xC000, spin, sizeof(spin));
+        cpu.memory[IRQ_VECTOR] = 0xC1;
+        cpu.memory[IRQ_VECTOR + 1] = 0x00;
+        cpu.pc = 0xC000;
+        cpu.sp = 0x01FF;
+        cpu.cycles = 0;
+        cpu.status = 0;
+        LOAD_FLAGS(&cpu);
+        schedule_event(&cpu, 3000, IRQ_IRQ, 0, 0);
+        exec_program_jit(&cpu);
+        ASSERT_EQ(cpu.pc, 0xC100);
+        ASSERT(cpu.cycles >= 3000 && cpu.cycles < 3000 + 3 + INTERRUPT_CYCLES + 3);
+
+        atomic_uchar flag = 0;
+        cpu.break_in = &flag;
+        cpu.pc = 0xC001;
+        thrd_t t;
+        ASSERT_EQ(thrd_create(&t, break_in_later, &flag), thrd_success);
+        exec_program_jit(&cpu);
+        thrd_join(t, NULL);
+        ASSERT_EQ(cpu.pc, 0xC001);
+        ASSERT_EQ(atomic_load(&flag), 0);
+        cpu.break_in = NULL;
+        free_cpu(&cpu);
+    }
+#endif
+
+    return tests_failed != 0;
 }